@@ -339,6 +339,8 @@ if __name__ == "__main__":
     qemu_opts = []
     if 'HDD_IMAGE' in os.environ:
         qemu_opts += ['-hda', os.environ['HDD_IMAGE']]
+    if 'SMP' in os.environ:
+        qemu_opts += ['-smp', os.environ['SMP']]
 
     r = Runner(args[0], trace=opts.trace, syms=opts.syms, qemu_opts=qemu_opts,
                timeout=opts.timeout, preformatted_image=opts.image, argv=argv,
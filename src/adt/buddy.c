@@ -213,27 +213,41 @@ void buddy_free_range(buddy_t *bd, range_t range) {
     uint64_t old_start = range.start;
     range.start &= ~0ULL << MIN_BUDDY_SZ_LOG2;
     range.start += min_sz;
+    if (range.extent < range.start - old_start)
+      return;
     range.extent -= range.start - old_start;
   }
 
-  /** Now, we iteratively work through the range trying to allocate the largest
-      block we can. { */
-
-  while (range.extent >= min_sz &&
-         aligned_for(range.start, MIN_BUDDY_SZ_LOG2)) {
-    
-    for (unsigned i = MAX_BUDDY_SZ_LOG2; i >= MIN_BUDDY_SZ_LOG2; --i) {
-      uintptr_t sz = 1 << i;
-      uint64_t start = range.start - bd->start;
-
-      if (sz > range.extent || aligned_for(start, i) == 0)
-        continue;
-      
-      range.extent -= sz;
-      range.start += sz;
-      buddy_free(bd, start + bd->start, sz);
-      break;
-    }
-
+  /** Now, we iteratively work through the range freeing the largest block we
+      can. The size of that block is limited by three things: the alignment of
+      its start address, the amount of the range left, and the largest block
+      size we support - so we can calculate it directly rather than trying
+      each size in turn.
+
+      Because every block we free is maximal, its buddy cannot be one we freed
+      earlier in this loop, so we can usually just mark it free directly. The
+      exception is when the buddy was freed by an earlier call (an adjacent
+      range), in which case we let ``buddy_free`` coalesce them. { */
+
+  while (range.extent >= min_sz) {
+    uint64_t start = range.start - bd->start;
+
+    unsigned log_sz = 63 - __builtin_clzll(range.extent);
+    if (log_sz > MAX_BUDDY_SZ_LOG2)
+      log_sz = MAX_BUDDY_SZ_LOG2;
+    if (start != 0 && (unsigned)__builtin_ctzll(start) < log_sz)
+      log_sz = __builtin_ctzll(start);
+
+    uint64_t sz = 1ULL << log_sz;
+    unsigned idx = start >> log_sz;
+    bitmap_t *order = &bd->orders[log_sz - MIN_BUDDY_SZ_LOG2];
+
+    if (log_sz != MAX_BUDDY_SZ_LOG2 && bitmap_isset(order, BUDDY(idx)))
+      buddy_free(bd, range.start, sz);
+    else
+      bitmap_set(order, idx);
+
+    range.extent -= sz;
+    range.start += sz;
   }
 }
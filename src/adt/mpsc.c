@@ -0,0 +1,57 @@
+#include "adt/mpsc.h"
+
+/* Dmitry Vyukov's intrusive MPSC queue. Nodes are linked from the oldest
+   ('tail') to the newest ('head'). A producer swaps itself in as the head
+   and only then links the previous head to itself, so for a moment the list
+   is broken between the two; the consumer treats that as the end of the
+   queue. */
+
+void mpsc_init(mpsc_queue_t *q) {
+  q->stub.next = NULL;
+  q->head = q->tail = &q->stub;
+}
+
+void mpsc_push(mpsc_queue_t *q, mpsc_node_t *n) {
+  n->next = NULL;
+  mpsc_node_t *prev = __sync_lock_test_and_set(&q->head, n);
+  /* Make 'n' complete before it becomes reachable from 'prev'. */
+  __sync_synchronize();
+  prev->next = n;
+}
+
+mpsc_node_t *mpsc_pop(mpsc_queue_t *q) {
+  mpsc_node_t *tail = q->tail, *next = tail->next;
+
+  /* Step over the stub, if it is at the front. */
+  if (tail == &q->stub) {
+    if (!next)
+      return NULL;
+    q->tail = tail = next;
+    next = next->next;
+  }
+
+  if (next) {
+    __sync_synchronize();
+    q->tail = next;
+    return tail;
+  }
+
+  /* 'tail' is the last node linked. If it is not the head, a push is part
+     way through and the list is broken after it. */
+  if (tail != q->head)
+    return NULL;
+
+  /* Put the stub back behind 'tail' so that it can be taken off the end. */
+  mpsc_push(q, &q->stub);
+  next = tail->next;
+  if (next) {
+    __sync_synchronize();
+    q->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+bool mpsc_empty(mpsc_queue_t *q) {
+  return q->head == &q->stub && q->tail == &q->stub;
+}
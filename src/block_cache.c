@@ -222,6 +222,13 @@ void disk_cache_release(disk_cache_t *cache, uint64_t addr) {
   mutex_release(&cache->parent->lock);
 }
 
+bool disk_cache_sync(disk_cache_t *cache, uint64_t addr, void *mapped_at) {
+  dbg("sync(%#x)\n", (uint32_t)addr);
+  addr &= ~(uint64_t)get_page_mask();
+  return cache->dev->write(cache->dev, addr, mapped_at,
+                           get_page_size()) == (int)get_page_size();
+}
+
 bool disk_cache_is_cached(disk_cache_t *cache, uint64_t addr) {
   addr >>= get_page_shift();
   mutex_acquire(&cache->parent->lock);
@@ -29,73 +29,70 @@
    friends. {src/include/hal.h,"typedef struct console","int read_console"} */
 
 /** So let's start defining our console multiplexer. The ``console_t`` structure
-    is a doubly-linked-list, so to register a new console all we have to do is
-    push the given object onto the front of that list.
+    is a linked list, so to register a new console all we have to do is push
+    the given object onto the front of that list.
 
-    Note we also follow our usual practice of using stuff before we've defined it -
-    in this case spinlocks, which will be used once we have multithreading to
-    synchronise calls to the console functions. { */
+    The list is read every time anything is printed, and only written when a
+    console comes or goes, so readers do not take a lock at all - they use RCU
+    (see rcu.h) instead. Writers to the list still need to exclude each other,
+    and each console has its own lock so that only one CPU at a time calls
+    into its driver. { */
 
 #include "hal.h"
+#include "rcu.h"
 
 /* The first console in a linked list. */
 static console_t *consoles = NULL;
 
-/* Lock for all console operations. */
+/* Lock for changes to the list. */
 static spinlock_t lock = SPINLOCK_RELEASED;
 
 /* Registers a new console - declared in hal.h */
 int register_console(console_t *c) {
-  spinlock_acquire(&lock);
-
-  if (consoles)
-    consoles->prev = c;
-  c->next = consoles;
-  c->prev = NULL;
-  
-  consoles = c;
+  spinlock_init(&c->lock);
 
   /* If an open() function was provided, call it. */
   if (c->open)
     c->open(c);
 
+  /* The console must be fully set up before readers can see it. */
+  spinlock_acquire(&lock);
+  c->next = consoles;
+  rcu_assign_pointer(consoles, c);
   spinlock_release(&lock);
   return 0;
 }
 
 /** Similarly for unregistering a console - just search through the list of
-    consoles and remove the offending item. Again we require thread
-    synchronisation. { */
+    consoles and remove the offending item. Readers may still be using it,
+    so we have to wait for them to finish with it before it is closed. { */
 
 /* Unregisters a console - declared in hal.h */
 void unregister_console(console_t *c) {
   spinlock_acquire(&lock);
 
-  console_t *prev = NULL;
-  console_t *this = consoles;
-
   /* Scan through the linked list looking for 'c'. */
-  while (this) {
-    if (this == c) {
-      if (this->next)
-        this->next->prev = prev;
-      if (this->prev)
-        this->prev->next = this->next;
-      if (!prev)
-        consoles = c;
-
-      /* Found - call flush() then close() if they exist. */
-      if (this->flush)
-        this->flush(this);
-      if (this->close)
-        this->close(this);
-      break;
-    }
-    prev = this;
-    this = this->next;
-  }
+  console_t **pthis = &consoles;
+  while (*pthis && *pthis != c)
+    pthis = &(*pthis)->next;
+
+  /* Unlink it. It still points on into the list, for readers that have yet
+     to move past it. */
+  bool found = *pthis != NULL;
+  if (found)
+    rcu_assign_pointer(*pthis, c->next);
 
   spinlock_release(&lock);
+  if (!found)
+    return;
+
+  synchronize_rcu();
+
+  /* Found - call flush() then close() if they exist. */
+  if (c->flush)
+    c->flush(c);
+  if (c->close)
+    c->close(c);
 }
 
 /** Then we get to define writing and reading from the console. Writing is a
@@ -104,41 +101,62 @@ void unregister_console(console_t *c) {
 
 /* Writes to a console - declared in hal.h */
 void write_console(const char *buf, int len) {
-  spinlock_acquire(&lock);
-  console_t *this = consoles;
+  rcu_read_lock();
+  console_t *this = rcu_dereference(consoles);
   while (this) {
-    if (this->write)
+    if (this->write) {
+      spinlock_acquire(&this->lock);
       this->write(this, buf, len);
-    this = this->next;
+      spinlock_release(&this->lock);
+    }
+    this = rcu_dereference(this->next);
   }
-  spinlock_release(&lock);
+  rcu_read_unlock();
 }
  
 /** Reading is slightly different - the ``read()`` functions defined in
     ``console_t`` are supposed to be non-blocking. So we cycle through all
     registered consoles trying to find one for whom ``read()`` is defined and
     returns a number of bytes greater than zero (0 return value means no data was
-    available). { */
+    available).
+
+    If none of them has any data, there is no point asking again straight away.
+    So long as interrupts are enabled we wait for one before going round again -
+    a keypress will interrupt us, and failing that the timer will. We must not
+    wait inside a read-side critical section, so we start a new one each time
+    round. The debugger reads with interrupts disabled, so it still has to
+    spin. { */
 
 /* Reads from a console - declared in hal.h */
 int read_console(char *buf, int len) {
   if (len == 0) return 0;
 
-  spinlock_acquire(&lock);
-  console_t *this = consoles;
-  while (this) {
-    if (this->read) {
-      int n = this->read(this, buf, len);
-      if (n > 0) {
-        spinlock_release(&lock);
-        return n;
+  int interrupts = get_interrupt_state();
+
+  for (;;) {
+    rcu_read_lock();
+    console_t *this = rcu_dereference(consoles);
+    if (!this) {
+      rcu_read_unlock();
+      return -1;
+    }
+    while (this) {
+      if (this->read) {
+        spinlock_acquire(&this->lock);
+        int n = this->read(this, buf, len);
+        spinlock_release(&this->lock);
+        if (n > 0) {
+          rcu_read_unlock();
+          return n;
+        }
       }
+      this = rcu_dereference(this->next);
     }
-    this = this->next;
-    if (!this) this = consoles;
+    rcu_read_unlock();
+
+    if (interrupts)
+      wait_for_interrupt();
   }
-  spinlock_release(&lock);
-  return -1;
 }
 
 /** Finally we define the function that will clean up any consoles active at
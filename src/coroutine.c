@@ -0,0 +1,310 @@
+/* Coroutines - see coroutine.h.
+
+   Each thread that spawns a coroutine gets a co_sched_t, which runs its
+   coroutines from co_run(): it takes the first from its ready list and
+   switches to it with switch_context(), and the coroutine switches back when
+   it yields, sleeps or finishes.
+
+   Stacks come from blocks taken with thread_stack_alloc(), each cut into as
+   many CO_STACK_SZ stacks as fit, and are never given back until the thread
+   is destroyed - a finished coroutine_t keeps its stack, and goes on a free
+   list for the next co_spawn(). Keeping the coroutine_t also means a waker
+   that still holds one after the coroutine has finished does no harm - its
+   wakeup is at worst a spurious one for whichever coroutine has it now. */
+
+#include "assert.h"
+#include "coroutine.h"
+#include "hal.h"
+#include "kmalloc.h"
+#include "string.h"
+#include "thread.h"
+
+#define CO_READY 0
+#define CO_RUN   1
+#define CO_SLEEP 2
+#define CO_DEAD  3
+
+/* Written at the bottom of every coroutine stack, and checked each time the
+   coroutine switches out. */
+#define CO_CANARY 0x600dc0de
+
+struct coroutine {
+  /* On the ready list, or the free list. */
+  struct coroutine *next;
+  struct co_sched *sched;
+
+  /* Saved by switch_context() while the coroutine is not running. */
+  uintptr_t context;
+  /* The stack, from 'bottom' up to 'top'. */
+  uintptr_t bottom, top;
+
+  void (*fn)(void*);
+  void *p;
+
+  volatile unsigned state;
+  /* Set by co_wake() while the coroutine is running - as
+     thread_t::wake_pending. */
+  volatile uint8_t wake_pending;
+};
+
+/* A thread stack cut into coroutine stacks, and their coroutine_t's. */
+typedef struct co_block {
+  struct co_block *next;
+  uintptr_t stack;
+  coroutine_t cos[];
+} co_block_t;
+
+typedef struct co_sched {
+  thread_t *thread;
+  /* Guards the ready list, and the 'state' and 'wake_pending' of every
+     coroutine. Taken by co_wake() from other CPUs and interrupt handlers;
+     everything else here is only touched by the thread itself. */
+  spinlock_t lock;
+  coroutine_t *head, *tail;
+
+  /* The coroutine running, and co_run()'s context while it does. */
+  coroutine_t *current;
+  uintptr_t context;
+  /* The interrupt state co_run() was called with, which new coroutines
+     start with. */
+  int interrupts;
+
+  /* Coroutines spawned and yet to finish. */
+  unsigned live;
+  coroutine_t *free;
+  co_block_t *blocks;
+} co_sched_t;
+
+/* Puts 'c' on the ready list. 's->lock' must be held. */
+static void make_ready(co_sched_t *s, coroutine_t *c) {
+  c->state = CO_READY;
+  c->next = NULL;
+  if (s->tail)
+    s->tail->next = c;
+  else
+    s->head = c;
+  s->tail = c;
+}
+
+/* Cuts a new thread stack into coroutine stacks, for the free list. */
+static void add_block(co_sched_t *s) {
+  uintptr_t lowest;
+  uintptr_t stack = thread_stack_alloc(s->thread, &lowest);
+  unsigned n = (stack + THREAD_STACK_SZ - lowest) / CO_STACK_SZ;
+  assert(n > 0 && "CO_STACK_SZ too large for a thread stack!");
+
+  co_block_t *b = kmalloc(sizeof(co_block_t) + n * sizeof(coroutine_t));
+  b->stack = stack;
+  b->next = s->blocks;
+  s->blocks = b;
+
+  for (unsigned i = 0; i < n; ++i) {
+    coroutine_t *c = &b->cos[i];
+    c->sched = s;
+    c->top = stack + THREAD_STACK_SZ - i * CO_STACK_SZ;
+    c->bottom = c->top - CO_STACK_SZ;
+    c->state = CO_DEAD;
+    c->next = s->free;
+    s->free = c;
+  }
+}
+
+/* Switches from the current coroutine 'c' back to co_run(), returning when
+   co_run() switches back to it. */
+static void suspend(coroutine_t *c) {
+  int interrupts = get_interrupt_state();
+  disable_interrupts();
+  switch_context(&c->context, c->sched->context);
+  set_interrupt_state(interrupts);
+}
+
+/* Where every coroutine starts, switched to from co_run(). */
+static __attribute__((noreturn)) void trampoline() {
+  co_sched_t *s = thread_current()->coroutines;
+  coroutine_t *c = s->current;
+  set_interrupt_state(s->interrupts);
+
+  c->fn(c->p);
+
+  disable_interrupts();
+  spinlock_acquire(&s->lock);
+  c->state = CO_DEAD;
+  spinlock_release(&s->lock);
+  switch_context(&c->context, s->context);
+  assert(0 && "Unreachable!");
+  for (;;) ;
+}
+
+coroutine_t *co_spawn(void (*fn)(void*), void *p) {
+  thread_t *t = thread_current();
+  co_sched_t *s = t->coroutines;
+  if (!s) {
+    s = kmalloc(sizeof(co_sched_t));
+    memset(s, 0, sizeof(co_sched_t));
+    s->thread = t;
+    spinlock_init(&s->lock);
+    t->coroutines = s;
+  }
+
+  if (!s->free)
+    add_block(s);
+  coroutine_t *c = s->free;
+  s->free = c->next;
+
+  c->fn = fn;
+  c->p = p;
+  c->wake_pending = 0;
+  *(uintptr_t*)c->bottom = CO_CANARY;
+  c->context = init_context(c->top, &trampoline);
+  ++s->live;
+
+  spinlock_acquire(&s->lock);
+  make_ready(s, c);
+  spinlock_release(&s->lock);
+  return c;
+}
+
+void co_run() {
+  co_sched_t *s = thread_current()->coroutines;
+  if (!s)
+    return;
+  assert(!s->current && "co_run() called from a coroutine!");
+
+  s->interrupts = get_interrupt_state();
+  disable_interrupts();
+  while (s->live) {
+    spinlock_acquire(&s->lock);
+    coroutine_t *c = s->head;
+    if (c) {
+      s->head = c->next;
+      if (!s->head)
+        s->tail = NULL;
+      c->state = CO_RUN;
+      /* Any token was for what woke it; it checks for that anyway. */
+      c->wake_pending = 0;
+    }
+    spinlock_release(&s->lock);
+
+    if (!c) {
+      /* Everything is asleep. co_wake() wakes us after queueing, and with
+         interrupts disabled cannot find us not yet asleep. */
+      thread_sleep();
+      continue;
+    }
+
+    s->current = c;
+    switch_context(&s->context, c->context);
+    s->current = NULL;
+
+    if (*(uintptr_t*)c->bottom != CO_CANARY)
+      panic("Coroutine stack overflow!");
+    if (c->state == CO_DEAD) {
+      --s->live;
+      c->next = s->free;
+      s->free = c;
+    }
+  }
+  set_interrupt_state(s->interrupts);
+}
+
+coroutine_t *co_current() {
+  co_sched_t *s = thread_current()->coroutines;
+  return s ? s->current : NULL;
+}
+
+void co_yield() {
+  coroutine_t *c = co_current();
+  if (!c) {
+    thread_yield();
+    return;
+  }
+
+  co_sched_t *s = c->sched;
+  spinlock_acquire(&s->lock);
+  make_ready(s, c);
+  spinlock_release(&s->lock);
+  suspend(c);
+}
+
+void co_sleep() {
+  coroutine_t *c = co_current();
+  if (!c) {
+    thread_sleep();
+    return;
+  }
+
+  co_sched_t *s = c->sched;
+  spinlock_acquire(&s->lock);
+  if (c->wake_pending) {
+    /* Woken since we last slept - see thread_sleep(). */
+    c->wake_pending = 0;
+    spinlock_release(&s->lock);
+    return;
+  }
+  c->state = CO_SLEEP;
+  spinlock_release(&s->lock);
+
+  /* Only co_run() resumes us, and not before this switch has saved our
+     context, so a co_wake() from now on is safe. */
+  suspend(c);
+}
+
+int co_wake(coroutine_t *c) {
+  co_sched_t *s = c->sched;
+  int ret = -1;
+
+  spinlock_acquire(&s->lock);
+  if (c->state == CO_SLEEP) {
+    make_ready(s, c);
+    ret = 0;
+  } else if (c->state == CO_RUN) {
+    c->wake_pending = 1;
+  }
+  spinlock_release(&s->lock);
+
+  if (ret == 0)
+    thread_wake(s->thread);
+  return ret;
+}
+
+void co_event_init(co_event_t *e) {
+  e->signalled = 0;
+  waitqueue_init(&e->waiters);
+}
+
+void co_await(co_event_t *e) {
+  if (e->signalled) {
+    /* Don't read what the signaller wrote before seeing the signal. */
+    __sync_synchronize();
+    return;
+  }
+
+  spinlock_acquire(&e->waiters.lock);
+  if (e->signalled) {
+    spinlock_release(&e->waiters.lock);
+    return;
+  }
+  waiter_t w;
+  waitqueue_add(&e->waiters, &w, /*exclusive=*/false);
+  waitqueue_sleep(&e->waiters, &w, WAITQUEUE_FOREVER);
+}
+
+void co_signal(co_event_t *e) {
+  spinlock_acquire(&e->waiters.lock);
+  e->signalled = 1;
+  waitqueue_wake_locked(&e->waiters, WAITQUEUE_ALL, /*handoff=*/false);
+  spinlock_release(&e->waiters.lock);
+}
+
+void co_thread_destroy(thread_t *t) {
+  co_sched_t *s = t->coroutines;
+  co_block_t *b = s->blocks;
+  while (b) {
+    co_block_t *next = b->next;
+    thread_stack_free(b->stack);
+    kfree(b);
+    b = next;
+  }
+  kfree(s);
+  t->coroutines = NULL;
+}
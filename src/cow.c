@@ -5,11 +5,27 @@
 #include "stdio.h"
 static uint32_t *cow_refcnt_array = (uint32_t*) MMAP_COW_REFCNTS;
 
-static void init_page(uint64_t p) {
-  uintptr_t backing_page =
-    (uintptr_t)(&cow_refcnt_array[p >> get_page_shift()]) & ~get_page_mask();
+/* Ensure the refcount array is backed by zeroed memory for every frame in
+   'r'. The array is populated one backing page at a time (each covers
+   get_page_size()/4 frames), so the cost grows with the size of the array
+   rather than the number of frames. */
+static void init_range(range_t r) {
+  if (r.extent == 0)
+    return;
+
+  uintptr_t first = (uintptr_t)&cow_refcnt_array[r.start >> get_page_shift()];
+  uintptr_t last =
+    (uintptr_t)&cow_refcnt_array[(r.start + r.extent - 1) >> get_page_shift()];
+
+  first &= ~get_page_mask();
+  last &= ~get_page_mask();
+
+  for (uintptr_t backing_page = first; backing_page <= last;
+       backing_page += get_page_size()) {
+    /* Adjacent ranges may share a backing page. */
+    if (is_mapped(backing_page))
+      continue;
 
-  if (!is_mapped(backing_page)) {
     uint64_t page = alloc_page(PAGE_REQ_NONE);
     assert(page != ~0ULL && "alloc_page failed!");
     int ret = map(backing_page, page, 1, PAGE_WRITE);
@@ -20,11 +36,8 @@ static void init_page(uint64_t p) {
 }
 
 int init_cow_refcnts(range_t *ranges, unsigned nranges) {
-  for (unsigned i = 0; i < nranges; ++i) {
-    for (uint64_t j = 0; j < ranges[i].extent; j += get_page_size()) {
-      init_page(ranges[i].start + j);
-    }
-  }
+  for (unsigned i = 0; i < nranges; ++i)
+    init_range(ranges[i]);
   return 0;
 }
 
@@ -160,8 +160,8 @@ static void do_debug() {
   stop_other_processors();
 
   /* Wait until all processors are stopped before continuing. */
-  int num_other_processors = get_num_processors();
-  if (num_other_processors != -1)
+  int num_other_processors = get_num_processors() - 1;
+  if (num_other_processors > 0)
     while (num_cores_in_debugger != num_other_processors)
       ;
   
@@ -658,6 +658,39 @@ static int64_t vfat_write(filesystem_t *fs, inode_t *ino, uint64_t offset,
   return write(vfs, (vfat_file_t*)ino->data, offset, buf, sz, true);
 }
 
+static int64_t vfat_bmap(filesystem_t *fs, inode_t *ino, uint64_t offset,
+                         disk_cache_t **cache) {
+  vfat_filesystem_t *vfs = (vfat_filesystem_t*) fs->data;
+  vfat_file_t *file = (vfat_file_t*) ino->data;
+  unsigned ps = get_page_size();
+
+  /* The page must be whole clusters, all within the file... */
+  if (offset + ps > file->size || ps % vfs->cluster_size != 0)
+    return -1;
+
+  if (!file->cluster_chain_read)
+    read_cluster_chain(vfs, file);
+
+  unsigned first = offset / vfs->cluster_size;
+  unsigned n = ps / vfs->cluster_size;
+  if (first + n > vector_length(&file->clusters))
+    return -1;
+
+  /* ... that are consecutive on disk, starting on a page boundary. */
+  uintptr_t cluster = *(uintptr_t*)vector_get(&file->clusters, first);
+  for (unsigned i = 1; i < n; ++i)
+    if (*(uintptr_t*)vector_get(&file->clusters, first + i) != cluster + i)
+      return -1;
+
+  uint64_t address = vfs->areas[AREA_DATA] +
+    (uint64_t)(cluster - 2) * vfs->cluster_size;
+  if (address & get_page_mask())
+    return -1;
+
+  *cache = vfs->cache;
+  return (int64_t)address;
+}
+
 static vector_t vfat_readdir(filesystem_t *fs, inode_t *dir) {
   assert(dir->type == it_dir && "readdir can only be called on a directory!");
   vfat_filesystem_t *vfs = (vfat_filesystem_t*) fs->data;
@@ -845,6 +878,7 @@ static filesystem_t fs_vfat = {
   .write = &vfat_write,
   .readdir = &vfat_readdir,
   .mknod = &vfat_mknod,
+  .bmap = &vfat_bmap,
   .get_root = &vfat_get_root,
   .destroy = &vfat_destroy
 };
@@ -48,6 +48,9 @@ int unregister_interrupt_handler(int num, interrupt_handler_t handler,
                                  void *p) {
   return -1;
 }
+void interrupt_exit() weak;
+void interrupt_exit() {
+}
 void enable_interrupts() weak;
 void enable_interrupts() {
 }
@@ -61,6 +64,10 @@ int get_interrupt_state() {
 void set_interrupt_state(int enable) weak;
 void set_interrupt_state(int enable) {
 }
+void wait_for_interrupt() weak;
+void wait_for_interrupt() {
+  enable_interrupts();
+}
 
 void trap() weak;
 void trap() {
@@ -128,6 +135,13 @@ int *get_all_processor_ids() weak;
 int *get_all_processor_ids() {
   return NULL;
 }
+int start_processor(int id, uintptr_t context) weak;
+int start_processor(int id, uintptr_t context) {
+  return -1;
+}
+void set_percpu_offset(int cpu, uintptr_t offset) weak;
+void set_percpu_offset(int cpu, uintptr_t offset) {
+}
 int get_ipi_interrupt_num() weak;
 int get_ipi_interrupt_num() {
   return -1;
@@ -139,12 +153,31 @@ void *get_ipi_data(struct regs *r) {
 void send_ipi(int proc_id, void *data) weak;
 void send_ipi(int proc_id, void *data) {
 }
+void ipi_poll() weak;
+void ipi_poll() {
+}
+
+/* A 64-bit value cannot be read or written atomically on every target. */
+static seqlock_t timestamp_lock = SEQLOCK_RELEASED;
 
 uint64_t get_timestamp() {
-  return timestamp;
+  unsigned seq;
+  uint64_t ts;
+  do {
+    seq = seqlock_read_begin(&timestamp_lock);
+    ts = timestamp;
+  } while (seqlock_read_retry(&timestamp_lock, seq));
+  return ts;
 }
 void set_timestamp(uint64_t ts) {
+  seqlock_write_acquire(&timestamp_lock);
   timestamp = ts;
+  seqlock_write_release(&timestamp_lock);
+}
+
+uint64_t get_cycle_count() weak;
+uint64_t get_cycle_count() {
+  return 0;
 }
 
 int register_callback(uint32_t num_millis, int periodic, void (*cb)(void*),
@@ -158,6 +191,13 @@ int unregister_callback(void (*cb)(void*)) weak;
 int unregister_callback(void (*cb)(void*)) {
   return -1;
 }
+int timer_idle_enter(void (*ignore)(void*)) weak;
+int timer_idle_enter(void (*ignore)(void*)) {
+  return -1;
+}
+void timer_idle_exit() weak;
+void timer_idle_exit() {
+}
 
 uint64_t alloc_page(int req) weak;
 uint64_t alloc_page(int req) {
@@ -200,6 +240,19 @@ int is_mapped(uintptr_t v) {
   return -1;
 }
 
+int set_swap_entry(uintptr_t v, uint32_t entry) weak;
+int set_swap_entry(uintptr_t v, uint32_t entry) {
+  return -1;
+}
+uint32_t get_swap_entry(uintptr_t v) weak;
+uint32_t get_swap_entry(uintptr_t v) {
+  return 0;
+}
+int test_and_clear_accessed(uintptr_t v) weak;
+int test_and_clear_accessed(uintptr_t v) {
+  return -1;
+}
+
 int init_virtual_memory(range_t *ranges, unsigned nranges) weak;
 int init_virtual_memory(range_t *ranges, unsigned nranges) {
   return -1;
@@ -261,3 +314,7 @@ void longjmp(jmp_buf buf, int val) weak;
 void longjmp(jmp_buf buf, int val) {
   for(;;);
 }
+void switch_context(uintptr_t *from, uintptr_t to) weak;
+void switch_context(uintptr_t *from, uintptr_t to) {
+  for(;;);
+}
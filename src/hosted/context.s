@@ -0,0 +1,26 @@
+bits 64
+
+;; switch_context(uintptr_t *from, uintptr_t to)
+;;
+;; Only the registers the calling convention says a callee must preserve are
+;; saved, on the stack being switched from; everything else is already dead
+;; at the call. The layout must match init_context() in hosted/hal.h.
+global switch_context:function switch_context.end-switch_context
+switch_context:
+        push    rbp
+        push    rbx
+        push    r12
+        push    r13
+        push    r14
+        push    r15
+        mov     [rdi], rsp      ; First parameter = where to save our context
+
+        mov     rsp, rsi        ; Second = context to switch to
+        pop     r15
+        pop     r14
+        pop     r13
+        pop     r12
+        pop     rbx
+        pop     rbp
+        ret
+.end:
@@ -1,5 +1,6 @@
 #include "hal.h"
 #include "mmap.h"
+#include "stdio.h"
 
 #define _BSD_SOURCE /* Workaround to get MAP_ANON defined */
 #define __USE_MISC  /* Workaround to get MAP_ANON defined */
@@ -16,10 +17,20 @@ static int free_memory() {
 
   range_t r = {MMAP_PHYS_BASE, MMAP_PHYS_END - MMAP_PHYS_BASE};
 
+  /* Time each phase so regressions in boot time are visible. */
+  uint64_t t0 = get_cycle_count();
   init_physical_memory_early(&r, 1, MMAP_PHYS_END);
+  uint64_t t1 = get_cycle_count();
   init_virtual_memory(&r, 1);
+  uint64_t t2 = get_cycle_count();
   init_physical_memory();
+  uint64_t t3 = get_cycle_count();
   init_cow_refcnts(&r, 1);
+  uint64_t t4 = get_cycle_count();
+
+  kprintf("boot: pmm-early %u, vmm %u, pmm %u, cow %u (kcycles)\n",
+          (uint32_t)((t1 - t0) / 1000), (uint32_t)((t2 - t1) / 1000),
+          (uint32_t)((t3 - t2) / 1000), (uint32_t)((t4 - t3) / 1000));
 
   return 0;
 }
@@ -0,0 +1,42 @@
+#include "hal.h"
+#include "hosted/smp.h"
+
+uint64_t get_cycle_count() {
+  /* The hosted target only runs on x86-64, which always has a TSC. */
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+/* Thread local storage is found by rounding the stack pointer down to a
+   multiple of THREAD_STACK_SZ, so the boot thread needs a stack aligned like
+   every other thread's. The host's stack could put that boundary anywhere
+   below main()'s frame, and a deep call or a timer signal would run off the
+   end of it, so main() is run on a stack of our own instead. */
+static uint8_t boot_stack[THREAD_STACK_SZ]
+  __attribute__((aligned(THREAD_STACK_SZ)));
+static int boot_argc;
+static char **boot_argv;
+
+int main(int argc, char **argv);
+void exit(int status) __attribute__((noreturn));
+
+static __attribute__((noreturn,noinline)) void boot_trampoline() {
+  exit(main(boot_argc, boot_argv));
+}
+
+/* glibc passes constructors the arguments to main(). */
+static __attribute__((constructor)) void switch_to_boot_stack(int argc,
+                                                              char **argv) {
+  jmp_buf jb;
+  hosted_smp_init(&argc, argv);
+  hosted_interrupts_init();
+  boot_argc = argc;
+  boot_argv = argv;
+  if (setjmp(jb) == 0) {
+    jmp_buf_set_stack(jb, (uintptr_t)boot_stack + THREAD_STACK_SZ);
+    longjmp(jb, 1);
+  }
+  /* As in thread_spawn(), this frame is no longer valid. */
+  boot_trampoline();
+}
@@ -0,0 +1,212 @@
+/* Interrupts on the hosted target are host signals: SIGALRM, from the
+   interval timer, is the timer interrupt, and SIGUSR1 is sent between
+   virtual CPUs for IPIs (see hosted/smp.c).
+
+   Masking is emulated. Each CPU - each host thread - has its own interrupt
+   flag; while it is clear a signal only leaves its interrupt pending, and
+   everything pending is delivered when the flag is set again. Handlers are
+   run with interrupts disabled, like an IRQ.
+
+   Only the first CPU takes timer interrupts. The host may deliver SIGALRM
+   to any thread, so another CPU that receives it passes it on.
+
+   The signals themselves are never blocked while kernel code runs. The
+   kernel may switch threads on the way out of an interrupt (see
+   interrupt_exit()), and the thread it switched away from can be
+   resumed on another CPU, where returning from the handler restores the
+   signal mask it was interrupted with - so every CPU must have the same
+   one. */
+
+#include "hal.h"
+#include "hosted/smp.h"
+#include "stdio.h"
+
+/* FIXME: Find out why we need these workarounds and remove them. */
+#define __USE_POSIX199309 /* Workaround to get siginfo_t defined */
+#define __USE_POSIX /* Workaround to get sigaction defined */
+#define __USE_POSIX199506 /* Workaround to get pthread_sigmask defined */
+#include <signal.h>
+#include <sys/time.h>
+#include <time.h>
+#ifndef SA_NODEFER /* Only exposed with XOPEN extensions. */
+# define SA_NODEFER 0x40000000
+#endif
+#ifndef SA_RESTART
+# define SA_RESTART 0x10000000
+#endif
+
+#ifdef DEBUG_interrupts
+# define dbg(args...) kprintf("interrupts: " args)
+#else
+# define dbg(args...)
+#endif
+
+#define NUM_IRQS 2
+#define MAX_HANDLERS_PER_IRQ 8
+
+/* How long to wait for an interrupt when no timer is running to end the
+   wait. */
+#define POLL_MS 1
+
+static struct {
+  interrupt_handler_t handler;
+  void *p;
+} handlers[NUM_IRQS][MAX_HANDLERS_PER_IRQ];
+static unsigned num_handlers[NUM_IRQS];
+
+/* This CPU's interrupt flag. */
+static __thread volatile int enabled = 1;
+/* Set when a timer interrupt is due on the first CPU. */
+static volatile int tick_pending;
+
+static int this_cpu() {
+  int id = get_processor_id();
+  return (id < 0) ? 0 : id;
+}
+
+static bool pending() {
+  return (tick_pending && this_cpu() == 0) || hosted_ipi_pending();
+}
+
+static void dispatch(int irq, struct regs *r) {
+  for (unsigned i = 0; i < num_handlers[irq]; ++i)
+    handlers[irq][i].handler(r, handlers[irq][i].p);
+}
+
+/* Takes and handles one pending interrupt, if there is one. */
+static bool deliver_one() {
+  struct regs r;
+  r.ipi_data = NULL;
+
+  if (this_cpu() == 0 && __sync_lock_test_and_set(&tick_pending, 0)) {
+    dispatch(HOSTED_IRQ_TIMER, &r);
+    return true;
+  }
+  if (hosted_take_ipi(&r.ipi_data)) {
+    dispatch(HOSTED_IRQ_IPI, &r);
+    return true;
+  }
+  return false;
+}
+
+/* interrupt_exit() may switch threads, and so we may come back on another
+   CPU with its interrupts to deliver - hence looking up the CPU each time. */
+static void deliver() {
+  do {
+    enabled = 0;
+    while (deliver_one())
+      ;
+    interrupt_exit();
+    enabled = 1;
+  } while (pending());
+}
+
+static void interrupt(int sig, siginfo_t *info, void *ctx) {
+  if (sig == SIGALRM) {
+    tick_pending = 1;
+    if (this_cpu() != 0) {
+      hosted_signal_cpu(0);
+      return;
+    }
+  }
+  if (enabled)
+    deliver();
+}
+
+int register_interrupt_handler(int num, interrupt_handler_t handler,
+                               void *p) {
+  if (num < 0 || num >= NUM_IRQS)
+    return -1;
+  if (num_handlers[num] >= MAX_HANDLERS_PER_IRQ)
+    return -1;
+  handlers[num][num_handlers[num]].handler = handler;
+  handlers[num][num_handlers[num]++].p = p;
+  return 0;
+}
+
+int unregister_interrupt_handler(int num, interrupt_handler_t handler,
+                                 void *p) {
+  if (num < 0 || num >= NUM_IRQS)
+    return -1;
+
+  int found = 0;
+  for (unsigned i = 0, e = num_handlers[num]; i < e; ++i) {
+    if (handlers[num][i].handler == handler &&
+        handlers[num][i].p == p)
+      found = 1;
+
+    if (found && i != e-1)
+      handlers[num][i] = handlers[num][i+1];
+  }
+
+  if (found) {
+    --num_handlers[num];
+    return 0;
+  }
+  return 1;
+}
+
+void *get_ipi_data(struct regs *r) {
+  return r->ipi_data;
+}
+
+void enable_interrupts() {
+  enabled = 1;
+  if (pending())
+    deliver();
+}
+
+void disable_interrupts() {
+  enabled = 0;
+}
+
+int get_interrupt_state() {
+  return enabled;
+}
+
+void set_interrupt_state(int enable) {
+  if (enable)
+    enable_interrupts();
+  else
+    disable_interrupts();
+}
+
+void wait_for_interrupt() {
+  /* Block the signals while we check for a pending interrupt, and
+     atomically unblock them as we suspend, so one cannot arrive in between
+     and be missed. */
+  sigset_t set, old;
+  sigemptyset(&set);
+  sigaddset(&set, SIGALRM);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, &old);
+
+  if (!pending()) {
+    /* Other CPUs are woken by IPIs, but nothing would wake the first if no
+       timer is running. Then just give the host the CPU for a while. */
+    struct itimerval it;
+    getitimer(ITIMER_REAL, &it);
+    if (this_cpu() != 0 || it.it_value.tv_sec || it.it_value.tv_usec) {
+      sigsuspend(&old);
+    } else {
+      struct timespec ts = {0, POLL_MS * 1000000};
+      nanosleep(&ts, NULL);
+    }
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  enable_interrupts();
+}
+
+void hosted_interrupts_init_cpu() {
+  enabled = 0;
+}
+
+void hosted_interrupts_init() {
+  struct sigaction act;
+  act.sa_sigaction = &interrupt;
+  sigemptyset(&act.sa_mask);
+  act.sa_flags = SA_SIGINFO | SA_NODEFER | SA_RESTART;
+  sigaction(SIGALRM, &act, NULL);
+  sigaction(SIGUSR1, &act, NULL);
+}
@@ -0,0 +1,185 @@
+/* Virtual CPUs for the hosted target.
+
+   Given "-smp N" on the command line, the hosted kernel runs on N host
+   threads, each standing in for a CPU. The thread that runs main() is the
+   first; the others are created by start_processor(). Kernel threads move
+   freely between them - a context switch is the same on any of them - and
+   anything the host keeps per thread (such as __thread variables) is per
+   CPU.
+
+   Without "-smp" there is just the one CPU, and the multiprocessor
+   functions say so as they do on any other uniprocessor target.
+
+   An IPI leaves its data in the target CPU's mailbox and sends it SIGUSR1,
+   which hosted/interrupts.c turns into an interrupt. */
+
+#include "hal.h"
+#include "hosted/smp.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+/* FIXME: Find out why we need these workarounds and remove them. */
+#define __USE_POSIX /* Workaround to get sigset_t defined */
+#define __USE_POSIX199506 /* Workaround to get pthread_kill defined */
+#include <signal.h>
+#include <pthread.h>
+
+#ifdef DEBUG_smp
+# define dbg(args...) kprintf("smp: " args)
+#else
+# define dbg(args...)
+#endif
+
+/* IPIs sent to a CPU that has yet to take them. The same data sent twice is
+   only delivered once, so this only fills up if many different IPIs are
+   sent to a CPU with interrupts disabled. */
+#define MAILBOX_SZ 16
+
+typedef struct mailbox {
+  spinlock_t lock;
+  void *data[MAILBOX_SZ];
+  unsigned head;
+  volatile unsigned n;
+} mailbox_t;
+
+static int num_cpus;
+static int cpu_ids[MAX_CORES];
+/* The number of CPUs started so far; they are started in order. */
+static volatile int online;
+static pthread_t threads[MAX_CORES];
+static uintptr_t contexts[MAX_CORES];
+static mailbox_t mailboxes[MAX_CORES];
+
+static __thread int cpu_id;
+
+int get_processor_id() {
+  return num_cpus ? cpu_id : -1;
+}
+
+int get_num_processors() {
+  return num_cpus ? num_cpus : -1;
+}
+
+int *get_all_processor_ids() {
+  return num_cpus ? cpu_ids : NULL;
+}
+
+int get_ipi_interrupt_num() {
+  return num_cpus ? HOSTED_IRQ_IPI : -1;
+}
+
+static void *cpu_main(void *p) {
+  cpu_id = (int)(uintptr_t)p;
+  hosted_init_fault_stack();
+  hosted_interrupts_init_cpu();
+
+  /* Signals were blocked by start_processor() for us to start with. */
+  sigset_t set;
+  sigemptyset(&set);
+  pthread_sigmask(SIG_SETMASK, &set, NULL);
+
+  dbg("CPU %d started\n", cpu_id);
+  uintptr_t unused;
+  switch_context(&unused, contexts[cpu_id]);
+  panic("Switched back to a CPU's startup context!");
+  return NULL;
+}
+
+int start_processor(int id, uintptr_t context) {
+  if (id <= 0 || id >= num_cpus || id != online)
+    return -1;
+  contexts[id] = context;
+
+  /* The new thread inherits our signal mask. It must not take interrupts
+     until it is ready to. */
+  sigset_t set, old;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, &old);
+  int r = pthread_create(&threads[id], NULL, &cpu_main, (void*)(uintptr_t)id);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (r != 0)
+    return -1;
+
+  __sync_synchronize();
+  ++online;
+  return 0;
+}
+
+void hosted_signal_cpu(int cpu) {
+  if (cpu < online)
+    pthread_kill(threads[cpu], SIGUSR1);
+}
+
+static void post(mailbox_t *m, void *data) {
+  spinlock_acquire(&m->lock);
+  bool sent = false;
+  for (unsigned i = 0; i < m->n && !sent; ++i)
+    sent = m->data[(m->head + i) % MAILBOX_SZ] == data;
+  if (!sent) {
+    if (m->n == MAILBOX_SZ)
+      panic("IPI mailbox full!");
+    m->data[(m->head + m->n) % MAILBOX_SZ] = data;
+    ++m->n;
+  }
+  spinlock_release(&m->lock);
+}
+
+void send_ipi(int proc_id, void *data) {
+  int self = get_processor_id();
+  for (int i = 0; i < online; ++i) {
+    if (proc_id == IPI_ALL_BUT_THIS ? i == self :
+        proc_id != IPI_ALL && proc_id != i)
+      continue;
+    post(&mailboxes[i], data);
+    hosted_signal_cpu(i);
+  }
+}
+
+bool hosted_ipi_pending() {
+  return num_cpus && mailboxes[cpu_id].n != 0;
+}
+
+bool hosted_take_ipi(void **data) {
+  if (!hosted_ipi_pending())
+    return false;
+
+  mailbox_t *m = &mailboxes[cpu_id];
+  spinlock_acquire(&m->lock);
+  bool taken = m->n != 0;
+  if (taken) {
+    *data = m->data[m->head];
+    m->head = (m->head + 1) % MAILBOX_SZ;
+    --m->n;
+  }
+  spinlock_release(&m->lock);
+  return taken;
+}
+
+void hosted_smp_init(int *argc, char **argv) {
+  /* The last one given wins. */
+  for (int i = 1; i < *argc; ) {
+    if (strcmp(argv[i], "-smp") != 0 || i + 1 == *argc) {
+      ++i;
+      continue;
+    }
+
+    num_cpus = (int)strtoul(argv[i+1], NULL, 10);
+    if (num_cpus < 1 || num_cpus > MAX_CORES)
+      num_cpus = 1;
+
+    for (int j = i + 2; j <= *argc; ++j)
+      argv[j-2] = argv[j];
+    *argc -= 2;
+  }
+  if (!num_cpus)
+    return;
+
+  for (int i = 0; i < num_cpus; ++i) {
+    cpu_ids[i] = i;
+    spinlock_init(&mailboxes[i].lock);
+  }
+  cpu_id = 0;
+  threads[0] = pthread_self();
+  online = 1;
+}
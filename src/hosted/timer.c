@@ -0,0 +1,187 @@
+/* The hosted timer drives register_callback() from the timer interrupt -
+   SIGALRM, see hosted/interrupts.c.
+
+   When the idle loop waits for an interrupt, the interval timer is set to
+   fire once, when the next callback is due, instead of every tick. Only the
+   first CPU takes timer interrupts, so only it can do this. */
+
+#include "hal.h"
+#include "stdio.h"
+
+/* FIXME: Find out why we need these workarounds and remove them. */
+#define __USE_POSIX199309 /* Workaround to get clock_gettime defined */
+#include <sys/time.h>
+#include <time.h>
+
+#ifdef DEBUG_timer
+# define dbg(args...) kprintf("timer: " args)
+#else
+# define dbg(args...)
+#endif
+
+#define TICK_MS 1
+/* The longest we sleep for when idle before checking again. */
+#define MAX_IDLE_MS 1000
+
+#define MAX_CALLBACKS 16
+
+typedef struct callback {
+  void (*fn)(void*);
+  void *data;
+  uint32_t period, remaining;
+  int periodic;
+} callback_t;
+
+static callback_t callbacks[MAX_CALLBACKS];
+static spinlock_t lock = SPINLOCK_RELEASED;
+static int armed;
+
+/* Nonzero while the idle loop has the timer set to fire once; the time it
+   went idle, in milliseconds. */
+static volatile int idle;
+static uint64_t idle_since;
+
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void dispatch() {
+  callback_t due[MAX_CALLBACKS];
+  unsigned n = 0;
+
+  /* The end of an idle period - timer_idle_exit() does the accounting. */
+  if (idle)
+    return;
+
+  spinlock_acquire(&lock);
+  for (unsigned i = 0; i < MAX_CALLBACKS; ++i) {
+    callback_t *c = &callbacks[i];
+    if (!c->fn || --c->remaining != 0)
+      continue;
+    due[n++] = *c;
+    if (c->periodic)
+      c->remaining = c->period;
+    else
+      c->fn = NULL;
+  }
+  spinlock_release(&lock);
+
+  /* Callbacks may register and unregister callbacks, so they are run
+     without the lock held. Any preemption they ask for is taken once they
+     all have run (see interrupt_exit()). */
+  for (unsigned i = 0; i < n; ++i)
+    due[i].fn(due[i].data);
+}
+
+static int timer_interrupt(struct regs *r, void *p) {
+  dispatch();
+  return 0;
+}
+
+/* Sets the interval timer to fire after 'ms' milliseconds, and every 'ms'
+   milliseconds after that if 'periodic' is set. Zero stops it. */
+static void set_timer(uint32_t ms, int periodic) {
+  struct itimerval it;
+  it.it_value.tv_sec = ms / 1000;
+  it.it_value.tv_usec = (ms % 1000) * 1000;
+  it.it_interval = periodic ? it.it_value : (struct timeval){0, 0};
+  setitimer(ITIMER_REAL, &it, NULL);
+}
+
+static void arm(int on) {
+  set_timer(on ? TICK_MS : 0, 1);
+  armed = on;
+}
+
+int timer_idle_enter(void (*ignore)(void*)) {
+  if (!armed || get_processor_id() > 0)
+    return -1;
+
+  uint32_t next = MAX_IDLE_MS / TICK_MS;
+  spinlock_acquire(&lock);
+  for (unsigned i = 0; i < MAX_CALLBACKS; ++i)
+    if (callbacks[i].fn && callbacks[i].fn != ignore &&
+        callbacks[i].remaining < next)
+      next = callbacks[i].remaining;
+  spinlock_release(&lock);
+
+  if (next <= 1)
+    return -1;
+
+  dbg("idle for up to %dms\n", next * TICK_MS);
+  idle = 1;
+  idle_since = now_ms();
+  set_timer(next * TICK_MS, 0);
+  return 0;
+}
+
+void timer_idle_exit() {
+  uint32_t ticks = (now_ms() - idle_since) / TICK_MS;
+  idle = 0;
+  arm(1);
+
+  spinlock_acquire(&lock);
+  for (unsigned i = 0; i < MAX_CALLBACKS; ++i) {
+    callback_t *c = &callbacks[i];
+    if (c->fn)
+      c->remaining = (c->remaining > ticks) ? c->remaining - ticks : 1;
+  }
+  spinlock_release(&lock);
+}
+
+int register_callback(uint32_t num_millis, int periodic, void (*cb)(void*),
+                      void *data) {
+  if (num_millis == 0 || cb == NULL)
+    return -1;
+
+  spinlock_acquire(&lock);
+  for (unsigned i = 0; i < MAX_CALLBACKS; ++i) {
+    if (callbacks[i].fn)
+      continue;
+    callbacks[i].fn = cb;
+    callbacks[i].data = data;
+    callbacks[i].period = callbacks[i].remaining =
+      (num_millis + TICK_MS - 1) / TICK_MS;
+    callbacks[i].periodic = periodic;
+    /* The timer only runs while there is something to call. */
+    if (!armed)
+      arm(1);
+    spinlock_release(&lock);
+    dbg("register_callback(%d, %d, %x) -> %d\n", num_millis, periodic, cb, i);
+    return i;
+  }
+  spinlock_release(&lock);
+  return -1;
+}
+
+int unregister_callback(void (*cb)(void*)) {
+  int ret = -1;
+  spinlock_acquire(&lock);
+  for (unsigned i = 0; i < MAX_CALLBACKS; ++i) {
+    if (callbacks[i].fn == cb) {
+      callbacks[i].fn = NULL;
+      ret = 0;
+    }
+  }
+  spinlock_release(&lock);
+  return ret;
+}
+
+static int timer_init() {
+  return register_interrupt_handler(HOSTED_IRQ_TIMER, &timer_interrupt, NULL);
+}
+
+static int timer_fini() {
+  arm(0);
+  return 0;
+}
+
+static module_t x run_on_startup = {
+  .name = "hosted/timer",
+  .required = NULL,
+  .load_after = NULL,
+  .init = &timer_init,
+  .fini = &timer_fini
+};
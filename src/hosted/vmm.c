@@ -1,8 +1,12 @@
 #include "assert.h"
 #include "hal.h"
+#include "hosted/smp.h"
 #include "mmap.h"
 #include "stdio.h"
 #include "string.h"
+#include "swap.h"
+#include "thread.h"
+#include "vfs.h"
 
 /* FIXME: Find out why we need these workarounds and remove them. */
 #define __USE_MISC /* Workaround to get MAP_ANON defined */
@@ -10,22 +14,69 @@
 #include <stdlib.h>
 #define __USE_POSIX199309 /* Workaround to get siginfo_t defined */
 #define __USE_POSIX /* Workaround to get siginfo_t defined */
+#define __USE_XOPEN_EXTENDED /* Workaround to get sigaltstack defined */
 #include <signal.h>
+#define __USE_GNU /* Workaround to get REG_RSP defined */
+#include <ucontext.h>
+#ifndef SA_NODEFER /* Only exposed with XOPEN extensions. */
+# define SA_NODEFER 0x40000000
+#endif
+#ifndef SA_ONSTACK
+# define SA_ONSTACK 0x08000000
+#endif
+#ifndef SI_KERNEL
+# define SI_KERNEL 0x80
+#endif
 
 address_space_t *current, *kernel;
 static spinlock_t global_vmm_lock = SPINLOCK_RELEASED;
 
+/* Entry bits private to the hosted VMM, above the generic PAGE_* flags.
+
+   HOSTED_SWAP marks a non-present entry holding a swap entry in its upper
+   20 bits.
+
+   There is no hardware accessed bit, so test_and_clear_accessed() emulates
+   one: it sets HOSTED_UNACCESSED and removes all access to the page, and the
+   SIGSEGV handler clears it again (restoring access) on the next touch.
+
+   HOSTED_SHARED marks a page clone_address_space() shared outright, which
+   holds a cow_refcnt reference as a copy-on-write page does. */
+#define HOSTED_SHARED     0x200
+#define HOSTED_UNACCESSED 0x400
+#define HOSTED_SWAP       0x800
+#define HOSTED_FLAGS_MASK 0xFF
+
+static unsigned to_prot(unsigned flags) {
+  return ((flags & PAGE_WRITE) ? PROT_WRITE : 0) |
+    ((flags & PAGE_EXECUTE) ? PROT_EXEC : 0) | PROT_READ;
+}
+
 int clone_address_space(address_space_t *dest, int make_cow) {
   spinlock_acquire(&current->lock);
   
   memcpy(dest, current, sizeof(address_space_t));
   spinlock_init(&dest->lock);
 
-  if (make_cow) {
-    for (unsigned i = 0; i < (1<<20); ++i) {
-      if (dest->a[i] & PAGE_WRITE)
-        dest->a[i] = (dest->a[i] & ~PAGE_WRITE) | PAGE_COW;
+  for (unsigned i = 0; i < (1<<20); ++i) {
+    if (dest->a[i] & HOSTED_SWAP) {
+      /* The swap slot is now referenced from both address spaces. */
+      swap_dup_entry(dest->a[i] >> 12);
+      continue;
     }
+    if (dest->a[i] == 0)
+      continue;
+    dest->a[i] &= ~HOSTED_UNACCESSED;
+    if (make_cow && (dest->a[i] & PAGE_WRITE))
+      dest->a[i] = (dest->a[i] & ~PAGE_WRITE) | PAGE_COW;
+    else if ((dest->a[i] & PAGE_COW) == 0)
+      dest->a[i] |= HOSTED_SHARED;
+
+    /* Either way the page now has another mapping, which swap and same-page
+       merging must know about. */
+    uint32_t p = dest->a[i] & 0xFFFFF000;
+    if (p >= MMAP_PHYS_BASE && p < MMAP_PHYS_END)
+      cow_refcnt_inc(p);
   }
 
   spinlock_release(&current->lock);
@@ -33,6 +84,11 @@ int clone_address_space(address_space_t *dest, int make_cow) {
 }
 
 int switch_address_space(address_space_t *dest) {
+  /* Remapping every page is very expensive - don't do it if we're already
+     in the requested address space. */
+  if (dest == current)
+    return 0;
+
   spinlock_acquire(&global_vmm_lock);
   spinlock_acquire(&current->lock);
 
@@ -42,11 +98,10 @@ int switch_address_space(address_space_t *dest) {
   }
 
   for (unsigned i = 0; i < (1<<20); ++i) {
-    if (dest->a[i] == 0) continue;
+    if (dest->a[i] == 0 || (dest->a[i] & HOSTED_SWAP)) continue;
 
-    unsigned flags = dest->a[i] & 0xFFF;
-    unsigned prot = ((flags & PAGE_WRITE) ? PROT_WRITE : 0) |
-      ((flags & PAGE_EXECUTE) ? PROT_EXEC : 0) | PROT_READ;
+    dest->a[i] &= ~HOSTED_UNACCESSED;
+    unsigned prot = to_prot(dest->a[i]);
     
     void *v = (void*) (uint64_t)(i*0x1000);
     if (mmap(v, dest->a[i] & 0xFFFFF000, prot, MAP_ANONYMOUS|MAP_PRIVATE|MAP_FIXED, -1, 0) != v) {
@@ -66,9 +121,13 @@ int switch_address_space(address_space_t *dest) {
 static int map_one_page(uintptr_t v, uint64_t p, unsigned flags) {
   assert(p != ~0ULL && "Invalid physical address given to map(): ~0ULL!");
 
-  /* Sanity check - if CoW, disable write access. */
-  if (flags & PAGE_COW)
+  /* Sanity check - if CoW, disable write access. Reference counts are only
+     kept for our emulated physical memory. */
+  if (flags & PAGE_COW) {
+    if (p >= MMAP_PHYS_BASE && p < MMAP_PHYS_END)
+      cow_refcnt_inc(p);
     flags &= ~PAGE_WRITE;
+  }
 
   address_space_t *a = current;
   if (v >= MMAP_KERNEL_START)
@@ -77,14 +136,14 @@ static int map_one_page(uintptr_t v, uint64_t p, unsigned flags) {
   spinlock_acquire(&a->lock);
   uint32_t *entry = &a->a[(uint32_t)v>>12];
 
-  if (*entry)
+  /* Mapping over a swap entry is allowed - it is how pages are swapped in. */
+  if (*entry && (*entry & HOSTED_SWAP) == 0)
     panic("Tried to map a page that was already mapped!");
   if (p > 0xFFFFFFFF)
     panic("Hosted mode doesn't support 64-bit phys addresses!");
   *entry = (uint32_t)p | flags;
     
-  unsigned prot = ((flags & PAGE_WRITE) ? PROT_WRITE : 0) |
-    ((flags & PAGE_EXECUTE) ? PROT_EXEC : 0) | PROT_READ;
+  unsigned prot = to_prot(flags);
 
   /* We need to memcpy the current physical memory value in, so make sure
      the map is writeable first. */
@@ -120,9 +179,23 @@ static int unmap_one_page(uintptr_t v) {
   if (*entry == 0)
     panic("Tried to unmap a page that wasn't mapped!");
 
+  if (*entry & HOSTED_SWAP) {
+    /* Nothing is mapped, but the swap slot must be released. */
+    swap_free_entry(*entry >> 12);
+    *entry = 0;
+    spinlock_release(&a->lock);
+    return 0;
+  }
+
+  if (*entry & HOSTED_UNACCESSED)
+    mprotect((void*)v, 0x1000, PROT_READ);
+
   uint32_t p = *entry & 0xFFFFF000;
-  if (p >= MMAP_PHYS_BASE && p < MMAP_PHYS_END)
+  if (p >= MMAP_PHYS_BASE && p < MMAP_PHYS_END) {
     memcpy((uint8_t*)(uintptr_t)p, (uint8_t*)v, 0x1000);
+    if (*entry & (PAGE_COW|HOSTED_SHARED))
+      cow_refcnt_dec(p);
+  }
 
   *entry = 0;
 
@@ -155,12 +228,12 @@ uint64_t get_mapping(uintptr_t v, unsigned *flags) {
     a = kernel;
   uint32_t *entry = &a->a[v>>12];
 
-  if (*entry == 0)
+  if (*entry == 0 || (*entry & HOSTED_SWAP))
     return ~0ULL;
 
   uint32_t p = *entry & 0xFFFFF000;
   if (flags)
-    *flags = *entry & 0xFFF;
+    *flags = *entry & HOSTED_FLAGS_MASK;
 
   return p;
 }
@@ -170,15 +243,72 @@ int is_mapped(uintptr_t v) {
   return get_mapping(v, &flags) != ~0ULL;
 }
 
-static void segv(int sig, siginfo_t *si, void *unused) {
-  uintptr_t addr = (uintptr_t)si->si_addr;
+static uint32_t *get_entry(uintptr_t v) {
+  return (v >= MMAP_KERNEL_START) ? &kernel->a[v>>12] : &current->a[v>>12];
+}
+
+int set_swap_entry(uintptr_t v, uint32_t swap_entry) {
+  if (!is_mapped(v))
+    return -1;
+
+  uint32_t *entry = get_entry(v);
+  *entry = (swap_entry << 12) | HOSTED_SWAP;
+
+  if (munmap((void*)v, 0x1000) == -1)
+    panic("munmap() failed!");
+  return 0;
+}
+
+uint32_t get_swap_entry(uintptr_t v) {
+  uint32_t *entry = get_entry(v);
+  return (*entry & HOSTED_SWAP) ? *entry >> 12 : 0;
+}
+
+int test_and_clear_accessed(uintptr_t v) {
+  if (!is_mapped(v))
+    return 0;
+
+  uint32_t *entry = get_entry(v);
+  if (*entry & HOSTED_UNACCESSED)
+    return 0;
+
+  *entry |= HOSTED_UNACCESSED;
+  if (mprotect((void*)v, 0x1000, PROT_NONE) != 0)
+    panic("mprotect() failed!");
+  return 1;
+}
+
+static void page_fault(uintptr_t addr) {
 
   unsigned flags;
   uint32_t p = (uint32_t)get_mapping(addr, &flags);
 
+  uint32_t *entry = get_entry(addr);
+  if (p != ~0U && (*entry & HOSTED_UNACCESSED)) {
+    /* First touch since test_and_clear_accessed() - record the access and
+       restore the page's real protection. */
+    *entry &= ~HOSTED_UNACCESSED;
+    if (mprotect((void*)(addr & ~0xFFFUL), 0x1000, to_prot(flags)) != 0)
+      panic("mprotect() failed!");
+    return;
+  }
+
   if (p != ~0U && (flags & PAGE_COW)) {
-    /* Page was marked copy-on-write. */
-    uint32_t p2 = (uint32_t)alloc_page(PAGE_REQ_UNDER4GB);
+    /* Page was marked copy-on-write. User pages are never touched with a
+       lock held, so copying one may swap others out to make room, as
+       swapping a page in does. */
+    int req = PAGE_REQ_UNDER4GB;
+    if (flags & PAGE_USER)
+      req |= PAGE_REQ_RECLAIM;
+    uint32_t p2 = (uint32_t)alloc_page(req);
+    if (p2 == ~0U)
+      panic("Out of memory during copy-on-write!");
+
+    /* If that slept, another thread may have copied the page meanwhile. */
+    if ((uint32_t)get_mapping(addr, &flags) != p || !(flags & PAGE_COW)) {
+      free_page(p2);
+      return;
+    }
 
     /* We have to copy the page. In order to avoid a costly and 
        non-reentrant map/unmap pair to temporarily have them
@@ -200,11 +330,109 @@ static void segv(int sig, siginfo_t *si, void *unused) {
     return;
   }
 
+  if (swap_handle_page_fault(addr))
+    return;
+
+  if (vfs_mmap_handle_page_fault(addr))
+    return;
+
   kprintf("*** Page fault @ 0x%08x\n", addr);
   void abort();
   abort();
 }
 
+/* Faults are taken on an alternate signal stack, so that a fault on an
+   unmapped page of a thread stack (see THREAD_STACK_LAZY) has somewhere to
+   run. Other faults may block, and so switch threads, which cannot be done
+   on a stack shared by every thread: for those the signal frame is moved to
+   the faulting thread's stack and the handler restarted there, in
+   refault(). */
+#define FAULT_STACK_SZ 0x8000
+
+/* Each CPU has its own. */
+static uint8_t fault_stacks[MAX_CORES][FAULT_STACK_SZ]
+  __attribute__((aligned(64)));
+static __thread uint8_t *fault_stack;
+
+static int on_fault_stack(uintptr_t sp) {
+  return sp >= (uintptr_t)fault_stack &&
+    sp < (uintptr_t)fault_stack + FAULT_STACK_SZ;
+}
+
+static __attribute__((noreturn)) void refault(uintptr_t addr, ucontext_t *uc,
+                                              int interrupts) {
+  page_fault(addr);
+  set_interrupt_state(interrupts);
+  /* Return from the signal as the host would have, with the frame moved. */
+  __asm__ volatile("mov %0, %%rsp; mov $15, %%eax; syscall" /* rt_sigreturn */
+                   : : "r" (uc) : "memory");
+  __builtin_unreachable();
+}
+
+static void move_to_thread_stack(ucontext_t *uc, uintptr_t addr,
+                                 int interrupts) {
+  /* The frame runs from the context to the top of the alternate stack. Keep
+     the floating point state, inside it, 64-byte aligned. */
+  uintptr_t sp = uc->uc_mcontext.gregs[REG_RSP];
+  uintptr_t len = (uintptr_t)fault_stack + FAULT_STACK_SZ - (uintptr_t)uc;
+  uintptr_t dest = (sp - 128 /* Red zone */ - len) & ~63UL;
+
+  for (uintptr_t a = sp; a > dest - 8; a -= get_page_size())
+    thread_handle_stack_fault(a - 1);
+
+  memcpy((void*)dest, uc, len);
+  ucontext_t *moved = (ucontext_t*)dest;
+  if (uc->uc_mcontext.fpregs)
+    moved->uc_mcontext.fpregs = (void*)((uintptr_t)uc->uc_mcontext.fpregs -
+                                        (uintptr_t)uc + dest);
+
+  uc->uc_mcontext.gregs[REG_RIP] = (uintptr_t)&refault;
+  uc->uc_mcontext.gregs[REG_RSP] = dest - 8; /* As if called. */
+  uc->uc_mcontext.gregs[REG_RDI] = addr;
+  uc->uc_mcontext.gregs[REG_RSI] = dest;
+  uc->uc_mcontext.gregs[REG_RDX] = interrupts;
+}
+
+static void segv(int sig, siginfo_t *si, void *ctx) {
+  ucontext_t *uc = (ucontext_t*)ctx;
+  uintptr_t addr = (uintptr_t)si->si_addr;
+  uintptr_t sp = uc->uc_mcontext.gregs[REG_RSP];
+
+  /* As on x86, faults are handled with interrupts disabled, so the timer
+     cannot preempt us half way through fixing up a mapping. */
+  int interrupts = get_interrupt_state();
+  disable_interrupts();
+
+  if (si->si_code == SI_KERNEL) {
+    /* The host could not push a signal frame - an interrupt arrived with
+       the stack pointer just above an unmapped page. A timer tick is lost;
+       an IPI waits in its mailbox until interrupts are next enabled. */
+    if (!thread_handle_stack_fault(sp - 1))
+      panic("Failed to deliver a signal!");
+  } else if (!thread_handle_stack_fault(addr)) {
+    if (!on_fault_stack(sp)) {
+      /* Interrupts stay disabled until refault() has handled the fault. */
+      move_to_thread_stack(uc, addr, interrupts);
+      return;
+    }
+    /* A fault while handling a fault on this stack. */
+    page_fault(addr);
+  }
+  set_interrupt_state(interrupts);
+}
+
+void hosted_init_fault_stack() {
+  int id = get_processor_id();
+  fault_stack = fault_stacks[(id < 0) ? 0 : id];
+
+  stack_t ss;
+  ss.ss_sp = fault_stack;
+  ss.ss_size = FAULT_STACK_SZ;
+  ss.ss_flags = 0;
+  if (sigaltstack(&ss, NULL) == -1)
+    panic("sigaltstack() failed!");
+}
+
 int init_virtual_memory(range_t *ranges, unsigned nranges) {
   void *malloc(unsigned);
   address_space_t *a = malloc(sizeof(address_space_t));
@@ -218,9 +446,16 @@ int init_virtual_memory(range_t *ranges, unsigned nranges) {
   kernel = malloc(sizeof(address_space_t));
   memset(kernel, 0, sizeof(address_space_t));
 
+  hosted_init_fault_stack();
+
   struct sigaction sa;
-  sa.sa_flags = SA_SIGINFO;
+  /* Faults can nest (e.g. swap-in touching a page whose access is being
+     tracked), as they can on real hardware. */
+  sa.sa_flags = SA_SIGINFO | SA_NODEFER | SA_ONSTACK;
+  /* Interrupts must not switch threads on the alternate stack. */
   sigemptyset(&sa.sa_mask);
+  sigaddset(&sa.sa_mask, SIGALRM);
+  sigaddset(&sa.sa_mask, SIGUSR1);
   sa.sa_sigaction = &segv;
   if (sigaction(SIGSEGV, &sa, NULL) == -1)
     panic("sigaction() failed!");
@@ -0,0 +1,46 @@
+#ifndef MPSC_H
+#define MPSC_H
+
+/* Lock-free multi-producer, single-consumer queue
+ *
+ * This ADT exposes an intrusive FIFO queue that any number of producers may
+ * push onto at once without taking a lock or spinning - a push is one atomic
+ * exchange and a store - while one consumer at a time pops from the other
+ * end. Whoever uses it must make sure there is only one consumer, for
+ * example by only popping with a lock held. It has no dependencies. */
+
+#include "types.h"
+
+/* Embed one of these in each object to be queued. An object may only be on
+   one queue, once, at a time. */
+typedef struct mpsc_node {
+  struct mpsc_node *volatile next;
+} mpsc_node_t;
+
+typedef struct mpsc_queue {
+  /* The most recently pushed node, swapped by producers. */
+  mpsc_node_t *volatile head;
+  /* The next node to pop, owned by the consumer. */
+  mpsc_node_t *tail;
+  /* Stands in for a node while the queue is empty, so producers never need
+     to touch 'tail'. */
+  mpsc_node_t stub;
+} mpsc_queue_t;
+
+/* Initialise 'q' as an empty queue. */
+void mpsc_init(mpsc_queue_t *q);
+
+/* Push 'n' onto the back of 'q'. Safe to call from any number of threads and
+   interrupt handlers at once; never blocks. */
+void mpsc_push(mpsc_queue_t *q, mpsc_node_t *n);
+
+/* Pop the node at the front of 'q', or return NULL if it is empty. May also
+   return NULL if a producer is part way through pushing onto an otherwise
+   empty queue; the node will be there once that push finishes. Only one
+   consumer may call this at a time. */
+mpsc_node_t *mpsc_pop(mpsc_queue_t *q);
+
+/* Returns true if 'q' looks empty. This takes no locks, so is only a hint. */
+bool mpsc_empty(mpsc_queue_t *q);
+
+#endif
@@ -18,6 +18,9 @@ disk_cache_t *disk_cache_new(disk_cache_group_t *group,
 void disk_cache_destroy(disk_cache_t *cache);
 bool disk_cache_get(disk_cache_t *cache, uint64_t addr, void *map_at);
 void disk_cache_release(disk_cache_t *cache, uint64_t addr);
+/* Write the cached page at 'addr' back to the device. The caller must hold a
+   handle on it, mapped at 'mapped_at'. */
+bool disk_cache_sync(disk_cache_t *cache, uint64_t addr, void *mapped_at);
 
 bool disk_cache_is_cached(disk_cache_t *cache, uint64_t addr);
 unsigned disk_cache_get_n_handles(disk_cache_t *cache, uint64_t addr);
@@ -0,0 +1,76 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include "hal.h"
+#include "types.h"
+
+struct thread;
+
+/* Coroutines: cheap concurrent tasks within one kernel thread.
+
+   A coroutine is a function with a stack of its own (CO_STACK_SZ), taken
+   from a pool kept by the thread, so many can be in flight without a
+   thread_t each or a trip through the scheduler to switch between them. The
+   coroutines of a thread only run while it is in co_run(), one at a time,
+   switching only when one yields or sleeps - so they need no locking
+   between themselves.
+
+   Sleeping suspends just the coroutine. Wait queues know about coroutines,
+   so waiting on a semaphore or a co_event_t does - and so a coroutine that
+   waits for block I/O (such as an IDE transfer) or for a VFS read lets the
+   thread's other coroutines carry on meanwhile. Mutexes belong to
+   threads, so a coroutine waiting for one waits with its whole thread; a
+   coroutine must not yield or sleep while holding a mutex, as another
+   coroutine of its thread wanting it would wait for itself.
+
+   Coroutine stacks are carved out of thread stacks, so thread_current()
+   works on them as usual. They have no guard page: overflowing one is only
+   caught, by a canary, when the coroutine next switches out. */
+
+typedef struct coroutine coroutine_t;
+
+/* Creates a coroutine in the current thread that will call 'fn' with 'p',
+   once the thread is in co_run(). May be called from a coroutine. The
+   coroutine_t returned is valid until 'fn' returns. */
+coroutine_t *co_spawn(void (*fn)(void*), void *p);
+
+/* Runs the current thread's coroutines until all have finished, sleeping
+   while all are asleep. Must not be called from a coroutine. */
+void co_run();
+
+/* Returns the coroutine running, or NULL if not in a coroutine. */
+coroutine_t *co_current();
+
+/* Lets the thread's other ready coroutines run. Outside a coroutine, this is
+   thread_yield(). */
+void co_yield();
+
+/* As thread_sleep(), but suspending only the current coroutine, which can be
+   woken with co_wake(). Outside a coroutine, this is thread_sleep(). Must be
+   called with interrupts disabled, and may return without sleeping if woken
+   since it last slept. */
+void co_sleep();
+
+/* As thread_wake(), for a coroutine asleep in co_sleep(). May be called from
+   any CPU or from interrupt handlers. */
+int co_wake(coroutine_t *c);
+
+/* An event a coroutine - or a thread - can wait for. Once signalled, it
+   stays signalled. */
+typedef struct co_event {
+  volatile unsigned signalled;
+  waitqueue_t waiters;
+} co_event_t;
+
+/* Initialise 'e' to unsignalled. */
+void co_event_init(co_event_t *e);
+/* Waits until 'e' is signalled. */
+void co_await(co_event_t *e);
+/* Signals 'e', waking everything waiting for it. Does not sleep, so may be
+   called from interrupt handlers. */
+void co_signal(co_event_t *e);
+
+/* Called by thread_destroy() to free 't's coroutine state. */
+void co_thread_destroy(struct thread *t);
+
+#endif
@@ -30,9 +30,16 @@
 
 #include "types.h"
 
+/* A ticket lock: acquirers take a ticket from 'next' and are served in
+   order, as 'owner' reaches their ticket. */
 typedef struct spinlock {
-  volatile unsigned val;
+  volatile unsigned next, owner;
   volatile unsigned interrupts;
+#if LOCKSTAT
+  /* When and where the holder acquired it from - see lockstat.h. */
+  struct lockstat *stat;
+  uint64_t acquired;
+#endif
 } spinlock_t;
 
 /* Platform specific hal.h's are required to define the following:
@@ -44,7 +51,14 @@ typedef struct spinlock {
        This trick was taken from the GNU header setjmp.h, and means jmp_buf
        can be treated as a pointer yet still have static storage.
      - struct regs, which is implementation defined and is passed to 
-       interrupt handlers and the debugger. */
+       interrupt handlers and the debugger.
+     - uintptr_t init_context(uintptr_t stack, void (*fn)()), which must lay
+       out a context on the stack whose top is 'stack', such that switching
+       to it with switch_context() calls 'fn'.
+     - void context_to_regs(struct regs *r, uintptr_t context), which copies
+       the state saved in a context into 'r' for the debugger.
+     - void cpu_relax(), which is called in the body of busy-wait loops.
+     - CO_STACK_SZ, the size of a coroutine's stack (see coroutine.h). */
 #if defined(X86)
 # include "x86/hal.h"
 #elif defined(HOSTED)
@@ -155,7 +169,9 @@ typedef struct console {
   void (*flush)(struct console *obj);
 
   /* Intrusive linked list, for HAL's use only. */
-  struct console *prev, *next;
+  struct console *next;
+  /* Serialises calls to the functions above, for HAL's use only. */
+  spinlock_t lock;
   /* Implementation dependent data. */
   void *data;
 } console_t;
@@ -191,6 +207,12 @@ int register_interrupt_handler(int num, interrupt_handler_t handler, void *p);
    Returns -1 on failure. */
 int unregister_interrupt_handler(int num, interrupt_handler_t handler, void *p);
 
+/* Called by the target on the way out of a hardware interrupt or IPI, once
+   every handler for it has run. The kernel takes any preemption a handler
+   asked for here, so that switching threads does not hold up the handlers
+   after it. */
+void interrupt_exit();
+
 /* Allows maskable interrupts to happen. */
 void enable_interrupts();
 
@@ -203,6 +225,10 @@ int get_interrupt_state();
 /* Sets the current interrupt state - 1 is enabled, 0 is disabled. */
 void set_interrupt_state(int enable);
 
+/* Enables interrupts and stops the processor until one arrives. Returns, with
+   interrupts enabled, once it has been handled. */
+void wait_for_interrupt();
+
 /*******************************************************************************
  * Debugging
  ******************************************************************************/
@@ -309,6 +335,16 @@ int get_num_processors();
    in the system. */
 int *get_all_processor_ids();
 
+/* Starts processor 'id', which must not have been started yet, running the
+   context 'context' (see init_context()) with interrupts disabled. Returns -1
+   if not implemented. */
+int start_processor(int id, uintptr_t context);
+
+/* Tells the target that CPU 'cpu's per-CPU data (see percpu.h) lies 'offset'
+   bytes from the 'percpu' section, for targets that address it through a
+   register. */
+void set_percpu_offset(int cpu, uintptr_t offset);
+
 /* Returns an implementation defined value that can be passed to
    register_interrupt_handler to handle an inter-processor message/interrupt.
 
@@ -331,6 +367,12 @@ void *get_ipi_data(struct regs *r);
    The value -2 (IPI_ALL_BUT_THIS) will send IPIs to all cores but this one. */
 void send_ipi(int proc_id, void *data);
 
+/* Does any work that another core is waiting on this one to do in answer to
+   an IPI. Called from busy-wait loops that run with interrupts disabled,
+   which cannot take the IPI itself - otherwise a core spinning on a lock held
+   by one that is waiting for it would never answer. */
+void ipi_poll();
+
 /********************************************************************************
  * Peripherals
  *******************************************************************************/
@@ -338,6 +380,12 @@ void send_ipi(int proc_id, void *data);
 uint64_t get_timestamp();
 void set_timestamp(uint64_t ts);
 
+/* Returns the value of a free-running, monotonically increasing counter with
+   the highest resolution available (the CPU cycle counter, where there is
+   one). Only the difference between two values is meaningful; it is intended
+   for profiling and benchmarking. Returns 0 if no such counter exists. */
+uint64_t get_cycle_count();
+
 /* Registers a callback to be fired in 'num_millis' milliseconds. If periodic
    is nonzero, the callback should be fired every 'num_millis' milliseconds,
    else it should only be called once.
@@ -348,6 +396,18 @@ int register_callback(uint32_t num_millis, int periodic, void (*cb)(void*),
 /* Unregisters a callback registered with register_callback. */
 int unregister_callback(void (*cb)(void*));
 
+/* Called by the idle loop, with interrupts disabled, before it waits for an
+   interrupt. Stops the periodic timer tick and arranges for the timer to
+   interrupt only when the next callback other than 'ignore' (which may be
+   NULL) is due. Returns -1 if the timer cannot do this - on any CPU but the
+   one that takes timer interrupts, or if the next callback is due anyway -
+   in which case it keeps ticking. */
+int timer_idle_enter(void (*ignore)(void*));
+/* Called by the idle loop, with interrupts disabled, once it has woken from
+   a successful timer_idle_enter(). Accounts the time spent idle to the
+   callbacks and restarts the periodic tick. */
+void timer_idle_exit();
+
 /*******************************************************************************
  * Memory management
  ******************************************************************************/
@@ -361,6 +421,9 @@ int unregister_callback(void (*cb)(void*));
 #define PAGE_REQ_NONE     0 /* No requirements on page location */
 #define PAGE_REQ_UNDER1MB 1 /* Require that the returned page be < 0x100000 */
 #define PAGE_REQ_UNDER4GB 2 /* Require that the returned page be < 0x10000000 */
+/* OR'd into one of the above by a caller that holds no locks and may sleep,
+   to let the allocator swap cold pages out to make room (see swap.h). */
+#define PAGE_REQ_RECLAIM  0x10
 
 /* Returns the (default) page size in bytes. Not all pages may be this size
    (large pages etc.) */
@@ -379,7 +442,7 @@ uint64_t early_alloc_page();
    failure.
 
    'req' is one of the 'PAGE_REQ_*' flags, indicating a requirement on the
-   address of the returned page. */
+   address of the returned page, optionally with PAGE_REQ_RECLAIM. */
 uint64_t alloc_page(int req);
 /* Mark a physical page as free. Returns -1 on failure. */
 int free_page(uint64_t page);
@@ -420,6 +483,25 @@ uint64_t get_mapping(uintptr_t v, unsigned *flags);
 /* Return 1 if 'v' is mapped, else 0, or -1 if not implemented. */
 int is_mapped(uintptr_t v);
 
+/* When a page is swapped out, its mapping is replaced by a non-present
+   "swap entry" - an opaque, nonzero value of at most SWAP_ENTRY_BITS bits
+   that the swap subsystem uses to find the page's contents again. A page
+   holding a swap entry is not mapped as far as get_mapping() and is_mapped()
+   are concerned. */
+#define SWAP_ENTRY_BITS 20
+
+/* Replace the mapping at 'v', which must be mapped, with the swap entry
+   'entry'. The physical page is not freed. Returns zero on success or -1 on
+   failure. */
+int set_swap_entry(uintptr_t v, uint32_t entry);
+
+/* If 'v' is not mapped but holds a swap entry, return it. Else return 0. */
+uint32_t get_swap_entry(uintptr_t v);
+
+/* Return 1 if the page mapped at 'v' has been accessed since the last call,
+   else 0, and clear its accessed state. Returns -1 if not implemented. */
+int test_and_clear_accessed(uintptr_t v);
+
 /* A range of memory, with a start and a size. */
 typedef struct range {
   uint64_t start;
@@ -461,7 +543,10 @@ int init_physical_memory();
 /* Initialise the copy-on-write page reference counts. */
 int init_cow_refcnts(range_t *ranges, unsigned nranges);
 
-/* Increment the reference count of a copy-on-write page. */
+/* Increment the reference count of a copy-on-write page. Pages that
+   clone_address_space() shares outright are counted too, so a nonzero count
+   means a page may be mapped by more than one address space, and must not be
+   swapped out or merged. */
 void cow_refcnt_inc(uint64_t p);
 
 /* Decrement the reference count of a copy-on-write page. */
@@ -584,8 +669,8 @@ int register_block_device_listener(void (*callback)(dev_t));
  * Threading
  *******************************************************************************/
 
-#define SPINLOCK_RELEASED {.val=0, .interrupts=0};
-#define SPINLOCK_ACQUIRED {.val=1, .interrupts=0};
+#define SPINLOCK_RELEASED {.next=0, .owner=0, .interrupts=0};
+#define SPINLOCK_ACQUIRED {.next=1, .owner=0, .interrupts=0};
 
 /* Initialise a spinlock to the released state. */
 void spinlock_init(spinlock_t *lock);
@@ -596,11 +681,102 @@ void spinlock_acquire(spinlock_t *lock);
 /* Release 'lock'. Nonblocking. */
 void spinlock_release(spinlock_t *lock);
 
+/* An MCS queue lock, for heavily contended locks. Each waiter spins on its
+   own node rather than on the lock, so a release only disturbs the next
+   waiter's cache line. The node is supplied by the caller - usually on the
+   stack - and must be passed to the matching release. */
+typedef struct mcs_node {
+  struct mcs_node *volatile next;
+  volatile unsigned locked;
+  unsigned interrupts;
+} mcs_node_t;
+
+typedef struct mcs_lock {
+  mcs_node_t *volatile tail;
+#if LOCKSTAT
+  /* When and where the holder acquired it from - see lockstat.h. */
+  struct lockstat *stat;
+  uint64_t acquired;
+#endif
+} mcs_lock_t;
+
+#define MCS_LOCK_RELEASED {.tail=NULL};
+
+/* Initialise an MCS lock to the released state. */
+void mcs_lock_init(mcs_lock_t *lock);
+/* Acquire 'lock', queueing on 'node' until it is available. */
+void mcs_lock_acquire(mcs_lock_t *lock, mcs_node_t *node);
+/* Release 'lock', acquired with 'node'. */
+void mcs_lock_release(mcs_lock_t *lock, mcs_node_t *node);
+
+/* A FIFO queue of sleeping threads, on which the blocking primitives below
+   are built. Each sleeper queues a waiter_t, usually on its own stack, and
+   sleeps until a waker takes it off the queue.
+
+   A waiter is either exclusive - it wants something only one thread can
+   have, such as a semaphore unit or a mutex - or not, such as a reader
+   waiting for a writer to finish. A wakeup for N goes through the queue in
+   order, waking every waiter up to and including the Nth exclusive one, so
+   non-exclusive waiters are woken in batches. A waker that is passing on a
+   resource can hand it off: the exclusive waiters it wakes are told they now
+   own it, so a thread that arrives in the meantime cannot take it first.
+
+   The queue lock is taken directly by the primitive using the queue, so that
+   it can check its own state and queue a waiter, or wake one and update its
+   state, atomically. */
+typedef struct waiter {
+  struct waiter *next;
+  struct thread *thread;
+  /* The coroutine of 'thread' that is waiting, if any - see coroutine.h. */
+  struct coroutine *co;
+  unsigned exclusive;
+  /* Zero until woken, then WAITQUEUE_WOKEN or WAITQUEUE_HANDOFF. */
+  volatile unsigned woken;
+  /* Set by the waker while it is still waking us, after 'woken' is. */
+  volatile unsigned waking;
+} waiter_t;
+
+typedef struct waitqueue {
+  spinlock_t lock;
+  waiter_t *head, *tail;
+} waitqueue_t;
+
+#define WAITQUEUE_WOKEN   1
+#define WAITQUEUE_HANDOFF 2
+
+/* Passed to waitqueue_sleep() as the timeout to wait without one. */
+#define WAITQUEUE_FOREVER (~0U)
+/* Passed to waitqueue_wake() to wake every waiter. */
+#define WAITQUEUE_ALL     (~0U)
+
+/* Initialise a wait queue to empty. */
+void waitqueue_init(waitqueue_t *q);
+/* Queues the current thread on 'w' at the tail of 'q'. 'q->lock' must be
+   held. */
+void waitqueue_add(waitqueue_t *q, waiter_t *w, bool exclusive);
+/* Releases 'q->lock', which must be held with 'w' queued by
+   waitqueue_add(), and sleeps until 'w' is woken or 'ms' milliseconds have
+   passed. Returns WAITQUEUE_WOKEN or WAITQUEUE_HANDOFF if woken, or 0 if
+   the wait timed out, in which case 'w' is no longer queued. */
+unsigned waitqueue_sleep(waitqueue_t *q, waiter_t *w, unsigned ms);
+/* Wakes waiters from the head of 'q', up to and including the 'n'th
+   exclusive one, handing the exclusive ones off if 'handoff' is set. Returns
+   the number of exclusive waiters woken. 'q->lock' must be held. */
+unsigned waitqueue_wake_locked(waitqueue_t *q, unsigned n, bool handoff);
+/* As waitqueue_wake_locked(), taking 'q->lock' and never handing off. */
+unsigned waitqueue_wake(waitqueue_t *q, unsigned n);
+/* Returns true if nothing is queued on 'q'. Only a hint unless 'q->lock' is
+   held. */
+static inline bool waitqueue_empty(waitqueue_t *q) {
+  return q->head == NULL;
+}
+
+/* A counting semaphore. Waiters are served in order: a signal with threads
+   waiting hands its unit straight to the first, rather than incrementing
+   'val'. */
 typedef struct semaphore {
   volatile unsigned val;
-
-  spinlock_t queue_lock;
-  struct thread *queue_head;
+  waitqueue_t queue;
 } semaphore_t;
 
 /* Initialise a semaphore to the value zero. */
@@ -610,38 +786,86 @@ semaphore_t *semaphore_new();
 /* Reduce the semaphore by one - pend/wait/acquire. This may be a blocking 
    operation. */
 void semaphore_wait(semaphore_t *s);
+/* As semaphore_wait(), but gives up after 'ms' milliseconds. Returns 0 if
+   the semaphore was decremented, or -1 if the wait timed out. */
+int semaphore_timedwait(semaphore_t *s, unsigned ms);
 /* Increase the semaphore by one - post/signal/release. */
 void semaphore_signal(semaphore_t *s);
 
-typedef semaphore_t mutex_t;
+/* A mutex that spins for a while before sleeping if its owner is running on
+   another CPU - it is likely to release it soon, and sleeping and waking
+   cost more than a short critical section. 'val' is 0 when released, 1 when
+   held and 2 when held and there may be threads sleeping on it. Sleepers
+   are handed the mutex in order on release.
+
+   The owner inherits the priority of the highest priority thread sleeping
+   on it, so that threads of a priority in between cannot hold that thread
+   up indefinitely by keeping the owner from running. Inheritance is
+   transitive: if the owner is itself sleeping on another mutex, that
+   mutex's owner inherits the priority too. */
+typedef struct mutex {
+  volatile unsigned val;
+  struct thread *volatile owner;
+
+  waitqueue_t queue;
+  /* For priority inheritance: the threads sleeping on it, the thread whose
+     'pi_held' list it is on, and the next mutex on that list. */
+  struct thread *pi_waiters;
+  struct thread *pi_holder;
+  struct mutex *pi_next;
+#if LOCKDEP
+  /* The lock class, and the next mutex held by the owner - see lockdep.h. */
+  const void *class;
+  struct mutex *held_next;
+#endif
+#if LOCKSTAT
+  /* When and where the holder acquired it from - see lockstat.h. */
+  struct lockstat *stat;
+  uint64_t acquired;
+#endif
+} mutex_t;
 
 /* Initialise a mutex to released. */
-static inline void mutex_init(mutex_t *s) {
-  semaphore_init(s);
-  semaphore_signal(s);
-}
+void mutex_init(mutex_t *m);
 /* Returns a new mutex, initialised to released. */
-static inline mutex_t *mutex_new() {
-  mutex_t *m = semaphore_new();
-  semaphore_signal(m);
-  return m;
-}
+mutex_t *mutex_new();
 /* Acquire the mutex. Blocking operation. */
-static inline void mutex_acquire(mutex_t *s) {
-  semaphore_wait(s);
-}
+void mutex_acquire(mutex_t *m);
+/* Acquire the mutex, giving up after 'ms' milliseconds. Returns 0 if it was
+   acquired, or -1 if the wait timed out. */
+int mutex_timedacquire(mutex_t *m, unsigned ms);
 /* Release the mutex. */
-static inline void mutex_release(mutex_t *s) {
-  semaphore_signal(s);
-}
-
-/* A readers-writers lock: multiple readers, one writer. */
+void mutex_release(mutex_t *m);
+/* Recomputes the priority of 't' from its base priority and those of the
+   threads sleeping on mutexes it holds, and passes any change on to the
+   owner of the mutex 't' is sleeping on, if any. Called by
+   thread_set_priority(). */
+void mutex_update_priority(struct thread *t);
+
+/* A readers-writers lock: multiple readers, one writer. It is biased towards
+   readers, which enter with a single atomic increment unless a writer holds
+   the lock; a writer waits until there are no readers at all, so may starve
+   if readers never let up. */
 typedef struct rwlock {
-  semaphore_t r, w;
-  spinlock_t lock;
-  volatile unsigned readcount, writecount;
+  /* The number of readers, plus RWLOCK_WRITER while a writer holds it. */
+  volatile unsigned count;
+  /* Held by writers throughout their write, so that writers are
+     serialised. */
+  mutex_t writer;
+  /* Readers that found a writer sleep here until it is done. */
+  waitqueue_t readers;
+  /* The writer waiting for readers to leave sleeps here until the last one
+     does. */
+  waitqueue_t writers;
+#if LOCKSTAT
+  /* When and where the writer acquired it from - see lockstat.h. */
+  struct lockstat *stat;
+  uint64_t acquired;
+#endif
 } rwlock_t;
 
+#define RWLOCK_WRITER 0x80000000U
+
 /* Initialise a readers-writers lock. */
 void rwlock_init(rwlock_t *l);
 /* Acquires a rwlock for reading. */
@@ -653,6 +877,38 @@ void rwlock_write_acquire(rwlock_t *l);
 /* Releases a rwlock from writing. */
 void rwlock_write_release(rwlock_t *l);
 
+/* A sequence lock, for small records that are read far more often than they
+   are written. Readers never write to the lock: they read the record, then
+   check that no writer changed it meanwhile, and try again if one did. The
+   record must therefore be safe to read while being written, as plain data
+   is - but not pointers that a writer may free. */
+typedef struct seqlock {
+  /* Odd while a write is in progress. */
+  volatile unsigned seq;
+  spinlock_t lock;
+} seqlock_t;
+
+#define SEQLOCK_RELEASED {.seq=0};
+
+/* Initialise a seqlock. */
+void seqlock_init(seqlock_t *l);
+/* Starts a read, returning the sequence number to pass to
+   seqlock_read_retry(). Reads look like:
+
+     unsigned seq;
+     do {
+       seq = seqlock_read_begin(&l);
+       ... copy out the record ...
+     } while (seqlock_read_retry(&l, seq)); */
+unsigned seqlock_read_begin(seqlock_t *l);
+/* Returns true if a write happened during the read started with 'seq', so
+   that the read must be retried. */
+bool seqlock_read_retry(seqlock_t *l, unsigned seq);
+/* Acquires a seqlock for writing. Spins, so writers must be brief. */
+void seqlock_write_acquire(seqlock_t *l);
+/* Releases a seqlock from writing. */
+void seqlock_write_release(seqlock_t *l);
+
 /* Saves the current location and register state for jumping back to
    with longjmp(). It returns 0 if returning directly, and nonzero
    if returning via longjmp(). */
@@ -665,4 +921,11 @@ void longjmp(jmp_buf buf, int val);
    with the debugging functions. */
 void jmp_buf_to_regs(struct regs *r, jmp_buf buf);
 
+/* Saves the current context on the current stack and stores it in '*from',
+   then resumes the context 'to', which was saved by switch_context() or made
+   by init_context(). Returns when some other context switches back to
+   '*from'. Unlike setjmp()/longjmp(), only the registers a callee must
+   preserve are saved - not the flags, so not the interrupt state either. */
+void switch_context(uintptr_t *from, uintptr_t to);
+
 #endif // HAL_H
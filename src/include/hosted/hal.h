@@ -2,6 +2,13 @@
 #define HOSTED_HAL_H
 
 #define THREAD_STACK_SZ 0x10000  /* 64KB of kernel stack. */
+/* Thread stacks start with the TLS page, followed by an unmapped guard page.
+   The rest is mapped on demand - the page fault handler runs on an alternate
+   signal stack, so it can fix up faults on the thread stack itself. */
+#define THREAD_STACK_LAZY 1
+/* Coroutine stacks, seven to a thread stack. Only the pages touched are
+   mapped, as for thread stacks. */
+#define CO_STACK_SZ 0x2000
 
 typedef struct address_space {
   uint32_t a[1<<20];
@@ -30,7 +37,20 @@ static inline uintptr_t round_to_page_size(uintptr_t x) {
     return x;
 }
 
+/* Tells the CPU we are spinning, which saves power and lets a hyperthread
+   sibling run. */
+static inline void cpu_relax() {
+  __asm__ volatile("pause" : : : "memory");
+}
+
+/* Interrupt numbers for register_interrupt_handler(). Host signals stand in
+   for interrupts - see hosted/interrupts.c. */
+#define HOSTED_IRQ_TIMER 0
+#define HOSTED_IRQ_IPI   1
+
 struct regs {
+  /* The value passed to send_ipi(), for HOSTED_IRQ_IPI handlers. */
+  void *ipi_data;
 };
 
 struct jmp_buf_impl {
@@ -47,4 +67,20 @@ static inline void jmp_buf_set_stack(jmp_buf buf, uintptr_t stack) {
 static inline void jmp_buf_to_regs(struct regs *r, jmp_buf buf) {
 }
 
+/* A context is a stack pointer, pointing at the registers pushed by
+   switch_context() (r15, r14, r13, r12, rbx, rbp) and the address it returns
+   to. */
+static inline uintptr_t init_context(uintptr_t stack, void (*fn)()) {
+  uint64_t *sp = (uint64_t*)stack;
+  *--sp = 0;                    /* Return address for 'fn', which also keeps
+                                   the stack aligned as if 'fn' was called. */
+  *--sp = (uint64_t)fn;
+  for (unsigned i = 0; i < 6; ++i)
+    *--sp = 0;
+  return (uintptr_t)sp;
+}
+
+static inline void context_to_regs(struct regs *r, uintptr_t context) {
+}
+
 #endif
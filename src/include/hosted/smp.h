@@ -0,0 +1,33 @@
+#ifndef HOSTED_SMP_H
+#define HOSTED_SMP_H
+
+/* Internal to the hosted target: its virtual CPUs (hosted/smp.c) and the
+   interrupts they take (hosted/interrupts.c). */
+
+#include "types.h"
+
+/* Removes "-smp N" from the command line, if it is there, and sets up for N
+   virtual CPUs. Called before main(). */
+void hosted_smp_init(int *argc, char **argv);
+
+/* Installs the signal handlers that deliver interrupts. Called before
+   main(). */
+void hosted_interrupts_init();
+/* Called on a virtual CPU's host thread before it runs any kernel code, with
+   signals blocked. Interrupts start disabled. */
+void hosted_interrupts_init_cpu();
+
+/* Interrupts CPU 'cpu' to deliver whatever is pending for it. */
+void hosted_signal_cpu(int cpu);
+
+/* Takes the oldest IPI waiting for this CPU, storing its data in '*data'.
+   Returns false if there is none. */
+bool hosted_take_ipi(void **data);
+/* Is there an IPI waiting for this CPU? */
+bool hosted_ipi_pending();
+
+/* Gives this host thread its own alternate stack for the page fault
+   handler. */
+void hosted_init_fault_stack();
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef LOCKDEP_H
+#define LOCKDEP_H
+
+#include "types.h"
+
+struct mutex;
+
+/* Lock order checking. When built with LOCKDEP=1, every mutex_t belongs to a
+   class: the call site of mutex_init() or mutex_new(), or of rwlock_init()
+   for a rwlock's writer mutex. Each time a thread acquires a mutex while
+   holding others, the order of their classes is recorded. An order that
+   closes a cycle - A taken while holding B, when elsewhere B has been taken
+   while holding A - means threads could deadlock each holding one and
+   wanting the other, and is reported the first time it is seen, whether or
+   not they actually do.
+
+   Mutexes of the same class held together, such as the locks of a parent
+   and a child directory, are not checked against each other. */
+
+/* Called before the current thread acquires 'm' from 'site'. Records the
+   order of 'm' after each mutex the thread holds, and reports any cycle. */
+void lockdep_acquire(struct mutex *m, const void *site);
+
+/* Called once the current thread holds 'm'. */
+void lockdep_acquired(struct mutex *m);
+
+/* Called as the current thread releases 'm'. */
+void lockdep_release(struct mutex *m);
+
+/* Returns the number of cycles reported so far. */
+unsigned lockdep_cycles();
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef LOCKSTAT_H
+#define LOCKSTAT_H
+
+#include "types.h"
+
+/* Lock contention statistics. When built with LOCKSTAT=1, every acquisition
+   of a spinlock_t, mcs_lock_t, semaphore_t, mutex_t or rwlock_t is recorded
+   against the address of the lock and the call site that acquired it. Times
+   are in cycles, as given by get_cycle_count().
+
+   The statistics are shown by the "lockstat" debugger command, and dumped at
+   shutdown in hosted builds. A lock that is freed and another allocated at
+   the same address will share statistics. */
+
+typedef struct lockstat {
+  const void *lock;
+  /* The return address of the call to the locking function. */
+  const void *site;
+  /* The kind of lock, e.g. "spinlock". */
+  const char *type;
+
+  unsigned acquisitions;
+  /* Acquisitions that found the lock held and had to wait. */
+  unsigned contended;
+  /* Total time spent waiting to acquire. */
+  uint64_t wait;
+  /* Longest time held, for locks that have a single holder. */
+  uint64_t max_hold;
+} lockstat_t;
+
+/* Records an acquisition of 'lock' of kind 'type' from 'site', which took
+   'wait' cycles and had to wait for another holder if 'contended'. Returns
+   the statistics recorded into, to be passed to lockstat_release(), or NULL
+   if there was no room for them. */
+lockstat_t *lockstat_acquire(const void *lock, const char *type,
+                             const void *site, bool contended, uint64_t wait);
+
+/* Records that a lock acquired with statistics 'stat' was held for 'hold'
+   cycles. 'stat' may be NULL. */
+void lockstat_release(lockstat_t *stat, uint64_t hold);
+
+/* Prints the 'n' entries with the most time spent waiting. */
+void lockstat_dump(unsigned n);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include "hal.h"
+
+/* Per-CPU variables.
+
+   A variable defined with PERCPU_DEFINE() has a copy for every CPU. The
+   definitions are gathered into the 'percpu' section, which the first CPU
+   uses as its copy - so per-CPU variables work from the first instruction -
+   and which is copied for each of the others when the percpu module starts.
+   A copy starts with what the first CPU's holds then, so only initialisers
+   should give per-CPU variables their starting values.
+
+   A CPU's copy of a variable lies a fixed offset from the variable itself.
+   Never use a per-CPU variable by name; take its address and use
+   this_cpu_ptr() or per_cpu_ptr(), or use the this_cpu_*() accessors on it.
+
+   A pointer from this_cpu_ptr() is only good while the thread cannot move to
+   another CPU, so hold it with preemption disabled. this_cpu_read() and
+   this_cpu_add() are one instruction on targets that address per-CPU data
+   through a segment register (x86 uses %fs), so need no such care; they take
+   32-bit variables. */
+
+#define PERCPU_DEFINE(type, name) \
+  __attribute__((section("percpu"))) __typeof__(type) name
+#define PERCPU_DECLARE(type, name) extern __typeof__(type) name
+
+/* The offset of each CPU's copy from the 'percpu' section. */
+extern uintptr_t percpu_offsets[MAX_CORES];
+/* Every CPU's copy holds its own offset. */
+PERCPU_DECLARE(uintptr_t, percpu_this_offset);
+
+#if defined(X86)
+
+static inline uintptr_t percpu_offset() {
+  uintptr_t offset;
+  __asm__ volatile("movl %%fs:%1, %0" : "=r" (offset)
+                   : "m" (percpu_this_offset));
+  return offset;
+}
+
+# define this_cpu_read(var) ({                                          \
+      uint32_t v_;                                                      \
+      __asm__ volatile("movl %%fs:%1, %0" : "=r" (v_) : "m" (var));     \
+      (__typeof__(var))v_; })
+
+# define this_cpu_add(var, n)                                           \
+  __asm__ volatile("addl %1, %%fs:%0" : "+m" (var) : "ir" ((uint32_t)(n)))
+
+#else
+
+/* No segment register to spare: look the offset up by processor ID. */
+static inline uintptr_t percpu_offset() {
+  int id = get_processor_id();
+  return percpu_offsets[(id < 0) ? 0 : id];
+}
+
+/* Finding the copy and using it are separate steps, so interrupts are
+   disabled in between - otherwise we could be preempted and moved to
+   another CPU, and use the copy of the one we left. */
+# define this_cpu_read(var) ({                                          \
+      int i_ = get_interrupt_state();                                   \
+      disable_interrupts();                                             \
+      __typeof__(var) v_ = *(volatile __typeof__(var)*)this_cpu_ptr(&(var)); \
+      set_interrupt_state(i_);                                          \
+      v_; })
+
+# define this_cpu_add(var, n) do {                                      \
+      int i_ = get_interrupt_state();                                   \
+      disable_interrupts();                                             \
+      *this_cpu_ptr(&(var)) += (n);                                     \
+      set_interrupt_state(i_);                                          \
+  } while (0)
+
+#endif
+
+/* This CPU's copy of the per-CPU variable at 'ptr'. */
+#define this_cpu_ptr(ptr) \
+  ((__typeof__(ptr))((uintptr_t)(ptr) + percpu_offset()))
+/* CPU 'cpu's copy of the per-CPU variable at 'ptr'. */
+#define per_cpu_ptr(ptr, cpu) \
+  ((__typeof__(ptr))((uintptr_t)(ptr) + percpu_offsets[cpu]))
+
+#define this_cpu_inc(var) this_cpu_add(var, 1)
+#define this_cpu_dec(var) this_cpu_add(var, -1)
+
+#endif
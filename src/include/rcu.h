@@ -0,0 +1,53 @@
+#ifndef RCU_H
+#define RCU_H
+
+#include "thread.h"
+
+/* Read-copy-update, for structures that are read far more often than they
+   are written. Readers take no locks: they only mark a read-side critical
+   section, in which they may follow pointers published with
+   rcu_assign_pointer(). Writers serialise among themselves, publish new
+   versions of what they change, and free the old versions only once every
+   reader that might still see them is done - after a grace period.
+
+   A read-side critical section disables preemption, so it must not sleep.
+   A grace period ends once every CPU has passed through a quiescent state
+   in which it cannot be inside one: switching threads, taking a timer tick
+   outside preempt_disable(), or being idle. */
+
+typedef struct rcu_head {
+  struct rcu_head *next;
+  void (*fn)(struct rcu_head *head);
+} rcu_head_t;
+
+/* Begins a read-side critical section. Nests. */
+static inline void rcu_read_lock() {
+  preempt_disable();
+}
+
+/* Ends a read-side critical section. */
+static inline void rcu_read_unlock() {
+  preempt_enable();
+}
+
+/* Reads a pointer published with rcu_assign_pointer(), in a read-side
+   critical section. */
+#define rcu_dereference(p) (*(__typeof__(p) volatile *)&(p))
+
+/* Publishes 'v' in 'p', once everything written to it beforehand is
+   visible. */
+#define rcu_assign_pointer(p, v) do {           \
+    __sync_synchronize();                       \
+    (p) = (v);                                  \
+  } while (0)
+
+/* Waits until every read-side critical section that was running when it was
+   called has ended. May sleep. */
+void synchronize_rcu();
+
+/* Calls 'fn' with 'head' after a grace period, from the RCU thread. 'head'
+   is usually embedded in the object to be freed. Does not sleep, so may be
+   called with spinlocks held. */
+void call_rcu(rcu_head_t *head, void (*fn)(rcu_head_t *head));
+
+#endif
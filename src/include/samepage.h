@@ -0,0 +1,29 @@
+#ifndef SAMEPAGE_H
+#define SAMEPAGE_H
+
+#include "types.h"
+
+/* Scan up to 'max_pages' user pages of the current address space, merging
+   any that are byte-identical into a single read-only copy-on-write frame.
+   Returns the number of pages merged. Other address spaces are not scanned. */
+unsigned samepage_scan(unsigned max_pages);
+
+/* Start scanning 'pages_per_pass' pages every 'interval_ms' milliseconds in
+   the background, from the system work queue. Returns 0 on success or -1 if
+   the scanner is already running. */
+int samepage_start(unsigned pages_per_pass, unsigned interval_ms);
+
+/* Stop the background scanner started by samepage_start(). */
+void samepage_stop();
+
+typedef struct samepage_stats {
+  /* Total pages looked at and merged since boot. */
+  unsigned pages_scanned, pages_merged;
+  /* Frames currently shared by merged pages, and the number of mappings
+     of them. The memory saved is (pages_sharing - frames_shared) pages. */
+  unsigned frames_shared, pages_sharing;
+} samepage_stats_t;
+
+void samepage_get_stats(samepage_stats_t *stats);
+
+#endif
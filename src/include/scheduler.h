@@ -5,5 +5,11 @@
 
 void scheduler_ready(thread_t *t);
 thread_t *scheduler_next();
+/* Changes the priority of 't', moving it to the right run queue if it is
+   queued. */
+void scheduler_set_priority(thread_t *t, unsigned priority);
+/* Returns true if a thread is queued to run on the current CPU. This does not
+   take any locks, so is only a hint. */
+bool scheduler_has_ready();
 
 #endif
@@ -0,0 +1,35 @@
+#ifndef SWAP_H
+#define SWAP_H
+
+#include "hal.h"
+#include "types.h"
+
+/* Use the block device 'dev' (a whole disk or a partition) as a swap area.
+   Returns 0 on success or -1 on failure. */
+int swap_on(dev_t dev);
+
+/* Try to free 'num_pages' physical pages by writing cold user pages in the
+   current address space out to swap. Returns the number of pages freed.
+   Sleeps, so must not be called with a spinlock, or any lock that swap I/O
+   may need, held - alloc_pages() only calls it for PAGE_REQ_RECLAIM. */
+unsigned swap_reclaim(unsigned num_pages);
+
+/* Called from the page fault handler. If 'v' holds a swap entry, read the
+   page back in and return true. Otherwise return false. */
+bool swap_handle_page_fault(uintptr_t v);
+
+/* Called when a swap entry is copied (when an address space is cloned) or
+   discarded (when it is unmapped), to keep the slot's reference count
+   correct. */
+void swap_dup_entry(uint32_t entry);
+void swap_free_entry(uint32_t entry);
+
+/* Statistics, for tests and the debugger. */
+typedef struct swap_stats {
+  unsigned slots_total, slots_used;
+  unsigned pages_out, pages_in;
+} swap_stats_t;
+
+void swap_get_stats(swap_stats_t *stats);
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef THREAD_H
 #define THREAD_H
 
+#include "adt/mpsc.h"
 #include "hal.h"
 
 #define THREAD_READY 0
@@ -8,6 +9,30 @@
 #define THREAD_SLEEP 2
 #define THREAD_DEAD  3
 
+#define THREAD_NUM_PRIORITIES   32 /* Priorities run from 0 (highest) to 31 */
+#define THREAD_PRIORITY_DEFAULT 16
+
+/* The default time slice, in milliseconds, a thread may run for before it is
+   preempted in favour of another ready thread. */
+#ifndef THREAD_QUANTUM_MS
+# define THREAD_QUANTUM_MS 10
+#endif
+
+/* A set of CPUs, indexed by get_processor_id(). */
+typedef struct cpu_mask {
+  uint32_t bits[MAX_CORES / 32];
+} cpu_mask_t;
+
+static inline void cpu_mask_set(cpu_mask_t *m, unsigned cpu) {
+  m->bits[cpu / 32] |= 1U << (cpu % 32);
+}
+static inline void cpu_mask_clear(cpu_mask_t *m, unsigned cpu) {
+  m->bits[cpu / 32] &= ~(1U << (cpu % 32));
+}
+static inline bool cpu_mask_test(const cpu_mask_t *m, unsigned cpu) {
+  return (m->bits[cpu / 32] & (1U << (cpu % 32))) != 0;
+}
+
 #define TLS_SLOT_TCB 0    /* TLS slot index for the thread control block (thread_t*) */
 #define TLS_SLOT_LAST 8   /* Final valid TLS slot entry. */
 #define TLS_SLOT_CANARY 9 /* Used internally to detect stack overrun. */
@@ -26,15 +51,11 @@ typedef struct thread {
   /* Intrusive linked list for the scheduler's use. */
   struct thread *scheduler_next;
 
-  /* Intrusive linked list for when this thread is queued
-     on a semaphore or condvar.
-
-     If queued on a semaphore, this gives the next thread in the
-     queue. */
-  struct thread *semaphore_next;
+  /* Links the thread into a CPU's queue of newly woken threads. */
+  mpsc_node_t wake_node;
 
-  /* Jump buffer to longjmp to. */
-  jmp_buf jmpbuf;
+  /* Saved by switch_context() while the thread is not running. */
+  uintptr_t context;
   
   /* Stack base (lowest address in memory) */
   uintptr_t stack;
@@ -45,11 +66,57 @@ typedef struct thread {
   /* Thread state */
   volatile uintptr_t state;
 
-  /* Thread priority (0 = highest) */
+  /* Set by thread_wake() while the thread is awake, so that it does not go
+     to sleep on a wakeup it has already been sent - see thread_sleep(). */
+  volatile uint8_t wake_pending;
+  /* Nonzero from a CPU switching to the thread until the switch away from
+     it has saved its context, so no other CPU resumes it before then. */
+  volatile uint8_t on_cpu;
+
+  /* Thread priority (0 = highest). This is raised above 'base_priority'
+     while the thread holds a mutex that a higher priority thread is
+     sleeping on - see mutex_t. */
   uint8_t priority;
 
+  /* The priority given by thread_set_priority(). */
+  uint8_t base_priority;
+
+  /* The priority of the run queue the thread was last put on. This may be
+     higher than 'priority' if the scheduler has aged the thread. */
+  uint8_t run_priority;
+
+  /* The CPU the thread is queued on or last ran on, or -1 if it has not
+     been scheduled yet. */
+  int16_t cpu;
+
+  /* The CPUs the thread may run on, if 'has_affinity' is set. */
+  cpu_mask_t affinity;
+
+  /* For priority inheritance: the mutex the thread is sleeping on, the next
+     thread sleeping on it, and the mutexes the thread holds that others are
+     sleeping on. */
+  struct mutex *blocked_on;
+  struct thread *pi_next;
+  struct mutex *pi_held;
+
+  /* The thread's coroutines, once it has spawned one - see coroutine.h. */
+  struct co_sched *coroutines;
+
+#if LOCKDEP
+  /* The mutexes the thread holds, most recently acquired first - see
+     lockdep.h. */
+  struct mutex *lockdep_held;
+#endif
+
+  /* Total time the thread has spent running, in get_cycle_count() cycles. */
+  uint64_t runtime;
+
   /* Free the thread_t object on finish? */
   uint8_t auto_free : 1;
+  /* Is the thread restricted to the CPUs in 'affinity'? */
+  uint8_t has_affinity : 1;
+  /* Is this a CPU's idle thread? */
+  uint8_t idle : 1;
 } thread_t;
 
 /* Creates a new thread object, starts it, and returns it.
@@ -71,16 +138,72 @@ void thread_kill(thread_t *t);
 /* Return the current thread. */
 thread_t *thread_current();
 
-/* Puts the current thread to sleep. It can be woken with thread_wake(). */
+/* Puts the current thread to sleep. It can be woken with thread_wake().
+
+   It may return without sleeping if it was woken since it last slept, as a
+   thread_wake() from another CPU may come just before the thread goes to
+   sleep, so callers must check what they were waiting for and sleep
+   again. */
 void thread_sleep();
 
+/* Puts the current thread to sleep for at least 'ms' milliseconds. */
+void thread_sleep_for(unsigned ms);
+
 /* Wakes the given thread. If the thread was in sleep mode and was woken,
-   return 0. Else, return -1. */
+   return 0. Else, return -1, and its next thread_sleep() returns at once. */
 int thread_wake(thread_t *t);
 
 /* Yield execution resources to another thread. */
 void thread_yield();
 
+/* Sets the priority of the given thread, between 0 (highest) and
+   THREAD_NUM_PRIORITIES-1. It may run at a higher priority while it holds a
+   mutex that a higher priority thread is waiting for. */
+void thread_set_priority(thread_t *t, unsigned priority);
+
+/* Restricts the given thread to running on the CPUs in 'mask', or lets it
+   run on any CPU if 'mask' is NULL. Takes effect the next time the thread
+   is queued. */
+void thread_set_affinity(thread_t *t, const cpu_mask_t *mask);
+
+/* Sets the time slice, in milliseconds, after which a running thread is
+   preempted if another thread is ready to run. Zero disables preemption, so
+   threads only switch when they yield or sleep. Returns -1 if there is no
+   timer to preempt with. */
+int thread_set_quantum(unsigned ms);
+
+/* Stops the current thread being preempted on this CPU until the matching
+   preempt_enable(). Calls nest. Spinlocks disable preemption while held. */
+void preempt_disable();
+
+/* Undoes a preempt_disable(). If a preemption was deferred while disabled,
+   the thread yields now. */
+void preempt_enable();
+
+/* Called by the page fault handler. If 'addr' lies in a thread stack that is
+   mapped on demand (THREAD_STACK_LAZY), maps its page, and enough below it
+   for the fault handler's own frames, and returns true. Panics if 'addr' is
+   in the stack's guard page. */
+bool thread_handle_stack_fault(uintptr_t addr);
+
+/* For RCU: returns a count that advances each time 'cpu' passes through a
+   quiescent state, in which it cannot be inside a read-side critical section
+   - switching threads, or taking a timer tick outside preempt_disable(). */
+unsigned thread_quiescent_count(unsigned cpu);
+
+/* For RCU: returns true if 'cpu' is outside preempt_disable() at this
+   instant, as it is while idle - so also in a quiescent state. */
+bool thread_cpu_preemptible(unsigned cpu);
+
+/* Allocates a block of THREAD_STACK_SZ, aligned as a thread stack is, whose
+   TLS names 't' as its thread, for carving into smaller stacks that 't' runs
+   on - see coroutine.h. Returns the block, and sets '*lowest' to the lowest
+   address in it free for stacks. */
+uintptr_t thread_stack_alloc(thread_t *t, uintptr_t *lowest);
+
+/* Frees a block from thread_stack_alloc(). */
+void thread_stack_free(uintptr_t stack);
+
 /* Returns a pointer to the 'idx'th entry in thread local storage. */
 uintptr_t *thread_tls_slot(unsigned idx);
 
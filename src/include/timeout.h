@@ -0,0 +1,33 @@
+#ifndef TIMEOUT_H
+#define TIMEOUT_H
+
+#include "types.h"
+
+/* A function to be called once, a number of milliseconds from now.
+
+   Pending timeouts are kept in a hashed hierarchical timing wheel, so adding
+   and cancelling one is O(1). The wheel is driven by register_callback(),
+   and the function is called from the timer interrupt, so it must not block.
+   The timeout_t belongs to the caller, and can live on its stack so long as
+   it is cancelled before returning. */
+typedef struct timeout {
+  struct timeout *next, **pprev;
+  uint64_t expires;
+  void (*fn)(void*);
+  void *data;
+} timeout_t;
+
+/* Initialises 't' to call 'fn' with 'data'. It is not pending. */
+void timeout_init(timeout_t *t, void (*fn)(void*), void *data);
+
+/* Makes 't' pending, to expire in no less than 'ms' milliseconds. If it was
+   already pending it is moved. */
+void timeout_add(timeout_t *t, unsigned ms);
+
+/* Stops 't' expiring. Returns 0 if it was pending, or -1 if it had already
+   expired or was never added. In the latter case its function has finished
+   running by the time this returns, so it must not be called from the
+   function itself. */
+int timeout_cancel(timeout_t *t);
+
+#endif
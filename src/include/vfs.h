@@ -10,6 +10,7 @@
  ******************************************************************************/
 
 struct inode;
+struct disk_cache;
 
 /* A filesystem driver. */
 typedef struct filesystem {
@@ -35,6 +36,15 @@ typedef struct filesystem {
                struct inode *dir_inode, struct inode *dest_inode,
                const char *name);
 
+  /* Optional. Returns the byte offset on the device of the page of normal
+     file 'inode' at the page-aligned 'offset', and in 'cache' the disk cache
+     the filesystem reads that page through. This lets vfs_mmap() map the
+     cached page directly instead of copying it. Returns -1 if the page is
+     not stored as one page-aligned run on the device, or runs past the end
+     of the file. */
+  int64_t (*bmap)(struct filesystem *fs, struct inode *inode, uint64_t offset,
+                  struct disk_cache **cache);
+
   /* Populates 'inode' with information for the root directory.
      Returns 0 on success, nonzero on failure. */
   int (*get_root)(struct filesystem *fs, struct inode *inode);
@@ -100,6 +110,14 @@ typedef struct mountpoint {
   struct inode *node;
   filesystem_t  fs;
   inode_t       orig_inode_data;
+
+  /* Pins on the mountpoint: open handles on its inodes, lookups passing
+     through it and mounts on top of it. It cannot be unmounted while
+     pinned. */
+  volatile unsigned refs;
+
+  /* The mount table is a list read under RCU. */
+  struct mountpoint *next;
 } mountpoint_t;
 
 /* Registers a filesystem with name "ident", and a probe function that
@@ -124,7 +142,7 @@ int vfs_mount(dev_t dev, inode_t *node, const char *fs);
 
 /* Unmounts. If the device is given (isn't 0), the mountpoint
    associated with it is unmounted. If not, the inode is expected to be
-   valid and is unmounted. */
+   valid and is unmounted. Fails with EBUSY if the filesystem is in use. */
 int vfs_umount(dev_t dev, inode_t *inode);
 
 typedef bool (*access_fn_t)(int mode);
@@ -147,6 +165,9 @@ int64_t vfs_read(inode_t *inode, uint64_t offset, void *buf, uint64_t sz);
 /* Performs a write of sz bytes from buf at offset. */
 int64_t vfs_write(inode_t *inode, uint64_t offset, void *buf, uint64_t sz);
 
+/* Takes another handle on inode, as vfs_open would. */
+void vfs_dup(inode_t *inode);
+
 /* Decrements the open count of inode. */
 void vfs_close(inode_t *inode);
 
@@ -161,4 +182,28 @@ int vfs_mknod(inode_t *parent,
               inode_type_t type,
               int mode, int uid, int gid);
 
+/* Flag for vfs_mmap(): writes to the mapping go to the file, instead of
+   being private to the mapping. */
+#define VFS_MAP_SHARED 0x100
+
+/* Maps 'length' bytes of normal file 'inode' from the page-aligned 'offset'
+   into kernel virtual memory, and takes a handle on the inode. 'flags' is
+   any of PAGE_WRITE, PAGE_EXECUTE, PAGE_USER and VFS_MAP_SHARED. Pages are
+   read in on first access. Returns the address of the mapping, or NULL on
+   error. */
+void *vfs_mmap(inode_t *inode, uint64_t offset, uint64_t length,
+               unsigned flags);
+
+/* Writes back the pages of a shared, writable mapping to the file. Returns
+   zero on success, nonzero on failure. */
+int vfs_msync(void *addr);
+
+/* Writes back (as vfs_msync) and unmaps a mapping created by vfs_mmap().
+   Returns zero on success, nonzero on failure. */
+int vfs_munmap(void *addr);
+
+/* Called by the page fault handler for accesses to non-present pages.
+   Returns true if 'v' is in a file mapping and its page has been read in. */
+bool vfs_mmap_handle_page_fault(uintptr_t v);
+
 #endif /* VFS_H */
@@ -0,0 +1,83 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include "hal.h"
+#include "timeout.h"
+#include "types.h"
+
+/* Work queues, for deferring work out of interrupt handlers or off a
+   caller's thread.
+
+   A work item is a function to call, queued on a workqueue_t. Items are run
+   by a pool of kernel threads on the CPU that queued them, in the order they
+   were queued, and each queue limits how many of its items may run at once
+   on a CPU. An item may sleep; while it does, another worker carries on
+   with the pool's other items.
+
+   The work_t belongs to the caller, usually embedded in a larger object that
+   the function finds with its argument. It may be queued again as soon as
+   its function starts, including from the function itself. */
+
+typedef struct work {
+  struct work *next;
+  void (*fn)(struct work *w);
+  /* Nonzero from being queued until the function starts. */
+  volatile unsigned pending;
+
+  /* Set while pending. */
+  struct workqueue *wq;
+  unsigned seq;
+  uint64_t queued_at;
+} work_t;
+
+/* A work item queued after a delay. */
+typedef struct delayed_work {
+  work_t work;
+  timeout_t timeout;
+  struct workqueue *wq;
+} delayed_work_t;
+
+typedef struct workqueue workqueue_t;
+
+/* Per-queue statistics, summed over all CPUs. Times are in
+   get_cycle_count() cycles. */
+typedef struct workqueue_stats {
+  unsigned queued, executed;
+  /* Time between items being queued and starting, in total and at most. */
+  uint64_t wait, max_wait;
+  /* Time spent running items. */
+  uint64_t run;
+} workqueue_stats_t;
+
+/* Initialises 'w' to call 'fn'. It is not pending. */
+void work_init(work_t *w, void (*fn)(work_t *w));
+/* Initialises 'dw' to call 'fn'. It is not pending. */
+void delayed_work_init(delayed_work_t *dw, void (*fn)(work_t *w));
+
+/* Creates a work queue called 'name'. At most 'max_active' of its items run
+   at once on each CPU; the rest wait their turn. */
+workqueue_t *workqueue_create(const char *name, unsigned max_active);
+/* Waits for all work queued on 'wq' to finish, then destroys it. Nothing
+   may be queued on it meanwhile. */
+void workqueue_destroy(workqueue_t *wq);
+
+/* Queues 'w' on 'wq'. Returns false, doing nothing, if it was already
+   pending. Does not sleep, so may be called from interrupt handlers. */
+bool queue_work(workqueue_t *wq, work_t *w);
+/* Queues 'dw' on 'wq' once 'ms' milliseconds have passed. Returns false,
+   doing nothing, if it was already pending. Does not sleep. */
+bool queue_delayed_work(workqueue_t *wq, delayed_work_t *dw, unsigned ms);
+/* Stops 'dw' being queued if its delay has yet to pass. Returns true if it
+   was stopped, in which case it is no longer pending. */
+bool cancel_delayed_work(delayed_work_t *dw);
+
+/* Waits until every item queued on 'wq' before the call has finished.
+   Delayed work whose delay has yet to pass is not waited for. */
+void flush_workqueue(workqueue_t *wq);
+
+void workqueue_get_stats(workqueue_t *wq, workqueue_stats_t *stats);
+
+/* A shared queue for items that need nothing special. */
+extern workqueue_t *system_wq;
+
+#endif
@@ -2,12 +2,21 @@
 #define X86_HAL_H
 
 #define THREAD_STACK_SZ 0x2000  /* 8KB of kernel stack. */
+/* Thread stacks are mapped up front and have no guard page: faults are taken
+   on the faulting stack, and two pages leave no room for one anyway. */
+/* Coroutine stacks, one to a thread stack with room for its TLS. Faults and
+   IRQs are taken on whatever stack is running, so a coroutine needs all the
+   room a thread has - handling a copy-on-write fault alone takes a page. */
+#define CO_STACK_SZ 0x1FC0
 
 #define X86_PRESENT 0x1
 #define X86_WRITE   0x2
 #define X86_USER    0x4
+#define X86_ACCESSED 0x20
+#define X86_GLOBAL  0x100
 #define X86_EXECUTE 0x200
 #define X86_COW     0x400
+#define X86_SHARED  0x800 /* Shared outright by clone_address_space() */
 
 typedef struct address_space {
   uint32_t *directory;
@@ -33,6 +42,12 @@ static inline uintptr_t round_to_page_size(uintptr_t x) {
     return x;
 }
 
+/* Tells the CPU we are spinning, which saves power and lets a hyperthread
+   sibling run. */
+static inline void cpu_relax() {
+  __asm__ volatile("pause" : : : "memory");
+}
+
 static inline void abort() {
   for(;;);
 }
@@ -58,6 +73,27 @@ static inline void jmp_buf_to_regs(struct regs *r, jmp_buf buf) {
   r->eflags = buf[0].eflags;
 }
 
+/* A context is a stack pointer, pointing at the registers pushed by
+   switch_context() (edi, esi, ebx, ebp) and the address it returns to. */
+static inline uintptr_t init_context(uintptr_t stack, void (*fn)()) {
+  uint32_t *sp = (uint32_t*)stack;
+  *--sp = 0;                    /* Return address for 'fn'. */
+  *--sp = (uint32_t)fn;
+  for (unsigned i = 0; i < 4; ++i)
+    *--sp = 0;
+  return (uintptr_t)sp;
+}
+
+static inline void context_to_regs(struct regs *r, uintptr_t context) {
+  uint32_t *sp = (uint32_t*)context;
+  r->edi = sp[0];
+  r->esi = sp[1];
+  r->ebx = sp[2];
+  r->ebp = sp[3];
+  r->eip = sp[4];
+  r->esp = context + 5 * sizeof(uint32_t);
+}
+
 #define abort() (void)0
 
 #endif
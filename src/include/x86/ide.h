@@ -134,6 +134,9 @@ typedef struct ide_dev {
   unsigned n;
   /* At the end of an operation, this semaphore should be signalled. */
   semaphore_t *sema;
+  /* Taken by the IRQ handler while it completes an operation, and by a
+     waiter giving up on one, so that only one of them does. */
+  spinlock_t irq_lock;
   /* Lock for this device's bus. */
   semaphore_t *lock;
 } ide_dev_t;
@@ -8,6 +8,12 @@
 #define CR0_PG  (1U<<31)  /* Paging enable */
 #define CR0_WP  (1U<<16)  /* Write-protect - allow page faults in kernel mode */
 
+#define CR4_PGE   (1U<<7)   /* Page global enable */
+#define CR4_PCIDE (1U<<17)  /* Process-context identifiers (IA-32e mode only) */
+
+#define CPUID_1_EDX_PGE   (1U<<13)
+#define CPUID_1_ECX_PCID  (1U<<17)
+
 static inline void outb(uint16_t port, uint8_t value) {
   __asm__ volatile ("outb %1, %0" : : "dN" (port), "a" (value));
 }
@@ -54,6 +60,12 @@ static inline uint32_t read_cr3() {
   return ret;
 }
 
+static inline uint32_t read_cr4() {
+  uint32_t ret;
+  __asm__ volatile("mov %%cr4, %0" : "=r" (ret));
+  return ret;
+}
+
 static inline void write_cr0(uint32_t val) {
   __asm__ volatile("mov %0, %%cr0" : : "r" (val));
 }
@@ -63,6 +75,21 @@ static inline void write_cr2(uint32_t val) {
 static inline void write_cr3(uint32_t val) {
   __asm__ volatile("mov %0, %%cr3" : : "r" (val));
 }
+static inline void write_cr4(uint32_t val) {
+  __asm__ volatile("mov %0, %%cr4" : : "r" (val));
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx,
+                         uint32_t *ecx, uint32_t *edx) {
+  __asm__ volatile("cpuid" : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+                   : "a" (leaf), "c" (0));
+}
+
+static inline uint64_t rdtsc() {
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((uint64_t)hi << 32) | lo;
+}
 
 
 #endif
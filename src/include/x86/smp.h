@@ -0,0 +1,40 @@
+#ifndef X86_SMP_H
+#define X86_SMP_H
+
+/* Internal to the x86 target: the local APIC and I/O APIC, and bringing up
+   the other cores (x86/apic.c), and what they need from the GDT and IDT
+   code. */
+
+#include "types.h"
+
+/* The vector IPIs arrive on, just above the ISA IRQs. */
+#define IPI_VECTOR 48
+/* The vector the local APIC raises spurious interrupts on. Its low four bits
+   must be set on older APICs. Spurious interrupts are not acknowledged. */
+#define SPURIOUS_VECTOR 0xFF
+
+/* The physical page the other cores start executing at - it must be below
+   1MB, and page aligned. See x86/trampoline.s. */
+#define AP_TRAMPOLINE 0x8000
+
+/* Returns the number of cores started so far, which are numbered from 0, or
+   0 before the APICs have been found. */
+int apic_num_online();
+
+/* Takes the oldest IPI waiting for this core, storing its data in '*data'.
+   Returns false if there is none. */
+bool apic_take_ipi(void **data);
+
+/* Replaces the 8259 PICs with another interrupt controller. 'ack' is called
+   with the vector of every interrupt taken, and 'enable' with the ISA IRQ
+   number of every IRQ that gains its first handler or loses its last. IRQs
+   that already have handlers are enabled on the new controller. */
+void set_irq_controller(void (*ack)(unsigned),
+                        void (*enable)(uint8_t, unsigned));
+
+/* Called on a core other than the first to load the GDT, with 'cpu's per-CPU
+   data in %fs, and the IDT. */
+void load_gdt(int cpu);
+void load_idt();
+
+#endif
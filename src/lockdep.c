@@ -0,0 +1,144 @@
+/* Lock order checking - see lockdep.h.
+
+   The order in which classes have been taken is kept as a graph, in a
+   fixed-size, open-addressed table of edges. Like lockstat, it is filled
+   from inside the locking functions, so is guarded by a bare test-and-set
+   lock. Each new edge is checked for a path back from its end to its start;
+   as each edge is only added once, that is rare once the system has warmed
+   up. */
+
+#if LOCKDEP
+
+#include "hal.h"
+#include "lockdep.h"
+#include "stdio.h"
+#include "thread.h"
+
+#define LOCKDEP_EDGES 1024
+/* Give up looking for a free entry after this many. */
+#define LOCKDEP_PROBES 32
+
+typedef struct edge {
+  const void *from, *to;
+} edge_t;
+
+static edge_t edges[LOCKDEP_EDGES];
+static volatile unsigned table_lock;
+/* Edges that could not be recorded as the table was too full. */
+static volatile unsigned dropped;
+static volatile unsigned cycles;
+
+/* Classes found by path(), which can be no more than there are edges. */
+static const void *reached[LOCKDEP_EDGES];
+
+static unsigned hash(const void *from, const void *to) {
+  uintptr_t h = (uintptr_t)from ^ ((uintptr_t)to * 31);
+  return (unsigned)(h ^ (h >> 10) ^ (h >> 20));
+}
+
+/* Records the edge 'from' -> 'to'. Returns true if it was new. */
+static bool add_edge(const void *from, const void *to) {
+  unsigned h = hash(from, to);
+  for (unsigned i = 0; i < LOCKDEP_PROBES; ++i) {
+    edge_t *e = &edges[(h + i) % LOCKDEP_EDGES];
+    if (e->from == from && e->to == to)
+      return false;
+    if (!e->from) {
+      e->from = from;
+      e->to = to;
+      return true;
+    }
+  }
+  ++dropped;
+  return false;
+}
+
+/* Is there a path of edges from 'from' to 'to'? Searches breadth first. */
+static bool path(const void *from, const void *to) {
+  unsigned n = 0, next = 0;
+  reached[n++] = from;
+  while (next < n) {
+    const void *c = reached[next++];
+    if (c == to)
+      return true;
+
+    for (unsigned i = 0; i < LOCKDEP_EDGES; ++i) {
+      if (edges[i].from != c)
+        continue;
+      unsigned j;
+      for (j = 0; j < n && reached[j] != edges[i].to; ++j)
+        ;
+      if (j == n && n < LOCKDEP_EDGES)
+        reached[n++] = edges[i].to;
+    }
+  }
+  return false;
+}
+
+static void print_site(const void *site) {
+  int offs;
+  const char *sym = lookup_kernel_symbol((uintptr_t)site, &offs);
+  if (sym)
+    kprintf("%s+%#x", sym, offs);
+  else
+    kprintf("%p", site);
+}
+
+void lockdep_acquire(struct mutex *m, const void *site) {
+  thread_t *t = thread_current();
+  /* Mutexes may be taken before threading is up. */
+  if (!t)
+    return;
+
+  for (mutex_t *h = t->lockdep_held; h; h = h->held_next) {
+    if (h->class == m->class)
+      continue;
+
+    int interrupts = get_interrupt_state();
+    disable_interrupts();
+    while (__sync_lock_test_and_set(&table_lock, 1)) {
+      ipi_poll();
+      cpu_relax();
+    }
+    bool cycle = add_edge(h->class, m->class) && path(m->class, h->class);
+    __sync_lock_release(&table_lock);
+    set_interrupt_state(interrupts);
+
+    if (!cycle)
+      continue;
+    __sync_fetch_and_add(&cycles, 1);
+    kprintf("lockdep: possible deadlock: mutex %p (class ", m);
+    print_site(m->class);
+    kprintf(") acquired at ");
+    print_site(site);
+    kprintf(" while holding mutex %p (class ", h);
+    print_site(h->class);
+    kprintf("), but elsewhere the other way round\n");
+  }
+}
+
+void lockdep_acquired(struct mutex *m) {
+  thread_t *t = thread_current();
+  if (!t)
+    return;
+  m->held_next = t->lockdep_held;
+  t->lockdep_held = m;
+}
+
+void lockdep_release(struct mutex *m) {
+  thread_t *t = thread_current();
+  if (!t)
+    return;
+  for (mutex_t **pm = &t->lockdep_held; *pm; pm = &(*pm)->held_next) {
+    if (*pm == m) {
+      *pm = m->held_next;
+      return;
+    }
+  }
+}
+
+unsigned lockdep_cycles() {
+  return cycles;
+}
+
+#endif
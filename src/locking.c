@@ -1,34 +1,284 @@
 #include "assert.h"
+#include "coroutine.h"
 #include "hal.h"
 #include "kmalloc.h"
+#include "lockdep.h"
+#include "lockstat.h"
+#include "scheduler.h"
 #include "stdlib.h"
 #include "thread.h"
+#include "timeout.h"
+
+/* With LOCKSTAT, acquisitions are recorded against the caller of the locking
+   function - or, where one locking function calls a helper or another, the
+   site it passes down to STAT_BEGIN_AT(). STAT_ACQUIRED() is for locks with a
+   single holder, whose hold time is recorded by STAT_RELEASE(); STAT_WAITED()
+   is for the rest. */
+#if LOCKSTAT
+# define STAT_BEGIN_AT(site)                                            \
+  uint64_t stat_start = get_cycle_count();                              \
+  const void *stat_site = (site)
+# define STAT_ACQUIRED(l, type, contended) do {                         \
+    (l)->acquired = get_cycle_count();                                  \
+    (l)->stat = lockstat_acquire((l), (type), stat_site, (contended),   \
+                                 (l)->acquired - stat_start);           \
+  } while (0)
+# define STAT_WAITED(l, type, contended)                                \
+  lockstat_acquire((l), (type), stat_site, (contended),                 \
+                   get_cycle_count() - stat_start)
+# define STAT_RELEASE(l)                                                \
+  lockstat_release((l)->stat, get_cycle_count() - (l)->acquired)
+#else
+# define STAT_BEGIN_AT(site) (void)(site)
+# define STAT_ACQUIRED(l, type, contended) (void)(contended)
+# define STAT_WAITED(l, type, contended) (void)(contended)
+# define STAT_RELEASE(l)
+#endif
+#define STAT_BEGIN() STAT_BEGIN_AT(__builtin_return_address(0))
+
+/* With LOCKDEP, mutex acquisitions are checked against the order in which
+   other mutexes have been taken. */
+#if LOCKDEP
+# define DEP_ACQUIRE(m, site) lockdep_acquire((m), (site))
+# define DEP_ACQUIRED(m) lockdep_acquired(m)
+# define DEP_RELEASE(m) lockdep_release(m)
+#else
+# define DEP_ACQUIRE(m, site)
+# define DEP_ACQUIRED(m)
+# define DEP_RELEASE(m)
+#endif
+
+/* Each waiter between us and the owner is another critical section to wait
+   out, so back off in proportion before looking again. */
+#define SPINLOCK_BACKOFF 16
 
 void spinlock_init(spinlock_t *lock) {
-  lock->val = 0;
+  lock->next = lock->owner = 0;
   lock->interrupts = 0;
 }
 
 void spinlock_acquire(spinlock_t *lock) {
+  /* A thread preempted while holding a spinlock would leave every other
+     thread that wants it spinning until it runs again. */
+  preempt_disable();
   int interrupts = get_interrupt_state();
+  STAT_BEGIN();
 
   disable_interrupts();
-  while (__sync_bool_compare_and_swap(&lock->val, 0, 1) == 0)
-    ;
+  unsigned ticket = __sync_fetch_and_add(&lock->next, 1);
+  unsigned owner;
+  bool contended = false;
+  while ((owner = lock->owner) != ticket) {
+    contended = true;
+    /* With interrupts off we cannot take an IPI, and the owner may be
+       waiting for us to answer one. */
+    ipi_poll();
+    for (unsigned i = (ticket - owner) * SPINLOCK_BACKOFF; i != 0; --i)
+      cpu_relax();
+  }
+  /* Keep the critical section after the acquire. */
+  __sync_synchronize();
 
   lock->interrupts = interrupts;
+  STAT_ACQUIRED(lock, "spinlock", contended);
 }
 
 void spinlock_release(spinlock_t *lock) {
-  while (__sync_bool_compare_and_swap(&lock->val, 1, 0) == 0)
-    ;
-  set_interrupt_state(lock->interrupts);
+  /* Once released, the next owner may overwrite 'interrupts'. */
+  int interrupts = lock->interrupts;
+  STAT_RELEASE(lock);
+  /* Only the owner writes 'owner', so a plain store will do, once the
+     critical section is complete. */
+  __sync_synchronize();
+  lock->owner = lock->owner + 1;
+  set_interrupt_state(interrupts);
+  preempt_enable();
+}
+
+void mcs_lock_init(mcs_lock_t *lock) {
+  lock->tail = NULL;
+}
+
+void mcs_lock_acquire(mcs_lock_t *lock, mcs_node_t *node) {
+  preempt_disable();
+  node->interrupts = get_interrupt_state();
+  STAT_BEGIN();
+  disable_interrupts();
+
+  node->next = NULL;
+  node->locked = 1;
+  mcs_node_t *prev = __sync_lock_test_and_set(&lock->tail, node);
+  if (prev) {
+    /* Queue behind 'prev', which will hand the lock to us. */
+    prev->next = node;
+    while (node->locked) {
+      ipi_poll();
+      cpu_relax();
+    }
+  }
+  __sync_synchronize();
+  STAT_ACQUIRED(lock, "mcs", prev != NULL);
+}
+
+void mcs_lock_release(mcs_lock_t *lock, mcs_node_t *node) {
+  STAT_RELEASE(lock);
+  if (!node->next) {
+    /* Nobody queued behind us - unless one is in the middle of doing so. */
+    if (__sync_bool_compare_and_swap(&lock->tail, node, NULL))
+      goto out;
+    while (!node->next) {
+      ipi_poll();
+      cpu_relax();
+    }
+  }
+  __sync_synchronize();
+  node->next->locked = 0;
+
+out:
+  set_interrupt_state(node->interrupts);
+  preempt_enable();
+}
+
+/* Wakes 't', or its coroutine 'co' if the sleeper is one. */
+static void wake(thread_t *t, coroutine_t *co) {
+  if (co)
+    co_wake(co);
+  else
+    thread_wake(t);
+}
+
+typedef struct timed_wait {
+  thread_t *thread;
+  coroutine_t *co;
+  volatile int expired;
+} timed_wait_t;
+
+static void timed_wait_expired(void *p) {
+  timed_wait_t *w = (timed_wait_t*)p;
+  thread_t *t = w->thread;
+  coroutine_t *co = w->co;
+  w->expired = 1;
+  wake(t, co);
+}
+
+void waitqueue_init(waitqueue_t *q) {
+  spinlock_init(&q->lock);
+  q->head = q->tail = NULL;
+}
+
+void waitqueue_add(waitqueue_t *q, waiter_t *w, bool exclusive) {
+  w->next = NULL;
+  w->thread = thread_current();
+  w->co = co_current();
+  w->exclusive = exclusive;
+  w->woken = 0;
+  w->waking = 0;
+
+  if (q->tail)
+    q->tail->next = w;
+  else
+    q->head = w;
+  q->tail = w;
+}
+
+/* Takes 'w' off 'q', if it is still on it. */
+static void waitqueue_remove(waitqueue_t *q, waiter_t *w) {
+  waiter_t *prev = NULL;
+  for (waiter_t *x = q->head; x; prev = x, x = x->next) {
+    if (x != w)
+      continue;
+    if (prev)
+      prev->next = w->next;
+    else
+      q->head = w->next;
+    if (q->tail == w)
+      q->tail = prev;
+    return;
+  }
+}
+
+unsigned waitqueue_sleep(waitqueue_t *q, waiter_t *w, unsigned ms) {
+  timed_wait_t tw = {.thread = w->thread, .co = w->co, .expired = 0};
+  timeout_t timeout;
+  if (ms != WAITQUEUE_FOREVER) {
+    timeout_init(&timeout, &timed_wait_expired, &tw);
+    timeout_add(&timeout, ms);
+  }
+
+  /* The interrupt state from before the lock was taken. */
+  int interrupts = q->lock.interrupts;
+  spinlock_release(&q->lock);
+
+  /* Once off the queue, 'woken' is set before the wakeup, so checking it
+     with interrupts disabled means neither a waker nor the timeout can find
+     us not yet asleep. */
+  disable_interrupts();
+  while (!w->woken && !tw.expired) {
+    /* A waiter queued with no coroutine sleeps with its whole thread, even
+       if it is in one - see mutex_acquire_slow(). */
+    if (w->co)
+      co_sleep();
+    else
+      thread_sleep();
+  }
+  set_interrupt_state(interrupts);
+
+  if (ms != WAITQUEUE_FOREVER) {
+    timeout_cancel(&timeout);
+    if (!w->woken) {
+      /* Timed out - unless a waker got to us first, in which case we may
+         have been handed something we must not drop. */
+      spinlock_acquire(&q->lock);
+      if (!w->woken)
+        waitqueue_remove(q, w);
+      spinlock_release(&q->lock);
+    }
+  }
+  /* A waker that got to us may still be in wake(). It holds the queue lock
+     with interrupts disabled meanwhile, so is running on another CPU. */
+  while (w->waking)
+    cpu_relax();
+  return w->woken;
+}
+
+unsigned waitqueue_wake_locked(waitqueue_t *q, unsigned n, bool handoff) {
+  unsigned woken = 0;
+  while (q->head && woken < n) {
+    waiter_t *w = q->head;
+    q->head = w->next;
+    if (!q->head)
+      q->tail = NULL;
+
+    unsigned how = WAITQUEUE_WOKEN;
+    if (w->exclusive) {
+      ++woken;
+      if (handoff)
+        how = WAITQUEUE_HANDOFF;
+    }
+    /* The waiter may see 'woken' before we wake it - it need not have gone
+       to sleep yet - but must not return, and let its thread exit and its
+       waiter_t go, until we are done with both. It waits for 'waking' to
+       clear first. */
+    w->waking = 1;
+    __sync_synchronize();
+    w->woken = how;
+    wake(w->thread, w->co);
+    __sync_synchronize();
+    w->waking = 0;
+  }
+  return woken;
+}
+
+unsigned waitqueue_wake(waitqueue_t *q, unsigned n) {
+  spinlock_acquire(&q->lock);
+  unsigned woken = waitqueue_wake_locked(q, n, false);
+  spinlock_release(&q->lock);
+  return woken;
 }
 
 void semaphore_init(semaphore_t *s) {
   s->val = 0;
-  spinlock_init(&s->queue_lock);
-  s->queue_head = NULL;
+  waitqueue_init(&s->queue);
 }
 
 semaphore_t *semaphore_new() {
@@ -38,84 +288,431 @@ semaphore_t *semaphore_new() {
   return p;
 }
 
+/* Tries to decrement the semaphore without sleeping. */
+static bool semaphore_try(semaphore_t *s) {
+  unsigned val;
+  while ( (val = s->val) != 0) {
+    if (__sync_bool_compare_and_swap(&s->val, val, val-1) == 1)
+      /* Compare and swap succeeded - we decremented val. */
+      return true;
+  }
+  return false;
+}
+
+/* The body of semaphore_wait() and semaphore_timedwait(), whose caller is
+   'site'. */
+static int semaphore_wait_ms(semaphore_t *s, unsigned ms, const void *site) {
+  STAT_BEGIN_AT(site);
+
+  if (semaphore_try(s)) {
+    STAT_WAITED(s, "semaphore", false);
+    return 0;
+  }
+
+  /* 'val' is only incremented while nobody is queued, so checking it again
+     under the queue lock means a signal cannot come between finding it at
+     zero and queueing. */
+  spinlock_acquire(&s->queue.lock);
+  if (semaphore_try(s)) {
+    spinlock_release(&s->queue.lock);
+    STAT_WAITED(s, "semaphore", false);
+    return 0;
+  }
+  waiter_t w;
+  waitqueue_add(&s->queue, &w, /*exclusive=*/true);
+
+  /* Woken only by a signal handing us its unit. */
+  if (!waitqueue_sleep(&s->queue, &w, ms))
+    return -1;
+  STAT_WAITED(s, "semaphore", true);
+  return 0;
+}
+
 void semaphore_wait(semaphore_t *s) {
   assert(s && "NULL semaphore given!");
+  semaphore_wait_ms(s, WAITQUEUE_FOREVER, __builtin_return_address(0));
+}
+
+int semaphore_timedwait(semaphore_t *s, unsigned ms) {
+  assert(s && "NULL semaphore given!");
+  return semaphore_wait_ms(s, ms, __builtin_return_address(0));
+}
+
+void semaphore_signal(semaphore_t *s) {
+  assert(s && "NULL semaphore given!");
+
+  /* Hand the unit to the first waiter if there is one, so that a thread
+     arriving in semaphore_wait() meanwhile cannot take it first. */
+  spinlock_acquire(&s->queue.lock);
+  if (!waitqueue_wake_locked(&s->queue, 1, /*handoff=*/true))
+    __sync_fetch_and_add(&s->val, 1);
+  spinlock_release(&s->queue.lock);
+}
+
+/* How many times to poll a mutex whose owner is running before sleeping. */
+#define MUTEX_SPIN_LIMIT 1000
+
+/* Priority inheritance is followed through at most this many mutexes, which
+   also stops it going round a deadlocked cycle for ever. */
+#define PI_MAX_DEPTH 16
+
+/* Guards every mutex's 'pi_*' fields and every thread's 'blocked_on',
+   'pi_next' and 'pi_held', so that a chain of owners and the mutexes they
+   sleep on can be followed safely. It nests inside a mutex's queue lock. It
+   is only taken when a mutex has sleepers, or by thread_set_priority(). */
+static spinlock_t pi_lock = SPINLOCK_RELEASED;
+
+/* The following are called with pi_lock held. */
+
+/* Puts 'm' on the list of contended mutexes held by 't'. */
+static void pi_hold(mutex_t *m, thread_t *t) {
+  if (m->pi_holder == t)
+    return;
+  assert(m->pi_holder == NULL);
+  m->pi_holder = t;
+  m->pi_next = t->pi_held;
+  t->pi_held = m;
+}
 
-  while (1) {
-    /* First, try and decrement the semaphore until it hits zero. */
-    unsigned val;
-    while ( (val = s->val) != 0) {
-      if (__sync_bool_compare_and_swap(&s->val, val, val-1) == 1)
-        /* Compare and swap succeeded - we decremented val. */
-        return;
+/* Takes 'm' off its holder's list of contended mutexes. */
+static void pi_unhold(mutex_t *m) {
+  if (!m->pi_holder)
+    return;
+  for (mutex_t **pm = &m->pi_holder->pi_held; *pm; pm = &(*pm)->pi_next) {
+    if (*pm == m) {
+      *pm = m->pi_next;
+      break;
     }
+  }
+  m->pi_holder = NULL;
+}
 
-    /* Semaphore is at zero, we must sleep. */
-    spinlock_acquire(&s->queue_lock);
-    thread_t *t = thread_current();
-    t->semaphore_next = s->queue_head;
-    s->queue_head = t;
-    spinlock_release(&s->queue_lock);
+/* Takes 't' off the list of threads sleeping on the mutex it is blocked
+   on. */
+static void pi_unblock(thread_t *t) {
+  mutex_t *m = t->blocked_on;
+  for (thread_t **pt = &m->pi_waiters; *pt; pt = &(*pt)->pi_next) {
+    if (*pt == t) {
+      *pt = t->pi_next;
+      break;
+    }
+  }
+  t->blocked_on = NULL;
+}
 
-    thread_sleep();
+/* Brings the priority of 't' up to date, and that of every owner down the
+   chain of mutexes it is sleeping on, until one does not change. */
+static void pi_update(thread_t *t) {
+  for (unsigned depth = 0; t && depth < PI_MAX_DEPTH; ++depth) {
+    unsigned priority = t->base_priority;
+    for (mutex_t *m = t->pi_held; m; m = m->pi_next)
+      for (thread_t *w = m->pi_waiters; w; w = w->pi_next)
+        if (w->priority < priority)
+          priority = w->priority;
 
+    if (priority == t->priority)
+      return;
+    scheduler_set_priority(t, priority);
+    t = t->blocked_on ? t->blocked_on->owner : NULL;
   }
 }
 
-void semaphore_signal(semaphore_t *s) {
-  assert(s && "NULL semaphore given!");
+void mutex_update_priority(thread_t *t) {
+  spinlock_acquire(&pi_lock);
+  pi_update(t);
+  spinlock_release(&pi_lock);
+}
 
-  /* FIXME: The current implementation is not FIFO, but LIFO, so
-     thread starvation could occur. */
-  __sync_fetch_and_add(&s->val, 1);
-
-  /* Wake one thread from the queue. */
-  spinlock_acquire(&s->queue_lock);
-  thread_t *t = s->queue_head;
-  if (t)
-    s->queue_head = t->semaphore_next;
-  spinlock_release(&s->queue_lock);
-  
-  if (t)
-    thread_wake(t);
+void mutex_init(mutex_t *m) {
+  m->val = 0;
+  m->owner = NULL;
+  waitqueue_init(&m->queue);
+  m->pi_waiters = NULL;
+  m->pi_holder = NULL;
+  m->pi_next = NULL;
+#if LOCKDEP
+  m->class = __builtin_return_address(0);
+  m->held_next = NULL;
+#endif
+}
+
+mutex_t *mutex_new() {
+  mutex_t *m = kmalloc(sizeof(mutex_t));
+  mutex_init(m);
+#if LOCKDEP
+  m->class = __builtin_return_address(0);
+#endif
+  return m;
+}
+
+/* Records 't' as the owner of 'm', which it has just taken. A thread that
+   started sleeping on 'm' before 'owner' was set will not have found us to
+   pass its priority to, so in that case we take it ourselves. */
+static void mutex_owned(mutex_t *m, thread_t *t) {
+  m->owner = t;
+  __sync_synchronize();
+  if (m->val != 2)
+    return;
+
+  spinlock_acquire(&pi_lock);
+  if (m->pi_waiters) {
+    pi_hold(m, t);
+    pi_update(t);
+  }
+  spinlock_release(&pi_lock);
+}
+
+/* Spins while the owner of 'm' is running, so likely to release it soon.
+   Returns true if 'm' was taken. Only ever takes a released mutex, which
+   it never is while there are sleepers to hand it to. */
+static bool mutex_spin(mutex_t *m) {
+  for (unsigned i = 0; i < MUTEX_SPIN_LIMIT; ++i) {
+    if (m->val == 0 && __sync_bool_compare_and_swap(&m->val, 0, 1))
+      return true;
+    thread_t *owner = m->owner;
+    if (owner && owner->state != THREAD_RUN)
+      return false;
+    cpu_relax();
+  }
+  return false;
+}
+
+/* The contended path of mutex_acquire() and mutex_timedacquire(). */
+static int mutex_acquire_slow(mutex_t *m, unsigned ms) {
+  thread_t *t = thread_current();
+  /* We may hold it already - through another of our coroutines that yielded
+     with it held, say. Spinning would only wait for ourselves, and sleeping
+     without a timeout would never end. */
+  bool self = m->owner == t;
+  assert((!self || ms != WAITQUEUE_FOREVER) &&
+         "Mutex already held by this thread!");
+
+  if (!self && mutex_spin(m)) {
+    mutex_owned(m, t);
+    return 0;
+  }
+
+  /* Mark the mutex as having sleepers, and queue ourselves, atomically with
+     respect to mutex_release(). */
+  spinlock_acquire(&m->queue.lock);
+  if (__sync_lock_test_and_set(&m->val, 2) == 0) {
+    /* Released meanwhile. */
+    spinlock_release(&m->queue.lock);
+    mutex_owned(m, t);
+    return 0;
+  }
+  waiter_t w;
+  waitqueue_add(&m->queue, &w, /*exclusive=*/true);
+  /* Priority inheritance follows threads, so a coroutine waits with its
+     whole thread. */
+  w.co = NULL;
+
+  /* Lend the owner our priority while we sleep. */
+  spinlock_acquire(&pi_lock);
+  t->blocked_on = m;
+  t->pi_next = m->pi_waiters;
+  m->pi_waiters = t;
+  thread_t *owner = m->owner;
+  if (owner) {
+    pi_hold(m, owner);
+    pi_update(owner);
+  }
+  spinlock_release(&pi_lock);
+
+  /* mutex_release() hands the mutex over, setting the owner for us. */
+  if (waitqueue_sleep(&m->queue, &w, ms))
+    return 0;
+
+  /* Timed out, so take back what we lent. */
+  spinlock_acquire(&pi_lock);
+  if (t->blocked_on == m) {
+    pi_unblock(t);
+    if (m->owner)
+      pi_update(m->owner);
+  }
+  spinlock_release(&pi_lock);
+  return -1;
+}
+
+/* The body of mutex_acquire() and mutex_timedacquire(), and of the writer's
+   mutex_acquire() in rwlock_write_acquire(), whose caller is 'site'. */
+static int mutex_acquire_at(mutex_t *m, unsigned ms, const void *site) {
+  assert(m && "NULL mutex given!");
+  STAT_BEGIN_AT(site);
+  DEP_ACQUIRE(m, site);
+
+  bool contended = false;
+  int ret = 0;
+  if (__sync_bool_compare_and_swap(&m->val, 0, 1)) {
+    mutex_owned(m, thread_current());
+  } else {
+    contended = true;
+    ret = mutex_acquire_slow(m, ms);
+  }
+
+  if (ret == 0) {
+    DEP_ACQUIRED(m);
+    STAT_ACQUIRED(m, "mutex", contended);
+  }
+  return ret;
+}
+
+void mutex_acquire(mutex_t *m) {
+  mutex_acquire_at(m, WAITQUEUE_FOREVER, __builtin_return_address(0));
+}
+
+int mutex_timedacquire(mutex_t *m, unsigned ms) {
+  return mutex_acquire_at(m, ms, __builtin_return_address(0));
+}
+
+void mutex_release(mutex_t *m) {
+  assert(m && "NULL mutex given!");
+
+  STAT_RELEASE(m);
+  DEP_RELEASE(m);
+  thread_t *self = m->owner;
+  m->owner = NULL;
+  if (__sync_bool_compare_and_swap(&m->val, 1, 0))
+    return;
+
+  /* There may be sleepers. Hand the mutex straight to the first, keeping it
+     held throughout so that nobody can barge in before it runs. */
+  spinlock_acquire(&m->queue.lock);
+  spinlock_acquire(&pi_lock);
+  pi_unhold(m);
+
+  waiter_t *w = m->queue.head;
+  if (w) {
+    thread_t *t = w->thread;
+    m->owner = t;
+    pi_unblock(t);
+    /* Stay on the slow path while there are sleepers, or threads that timed
+       out sleeping and have yet to take back their priority. */
+    m->val = (w->next || m->pi_waiters) ? 2 : 1;
+
+    /* The new owner inherits from the sleepers left behind it. */
+    if (m->pi_waiters) {
+      pi_hold(m, t);
+      pi_update(t);
+    }
+    waitqueue_wake_locked(&m->queue, 1, /*handoff=*/true);
+  } else {
+    m->val = 0;
+  }
+
+  /* Drop whatever we inherited through 'm'. */
+  if (self)
+    pi_update(self);
+  spinlock_release(&pi_lock);
+  spinlock_release(&m->queue.lock);
 }
 
 void rwlock_init(rwlock_t *l) {
-  semaphore_init(&l->r);
-  semaphore_init(&l->w);
-  semaphore_signal(&l->r);
-  semaphore_signal(&l->w);
-  spinlock_init(&l->lock);
-  l->readcount = l->writecount = 0;
+  l->count = 0;
+  mutex_init(&l->writer);
+#if LOCKDEP
+  l->writer.class = __builtin_return_address(0);
+#endif
+  waitqueue_init(&l->readers);
+  waitqueue_init(&l->writers);
 }
 
 void rwlock_read_acquire(rwlock_t *l) {
   assert(l);
+  STAT_BEGIN();
+  bool contended = false;
 
-  spinlock_acquire(&l->lock);
-  semaphore_wait(&l->r);
-  if (__sync_fetch_and_add(&l->readcount, 1) == 0)
-    semaphore_signal(&l->w);
-  semaphore_signal(&l->r);
-  spinlock_release(&l->lock);
+  while (__sync_add_and_fetch(&l->count, 1) & RWLOCK_WRITER) {
+    /* A writer is in. Back out, and sleep until it is done - unless it
+       finished before we queued, as rwlock_write_release() wakes readers
+       under the queue lock after leaving. */
+    __sync_fetch_and_sub(&l->count, 1);
+    contended = true;
+
+    spinlock_acquire(&l->readers.lock);
+    if (!(l->count & RWLOCK_WRITER)) {
+      spinlock_release(&l->readers.lock);
+      continue;
+    }
+    waiter_t w;
+    waitqueue_add(&l->readers, &w, /*exclusive=*/false);
+    waitqueue_sleep(&l->readers, &w, WAITQUEUE_FOREVER);
+  }
+  STAT_WAITED(l, "rwlock-r", contended);
 }
 
 void rwlock_read_release(rwlock_t *l) {
   assert(l);
-  if (__sync_fetch_and_sub(&l->readcount, 1) == 1)
-    semaphore_signal(&l->w);
+  /* The last reader out wakes any writer waiting for it. The decrement is a
+     full barrier, so a writer that queued before it is seen here. */
+  if (__sync_sub_and_fetch(&l->count, 1) == 0 && l->writers.head)
+    waitqueue_wake(&l->writers, WAITQUEUE_ALL);
 }
 
 void rwlock_write_acquire(rwlock_t *l) {
-  if (__sync_fetch_and_add(&l->writecount, 1) == 0)
-    semaphore_wait(&l->r);
+  assert(l);
+  STAT_BEGIN();
+  bool contended = l->count != 0 || l->writer.val != 0;
 
-  semaphore_wait(&l->w);
+  mutex_acquire_at(&l->writer, WAITQUEUE_FOREVER,
+                   __builtin_return_address(0));
+  /* Wait for the readers to leave. New readers can still get in until we
+     do, which is what biases the lock towards them. */
+  while (!__sync_bool_compare_and_swap(&l->count, 0, RWLOCK_WRITER)) {
+    /* Queue before looking at the count again, so that the last reader
+       either sees us queued or leaves before we look. */
+    spinlock_acquire(&l->writers.lock);
+    waiter_t w;
+    waitqueue_add(&l->writers, &w, /*exclusive=*/false);
+    __sync_synchronize();
+    if (l->count == 0) {
+      waitqueue_remove(&l->writers, &w);
+      spinlock_release(&l->writers.lock);
+      continue;
+    }
+    waitqueue_sleep(&l->writers, &w, WAITQUEUE_FOREVER);
+  }
+  STAT_ACQUIRED(l, "rwlock-w", contended);
 }
 
 void rwlock_write_release(rwlock_t *l) {
-  semaphore_signal(&l->w);
+  assert(l);
+  STAT_RELEASE(l);
+  __sync_fetch_and_sub(&l->count, RWLOCK_WRITER);
+  /* Wake every reader that found us in, together. */
+  waitqueue_wake(&l->readers, WAITQUEUE_ALL);
+  mutex_release(&l->writer);
+}
+
+void seqlock_init(seqlock_t *l) {
+  l->seq = 0;
+  spinlock_init(&l->lock);
+}
 
-  if (__sync_fetch_and_sub(&l->writecount, 1) == 1)
-    semaphore_signal(&l->r);
+unsigned seqlock_read_begin(seqlock_t *l) {
+  unsigned seq;
+  while ((seq = l->seq) & 1) {
+    ipi_poll();
+    cpu_relax();
+  }
+  /* Keep the reads of the record after reading 'seq'. */
+  __sync_synchronize();
+  return seq;
+}
+
+bool seqlock_read_retry(seqlock_t *l, unsigned seq) {
+  __sync_synchronize();
+  return l->seq != seq;
+}
+
+void seqlock_write_acquire(seqlock_t *l) {
+  spinlock_acquire(&l->lock);
+  l->seq = l->seq + 1;
+  __sync_synchronize();
+}
+
+void seqlock_write_release(seqlock_t *l) {
+  __sync_synchronize();
+  l->seq = l->seq + 1;
+  spinlock_release(&l->lock);
 }
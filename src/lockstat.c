@@ -0,0 +1,155 @@
+/* Lock contention statistics - see lockstat.h.
+
+   Statistics live in a fixed-size, open-addressed table keyed by lock and
+   call site. It is filled from inside the locking functions, so must not
+   itself allocate or take any lock that is instrumented; it is guarded by a
+   bare test-and-set lock instead. */
+
+#if LOCKSTAT
+
+#include "hal.h"
+#include "lockstat.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#define LOCKSTAT_ENTRIES 1024
+/* Give up looking for a free entry after this many, so that a full table
+   does not make every acquisition scan the whole of it. */
+#define LOCKSTAT_PROBES 32
+/* Entries shown by the debugger command if no number is given. */
+#define LOCKSTAT_SHOW 20
+
+static lockstat_t table[LOCKSTAT_ENTRIES];
+static volatile unsigned table_lock;
+/* Acquisitions that could not be recorded as the table was too full. */
+static volatile unsigned dropped;
+
+static unsigned hash(const void *lock, const void *site) {
+  uintptr_t h = (uintptr_t)lock ^ ((uintptr_t)site * 31);
+  return (unsigned)(h ^ (h >> 10) ^ (h >> 20));
+}
+
+lockstat_t *lockstat_acquire(const void *lock, const char *type,
+                             const void *site, bool contended, uint64_t wait) {
+  unsigned h = hash(lock, site);
+
+  int interrupts = get_interrupt_state();
+  disable_interrupts();
+  while (__sync_lock_test_and_set(&table_lock, 1)) {
+    ipi_poll();
+    cpu_relax();
+  }
+
+  lockstat_t *s = NULL;
+  for (unsigned i = 0; i < LOCKSTAT_PROBES; ++i) {
+    lockstat_t *e = &table[(h + i) % LOCKSTAT_ENTRIES];
+    if (e->lock == lock && e->site == site) {
+      s = e;
+      break;
+    }
+    if (!e->lock) {
+      e->lock = lock;
+      e->site = site;
+      e->type = type;
+      s = e;
+      break;
+    }
+  }
+
+  if (s) {
+    ++s->acquisitions;
+    if (contended)
+      ++s->contended;
+    s->wait += wait;
+  } else {
+    ++dropped;
+  }
+
+  __sync_lock_release(&table_lock);
+  set_interrupt_state(interrupts);
+  return s;
+}
+
+void lockstat_release(lockstat_t *stat, uint64_t hold) {
+  /* Only the holder of the lock updates this, so no need for the table
+     lock. */
+  if (stat && hold > stat->max_hold)
+    stat->max_hold = hold;
+}
+
+/* Is entry 'i' with 'wait' after entry 'prev' with 'prev_wait', in order of
+   decreasing wait? */
+static bool after(unsigned i, uint64_t wait, int prev, uint64_t prev_wait) {
+  return wait < prev_wait || (wait == prev_wait && (int)i > prev);
+}
+
+void lockstat_dump(unsigned n) {
+  kprintf("lockstat: %d dropped acquisitions\n", dropped);
+
+  /* Print in order of decreasing wait without needing space to sort in:
+     each time round, pick the greatest wait after the last one printed. */
+  int prev = -1;
+  uint64_t prev_wait = ~0ULL;
+  for (unsigned k = 0; k < n; ++k) {
+    int best = -1;
+    for (unsigned i = 0; i < LOCKSTAT_ENTRIES; ++i) {
+      if (!table[i].lock || !after(i, table[i].wait, prev, prev_wait))
+        continue;
+      if (best < 0 || table[i].wait > table[best].wait)
+        best = i;
+    }
+    if (best < 0)
+      break;
+
+    lockstat_t *e = &table[best];
+    int offs;
+    const char *sym = lookup_kernel_symbol((uintptr_t)e->site, &offs);
+    kprintf("%-9s %p ", e->type, e->lock);
+    if (sym)
+      kprintf("%s+%#x", sym, offs);
+    else
+      kprintf("%p", e->site);
+    kprintf(": %u acquired, %u contended, %u kcycles waiting, "
+            "%u cycles max hold\n", e->acquisitions, e->contended,
+            (unsigned)(e->wait / 1000), (unsigned)e->max_hold);
+
+    prev = best;
+    prev_wait = e->wait;
+  }
+}
+
+static void inspect_lockstat(const char *cmd, core_debug_state_t *states,
+                             int core) {
+  unsigned n = LOCKSTAT_SHOW;
+  if (strchr(cmd, ' '))
+    n = strtoul(strchr(cmd, ' ')+1, NULL, 0);
+  lockstat_dump(n);
+}
+
+static int lockstat_init() {
+  register_debugger_handler("lockstat",
+                            "Show the most contended locks: lockstat [count]",
+                            &inspect_lockstat);
+  return 0;
+}
+
+static int lockstat_fini() {
+#if defined(HOSTED)
+  lockstat_dump(LOCKSTAT_ENTRIES);
+#endif
+  return 0;
+}
+
+static prereq_t load_after[] = { {"debugger",NULL}, {"console",NULL},
+                                 {NULL,NULL} };
+
+static module_t x run_on_startup = {
+  .name = "lockstat",
+  .required = NULL,
+  .load_after = load_after,
+  .init = &lockstat_init,
+  .fini = &lockstat_fini
+};
+
+#endif
@@ -0,0 +1,55 @@
+/* Per-CPU variables - see percpu.h. */
+
+#include "hal.h"
+#include "kmalloc.h"
+#include "percpu.h"
+#include "stdio.h"
+#include "string.h"
+
+#ifdef DEBUG_percpu
+# define dbg(args...) kprintf("percpu: " args)
+#else
+# define dbg(args...)
+#endif
+
+/* Copies are aligned like the section is, to this boundary, so that
+   anything aligned within it stays aligned. */
+#define PERCPU_ALIGN 64
+
+/* Provided by the linker around the 'percpu' section. */
+extern char __start_percpu[], __stop_percpu[];
+
+uintptr_t percpu_offsets[MAX_CORES];
+PERCPU_DEFINE(uintptr_t, percpu_this_offset) = 0;
+
+static int percpu_init() {
+  int n = get_num_processors();
+  unsigned sz = __stop_percpu - __start_percpu;
+  dbg("%d bytes of per-CPU data\n", sz);
+
+  for (int cpu = 1; cpu < n; ++cpu) {
+    uintptr_t base = (uintptr_t)kmalloc(sz + PERCPU_ALIGN);
+    uintptr_t copy =
+      base + (((uintptr_t)__start_percpu - base) & (PERCPU_ALIGN - 1));
+    memcpy((void*)copy, __start_percpu, sz);
+
+    uintptr_t offset = copy - (uintptr_t)__start_percpu;
+    percpu_offsets[cpu] = offset;
+    *per_cpu_ptr(&percpu_this_offset, cpu) = offset;
+    set_percpu_offset(cpu, offset);
+    dbg("CPU %d at %p\n", cpu, (void*)copy);
+  }
+  return 0;
+}
+
+static prereq_t prereqs[] = { {"kmalloc",NULL}, {NULL,NULL} };
+static prereq_t load_after[] = { {"x86/gdt",NULL}, {"x86/apic",NULL},
+                                 {NULL,NULL} };
+
+static module_t x run_on_startup = {
+  .name = "percpu",
+  .required = prereqs,
+  .load_after = load_after,
+  .init = &percpu_init,
+  .fini = NULL
+};
@@ -68,6 +68,7 @@
 #include "mmap.h"
 #include "adt/buddy.h"
 #include "string.h"
+#include "swap.h"
 
 #ifdef DEBUG_pmm
 # define dbg(args...) kprintf("pmm: " args)
@@ -85,7 +86,9 @@ extern range_t  early_ranges[64];
 extern unsigned early_nranges;
 extern uint64_t early_max_extent;
 
-static spinlock_t lock = SPINLOCK_RELEASED;
+/* Every CPU allocates through here, so this is one of the most contended
+   locks in the kernel; use a queue lock. */
+static mcs_lock_t lock = MCS_LOCK_RELEASED;
 static buddy_t allocators[3];
 
 static range_t split_range(range_t *r, uint64_t loc) {
@@ -111,9 +114,10 @@ uint64_t alloc_page(int req) {
   return alloc_pages(req, 1);
 }
 
-uint64_t alloc_pages(int req, size_t num) {
+static uint64_t try_alloc_pages(int req, size_t num) {
+  mcs_node_t node;
   dbg("alloc_pages: get lock\n");
-  spinlock_acquire(&lock);
+  mcs_lock_acquire(&lock, &node);
   dbg("alloc_pages: got lock\n");
   uint64_t val = buddy_alloc(&allocators[req], num * get_page_size());
   dbg("alloc_pages2: returning %x\n", val & 0xFFFFFFFF);
@@ -121,7 +125,24 @@ uint64_t alloc_pages(int req, size_t num) {
     val = buddy_alloc(&allocators[PAGE_REQ_UNDER4GB], num * get_page_size());
   dbg("alloc_pages: returning %x\n", val & 0xFFFFFFFF);
   
-  spinlock_release(&lock);
+  mcs_lock_release(&lock, &node);
+  return val;
+}
+
+/** If we run out of memory, we try to make some room by swapping cold user
+    pages out, then try once more. Swapping out sleeps on I/O and takes the
+    address space lock, so only callers that may sleep and hold no lock it
+    needs may ask for it, with PAGE_REQ_RECLAIM - faults on user pages and
+    on memory-mapped files do, but the page table allocations of map() and
+    clone_address_space(), for instance, cannot. { */
+
+uint64_t alloc_pages(int req, size_t num) {
+  int reclaim = req & PAGE_REQ_RECLAIM;
+  req &= ~PAGE_REQ_RECLAIM;
+
+  uint64_t val = try_alloc_pages(req, num);
+  if (val == ~0ULL && reclaim && swap_reclaim(num) > 0)
+    val = try_alloc_pages(req, num);
   return val;
 }
 
@@ -130,7 +151,8 @@ int free_page(uint64_t page) {
 }
 
 int free_pages(uint64_t pages, size_t num) {
-  spinlock_acquire(&lock);
+  mcs_node_t node;
+  mcs_lock_acquire(&lock, &node);
 
   int req = PAGE_REQ_NONE;
   if (pages < 0x100000)
@@ -140,7 +162,7 @@ int free_pages(uint64_t pages, size_t num) {
   
   buddy_free(&allocators[req], pages, num * get_page_size());
 
-  spinlock_release(&lock);
+  mcs_lock_release(&lock, &node);
   return 0;
 }
 
@@ -0,0 +1,114 @@
+/* Read-copy-update - see rcu.h.
+
+   A grace period is detected without any bookkeeping on the read side: for
+   each other CPU, synchronize_rcu() notes its quiescent count, then waits
+   for the count to move on or for the CPU to be seen outside
+   preempt_disable(). Either way, any reader that CPU was running at the
+   start has finished. The calling CPU is not in a reader, and readers cannot
+   be preempted, so it needs no waiting for at all - which makes
+   synchronize_rcu() free on a uniprocessor. */
+
+#include "hal.h"
+#include "rcu.h"
+#include "stdio.h"
+#include "thread.h"
+
+#ifdef DEBUG_rcu
+# define dbg(args...) kprintf("rcu: " args)
+#else
+# define dbg(args...)
+#endif
+
+/* How long to sleep between looks at a CPU that has yet to pass through a
+   quiescent state. */
+#define RCU_POLL_MS 1
+
+/* Callbacks waiting for a grace period, most recent first, and the number
+   of them for the RCU thread to wait for. */
+static rcu_head_t *pending;
+static spinlock_t pending_lock = SPINLOCK_RELEASED;
+static semaphore_t pending_sem;
+
+static bool quiesced(unsigned cpu, unsigned count) {
+  __sync_synchronize();
+  return thread_quiescent_count(cpu) != count || thread_cpu_preemptible(cpu);
+}
+
+void synchronize_rcu() {
+  int id = get_processor_id();
+  unsigned self = (id < 0) ? 0 : id;
+  int n = get_num_processors();
+
+  /* Everything unpublished before now must be unreachable to readers that
+     start after we look at their CPU. */
+  __sync_synchronize();
+  for (int cpu = 0; cpu < n; ++cpu) {
+    if ((unsigned)cpu == self)
+      continue;
+
+    unsigned count = thread_quiescent_count(cpu);
+    while (!quiesced(cpu, count)) {
+      dbg("waiting for CPU %d\n", cpu);
+      thread_sleep_for(RCU_POLL_MS);
+    }
+  }
+}
+
+void call_rcu(rcu_head_t *head, void (*fn)(rcu_head_t *head)) {
+  head->fn = fn;
+
+  spinlock_acquire(&pending_lock);
+  head->next = pending;
+  pending = head;
+  spinlock_release(&pending_lock);
+
+  semaphore_signal(&pending_sem);
+}
+
+/* Runs callbacks in batches: everything queued so far shares one grace
+   period. */
+static void rcu_thread(void *unused) {
+  for (;;) {
+    semaphore_wait(&pending_sem);
+
+    spinlock_acquire(&pending_lock);
+    rcu_head_t *batch = pending;
+    pending = NULL;
+    spinlock_release(&pending_lock);
+    if (!batch)
+      /* Run with an earlier batch. */
+      continue;
+
+    synchronize_rcu();
+
+    /* Run them in the order they were queued. */
+    rcu_head_t *ordered = NULL;
+    while (batch) {
+      rcu_head_t *next = batch->next;
+      batch->next = ordered;
+      ordered = batch;
+      batch = next;
+    }
+    while (ordered) {
+      rcu_head_t *next = ordered->next;
+      ordered->fn(ordered);
+      ordered = next;
+    }
+  }
+}
+
+static int rcu_init() {
+  semaphore_init(&pending_sem);
+  thread_spawn(&rcu_thread, NULL, /*auto_free=*/1);
+  return 0;
+}
+
+static prereq_t prereqs[] = { {"threading",NULL}, {NULL,NULL} };
+
+static module_t x run_on_startup = {
+  .name = "rcu",
+  .required = prereqs,
+  .load_after = NULL,
+  .init = &rcu_init,
+  .fini = NULL
+};
@@ -0,0 +1,275 @@
+/* Same-page merging.
+
+   Address spaces created with clone_address_space() start out sharing their
+   pages copy-on-write, but as copies are broken they end up holding many
+   pages that are byte-for-byte identical. The scanner here finds such pages
+   and maps them all onto one read-only frame, freeing the rest. A write to
+   any of them is then just an ordinary copy-on-write fault.
+
+   Pages are found by content hash. The hash table maps a hash to the virtual
+   address of the first page seen with it; a later page with the same hash is
+   compared in full before being merged, so stale entries and collisions are
+   harmless. The table is rebuilt every time the scan wraps around.
+
+   Only the current address space is scanned: the table holds virtual
+   addresses, which mean nothing in any other. Pages of other address spaces
+   are merged only when a thread running in them calls samepage_scan().
+
+   Every mapping of a merged frame is a copy-on-write mapping, so its
+   cow_refcnt() is exactly the number of pages sharing it. When that drops to
+   zero every sharer has broken away, and the frame is freed. */
+
+#include "adt/hashtable.h"
+#include "adt/vector.h"
+#include "hal.h"
+#include "mmap.h"
+#include "samepage.h"
+#include "stdio.h"
+#include "workqueue.h"
+
+#ifdef DEBUG_samepage
+# define dbg(args...) kprintf("samepage: " args)
+#else
+# define dbg(args...)
+#endif
+
+#define NUM_BUCKETS 1021
+
+static mutex_t lock;
+
+/* Content hash -> virtual address of a page with that content. */
+static hashtable_t pages;
+/* Physical frames we have merged pages into, as a set and a list. */
+static hashtable_t merged;
+static vector_t merged_list;
+
+static uintptr_t scan_hand;
+static unsigned pages_scanned, pages_merged;
+
+static delayed_work_t scan_work;
+static volatile int scanner_running, scanner_stop;
+static unsigned scanner_pages_per_pass, scanner_interval_ms;
+
+/* 64-bit FNV-1a over the page, a word at a time. */
+static uint64_t hash_page(uintptr_t v) {
+  const uint32_t *w = (const uint32_t*)v;
+  uint64_t h = 14695981039346656037ULL;
+  for (unsigned i = 0; i < get_page_size() / 4; ++i) {
+    h ^= w[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static bool same_page(uintptr_t a, uintptr_t b) {
+  const uint32_t *x = (const uint32_t*)a, *y = (const uint32_t*)b;
+  for (unsigned i = 0; i < get_page_size() / 4; ++i)
+    if (x[i] != y[i])
+      return false;
+  return true;
+}
+
+static void remap(uintptr_t v, uint64_t p, unsigned flags) {
+  if (unmap(v, 1) == -1 || map(v, p, 1, flags) == -1)
+    panic("samepage: remap failed!");
+}
+
+/* Merge the page at 'v' (mapped to 'p') into the frame 'p1' mapped at 'v1'.
+   Returns true if the pages were merged. */
+static bool merge(uintptr_t v1, uint64_t p1, unsigned f1,
+                  uintptr_t v, uint64_t p, unsigned f) {
+  /* Compare before touching the target, so that a page that merely shares a
+     stale hash is left as it was. */
+  if (!same_page(v1, v))
+    return false;
+
+  /* Both pages must be read-only for the merge, so that neither can change
+     under it - a write to either now faults instead, on the copy-on-write
+     mapping. Either may have changed since the comparison, so compare again
+     once they are, and give back their write access if so. remap() flushes
+     the old, writable TLB entries. */
+  bool protect1 = (f1 & PAGE_COW) == 0, protect = (f & PAGE_COW) == 0;
+  if (protect1)
+    remap(v1, p1, f1 | PAGE_COW);
+  if (protect)
+    remap(v, p, f | PAGE_COW);
+  if (!same_page(v1, v)) {
+    if (protect)
+      remap(v, p, f);
+    if (protect1)
+      remap(v1, p1, f1);
+    return false;
+  }
+  if (protect1) {
+    hashtable_set64(&merged, p1, 1);
+    vector_add(&merged_list, &p1);
+  }
+
+  /* map() takes the copy-on-write reference on p1 for us, and unmap() drops
+     the one on p taken above. Keep PAGE_WRITE in the flags so that breaking
+     the copy gives a writable page. */
+  remap(v, p1, f | PAGE_COW);
+  free_page(p);
+
+  dbg("merged %x into %x (frame %x)\n", v, v1, (uint32_t)p1);
+  return true;
+}
+
+/* Free any merged frames that nothing maps any more. */
+static void reap() {
+  for (unsigned i = 0; i < vector_length(&merged_list); ) {
+    uint64_t p = *(uint64_t*)vector_get(&merged_list, i);
+    if (cow_refcnt(p) == 0) {
+      hashtable_set64(&merged, p, 0);
+      vector_erase(&merged_list, i);
+      free_page(p);
+    } else {
+      ++i;
+    }
+  }
+}
+
+unsigned samepage_scan(unsigned max_pages) {
+  unsigned n = 0, nmerged = 0;
+
+  mutex_acquire(&lock);
+
+  uintptr_t v = scan_hand;
+  while (n < max_pages) {
+    v = iterate_mappings(v);
+    if (v == ~0UL || v >= MMAP_KERNEL_START) {
+      /* Wrapped around - start a new generation of hashes. */
+      v = 0;
+      hashtable_destroy(&pages);
+      pages = hashtable_new(NUM_BUCKETS);
+      reap();
+      /* Stop after one complete lap. */
+      if (scan_hand == 0)
+        break;
+      scan_hand = 0;
+      continue;
+    }
+
+    unsigned f;
+    uint64_t p = get_mapping(v, &f);
+
+    /* Only user pages are candidates. Frames that are shared copy-on-write
+       may be mapped by pages we cannot see (in another address space), so
+       we leave them alone unless we merged them ourselves. */
+    bool mine = hashtable_get64(&merged, p) != 0;
+    if ((f & PAGE_USER) == 0 || (cow_refcnt(p) != 0 && !mine))
+      continue;
+
+    ++n;
+    uint64_t h = hash_page(v);
+    uintptr_t v1 = (uintptr_t)hashtable_get64(&pages, h);
+
+    unsigned f1;
+    uint64_t p1 = v1 ? get_mapping(v1, &f1) : ~0ULL;
+
+    if (p1 == p)
+      continue;
+
+    /* Only a private page can be merged into another frame (its own frame
+       is freed), but the frame it is merged into may already be shared. */
+    if (p1 == ~0ULL || (f1 & PAGE_USER) == 0 ||
+        (cow_refcnt(p1) != 0 && hashtable_get64(&merged, p1) == 0) ||
+        mine) {
+      /* No usable page with this hash yet - this one becomes it. */
+      hashtable_set64(&pages, h, v);
+      continue;
+    }
+
+    if (merge(v1, p1, f1, v, p, f))
+      ++nmerged;
+    else
+      hashtable_set64(&pages, h, v);
+  }
+  scan_hand = v;
+
+  pages_scanned += n;
+  pages_merged += nmerged;
+  mutex_release(&lock);
+
+  return nmerged;
+}
+
+void samepage_get_stats(samepage_stats_t *stats) {
+  mutex_acquire(&lock);
+  stats->pages_scanned = pages_scanned;
+  stats->pages_merged = pages_merged;
+  stats->frames_shared = stats->pages_sharing = 0;
+  for (unsigned i = 0; i < vector_length(&merged_list); ++i) {
+    unsigned refs = cow_refcnt(*(uint64_t*)vector_get(&merged_list, i));
+    if (refs) {
+      ++stats->frames_shared;
+      stats->pages_sharing += refs;
+    }
+  }
+  mutex_release(&lock);
+}
+
+/* The background scanner is delayed work that queues itself again after
+   each pass, so it needs no thread of its own. */
+static void scan_pass(work_t *w) {
+  if (scanner_stop) {
+    scanner_running = 0;
+    return;
+  }
+  samepage_scan(scanner_pages_per_pass);
+  queue_delayed_work(system_wq, &scan_work, scanner_interval_ms);
+}
+
+int samepage_start(unsigned pages_per_pass, unsigned interval_ms) {
+  if (scanner_running)
+    return -1;
+
+  scanner_pages_per_pass = pages_per_pass;
+  scanner_interval_ms = interval_ms;
+  scanner_stop = 0;
+  scanner_running = 1;
+  queue_delayed_work(system_wq, &scan_work, interval_ms);
+  return 0;
+}
+
+void samepage_stop() {
+  if (!scanner_running)
+    return;
+  scanner_stop = 1;
+  /* If a pass is running, it will see 'scanner_stop' next time instead. */
+  if (cancel_delayed_work(&scan_work))
+    scanner_running = 0;
+}
+
+static void inspect_samepage(const char *cmd, core_debug_state_t *states,
+                             int core) {
+  samepage_stats_t s;
+  samepage_get_stats(&s);
+  kprintf("scanned %d, merged %d; %d frames shared by %d pages, saving %dKB\n",
+          s.pages_scanned, s.pages_merged, s.frames_shared, s.pages_sharing,
+          (s.pages_sharing - s.frames_shared) * (get_page_size() / 1024));
+}
+
+static int samepage_init() {
+  mutex_init(&lock);
+  delayed_work_init(&scan_work, &scan_pass);
+  pages = hashtable_new(NUM_BUCKETS);
+  merged = hashtable_new(NUM_BUCKETS);
+  merged_list = vector_new(sizeof(uint64_t), 16);
+
+  register_debugger_handler("samepage", "Show same-page merging statistics",
+                            &inspect_samepage);
+  return 0;
+}
+
+static prereq_t prereqs[] = { {"kmalloc",NULL}, {"workqueue",NULL},
+                              {NULL,NULL} };
+static prereq_t load_after[] = { {"debugger",NULL}, {NULL,NULL} };
+
+static module_t x run_on_startup = {
+  .name = "samepage",
+  .required = prereqs,
+  .load_after = load_after,
+  .init = &samepage_init,
+  .fini = NULL
+};
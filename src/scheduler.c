@@ -1,36 +1,245 @@
+/* A multi-level, per-CPU scheduler.
+
+   Every CPU has its own set of run queues, one FIFO queue per priority
+   level, and a bitmap of the levels that have threads queued on them, so
+   both queueing a thread and picking the highest priority one are constant
+   time and CPUs do not contend on a shared lock.
+
+   A woken thread goes back on the CPU it last ran on, where its working set
+   is most likely still cached. A CPU that runs out of threads steals the
+   highest priority thread it is allowed to run from another CPU.
+
+   Waking a thread must not wait for the CPU's lock, as wakeups come from
+   interrupt handlers and other CPUs while the CPU itself is scheduling, so a
+   woken thread is pushed onto a lock-free queue of arrivals instead. Whoever
+   next takes the lock - the CPU picking a thread, or a stealer - moves the
+   arrivals onto the run queues first, so there is only ever one consumer.
+
+   To stop low priority threads starving, every AGING_INTERVAL picks the head
+   of every non-empty queue below the highest is promoted one level. A thread
+   goes back to its own priority the next time it is queued. */
+
 #include "scheduler.h"
+#include "adt/mpsc.h"
 #include "assert.h"
 
-static thread_t *ready_s = NULL, *ready_e = NULL;
-static spinlock_t ready_lock = SPINLOCK_RELEASED;
+#define AGING_INTERVAL 8
+
+typedef struct run_queue {
+  thread_t *head, *tail;
+} run_queue_t;
+
+typedef struct cpu_run_queues {
+  run_queue_t queues[THREAD_NUM_PRIORITIES];
+  /* Bit N is set if queues[N] is non-empty. */
+  uint32_t nonempty;
+  /* Number of threads queued, for stealers to peek at without the lock. */
+  volatile unsigned nr_ready;
+  unsigned picks;
+  /* Threads woken onto this CPU but not yet on a run queue. */
+  mpsc_queue_t incoming;
+  /* Taken on every yield and by stealers from other CPUs. */
+  mcs_lock_t lock;
+} cpu_run_queues_t;
+
+static cpu_run_queues_t cpus[MAX_CORES];
+
+static unsigned this_cpu() {
+  int id = get_processor_id();
+  return (id < 0) ? 0 : id;
+}
+
+static unsigned num_cpus() {
+  int n = get_num_processors();
+  return (n < 1) ? 1 : n;
+}
+
+/* Is there anything queued on 'rq', arrived or not? No locks are taken. */
+static bool has_ready(cpu_run_queues_t *rq) {
+  return rq->nr_ready != 0 || !mpsc_empty(&rq->incoming);
+}
+
+static bool allowed_on(thread_t *t, unsigned cpu) {
+  return !t->has_affinity || cpu_mask_test(&t->affinity, cpu);
+}
+
+/* All of the following are called with the CPU's lock held. */
+
+static void enqueue(cpu_run_queues_t *rq, thread_t *t, unsigned level) {
+  run_queue_t *q = &rq->queues[level];
+
+  t->run_priority = level;
+  t->scheduler_next = NULL;
+  if (q->tail)
+    q->tail->scheduler_next = t;
+  else
+    q->head = t;
+  q->tail = t;
+
+  rq->nonempty |= 1U << level;
+  ++rq->nr_ready;
+}
+
+/* Removes 't', which follows 'prev' (or is the head if 'prev' is NULL), from
+   the queue of the given level. */
+static void unlink(cpu_run_queues_t *rq, unsigned level, thread_t *prev,
+                   thread_t *t) {
+  run_queue_t *q = &rq->queues[level];
+
+  if (prev)
+    prev->scheduler_next = t->scheduler_next;
+  else
+    q->head = t->scheduler_next;
+  if (q->tail == t)
+    q->tail = prev;
+  if (!q->head)
+    rq->nonempty &= ~(1U << level);
+  --rq->nr_ready;
+}
+
+static thread_t *dequeue(cpu_run_queues_t *rq, unsigned level) {
+  thread_t *t = rq->queues[level].head;
+  unlink(rq, level, NULL, t);
+  return t;
+}
+
+static void age(cpu_run_queues_t *rq) {
+  uint32_t levels = rq->nonempty;
+  if (!levels)
+    return;
+
+  /* Skip the highest priority queue - it will run anyway. Going from high to
+     low priority means a thread is only ever promoted once per call. */
+  levels &= levels - 1;
+  while (levels) {
+    unsigned level = __builtin_ctz(levels);
+    levels &= levels - 1;
+    enqueue(rq, dequeue(rq, level), level - 1);
+  }
+}
+
+/* Moves newly woken threads onto the run queues, in the order they arrived. */
+static void drain(cpu_run_queues_t *rq) {
+  mpsc_node_t *n;
+  while ((n = mpsc_pop(&rq->incoming)) != NULL) {
+    thread_t *t = (thread_t*)((uintptr_t)n - offsetof(thread_t, wake_node));
+    enqueue(rq, t, t->priority);
+  }
+}
+
+/* Takes the highest priority thread that may run on 'cpu' from 'rq'. */
+static thread_t *steal_from(cpu_run_queues_t *rq, unsigned cpu) {
+  uint32_t levels = rq->nonempty;
+  while (levels) {
+    unsigned level = __builtin_ctz(levels);
+    levels &= levels - 1;
+
+    thread_t *prev = NULL;
+    for (thread_t *t = rq->queues[level].head; t;
+         prev = t, t = t->scheduler_next) {
+      if (allowed_on(t, cpu)) {
+        unlink(rq, level, prev, t);
+        return t;
+      }
+    }
+  }
+  return NULL;
+}
 
 void scheduler_ready(thread_t *t) {
   assert(t);
-  spinlock_acquire(&ready_lock);
+  assert(t->priority < THREAD_NUM_PRIORITIES);
 
-  if (ready_e)
-    ready_e->scheduler_next = t;
-  t->scheduler_next = NULL;
-  ready_e = t;
+  /* Prefer the CPU the thread last ran on. New threads, and threads that
+     are no longer allowed there, go on this CPU or the first one they are
+     allowed on. */
+  unsigned cpu = this_cpu();
+  if (t->cpu >= 0 && allowed_on(t, t->cpu))
+    cpu = t->cpu;
+  else if (!allowed_on(t, cpu))
+    for (cpu = 0; cpu < num_cpus() && !allowed_on(t, cpu); ++cpu)
+      ;
+  assert(cpu < num_cpus() && "Thread is not allowed on any CPU!");
 
-  if (!ready_s)
-    ready_s = t;
+  /* Interrupts are off so that this CPU cannot be stopped part way through
+     the push - it would hide anything pushed after it until it finished. */
+  int interrupts = get_interrupt_state();
+  disable_interrupts();
+  t->cpu = cpu;
+  mpsc_push(&cpus[cpu].incoming, &t->wake_node);
+  set_interrupt_state(interrupts);
+}
+
+void scheduler_set_priority(thread_t *t, unsigned priority) {
+  assert(priority < THREAD_NUM_PRIORITIES);
+
+  t->priority = priority;
+  if (t->cpu < 0)
+    return;
+
+  cpu_run_queues_t *rq = &cpus[t->cpu];
+  mcs_node_t node;
+  mcs_lock_acquire(&rq->lock, &node);
+  /* Threads that have yet to arrive will be queued at their new priority. */
+  drain(rq);
+
+  /* If the thread is queued, move it to its new queue. This is the only
+     operation that is not constant time, as the queues are singly linked. */
+  unsigned level = t->run_priority;
+  thread_t *prev = NULL;
+  for (thread_t *i = rq->queues[level].head; i;
+       prev = i, i = i->scheduler_next) {
+    if (i == t) {
+      unlink(rq, level, prev, t);
+      enqueue(rq, t, priority);
+      break;
+    }
+  }
+
+  mcs_lock_release(&rq->lock, &node);
+}
 
-  spinlock_release(&ready_lock);
+bool scheduler_has_ready() {
+  return has_ready(&cpus[this_cpu()]);
 }
 
 thread_t *scheduler_next() {
-  spinlock_acquire(&ready_lock);
+  unsigned cpu = this_cpu();
+  cpu_run_queues_t *rq = &cpus[cpu];
+  mcs_node_t node;
 
-  thread_t *t = ready_s;
-  if (t)
-    ready_s = t->scheduler_next;
+  mcs_lock_acquire(&rq->lock, &node);
+  drain(rq);
+  if (++rq->picks % AGING_INTERVAL == 0)
+    age(rq);
+
+  thread_t *t = NULL;
+  if (rq->nonempty)
+    t = dequeue(rq, __builtin_ctz(rq->nonempty));
+  mcs_lock_release(&rq->lock, &node);
 
-  spinlock_release(&ready_lock);
+  /* Nothing to do here - look for work on the other CPUs, starting with our
+     neighbour so that stealers spread out. Only one lock is held at once. */
+  unsigned n = num_cpus();
+  for (unsigned i = 1; !t && i < n; ++i) {
+    cpu_run_queues_t *victim = &cpus[(cpu + i) % n];
+    if (!has_ready(victim))
+      continue;
+
+    mcs_lock_acquire(&victim->lock, &node);
+    drain(victim);
+    t = steal_from(victim, cpu);
+    mcs_lock_release(&victim->lock, &node);
+  }
+
+  if (t)
+    t->cpu = cpu;
   return t;
 }
 
 static int scheduler_init() {
+  for (unsigned i = 0; i < MAX_CORES; ++i)
+    mpsc_init(&cpus[i].incoming);
   return 0;
 }
 
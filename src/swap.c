@@ -0,0 +1,325 @@
+/* Swap: reclaiming anonymous user pages by writing them out to a block
+   device.
+
+   A swap area is any registered block device, divided into page-sized slots.
+   When a page is swapped out, its contents are written to a free slot and its
+   mapping is replaced by a non-present *swap entry* (see set_swap_entry() in
+   hal.h) that names the area and slot. Touching the page then faults, and the
+   page fault handler calls swap_handle_page_fault() to read it back in.
+
+   Victims are chosen with the clock (second chance) algorithm: a hand sweeps
+   over the user mappings of the current address space, and a page is only
+   evicted if it has not been accessed since the hand last passed it. */
+
+#include "adt/bitmap.h"
+#include "assert.h"
+#include "hal.h"
+#include "kmalloc.h"
+#include "mmap.h"
+#include "stdio.h"
+#include "string.h"
+#include "swap.h"
+
+#ifdef DEBUG_swap
+# define dbg(args...) kprintf("swap: " args)
+#else
+# define dbg(args...)
+#endif
+
+#define MAX_SWAP_AREAS 4
+#define SWAP_AREA_BITS 2
+#define SWAP_SLOT_BITS (SWAP_ENTRY_BITS - SWAP_AREA_BITS)
+#define SWAP_MAX_SLOTS (1U << SWAP_SLOT_BITS)
+
+typedef struct swap_area {
+  block_device_t *dev;
+  unsigned nslots, nfree;
+  /* A set bit marks a free slot. */
+  bitmap_t free_slots;
+  /* Number of page table entries referring to each slot. */
+  uint8_t *refcnt;
+  /* The mapping flags the page had when it was swapped out. */
+  uint8_t *flags;
+} swap_area_t;
+
+static swap_area_t areas[MAX_SWAP_AREAS];
+static unsigned nareas;
+
+/* Protects slot allocation and reference counts. */
+static spinlock_t slot_lock = SPINLOCK_RELEASED;
+/* Serialises swap I/O, the bounce buffer and the clock hand. */
+static mutex_t io_lock;
+static uint8_t *bounce;
+
+static uintptr_t clock_hand;
+static volatile int in_reclaim;
+static volatile unsigned pages_out, pages_in;
+
+/* Slot zero of area zero would give a zero entry, which means "no entry", so
+   offset every entry by one. */
+static uint32_t make_entry(unsigned area, unsigned slot) {
+  return ((area << SWAP_SLOT_BITS) | slot) + 1;
+}
+
+static swap_area_t *decode_entry(uint32_t entry, unsigned *slot) {
+  --entry;
+  unsigned area = entry >> SWAP_SLOT_BITS;
+  *slot = entry & (SWAP_MAX_SLOTS - 1);
+  assert(area < nareas && *slot < areas[area].nslots && "Bad swap entry!");
+  return &areas[area];
+}
+
+static uint32_t alloc_slot(unsigned flags) {
+  spinlock_acquire(&slot_lock);
+  for (unsigned i = 0; i < nareas; ++i) {
+    swap_area_t *a = &areas[i];
+    if (a->nfree == 0)
+      continue;
+
+    int64_t slot = bitmap_first_set(&a->free_slots);
+    assert(slot >= 0 && (unsigned)slot < a->nslots);
+    bitmap_clear(&a->free_slots, slot);
+    --a->nfree;
+    a->refcnt[slot] = 1;
+    a->flags[slot] = flags;
+
+    spinlock_release(&slot_lock);
+    return make_entry(i, slot);
+  }
+  spinlock_release(&slot_lock);
+  return 0;
+}
+
+void swap_dup_entry(uint32_t entry) {
+  unsigned slot;
+  swap_area_t *a = decode_entry(entry, &slot);
+
+  spinlock_acquire(&slot_lock);
+  assert(a->refcnt[slot] != 0xFF && "Swap slot reference count overflow!");
+  ++a->refcnt[slot];
+  spinlock_release(&slot_lock);
+}
+
+void swap_free_entry(uint32_t entry) {
+  unsigned slot;
+  swap_area_t *a = decode_entry(entry, &slot);
+
+  spinlock_acquire(&slot_lock);
+  assert(a->refcnt[slot] != 0 && "Freeing a free swap slot!");
+  if (--a->refcnt[slot] == 0) {
+    bitmap_set(&a->free_slots, slot);
+    ++a->nfree;
+  }
+  spinlock_release(&slot_lock);
+}
+
+int swap_on(dev_t id) {
+  block_device_t *dev = get_block_device(id);
+  if (!dev || nareas == MAX_SWAP_AREAS)
+    return -1;
+
+  uint64_t nslots = dev->length(dev) >> get_page_shift();
+  if (nslots > SWAP_MAX_SLOTS)
+    nslots = SWAP_MAX_SLOTS;
+  if (nslots == 0)
+    return -1;
+
+  uint8_t *bitmap = kmalloc(nslots / 8 + 1);
+  uint8_t *refcnt = kmalloc(nslots);
+  uint8_t *flags = kmalloc(nslots);
+  if (!bitmap || !refcnt || !flags) {
+    kfree(bitmap);
+    kfree(refcnt);
+    kfree(flags);
+    return -1;
+  }
+
+  mutex_acquire(&io_lock);
+  if (!bounce)
+    bounce = kmalloc(get_page_size());
+
+  swap_area_t *a = &areas[nareas];
+  a->dev = dev;
+  a->nslots = a->nfree = nslots;
+  a->refcnt = refcnt;
+  a->flags = flags;
+  bitmap_init(&a->free_slots, bitmap, nslots);
+  for (unsigned i = 0; i < nslots; ++i)
+    bitmap_set(&a->free_slots, i);
+
+  spinlock_acquire(&slot_lock);
+  ++nareas;
+  spinlock_release(&slot_lock);
+  mutex_release(&io_lock);
+
+  dbg("swap_on: %d slots on device %x\n", (uint32_t)nslots, id);
+  return 0;
+}
+
+/* Map 'p' at 'v' with 'flags' and fill it from the bounce buffer. Any swap
+   entry at 'v' is replaced. Called with io_lock held. */
+static void map_from_bounce(uintptr_t v, uint64_t p, unsigned flags) {
+  /* Map writable so we can fill the page, then drop write access again if
+     the page didn't have it. */
+  if (map(v, p, 1, flags | PAGE_WRITE) == -1)
+    panic("swap: map() failed!");
+  memcpy((void*)v, bounce, get_page_size());
+
+  if ((flags & PAGE_WRITE) == 0 &&
+      (unmap(v, 1) == -1 || map(v, p, 1, flags) == -1))
+    panic("swap: map() failed!");
+}
+
+/* Write the page at 'v' (mapped to 'p') out to swap. Called with io_lock
+   held. */
+static int swap_out(uintptr_t v, uint64_t p, unsigned flags) {
+  unsigned ps = get_page_size();
+
+  uint32_t entry = alloc_slot(flags & (PAGE_WRITE|PAGE_EXECUTE|PAGE_USER));
+  if (entry == 0)
+    return -1;
+
+  /* Take a copy and unmap the page before starting the write, so the page
+     cannot change under us. Anyone touching it from now on will fault and
+     wait on io_lock until the write has finished. */
+  memcpy(bounce, (void*)v, ps);
+  if (set_swap_entry(v, entry) == -1) {
+    swap_free_entry(entry);
+    return -1;
+  }
+
+  unsigned slot;
+  swap_area_t *a = decode_entry(entry, &slot);
+  if (a->dev->write(a->dev, (uint64_t)slot * ps, bounce, ps) != (int)ps) {
+    /* Put the page back the way it was. */
+    kprintf("swap: write to slot %d failed!\n", slot);
+    swap_free_entry(entry);
+    map_from_bounce(v, p, flags);
+    return -1;
+  }
+
+  free_page(p);
+  ++pages_out;
+  dbg("swap_out: %x -> slot %d\n", v, slot);
+  return 0;
+}
+
+unsigned swap_reclaim(unsigned num_pages) {
+  /* Don't recurse if the swap path itself runs out of memory. */
+  if (nareas == 0 || in_reclaim)
+    return 0;
+
+  mutex_acquire(&io_lock);
+  in_reclaim = 1;
+
+  unsigned freed = 0, wraps = 0;
+  uintptr_t v = clock_hand;
+
+  /* Two trips around the clock give every page its second chance. */
+  while (freed < num_pages && wraps < 2) {
+    v = iterate_mappings(v);
+    if (v == ~0UL || v >= MMAP_KERNEL_START) {
+      v = 0;
+      ++wraps;
+      continue;
+    }
+
+    unsigned flags;
+    uint64_t p = get_mapping(v, &flags);
+
+    /* Only private user pages are candidates. Pages mapped by another
+       address space as well - copy-on-write, or shared outright by
+       clone_address_space() - hold a cow_refcnt reference, and are left
+       alone: freeing one would pull it out from under the other. */
+    if ((flags & PAGE_USER) == 0 || (flags & PAGE_COW) || cow_refcnt(p) != 0)
+      continue;
+
+    if (test_and_clear_accessed(v) == 1)
+      continue;
+
+    if (swap_out(v, p, flags) == 0)
+      ++freed;
+  }
+
+  clock_hand = v;
+  in_reclaim = 0;
+  mutex_release(&io_lock);
+
+  dbg("swap_reclaim: freed %d/%d pages\n", freed, num_pages);
+  return freed;
+}
+
+bool swap_handle_page_fault(uintptr_t v) {
+  v &= ~get_page_mask();
+  if (get_swap_entry(v) == 0)
+    return false;
+
+  /* Allocate before taking io_lock, as allocation may itself need to
+     reclaim. */
+  uint64_t p = alloc_page(PAGE_REQ_NONE | PAGE_REQ_RECLAIM);
+  if (p == ~0ULL)
+    panic("swap: out of memory while swapping in!");
+
+  mutex_acquire(&io_lock);
+
+  /* Another thread may have swapped the page in while we waited. */
+  uint32_t entry = get_swap_entry(v);
+  if (entry == 0) {
+    mutex_release(&io_lock);
+    free_page(p);
+    return true;
+  }
+
+  unsigned slot, ps = get_page_size();
+  swap_area_t *a = decode_entry(entry, &slot);
+  unsigned flags = a->flags[slot];
+
+  if (a->dev->read(a->dev, (uint64_t)slot * ps, bounce, ps) != (int)ps)
+    panic("swap: read failed!");
+
+  map_from_bounce(v, p, flags);
+  swap_free_entry(entry);
+  ++pages_in;
+  mutex_release(&io_lock);
+
+  dbg("swap_in: slot %d -> %x\n", slot, v);
+  return true;
+}
+
+void swap_get_stats(swap_stats_t *stats) {
+  spinlock_acquire(&slot_lock);
+  stats->slots_total = stats->slots_used = 0;
+  for (unsigned i = 0; i < nareas; ++i) {
+    stats->slots_total += areas[i].nslots;
+    stats->slots_used += areas[i].nslots - areas[i].nfree;
+  }
+  spinlock_release(&slot_lock);
+
+  stats->pages_out = pages_out;
+  stats->pages_in = pages_in;
+}
+
+static void inspect_swap(const char *cmd, core_debug_state_t *states,
+                         int core) {
+  swap_stats_t s;
+  swap_get_stats(&s);
+  kprintf("%d/%d slots used, %d pages out, %d pages in\n", s.slots_used,
+          s.slots_total, s.pages_out, s.pages_in);
+}
+
+static int swap_init() {
+  mutex_init(&io_lock);
+  register_debugger_handler("swap", "Show swap usage", &inspect_swap);
+  return 0;
+}
+
+static prereq_t prereqs[] = { {"kmalloc",NULL}, {NULL,NULL} };
+static prereq_t load_after[] = { {"debugger",NULL}, {NULL,NULL} };
+
+static module_t x run_on_startup = {
+  .name = "swap",
+  .required = prereqs,
+  .load_after = load_after,
+  .init = &swap_init,
+  .fini = NULL
+};
@@ -2,9 +2,12 @@
 #include "thread.h"
 #include "slab.h"
 #include "assert.h"
+#include "coroutine.h"
+#include "percpu.h"
 #include "scheduler.h"
 #include "stdio.h"
 #include "string.h"
+#include "timeout.h"
 
 /* The slab cache for thread_t objects. */
 static slab_cache_t thread_cache;
@@ -14,11 +17,58 @@ static spinlock_t thread_list_lock = SPINLOCK_RELEASED;
 
 #define CANARY_VAL 0x4321abcd
 
+/* TLS slot holding the spawning thread's interrupt state until the new thread
+   first runs. */
+#define TLS_SLOT_INTERRUPTS 3
+
+/* Per-CPU preemption state.
+
+   'preempt_count' is the preempt_disable() nesting depth of the thread
+   running on the CPU. It is saved by a thread when it switches out, and
+   restored when it is switched back in. 'need_resched' is set by the timer
+   when it wants to preempt; the switch happens on the way out of the
+   interrupt, or once the count drops to zero if it was nonzero then. */
+static PERCPU_DEFINE(volatile unsigned, preempt_count);
+static volatile uint8_t need_resched[MAX_CORES];
+/* The thread running on each CPU at the last tick, and when the running
+   thread was switched in. */
+static thread_t *last_ticked[MAX_CORES];
+static uint64_t switched_in_at[MAX_CORES];
+/* Set once there is a thread to preempt. */
+static volatile int preemption_ready;
+
+/* Each CPU's idle thread, which runs when nothing else can. */
+static thread_t *idle_threads[MAX_CORES];
+/* Set while a CPU's idle thread may be waiting for an interrupt, so
+   queueing a thread there needs an IPI to get it noticed. Halted CPUs are
+   not ticked. */
+static volatile uint8_t halted[MAX_CORES];
+/* Set while a CPU is idle with the preemption tick stopped, because every
+   other CPU was idle too. A CPU that stops idling kicks it to get the tick
+   going again. */
+static volatile uint8_t tick_stopped[MAX_CORES];
+/* The thread each CPU is switching away from - see finish_switch(). */
+static thread_t *switching_from[MAX_CORES];
+
+/* The data of the IPIs we send. Other CPUs are ticked by the one that takes
+   timer interrupts, and kicked out of their idle loop when a thread is
+   queued on them. */
+#define THREAD_IPI_TICK ((void*)1)
+#define THREAD_IPI_KICK ((void*)2)
+
+/* For RCU - see thread_quiescent_count(). */
+static PERCPU_DEFINE(volatile unsigned, quiescent);
+
+static unsigned this_cpu() {
+  int id = get_processor_id();
+  return (id < 0) ? 0 : id;
+}
+
 static void inspect_threads(const char *cmd, core_debug_state_t *states, int core_num) {
   thread_t *t = thread_list_head;
   while (t) {
     struct regs r;
-    jmp_buf_to_regs(&r, t->jmpbuf);
+    context_to_regs(&r, t->context);
 
     uintptr_t data = 0;
     uintptr_t pc = backtrace(&data, &r);
@@ -34,22 +84,60 @@ static void inspect_threads(const char *cmd, core_debug_state_t *states, int cor
     default: state_str = "UNKNOWN"; break;
     }
 
+    uint32_t kcycles = (uint32_t)(t->runtime / 1000);
     if (sym)
-      kprintf("#%3d: %-5s [%s+%d]\n", t->id, state_str, sym, offs);
+      kprintf("#%3d: %-5s %8dk [%s+%d]\n", t->id, state_str, kcycles, sym,
+              offs);
     else
-      kprintf("#%3d: %-5s 0x%x\n", t->id, state_str, pc);
+      kprintf("#%3d: %-5s %8dk 0x%x\n", t->id, state_str, kcycles, pc);
     
     t = t->next;
   }
 }
 
+/* Each CPU keeps a few free stacks, still mapped, so that spawning a thread
+   does not have to go to the virtual and physical memory allocators. A cache
+   is only touched by its own CPU, with interrupts disabled. */
+#define STACK_CACHE_SZ 8
+
+typedef struct stack_cache {
+  uintptr_t stacks[STACK_CACHE_SZ];
+  unsigned n;
+} stack_cache_t;
+
+static stack_cache_t stack_caches[MAX_CORES];
+
+#ifdef THREAD_STACK_LAZY
+/* The guard page follows the TLS page. Stacks are mapped on demand, with this
+   much more below a faulting address so that the fault handler's own frames
+   fit. The top pages are always mapped. */
+# define GUARD_PAGE(stack)  ((stack) + get_page_size())
+# define STACK_FAULT_MARGIN 0x2000
+# define STACK_EAGER_SZ     0x2000
+#endif
+
 static uintptr_t alloc_stack_and_tls() {
   unsigned pagesz = get_page_size();
 
-  uintptr_t addr = vmspace_alloc(&kernel_vmspace, THREAD_STACK_SZ, 0);
+  int interrupts = get_interrupt_state();
+  disable_interrupts();
+  stack_cache_t *c = &stack_caches[this_cpu()];
+  uintptr_t addr = c->n ? c->stacks[--c->n] : 0;
+  set_interrupt_state(interrupts);
+  if (addr)
+    return addr;
+
+  addr = vmspace_alloc(&kernel_vmspace, THREAD_STACK_SZ, 0);
 
+#ifdef THREAD_STACK_LAZY
+  map(addr, alloc_page(PAGE_REQ_NONE), 1, PAGE_WRITE);
+  for (unsigned i = THREAD_STACK_SZ - STACK_EAGER_SZ; i < THREAD_STACK_SZ;
+       i += pagesz)
+    map(addr+i, alloc_page(PAGE_REQ_NONE), 1, PAGE_WRITE);
+#else
   for (unsigned i = 0; i < THREAD_STACK_SZ; i += pagesz)
     map(addr+i, alloc_page(PAGE_REQ_NONE), 1, PAGE_WRITE);
+#endif
 
   return addr;
 }
@@ -57,36 +145,107 @@ static uintptr_t alloc_stack_and_tls() {
 static void free_stack_and_tls(uintptr_t stack) {
   unsigned pagesz = get_page_size();
 
+  int interrupts = get_interrupt_state();
+  disable_interrupts();
+  stack_cache_t *c = &stack_caches[this_cpu()];
+  bool cached = c->n < STACK_CACHE_SZ;
+  if (cached)
+    c->stacks[c->n++] = stack;
+  set_interrupt_state(interrupts);
+  if (cached)
+    return;
+
   unsigned flags;
   for (unsigned i = 0; i < THREAD_STACK_SZ; i += pagesz) {
-    free_page(get_mapping(stack+i, &flags));
+    uint64_t p = get_mapping(stack+i, &flags);
+    if (p == ~0ULL)
+      continue;
     unmap(stack+i, 1);
+    free_page(p);
+  }
+  vmspace_free(&kernel_vmspace, THREAD_STACK_SZ, stack, 0);
+}
+
+/* Charges the current thread for the time since it was switched in. */
+static void account() {
+  unsigned cpu = this_cpu();
+  uint64_t now = get_cycle_count();
+  thread_current()->runtime += now - switched_in_at[cpu];
+  switched_in_at[cpu] = now;
+}
+
+/* Called by a thread as soon as yield() has switched to it, on the CPU that
+   switched: the thread it switched from is saved, so may now run elsewhere. */
+static void finish_switch() {
+  unsigned cpu = this_cpu();
+  thread_t *prev = switching_from[cpu];
+  switching_from[cpu] = NULL;
+  if (prev) {
+    __sync_synchronize();
+    prev->on_cpu = 0;
   }
 }
 
+/* Switches to the next thread to run, or to the idle thread if there is none,
+   and returns when the current thread is switched back in. Called with
+   preemption disabled; the thread switched to inherits the count and must
+   restore its own. */
 static void yield() {
-  thread_t *t = scheduler_next();
+  thread_t *self = thread_current();
+  thread_t *t;
 
-  if (!t) return;
-  if (t->request_kill) {
+  /* Whoever called us is not in an RCU read-side critical section, as those
+     cannot sleep or be preempted. */
+  this_cpu_inc(quiescent);
+
+  while ((t = scheduler_next()) && t->request_kill)
     t->state = THREAD_DEAD;
-    yield();
-    assert(0 && "Unreachable!");
-    return;
+
+  /* A thread can be queued again - by a wakeup, or by yielding - while its
+     CPU is still switching away from it. Rather than wait for that CPU,
+     which could be waiting for us in turn, come back for it later. */
+  if (t && t != self && t->on_cpu) {
+    scheduler_ready(t);
+    t = NULL;
+  }
+
+  if (!t) {
+    t = idle_threads[this_cpu()];
+    if (!t || t == self) {
+      if (self->state == THREAD_READY)
+        self->state = THREAD_RUN;
+      return;
+    }
   }
   t->state = THREAD_RUN;
-  longjmp(t->jmpbuf, 1);
+  if (t == self)
+    return;
+
+  account();
+  /* Don't read its context before seeing it saved. */
+  __sync_synchronize();
+  t->on_cpu = 1;
+  switching_from[this_cpu()] = self;
+  switch_context(&self->context, t->context);
+  finish_switch();
 }
 
 static __attribute__((noreturn,noinline)) void trampoline() {
   void (*fn)(void*) = (void (*)(void*)) *thread_tls_slot(1);
   void *p = (void*) *thread_tls_slot(2);
 
+  /* We were switched to from yield(), which is called with preemption (and
+     possibly interrupts) disabled. */
+  finish_switch();
+  *this_cpu_ptr(&preempt_count) = 0;
+  set_interrupt_state(*thread_tls_slot(TLS_SLOT_INTERRUPTS));
+
   fn(p);
 
   thread_t *t = thread_current();
   t->state = THREAD_DEAD;
 
+  preempt_disable();
   yield();
   assert(0 && "Unreachable!");
   for (;;) ;
@@ -103,16 +262,65 @@ uintptr_t *thread_tls_slot(unsigned idx) {
   return tls_slot(idx, (uintptr_t)__builtin_frame_address(0));
 }
 
+uintptr_t thread_stack_alloc(thread_t *t, uintptr_t *lowest) {
+  uintptr_t stack = alloc_stack_and_tls();
+  *tls_slot(TLS_SLOT_TCB, stack) = (uintptr_t)t;
+  *tls_slot(TLS_SLOT_CANARY, stack) = CANARY_VAL;
+#ifdef THREAD_STACK_LAZY
+  *lowest = GUARD_PAGE(stack) + get_page_size();
+#else
+  *lowest = (uintptr_t)tls_slot(TLS_SLOT_CANARY + 1, stack);
+#endif
+  return stack;
+}
+
+void thread_stack_free(uintptr_t stack) {
+  free_stack_and_tls(stack);
+}
+
+bool thread_handle_stack_fault(uintptr_t addr) {
+#ifdef THREAD_STACK_LAZY
+  unsigned pagesz = get_page_size();
+  uintptr_t stack = addr & ~(THREAD_STACK_SZ-1);
+  uintptr_t page = addr & ~(pagesz-1);
+
+  /* Thread stacks are recognised by their TLS page. Reading it may fault
+     itself, so faults on it are not ours. */
+  if (addr < kernel_vmspace.start ||
+      addr - kernel_vmspace.start >= kernel_vmspace.size ||
+      page < GUARD_PAGE(stack) ||
+      get_mapping(stack, NULL) == ~0ULL ||
+      *tls_slot(TLS_SLOT_CANARY, stack) != CANARY_VAL)
+    return false;
+
+  if (page == GUARD_PAGE(stack))
+    panic("Kernel stack overflow!");
+
+  uintptr_t lowest = (addr - STACK_FAULT_MARGIN) & ~(pagesz-1);
+  if (lowest < GUARD_PAGE(stack) + pagesz)
+    lowest = GUARD_PAGE(stack) + pagesz;
+  for (; page >= lowest; page -= pagesz)
+    if (get_mapping(page, NULL) == ~0ULL)
+      map(page, alloc_page(PAGE_REQ_NONE), 1, PAGE_WRITE);
+  return true;
+#else
+  return false;
+#endif
+}
+
 thread_t *thread_current() {
   return (thread_t*) *thread_tls_slot(TLS_SLOT_TCB);
 }
 
-thread_t *thread_spawn(void (*fn)(void*), void *p, uint8_t auto_free) {
+/* Creates a thread that will run 'fn', but does not queue it. */
+static thread_t *create(void (*fn)(void*), void *p, uint8_t auto_free) {
   thread_t *t = (thread_t*)slab_cache_alloc(&thread_cache);
 
   memset(t, 0, sizeof(thread_t));
 
   t->auto_free = auto_free;
+  t->priority = t->base_priority = THREAD_PRIORITY_DEFAULT;
+  t->cpu = -1;
   t->stack = alloc_stack_and_tls();
  
   spinlock_acquire(&thread_list_lock);
@@ -127,24 +335,47 @@ thread_t *thread_spawn(void (*fn)(void*), void *p, uint8_t auto_free) {
   /* Store the function and argument temporarily in TLS */
   *tls_slot(1, t->stack) = (uintptr_t)fn;
   *tls_slot(2, t->stack) = (uintptr_t)p;
+  *tls_slot(TLS_SLOT_INTERRUPTS, t->stack) = get_interrupt_state();
 
   /* In the last valid TLS slot, store a canary. */
   *tls_slot(TLS_SLOT_CANARY, t->stack) = CANARY_VAL;
 
-  if (setjmp(t->jmpbuf) == 0) {
-    jmp_buf_set_stack(t->jmpbuf, t->stack + THREAD_STACK_SZ);
+  /* The first switch to the thread "returns" into trampoline(). */
+  t->context = init_context(t->stack + THREAD_STACK_SZ, &trampoline);
+  return t;
+}
 
-    scheduler_ready(t);
+/* Interrupts 'cpu' if it may be idle, so that it notices a thread just
+   queued on it. */
+static void kick(int cpu) {
+  /* Either the idle loop sees what was queued or we see it halted. */
+  __sync_synchronize();
+  if (cpu >= 0 && (unsigned)cpu != this_cpu() && halted[cpu])
+    send_ipi(cpu, THREAD_IPI_KICK);
+}
 
-    return t;
-  } else {
-    /* Tail call to trampoline which is defined as noinline, to force the creation
-       of a new stack frame as the previous stack frame is now invalid! */
-    trampoline();
-  }
+/* Wakes one idle CPU, which will steal work from the busy ones. */
+static void kick_idle() {
+  unsigned self = this_cpu();
+  for (int i = 0; i < get_num_processors(); ++i)
+    if ((unsigned)i != self && halted[i]) {
+      send_ipi(i, THREAD_IPI_KICK);
+      return;
+    }
+}
+
+thread_t *thread_spawn(void (*fn)(void*), void *p, uint8_t auto_free) {
+  thread_t *t = create(fn, p, auto_free);
+  scheduler_ready(t);
+  kick(t->cpu);
+  return t;
 }
 
 void thread_destroy(thread_t *t) {
+  /* It may be dead but not yet switched away from. */
+  while (t->on_cpu)
+    cpu_relax();
+
   spinlock_acquire(&thread_list_lock);
   if (t->next)
     t->next->prev = t->prev;
@@ -155,40 +386,247 @@ void thread_destroy(thread_t *t) {
     thread_list_head = t->next;
   spinlock_release(&thread_list_lock);
 
+  if (t->coroutines)
+    co_thread_destroy(t);
   free_stack_and_tls(t->stack);
   slab_cache_free(&thread_cache, (void*)t);
 }  
 
+/* Called by a thread that has been switched back in by yield(), or for which
+   yield() found nothing else to run. */
+static void switched_in(unsigned count, int interrupts) {
+  /* We may be on a different CPU from the one we left. */
+  *this_cpu_ptr(&preempt_count) = count;
+  set_interrupt_state(interrupts);
+  preempt_enable();
+}
+
 void thread_sleep() {
   thread_t *t = thread_current();
 
-  t->state = THREAD_SLEEP;
-  if (setjmp(t->jmpbuf) == 0) {
-    if (t->request_kill)
-      t->state = THREAD_DEAD;
-    yield();
+  preempt_disable();
+  unsigned count = this_cpu_read(preempt_count);
+  int interrupts = get_interrupt_state();
+
+  if (t->request_kill) {
+    t->state = THREAD_DEAD;
+  } else {
+    t->state = THREAD_SLEEP;
+    /* A thread_wake() that found us still awake left a token instead. Take
+       it rather than sleep - unless a thread_wake() since has found us
+       asleep, and queued us to run. */
+    __sync_synchronize();
+    if (t->wake_pending &&
+        __sync_bool_compare_and_swap(&t->state, THREAD_SLEEP, THREAD_RUN)) {
+      t->wake_pending = 0;
+      switched_in(count, interrupts);
+      return;
+    }
   }
+  yield();
+  /* Any token was for what woke us; the caller checks for it anyway. */
+  t->wake_pending = 0;
+  switched_in(count, interrupts);
+}
+
+typedef struct sleeper {
+  thread_t *thread;
+  volatile int expired;
+} sleeper_t;
+
+static void sleeper_expired(void *p) {
+  sleeper_t *s = (sleeper_t*)p;
+  s->expired = 1;
+  thread_wake(s->thread);
+}
+
+void thread_sleep_for(unsigned ms) {
+  sleeper_t s = {.thread = thread_current(), .expired = 0};
+  timeout_t timeout;
+  timeout_init(&timeout, &sleeper_expired, &s);
+
+  /* With interrupts disabled the timeout cannot expire between being added
+     and finding us asleep. */
+  int interrupts = get_interrupt_state();
+  disable_interrupts();
+  timeout_add(&timeout, ms);
+  while (!s.expired)
+    thread_sleep();
+  set_interrupt_state(interrupts);
 }
 
 int thread_wake(thread_t *t) {
-  if (__sync_bool_compare_and_swap(&t->state, THREAD_SLEEP, THREAD_READY) == 1) {
-    scheduler_ready(t);
-    return 0;
+  if (!__sync_bool_compare_and_swap(&t->state, THREAD_SLEEP, THREAD_READY)) {
+    /* It may be on another CPU, about to sleep having checked for whatever
+       we are waking it for just before it happened. */
+    t->wake_pending = 1;
+    __sync_synchronize();
+    if (!__sync_bool_compare_and_swap(&t->state, THREAD_SLEEP, THREAD_READY))
+      return -1;
   }
-  return -1;
+  scheduler_ready(t);
+  kick(t->cpu);
+  return 0;
 }
 
 void thread_yield() {
   thread_t *t = thread_current();
   assert(*tls_slot(TLS_SLOT_CANARY, t->stack) == CANARY_VAL);
 
-  if (setjmp(t->jmpbuf) == 0) {
-    if (t->request_kill)
-      t->state = THREAD_DEAD;
-    else
+  preempt_disable();
+  unsigned count = this_cpu_read(preempt_count);
+  int interrupts = get_interrupt_state();
+
+  /* Only a thread on a CPU is THREAD_RUN - mutex_acquire() relies on it. */
+  if (t->request_kill)
+    t->state = THREAD_DEAD;
+  else {
+    t->state = THREAD_READY;
+    if (!t->idle)
       scheduler_ready(t);
-    yield();
   }
+  yield();
+  switched_in(count, interrupts);
+}
+
+void preempt_disable() {
+  this_cpu_inc(preempt_count);
+}
+
+void preempt_enable() {
+  assert(this_cpu_read(preempt_count) > 0 && "Unbalanced preempt_enable()!");
+  this_cpu_dec(preempt_count);
+
+  /* Take a preemption that was deferred while we were in a critical section,
+     unless interrupts are still disabled - the next tick will catch it. */
+  unsigned cpu = this_cpu();
+  if (this_cpu_read(preempt_count) == 0 &&
+      need_resched[cpu] && preemption_ready && get_interrupt_state()) {
+    need_resched[cpu] = 0;
+    thread_yield();
+  }
+}
+
+/* A thread is preempted once it has run for a whole quantum - from one tick
+   to the next - if something else is ready to run. The tick only asks for
+   it; interrupt_exit() or preempt_enable() does the switch. */
+static void tick() {
+  unsigned cpu = this_cpu();
+  thread_t *t = thread_current();
+
+  if (!preemption_ready)
+    return;
+  unsigned count = this_cpu_read(preempt_count);
+  if (count == 0)
+    this_cpu_inc(quiescent);
+  bool waiting = scheduler_has_ready();
+  if (waiting)
+    kick_idle();
+  if (last_ticked[cpu] != t) {
+    last_ticked[cpu] = t;
+    return;
+  }
+  if (waiting)
+    need_resched[cpu] = 1;
+}
+
+/* The timer callback, on the CPU that takes timer interrupts. An idle CPU
+   has nothing to preempt, so is left halted - tick() wakes one when there
+   is work for it to steal. */
+static void preempt_tick(void *unused) {
+  unsigned self = this_cpu();
+  for (int i = 0; i < get_num_processors(); ++i)
+    if ((unsigned)i != self && !halted[i])
+      send_ipi(i, THREAD_IPI_TICK);
+  tick();
+}
+
+void interrupt_exit() {
+  if (!preemption_ready)
+    return;
+  unsigned cpu = this_cpu();
+  /* The idle loop yields by itself once the interrupt has woken it. */
+  if (!need_resched[cpu] || this_cpu_read(preempt_count) != 0 ||
+      thread_current()->idle)
+    return;
+  need_resched[cpu] = 0;
+  last_ticked[cpu] = NULL;
+  thread_yield();
+}
+
+static int handle_ipi(struct regs *r, void *unused) {
+  /* A kick has done its job by interrupting the idle loop. */
+  if (get_ipi_data(r) == THREAD_IPI_TICK)
+    tick();
+  return 0;
+}
+
+int thread_set_quantum(unsigned ms) {
+  unregister_callback(&preempt_tick);
+  if (ms == 0)
+    return 0;
+  return register_callback(ms, 1, &preempt_tick, NULL) == -1 ? -1 : 0;
+}
+
+/* The idle thread never sits on a run queue - yield() switches to it when
+   there is nothing else to run. It runs anything that has become ready, and
+   otherwise halts the CPU until an interrupt, with the timer tick stopped
+   until the next timer event. The preemption tick is stopped too if every
+   other CPU is idle as well. */
+static void idle(void *unused) {
+  /* Idle threads never move. */
+  unsigned cpu = this_cpu();
+
+  for (;;) {
+    thread_yield();
+
+    disable_interrupts();
+    halted[cpu] = 1;
+    __sync_synchronize();
+    if (!scheduler_has_ready()) {
+      /* Either we see another CPU running or it sees the tick stopped. */
+      tick_stopped[cpu] = 1;
+      __sync_synchronize();
+      for (int i = 0; i < get_num_processors(); ++i)
+        if ((unsigned)i != cpu && !halted[i])
+          tick_stopped[cpu] = 0;
+      int tickless =
+        timer_idle_enter(tick_stopped[cpu] ? &preempt_tick : NULL) == 0;
+      if (!tickless)
+        tick_stopped[cpu] = 0;
+      wait_for_interrupt();
+      disable_interrupts();
+      if (tickless)
+        timer_idle_exit();
+      tick_stopped[cpu] = 0;
+    }
+    halted[cpu] = 0;
+    __sync_synchronize();
+    for (int i = 0; i < get_num_processors(); ++i)
+      if (tick_stopped[i])
+        kick(i);
+    enable_interrupts();
+  }
+}
+
+void thread_set_priority(thread_t *t, unsigned priority) {
+  assert(priority < THREAD_NUM_PRIORITIES && "Bad thread priority!");
+  t->base_priority = priority;
+  mutex_update_priority(t);
+}
+
+void thread_set_affinity(thread_t *t, const cpu_mask_t *mask) {
+  if (mask)
+    t->affinity = *mask;
+  t->has_affinity = (mask != NULL);
+}
+
+unsigned thread_quiescent_count(unsigned cpu) {
+  return *per_cpu_ptr(&quiescent, cpu);
+}
+
+bool thread_cpu_preemptible(unsigned cpu) {
+  return *per_cpu_ptr(&preempt_count, cpu) == 0;
 }
 
 void thread_kill(thread_t *t) {
@@ -200,11 +638,13 @@ static int threading_init() {
     .id = 0,
     .prev = NULL, .next = NULL,
     .scheduler_next = NULL,
-    .semaphore_next = NULL,
     .stack = 0,
     .request_kill = 0,
     .state = 0,
-    .priority = 0,
+    .priority = THREAD_PRIORITY_DEFAULT,
+    .base_priority = THREAD_PRIORITY_DEFAULT,
+    .run_priority = THREAD_PRIORITY_DEFAULT,
+    .cpu = -1,
     .auto_free = 0
   };
 
@@ -213,6 +653,7 @@ static int threading_init() {
 
   thread_t *t = (thread_t*)slab_cache_alloc(&thread_cache);
   t->stack = (uintptr_t)__builtin_frame_address(0) & ~(THREAD_STACK_SZ-1);
+  t->on_cpu = 1;
 
   *tls_slot(TLS_SLOT_TCB, t->stack) = (uintptr_t)t;
   *tls_slot(TLS_SLOT_CANARY, t->stack) = CANARY_VAL;
@@ -225,14 +666,42 @@ static int threading_init() {
 
   register_debugger_handler("threads", "List all thread states", &inspect_threads);
 
+  int ncpus = get_num_processors();
+  for (int i = 0; i < ncpus || i == 0; ++i) {
+    thread_t *idle_t = create(&idle, NULL, 0);
+    idle_t->idle = 1;
+    idle_t->cpu = i;
+    idle_threads[i] = idle_t;
+  }
+
+  if (get_ipi_interrupt_num() != -1)
+    register_interrupt_handler(get_ipi_interrupt_num(), &handle_ipi, NULL);
+
+  /* Preempt CPU-bound threads. Without a timer, threads are cooperative. */
+  switched_in_at[this_cpu()] = get_cycle_count();
+  preemption_ready = 1;
+  thread_set_quantum(THREAD_QUANTUM_MS);
+
+  /* Start the other CPUs, each in its idle thread. */
+  for (int i = 1; i < ncpus; ++i) {
+    thread_t *idle_t = idle_threads[i];
+    idle_t->state = THREAD_RUN;
+    idle_t->on_cpu = 1;
+    switched_in_at[i] = get_cycle_count();
+    if (start_processor(i, idle_t->context) == -1)
+      kprintf("threading: unable to start CPU %d!\n", i);
+  }
+
   return 0;
 }
 
-static prereq_t p[] = { {"kmalloc",NULL}, {"scheduler",NULL}, {NULL,NULL} };
+static prereq_t p[] = { {"kmalloc",NULL}, {"scheduler",NULL},
+                        {"percpu",NULL}, {NULL,NULL} };
+static prereq_t la[] = { {"x86/pit",NULL}, {"hosted/timer",NULL}, {NULL,NULL} };
 static module_t x run_on_startup = {
   .name = "threading",
   .required = p,
-  .load_after = NULL,
+  .load_after = la,
   .init = &threading_init,
   .fini = NULL
 };
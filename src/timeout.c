@@ -0,0 +1,194 @@
+/* Timeouts, kept in a hashed hierarchical timing wheel.
+
+   Time is counted in ticks of TICK_MS. A timeout due within the next
+   ROOT_SZ ticks hangs off the root wheel, in the slot for its expiry time
+   modulo ROOT_SZ. Later ones go in one of the coarser wheels, each of whose
+   LEVEL_SZ slots covers as many ticks as the whole of the wheel below it.
+   Adding is then a matter of working out a slot, and cancelling of
+   unlinking from it.
+
+   Every tick the root wheel's current slot is run. Each time the root wheel
+   wraps around, the next slot of the wheel above is emptied and its timeouts
+   re-added, falling into the root wheel now that they are close - and so on
+   up, a cascade.
+
+   The wheel only asks the platform timer for ticks while something is
+   pending, so an idle system with no timeouts can still go tickless. */
+
+#include "assert.h"
+#include "hal.h"
+#include "stdio.h"
+#include "timeout.h"
+
+#ifdef DEBUG_timeout
+# define dbg(args...) kprintf("timeout: " args)
+#else
+# define dbg(args...)
+#endif
+
+#define TICK_MS 1
+
+#define ROOT_BITS  8
+#define ROOT_SZ    (1U << ROOT_BITS)
+#define LEVEL_BITS 6
+#define LEVEL_SZ   (1U << LEVEL_BITS)
+#define NUM_LEVELS 3
+/* The furthest ahead a timeout can be placed, in ticks (about 18 hours).
+   Later ones are placed here, and placed again when they cascade down. */
+#define MAX_DELTA  ((1ULL << (ROOT_BITS + NUM_LEVELS*LEVEL_BITS)) - 1)
+
+static timeout_t *root[ROOT_SZ];
+static timeout_t *levels[NUM_LEVELS][LEVEL_SZ];
+
+static spinlock_t lock = SPINLOCK_RELEASED;
+/* The next tick to run. */
+static uint64_t now;
+static unsigned num_pending;
+static int ticking;
+/* The timeout whose function is being called, if any. */
+static timeout_t *volatile running;
+
+static void tick(void *unused);
+
+static void link(timeout_t **slot, timeout_t *t) {
+  t->next = *slot;
+  if (t->next)
+    t->next->pprev = &t->next;
+  t->pprev = slot;
+  *slot = t;
+}
+
+static void unlink(timeout_t *t) {
+  *t->pprev = t->next;
+  if (t->next)
+    t->next->pprev = t->pprev;
+  t->next = NULL;
+  t->pprev = NULL;
+}
+
+/* Links 't' into the slot for its expiry time. Called with the lock held. */
+static void place(timeout_t *t) {
+  uint64_t expires = t->expires;
+  int64_t delta = (int64_t)(expires - now);
+
+  if (delta < 0) {
+    /* Already due: run it at the next tick. */
+    link(&root[now % ROOT_SZ], t);
+    return;
+  }
+  if (delta < ROOT_SZ) {
+    link(&root[expires % ROOT_SZ], t);
+    return;
+  }
+  if ((uint64_t)delta > MAX_DELTA)
+    expires = now + MAX_DELTA;
+
+  for (unsigned l = 0; l < NUM_LEVELS; ++l) {
+    unsigned shift = ROOT_BITS + l * LEVEL_BITS;
+    if (l == NUM_LEVELS-1 || (uint64_t)delta < (1ULL << (shift + LEVEL_BITS))) {
+      link(&levels[l][(expires >> shift) % LEVEL_SZ], t);
+      return;
+    }
+  }
+}
+
+/* Re-places everything in slot 'idx' of wheel 'l', and returns 'idx'. */
+static unsigned cascade(unsigned l, unsigned idx) {
+  timeout_t *t = levels[l][idx];
+  levels[l][idx] = NULL;
+  while (t) {
+    timeout_t *next = t->next;
+    place(t);
+    t = next;
+  }
+  return idx;
+}
+
+void timeout_init(timeout_t *t, void (*fn)(void*), void *data) {
+  t->next = NULL;
+  t->pprev = NULL;
+  t->expires = 0;
+  t->fn = fn;
+  t->data = data;
+}
+
+void timeout_add(timeout_t *t, unsigned ms) {
+  assert(t->fn && "timeout_add() on an uninitialised timeout!");
+
+  spinlock_acquire(&lock);
+  if (t->pprev)
+    unlink(t);
+  else
+    ++num_pending;
+
+  /* The current tick may be about to end, so a timeout of N ticks expires
+     N ticks after the next one starts. */
+  t->expires = now + (ms + TICK_MS - 1) / TICK_MS;
+  place(t);
+
+  if (!ticking) {
+    if (register_callback(TICK_MS, 1, &tick, NULL) == -1)
+      panic("timeout: no timer to drive the timing wheel!");
+    ticking = 1;
+  }
+  spinlock_release(&lock);
+}
+
+int timeout_cancel(timeout_t *t) {
+  spinlock_acquire(&lock);
+  if (t->pprev) {
+    unlink(t);
+    --num_pending;
+    spinlock_release(&lock);
+    return 0;
+  }
+
+  /* It may be expiring on another CPU right now. */
+  while (running == t) {
+    spinlock_release(&lock);
+    spinlock_acquire(&lock);
+  }
+  spinlock_release(&lock);
+  return -1;
+}
+
+static void tick(void *unused) {
+  spinlock_acquire(&lock);
+
+  unsigned idx = now % ROOT_SZ;
+  if (idx == 0)
+    for (unsigned l = 0; l < NUM_LEVELS; ++l)
+      if (cascade(l, (now >> (ROOT_BITS + l*LEVEL_BITS)) % LEVEL_SZ) != 0)
+        break;
+  ++now;
+
+  /* Take the slot, so that timeouts added to it while it runs wait for the
+     next time round. Each is run without the lock, and may be cancelled
+     while we do so, so take them off one by one. */
+  timeout_t *expired = NULL;
+  if (root[idx]) {
+    expired = root[idx];
+    root[idx] = NULL;
+    expired->pprev = &expired;
+  }
+
+  while (expired) {
+    timeout_t *t = expired;
+    unlink(t);
+    --num_pending;
+    running = t;
+    spinlock_release(&lock);
+
+    dbg("expired: %x\n", t);
+    t->fn(t->data);
+
+    spinlock_acquire(&lock);
+    running = NULL;
+  }
+
+  if (num_pending == 0) {
+    unregister_callback(&tick);
+    ticking = 0;
+  }
+  spinlock_release(&lock);
+}
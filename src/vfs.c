@@ -2,6 +2,7 @@
 #include "directory_cache.h"
 #include "errno.h"
 #include "kmalloc.h"
+#include "rcu.h"
 #include "stdio.h"
 #include "string.h"
 #include "vfs.h"
@@ -14,8 +15,11 @@
 
 #define MAX_SYMLINKS_TO_FOLLOW 10
 
-static vector_t filesystems, mountpoints;
-static mutex_t filesystem_lock, mountpoint_lock;
+static vector_t filesystems;
+static mutex_t filesystem_lock;
+/* The mount table. Readers use RCU; changes are made under the mutex. */
+static mountpoint_t *mountpoints;
+static mutex_t mountpoint_lock;
 static inode_t root;
 
 typedef struct fs_info {
@@ -53,6 +57,31 @@ inode_t *vfs_get_root() {
   return &root;
 }
 
+/* A lookup pins the mountpoint of each inode it holds a read lock on, and a
+   handle pins the mountpoint of its inode, so that the filesystem cannot be
+   unmounted from under them. vfs_umount() takes the write lock of the
+   mounted-on inode, so a mountpoint can only be newly pinned through it,
+   or by someone already holding a pin, until it is gone. */
+static void pin(inode_t *node) {
+  if (node->mountpoint)
+    __sync_fetch_and_add(&node->mountpoint->refs, 1);
+}
+
+static void unpin(inode_t *node) {
+  if (node->mountpoint)
+    __sync_fetch_and_sub(&node->mountpoint->refs, 1);
+}
+
+static void lock_node(inode_t *node) {
+  rwlock_read_acquire(&node->rwlock);
+  pin(node);
+}
+
+static void unlock_node(inode_t *node) {
+  unpin(node);
+  rwlock_read_release(&node->rwlock);
+}
+
 int vfs_mount(dev_t dev, inode_t *node, const char *fs) {
   assert(node->type == it_dir && "mount() called on non-directory inode!");
 
@@ -60,8 +89,7 @@ int vfs_mount(dev_t dev, inode_t *node, const char *fs) {
 
   /* Is the device or inode already mounted? */
   mutex_acquire(&mountpoint_lock);
-  for (unsigned i = 0; i < vector_length(&mountpoints); ++i) {
-    mountpoint_t *mp = *(mountpoint_t**)vector_get(&mountpoints, i);
+  for (mountpoint_t *mp = mountpoints; mp; mp = mp->next) {
     if (mp->dev == dev || mp->node == node) {
       dbg("mount: device or inode already mounted!\n");
       set_errno(EBUSY);
@@ -79,14 +107,21 @@ int vfs_mount(dev_t dev, inode_t *node, const char *fs) {
       if (fsi->probe(dev, &mp->fs) == 0) {
         mp->dev = dev;
         mp->node = node;
+        mp->refs = 0;
+
+        rwlock_write_acquire(&node->rwlock);
+        /* The filesystem we are mounting on stays pinned until umount. */
+        pin(node);
         /* Back up the inode data to be restored on umount. */
         memcpy(&mp->orig_inode_data, node, sizeof(inode_t));
 
         node->mountpoint = mp;
-        vector_add(&mountpoints, &mp);
-
         mp->fs.get_root(&node->mountpoint->fs, node);
         node->u.dir_cache = NULL;
+        rwlock_write_release(&node->rwlock);
+
+        mp->next = mountpoints;
+        rcu_assign_pointer(mountpoints, mp);
 
         dbg("mount() succeeded\n");
         mutex_release(&mountpoint_lock);
@@ -112,19 +147,42 @@ int vfs_umount(dev_t dev, inode_t *node) {
 
   mutex_acquire(&mountpoint_lock);
   /* Is the device or inode already mounted? */
-  for (unsigned i = 0; i < vector_length(&mountpoints); ++i) {
-    mountpoint_t *mp = *(mountpoint_t**)vector_get(&mountpoints, i);
+  for (mountpoint_t **pmp = &mountpoints; *pmp; pmp = &(*pmp)->next) {
+    mountpoint_t *mp = *pmp;
     if (mp->dev == dev || mp->node == node) {
       dbg("umount: unmounting device %x from node %x\n",
           mp->dev, mp->node);
-      /* FIXME: Check if the FS is busy. Keep a refcount in mountpoint_t? */
+
+      /* With the write lock held no new lookup can enter the filesystem, so
+         once it is not pinned it stays that way. */
+      inode_t *n = mp->node;
+      rwlock_write_acquire(&n->rwlock);
+      if (mp->refs != 0) {
+        dbg("umount: filesystem busy!\n");
+        rwlock_write_release(&n->rwlock);
+        set_errno(EBUSY);
+        mutex_release(&mountpoint_lock);
+        return 1;
+      }
 
       if (mp->fs.destroy)
         mp->fs.destroy(&mp->fs);
 
-      /* Restore the inode as it was before it was mounted. */
-      memcpy(mp->node, &mp->orig_inode_data, sizeof(inode_t));
+      /* Restore the inode as it was before it was mounted - all but the
+         lock, which we hold - and unpin the filesystem it is on. */
+      size_t lock_start = offsetof(inode_t, rwlock);
+      size_t lock_end = lock_start + sizeof(rwlock_t);
+      memcpy(n, &mp->orig_inode_data, lock_start);
+      memcpy((uint8_t*)n + lock_end, (uint8_t*)&mp->orig_inode_data + lock_end,
+             sizeof(inode_t) - lock_end);
+      unpin(n);
+      rwlock_write_release(&n->rwlock);
+
+      /* The "mounts" debugger command may still be walking the list. */
+      rcu_assign_pointer(*pmp, mp->next);
       mutex_release(&mountpoint_lock);
+      synchronize_rcu();
+      kfree(mp);
       return 0;
     }
   }
@@ -141,7 +199,12 @@ static void maybe_generate_dircache(inode_t *node) {
     rwlock_read_release(&node->rwlock);
     rwlock_write_acquire(&node->rwlock);
 
-    if (node->u.dir_cache) return;
+    if (node->u.dir_cache) {
+      /* Someone else generated it while we waited. */
+      rwlock_write_release(&node->rwlock);
+      rwlock_read_acquire(&node->rwlock);
+      return;
+    }
     /* FIXME: Factor out dir cache generation from here and traverse_node() */
     dbg("... generating directory cache ...\n");
     vector_t v = node->mountpoint->fs.readdir(&node->mountpoint->fs, node);
@@ -180,16 +243,16 @@ vector_t vfs_readdir(inode_t *node) {
 }
 
 /* Attempt to traverse from 'parent' to its child in 'path', assuming we hold a read lock
-   on 'parent'.
+   on 'parent' (and pin it - see pin()).
 
-   Return an inode with a read lock held. */
+   Return an inode with a read lock held and pinned. */
 static inode_t *traverse_node(inode_t *parent,
                               const char *path, access_fn_t access) {
   dbg("_traverse: parent %x path '%s'\n", parent, path);
   if (parent->type != it_dir) {
     dbg("_traverse: parent was not a directory!\n");
     set_errno(ENOENT);
-    rwlock_read_release(&parent->rwlock);
+    unlock_node(parent);
     return NULL;
   }
 
@@ -202,7 +265,7 @@ static inode_t *traverse_node(inode_t *parent,
   if (! ((parent->mode & 1) == 1 || access(parent->mode)) ) {
     dbg("_traverse: search access denied!\n");
     set_errno(EACCES);
-    rwlock_read_release(&parent->rwlock);
+    unlock_node(parent);
     return NULL;
   }
 
@@ -213,12 +276,12 @@ static inode_t *traverse_node(inode_t *parent,
   if (!child) {
     dbg("_traverse: no such file or directory!\n");
     set_errno(ENOENT);
-    rwlock_read_release(&parent->rwlock);
+    unlock_node(parent);
     return NULL;
   }
 
-  rwlock_read_acquire(&child->rwlock);
-  rwlock_read_release(&parent->rwlock);
+  lock_node(child);
+  unlock_node(parent);
 
   return child;
 }
@@ -237,7 +300,7 @@ static inode_t *traverse_path(inode_t *inode,
     while (inode->type == it_symlink) {
       if (++nloop >= MAX_SYMLINKS_TO_FOLLOW) {
         set_errno(ELOOP);
-        rwlock_read_release(&inode->rwlock);
+        unlock_node(inode);
         return NULL;
       }
 
@@ -246,8 +309,8 @@ static inode_t *traverse_path(inode_t *inode,
       buf[nbuf] = '\0';
 
       inode_t *parent = (buf[0] == '/') ? &root : inode->parent;
-      rwlock_read_acquire(&parent->rwlock);
-      rwlock_read_release(&inode->rwlock);
+      lock_node(parent);
+      unlock_node(inode);
 
       inode = traverse_path( parent, buf, access );
       if (!inode) return NULL;
@@ -266,15 +329,16 @@ static inode_t *traverse_path(inode_t *inode,
 inode_t *vfs_lopen(const char *path, access_fn_t access) {
   inode_t *inode = &root;
 
-  rwlock_read_acquire(&inode->rwlock);
+  lock_node(inode);
   dbg("lopen: '%s'\n", path);
 
   inode = traverse_path(inode, path, access);
 
-  if (inode)
+  /* The handle keeps the lookup's pin. */
+  if (inode) {
     ++inode->handles;
-
-  rwlock_read_release(&inode->rwlock);
+    rwlock_read_release(&inode->rwlock);
+  }
 
   return inode;
 }
@@ -284,7 +348,7 @@ inode_t *vfs_open(const char *path, access_fn_t access) {
   char buf[512];
   int nbuf;
 
-  rwlock_read_acquire(&inode->rwlock);
+  lock_node(inode);
 
   dbg("open: '%s'\n", path);
 
@@ -295,7 +359,7 @@ inode_t *vfs_open(const char *path, access_fn_t access) {
   while (inode && inode->type == it_symlink) {
     if (++nloop >= MAX_SYMLINKS_TO_FOLLOW) {
       set_errno(ELOOP);
-      rwlock_read_release(&inode->rwlock);
+      unlock_node(inode);
       return NULL;
     }
 
@@ -303,10 +367,14 @@ inode_t *vfs_open(const char *path, access_fn_t access) {
     assert(nbuf > 0 && "Symlink read failed!");
     buf[nbuf] = '\0';
 
-    inode = traverse_path( (buf[0] == '/') ? &root : inode->parent,
-                           buf, access );
+    inode_t *parent = (buf[0] == '/') ? &root : inode->parent;
+    lock_node(parent);
+    unlock_node(inode);
+
+    inode = traverse_path(parent, buf, access);
   }
 
+  /* The handle keeps the lookup's pin. */
   if (inode) {
     ++inode->handles;
     rwlock_read_release(&inode->rwlock);
@@ -332,6 +400,14 @@ void vfs_close(inode_t *node) {
 
   rwlock_write_acquire(&node->rwlock);
   --node->handles;
+  unpin(node);
+  rwlock_write_release(&node->rwlock);
+}
+
+void vfs_dup(inode_t *node) {
+  rwlock_write_acquire(&node->rwlock);
+  ++node->handles;
+  pin(node);
   rwlock_write_release(&node->rwlock);
 }
 
@@ -377,9 +453,20 @@ int vfs_mknod(inode_t *parent,
   return 0;
 }
 
+static void inspect_mounts(const char *cmd, core_debug_state_t *states,
+                           int core) {
+  /* Another CPU may have been stopped holding the mutex, so we must not take
+     it. */
+  rcu_read_lock();
+  for (mountpoint_t *mp = rcu_dereference(mountpoints); mp;
+       mp = rcu_dereference(mp->next))
+    kprintf("dev %d:%d on inode %p\n", major(mp->dev), minor(mp->dev),
+            mp->node);
+  rcu_read_unlock();
+}
+
 static int vfs_init() {
   filesystems = vector_new(sizeof(fs_info_t), 4);
-  mountpoints = vector_new(sizeof(mountpoint_t*), 4);
 
   mutex_init(&filesystem_lock);
   mutex_init(&mountpoint_lock);
@@ -399,14 +486,14 @@ static int vfs_init() {
   root.data = NULL;
   rwlock_init(&root.rwlock);
 
+  register_debugger_handler("mounts", "List mounted devices",
+                            &inspect_mounts);
   return 0;
 }
 
 static int vfs_fini() {
   /* Call all destroy functions. */
-  for (unsigned i = 0; i < vector_length(&mountpoints); ++i) {
-    mountpoint_t *mp = * (mountpoint_t**)vector_get(&mountpoints, i);
-    
+  for (mountpoint_t *mp = mountpoints; mp; mp = mp->next) {
     if (mp->fs.destroy)
       mp->fs.destroy(&mp->fs);
   }
@@ -415,10 +502,11 @@ static int vfs_fini() {
 }
 
 static prereq_t req[] = { {"kmalloc",NULL}, {NULL,NULL} };
+static prereq_t load_after[] = { {"debugger",NULL}, {NULL,NULL} };
 static module_t x run_on_startup = {
   .name = "vfs",
   .required = req,
-  .load_after = NULL,
+  .load_after = load_after,
   .init = &vfs_init,
   .fini = &vfs_fini
 };
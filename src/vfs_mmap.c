@@ -0,0 +1,305 @@
+/* Memory-mapped files.
+
+   vfs_mmap() only reserves virtual address space; pages are read in by the
+   page fault handler the first time they are touched.
+
+   Where the filesystem can tell us (through its 'bmap' hook) that a page of
+   the file is stored as one aligned page on the device, the page is mapped
+   straight out of the disk cache, so the mapping shares its frame with
+   vfs_read() and vfs_write(). Private writable mappings map it copy-on-write.
+   Pages that cannot be shared (partial pages at the end of a file, or files
+   on filesystems without 'bmap') are copied into a private frame with
+   vfs_read() instead.
+
+   While a disk cache frame is mapped we hold a handle on it, so the cache
+   cannot evict it, and a cow_refcnt reference, so swap and same-page merging
+   treat it as shared and leave it alone. */
+
+#include "block_cache.h"
+#include "errno.h"
+#include "hal.h"
+#include "kmalloc.h"
+#include "stdio.h"
+#include "string.h"
+#include "vfs.h"
+#include "vmspace.h"
+
+#ifdef DEBUG_vfs_mmap
+# define dbg(args...) kprintf("vfs_mmap: " args)
+#else
+# define dbg(args...)
+#endif
+
+/* mmap_page_t::phys for a page that has not been read in yet. */
+#define NOT_PRESENT (~0ULL)
+
+typedef struct mmap_page {
+  /* The frame the page was populated with. */
+  uint64_t phys;
+  /* The disk cache and device offset it came from, or NULL if the page is a
+     private copy. */
+  disk_cache_t *cache;
+  uint64_t dev_offset;
+} mmap_page_t;
+
+typedef struct mapping {
+  uintptr_t start;
+  unsigned npages, reserved;
+  inode_t *inode;
+  uint64_t offset;
+  unsigned flags;
+  /* Protects 'pages', and is held while a page is read in. */
+  mutex_t lock;
+  mmap_page_t *pages;
+
+  struct mapping *next;
+} mapping_t;
+
+/* Protects the mapping list. Faults only read it, so pages of different
+   mappings are read in at the same time; changing it waits for them. */
+static rwlock_t lock;
+static mapping_t *mappings;
+
+static mapping_t *find_mapping(uintptr_t v) {
+  for (mapping_t *m = mappings; m; m = m->next)
+    if (v >= m->start && v < m->start + m->npages * get_page_size())
+      return m;
+  return NULL;
+}
+
+/* Change the flags on the page at 'v'. */
+static void remap(uintptr_t v, uint64_t p, unsigned flags) {
+  if (unmap(v, 1) == -1 || map(v, p, 1, flags) == -1)
+    panic("vfs_mmap: remap failed!");
+}
+
+static void populate(mapping_t *m, unsigned idx) {
+  unsigned ps = get_page_size();
+  uintptr_t v = m->start + idx * ps;
+  uint64_t offset = m->offset + (uint64_t)idx * ps;
+  mmap_page_t *pg = &m->pages[idx];
+
+  unsigned flags = m->flags & (PAGE_WRITE|PAGE_EXECUTE|PAGE_USER);
+  bool shared = (m->flags & VFS_MAP_SHARED) != 0;
+
+  filesystem_t *fs = &m->inode->mountpoint->fs;
+  disk_cache_t *cache = NULL;
+  int64_t addr = fs->bmap ? fs->bmap(fs, m->inode, offset, &cache) : -1;
+
+  if (addr != -1) {
+    /* disk_cache_get() maps the page writable; drop to the mapping's flags
+       if they differ. */
+    disk_cache_get(cache, addr, (void*)v);
+    uint64_t p = get_mapping(v, NULL);
+    cow_refcnt_inc(p);
+
+    if (!shared && (flags & PAGE_WRITE))
+      remap(v, p, flags | PAGE_COW);
+    else if (!(flags & PAGE_WRITE))
+      remap(v, p, flags);
+
+    pg->phys = p;
+    pg->cache = cache;
+    pg->dev_offset = addr;
+    dbg("fault %x: offset %x from cache (device %x)\n", v, (uint32_t)offset,
+        (uint32_t)addr);
+    return;
+  }
+
+  /* Swapping out never needs the locks we hold, so we may reclaim. */
+  uint64_t p = alloc_page(PAGE_REQ_NONE | PAGE_REQ_RECLAIM);
+  if (p == ~0ULL)
+    panic("vfs_mmap: out of memory!");
+  map(v, p, 1, PAGE_WRITE);
+
+  memset((void*)v, 0, ps);
+  if (offset < (uint64_t)m->inode->size) {
+    uint64_t sz = m->inode->size - offset;
+    vfs_read(m->inode, offset, (void*)v, sz > ps ? ps : sz);
+  }
+
+  if (flags != PAGE_WRITE)
+    remap(v, p, flags);
+
+  pg->phys = p;
+  pg->cache = NULL;
+  dbg("fault %x: offset %x copied\n", v, (uint32_t)offset);
+}
+
+bool vfs_mmap_handle_page_fault(uintptr_t v) {
+  /* Nothing can be mapped before the module is initialised. */
+  if (mappings == NULL)
+    return false;
+
+  v &= ~get_page_mask();
+  /* A fault on a present page is a protection fault, not ours to fix. */
+  if (get_mapping(v, NULL) != ~0ULL)
+    return false;
+
+  rwlock_read_acquire(&lock);
+  mapping_t *m = find_mapping(v);
+  if (!m) {
+    rwlock_read_release(&lock);
+    return false;
+  }
+
+  unsigned idx = (v - m->start) / get_page_size();
+  mutex_acquire(&m->lock);
+  /* Another thread may have faulted the page in while we waited. */
+  if (m->pages[idx].phys == NOT_PRESENT)
+    populate(m, idx);
+  bool ok = get_mapping(v, NULL) != ~0ULL;
+  mutex_release(&m->lock);
+
+  rwlock_read_release(&lock);
+  return ok;
+}
+
+void *vfs_mmap(inode_t *inode, uint64_t offset, uint64_t length,
+               unsigned flags) {
+  unsigned ps = get_page_size();
+  if (inode->type != it_file || (offset & get_page_mask()) || length == 0) {
+    set_errno(EINVAL);
+    return NULL;
+  }
+
+  unsigned npages = (length + ps - 1) / ps;
+
+  mapping_t *m = kmalloc(sizeof(mapping_t));
+  mmap_page_t *pages = kmalloc(npages * sizeof(mmap_page_t));
+  uintptr_t start = (m && pages) ?
+    vmspace_alloc(&kernel_vmspace, npages * ps, 0) : ~0UL;
+  if (start == ~0UL || start == 0) {
+    kfree(m);
+    kfree(pages);
+    set_errno(ENOMEM);
+    return NULL;
+  }
+
+  for (unsigned i = 0; i < npages; ++i)
+    pages[i].phys = NOT_PRESENT;
+
+  m->start = start;
+  m->npages = npages;
+  m->reserved = npages * ps;
+  m->inode = inode;
+  m->offset = offset;
+  m->flags = flags;
+  mutex_init(&m->lock);
+  m->pages = pages;
+
+  /* The mapping holds a handle on the inode, like an open file. */
+  vfs_dup(inode);
+
+  rwlock_write_acquire(&lock);
+  m->next = mappings;
+  mappings = m;
+  rwlock_write_release(&lock);
+
+  dbg("mmap(%x, %x, %x, %x) -> %x\n", inode, (uint32_t)offset,
+      (uint32_t)length, flags, start);
+  return (void*)start;
+}
+
+/* Called with m->lock held, or the list locked for writing. */
+static int sync(mapping_t *m) {
+  if ((m->flags & (VFS_MAP_SHARED|PAGE_WRITE)) != (VFS_MAP_SHARED|PAGE_WRITE))
+    return 0;
+
+  unsigned ps = get_page_size();
+  int ret = 0;
+  for (unsigned i = 0; i < m->npages; ++i) {
+    mmap_page_t *pg = &m->pages[i];
+    void *v = (void*)(m->start + i * ps);
+    uint64_t offset = m->offset + (uint64_t)i * ps;
+
+    if (pg->phys == NOT_PRESENT)
+      continue;
+
+    if (pg->cache) {
+      if (!disk_cache_sync(pg->cache, pg->dev_offset, v))
+        ret = 1;
+    } else if (offset < (uint64_t)m->inode->size) {
+      uint64_t sz = m->inode->size - offset;
+      if (sz > ps)
+        sz = ps;
+      if (vfs_write(m->inode, offset, v, sz) != (int64_t)sz)
+        ret = 1;
+    }
+  }
+  return ret;
+}
+
+int vfs_msync(void *addr) {
+  rwlock_read_acquire(&lock);
+  mapping_t *m = find_mapping((uintptr_t)addr);
+  int ret = 1;
+  if (m) {
+    mutex_acquire(&m->lock);
+    ret = sync(m);
+    mutex_release(&m->lock);
+  }
+  rwlock_read_release(&lock);
+  return ret;
+}
+
+int vfs_munmap(void *addr) {
+  /* No fault can be using the mapping once we have the list to ourselves. */
+  rwlock_write_acquire(&lock);
+
+  mapping_t **pm = &mappings;
+  while (*pm && (*pm)->start != (uintptr_t)addr)
+    pm = &(*pm)->next;
+  mapping_t *m = *pm;
+  if (!m) {
+    rwlock_write_release(&lock);
+    set_errno(EINVAL);
+    return 1;
+  }
+
+  int ret = sync(m);
+  *pm = m->next;
+
+  for (unsigned i = 0; i < m->npages; ++i) {
+    mmap_page_t *pg = &m->pages[i];
+    uintptr_t v = m->start + i * get_page_size();
+    if (pg->phys == NOT_PRESENT)
+      continue;
+
+    /* The page may have been copied by a copy-on-write fault, swapped out
+       or merged since we populated it. Frames we own are freed; shared
+       frames just lose the reference unmap() drops. */
+    unsigned flags = 0;
+    uint64_t p = get_mapping(v, &flags);
+    if (p != ~0ULL || get_swap_entry(v) != 0)
+      unmap(v, 1);
+    if (p != ~0ULL && !(flags & PAGE_COW) && !(pg->cache && p == pg->phys))
+      free_page(p);
+
+    if (pg->cache) {
+      cow_refcnt_dec(pg->phys);
+      disk_cache_release(pg->cache, pg->dev_offset);
+    }
+  }
+  rwlock_write_release(&lock);
+
+  vmspace_free(&kernel_vmspace, m->reserved, m->start, 0);
+  vfs_close(m->inode);
+  kfree(m->pages);
+  kfree(m);
+  return ret;
+}
+
+static int vfs_mmap_init() {
+  rwlock_init(&lock);
+  return 0;
+}
+
+static prereq_t req[] = { {"vfs",NULL}, {"kmalloc",NULL}, {NULL,NULL} };
+static module_t x run_on_startup = {
+  .name = "vfs_mmap",
+  .required = req,
+  .load_after = NULL,
+  .init = &vfs_mmap_init,
+  .fini = NULL
+};
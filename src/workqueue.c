@@ -0,0 +1,364 @@
+/* Work queues - see workqueue.h.
+
+   Each CPU has a pool of WORKQUEUE_WORKERS threads bound to it, and a FIFO
+   of the items ready to run there, taken by whichever worker is free. An
+   item is ready once its queue has fewer than 'max_active' items ready or
+   running on the CPU; until then it waits on the queue's own list for that
+   CPU, and one of those finishing makes the next ready.
+
+   Items are numbered as they are queued on each CPU, and every worker notes
+   the number of the item it is running, so a flush can tell when everything
+   queued before it is done. */
+
+#include "assert.h"
+#include "hal.h"
+#include "kmalloc.h"
+#include "stdio.h"
+#include "string.h"
+#include "thread.h"
+#include "workqueue.h"
+
+#ifdef DEBUG_workqueue
+# define dbg(args...) kprintf("workqueue: " args)
+#else
+# define dbg(args...)
+#endif
+
+/* Workers per CPU: the most items that can be running, or sleeping, on a
+   CPU at once across all queues. */
+#define WORKQUEUE_WORKERS 4
+
+/* A queue's state on one CPU. */
+typedef struct wq_cpu {
+  /* Items held back by 'max_active', in order. */
+  work_t *head, *tail;
+  /* Items ready or running. */
+  unsigned active;
+  unsigned next_seq;
+  workqueue_stats_t stats;
+} wq_cpu_t;
+
+struct workqueue {
+  const char *name;
+  unsigned max_active;
+  struct workqueue *next;
+  /* One per pool. */
+  wq_cpu_t cpus[];
+};
+
+typedef struct worker {
+  struct pool *pool;
+  /* The queue and number of the item being run, or NULL while idle. */
+  workqueue_t *volatile wq;
+  unsigned seq;
+} worker_t;
+
+typedef struct pool {
+  unsigned cpu;
+  /* Guards everything here and in the wq_cpu_t of every queue for this
+     CPU. Taken from interrupt handlers. */
+  spinlock_t lock;
+  /* Items ready to run, in order, and their number. */
+  work_t *head, *tail;
+  semaphore_t ready;
+  /* Threads in flush_workqueue(), woken as each item finishes. */
+  waitqueue_t done;
+  worker_t workers[WORKQUEUE_WORKERS];
+} pool_t;
+
+static pool_t pools[MAX_CORES];
+static unsigned npools;
+
+static workqueue_t *queues;
+static spinlock_t queues_lock = SPINLOCK_RELEASED;
+
+workqueue_t *system_wq;
+
+static unsigned this_cpu() {
+  int id = get_processor_id();
+  return (id < 0) ? 0 : (unsigned)id % npools;
+}
+
+/* Is item number 'a' older than 'b'? */
+static bool before(unsigned a, unsigned b) {
+  return (int)(a - b) < 0;
+}
+
+static void append(work_t **head, work_t **tail, work_t *w) {
+  w->next = NULL;
+  if (*tail)
+    (*tail)->next = w;
+  else
+    *head = w;
+  *tail = w;
+}
+
+static work_t *pop(work_t **head, work_t **tail) {
+  work_t *w = *head;
+  *head = w->next;
+  if (!*head)
+    *tail = NULL;
+  return w;
+}
+
+void work_init(work_t *w, void (*fn)(work_t *w)) {
+  w->next = NULL;
+  w->fn = fn;
+  w->pending = 0;
+  w->wq = NULL;
+}
+
+/* Queues 'w', which the caller has marked pending, on this CPU. */
+static void enqueue(workqueue_t *wq, work_t *w) {
+  pool_t *p = &pools[this_cpu()];
+  wq_cpu_t *c = &wq->cpus[p->cpu];
+
+  w->wq = wq;
+  w->queued_at = get_cycle_count();
+
+  spinlock_acquire(&p->lock);
+  w->seq = c->next_seq++;
+  ++c->stats.queued;
+  bool ready = c->active < wq->max_active;
+  if (ready) {
+    ++c->active;
+    append(&p->head, &p->tail, w);
+  } else {
+    append(&c->head, &c->tail, w);
+  }
+  spinlock_release(&p->lock);
+
+  if (ready)
+    semaphore_signal(&p->ready);
+}
+
+bool queue_work(workqueue_t *wq, work_t *w) {
+  assert(wq && w);
+  if (!__sync_bool_compare_and_swap(&w->pending, 0, 1))
+    return false;
+  enqueue(wq, w);
+  return true;
+}
+
+static void delayed_work_expired(void *p) {
+  delayed_work_t *dw = (delayed_work_t*)p;
+  enqueue(dw->wq, &dw->work);
+}
+
+void delayed_work_init(delayed_work_t *dw, void (*fn)(work_t *w)) {
+  work_init(&dw->work, fn);
+  timeout_init(&dw->timeout, &delayed_work_expired, dw);
+  dw->wq = NULL;
+}
+
+bool queue_delayed_work(workqueue_t *wq, delayed_work_t *dw, unsigned ms) {
+  assert(wq && dw);
+  if (!__sync_bool_compare_and_swap(&dw->work.pending, 0, 1))
+    return false;
+
+  dw->wq = wq;
+  if (ms == 0)
+    enqueue(wq, &dw->work);
+  else
+    timeout_add(&dw->timeout, ms);
+  return true;
+}
+
+bool cancel_delayed_work(delayed_work_t *dw) {
+  if (timeout_cancel(&dw->timeout) != 0)
+    return false;
+  dw->work.pending = 0;
+  return true;
+}
+
+static void worker(void *arg) {
+  worker_t *me = (worker_t*)arg;
+  pool_t *p = me->pool;
+
+  while (1) {
+    semaphore_wait(&p->ready);
+
+    spinlock_acquire(&p->lock);
+    work_t *w = pop(&p->head, &p->tail);
+    workqueue_t *wq = w->wq;
+    void (*fn)(work_t*) = w->fn;
+    me->wq = wq;
+    me->seq = w->seq;
+    uint64_t start = get_cycle_count();
+    uint64_t wait = start - w->queued_at;
+    /* From here it may be queued again. */
+    w->pending = 0;
+    spinlock_release(&p->lock);
+
+    dbg("%s: running %p\n", wq->name, w);
+    fn(w);
+    uint64_t run = get_cycle_count() - start;
+
+    spinlock_acquire(&p->lock);
+    wq_cpu_t *c = &wq->cpus[p->cpu];
+    ++c->stats.executed;
+    c->stats.wait += wait;
+    if (wait > c->stats.max_wait)
+      c->stats.max_wait = wait;
+    c->stats.run += run;
+    me->wq = NULL;
+
+    /* Let the next held back item of this queue go in our place. */
+    bool ready = c->head != NULL;
+    if (ready)
+      append(&p->head, &p->tail, pop(&c->head, &c->tail));
+    else
+      --c->active;
+    spinlock_release(&p->lock);
+
+    if (ready)
+      semaphore_signal(&p->ready);
+    waitqueue_wake(&p->done, WAITQUEUE_ALL);
+  }
+}
+
+/* Is any item of 'wq' numbered before 'seq' still to finish on 'p'? Called
+   with the pool's lock held. */
+static bool outstanding(pool_t *p, workqueue_t *wq, unsigned seq) {
+  wq_cpu_t *c = &wq->cpus[p->cpu];
+  if (c->head && before(c->head->seq, seq))
+    return true;
+  for (work_t *w = p->head; w; w = w->next)
+    if (w->wq == wq && before(w->seq, seq))
+      return true;
+  for (unsigned i = 0; i < WORKQUEUE_WORKERS; ++i)
+    if (p->workers[i].wq == wq && before(p->workers[i].seq, seq))
+      return true;
+  return false;
+}
+
+void flush_workqueue(workqueue_t *wq) {
+  unsigned seqs[npools];
+  for (unsigned i = 0; i < npools; ++i) {
+    spinlock_acquire(&pools[i].lock);
+    seqs[i] = wq->cpus[i].next_seq;
+    spinlock_release(&pools[i].lock);
+  }
+
+  for (unsigned i = 0; i < npools; ++i) {
+    pool_t *p = &pools[i];
+    while (1) {
+      /* Workers wake flushers under the wait queue's lock after updating
+         the pool, so checking under it means we cannot miss the last. */
+      spinlock_acquire(&p->done.lock);
+      spinlock_acquire(&p->lock);
+      bool busy = outstanding(p, wq, seqs[i]);
+      spinlock_release(&p->lock);
+      if (!busy) {
+        spinlock_release(&p->done.lock);
+        break;
+      }
+
+      waiter_t w;
+      waitqueue_add(&p->done, &w, /*exclusive=*/false);
+      waitqueue_sleep(&p->done, &w, WAITQUEUE_FOREVER);
+    }
+  }
+}
+
+workqueue_t *workqueue_create(const char *name, unsigned max_active) {
+  assert(max_active > 0);
+  unsigned sz = sizeof(workqueue_t) + npools * sizeof(wq_cpu_t);
+  workqueue_t *wq = kmalloc(sz);
+  memset(wq, 0, sz);
+  wq->name = name;
+  wq->max_active = max_active;
+
+  spinlock_acquire(&queues_lock);
+  wq->next = queues;
+  queues = wq;
+  spinlock_release(&queues_lock);
+  return wq;
+}
+
+void workqueue_destroy(workqueue_t *wq) {
+  flush_workqueue(wq);
+
+  spinlock_acquire(&queues_lock);
+  for (workqueue_t **pq = &queues; *pq; pq = &(*pq)->next) {
+    if (*pq == wq) {
+      *pq = wq->next;
+      break;
+    }
+  }
+  spinlock_release(&queues_lock);
+  kfree(wq);
+}
+
+void workqueue_get_stats(workqueue_t *wq, workqueue_stats_t *stats) {
+  memset(stats, 0, sizeof(workqueue_stats_t));
+  for (unsigned i = 0; i < npools; ++i) {
+    spinlock_acquire(&pools[i].lock);
+    workqueue_stats_t *s = &wq->cpus[i].stats;
+    stats->queued += s->queued;
+    stats->executed += s->executed;
+    stats->wait += s->wait;
+    stats->run += s->run;
+    if (s->max_wait > stats->max_wait)
+      stats->max_wait = s->max_wait;
+    spinlock_release(&pools[i].lock);
+  }
+}
+
+static void inspect_workqueues(const char *cmd, core_debug_state_t *states,
+                               int core) {
+  spinlock_acquire(&queues_lock);
+  for (workqueue_t *wq = queues; wq; wq = wq->next) {
+    workqueue_stats_t s;
+    workqueue_get_stats(wq, &s);
+    unsigned n = s.executed ? s.executed : 1;
+    kprintf("%-10s max %d: %u queued, %u executed; wait %u mean, %u max; "
+            "run %u mean (cycles)\n", wq->name, wq->max_active, s.queued,
+            s.executed, (unsigned)(s.wait / n), (unsigned)s.max_wait,
+            (unsigned)(s.run / n));
+  }
+  spinlock_release(&queues_lock);
+}
+
+static int workqueue_init() {
+  int n = get_num_processors();
+  npools = (n < 1) ? 1 : n;
+
+  for (unsigned i = 0; i < npools; ++i) {
+    pool_t *p = &pools[i];
+    p->cpu = i;
+    spinlock_init(&p->lock);
+    p->head = p->tail = NULL;
+    semaphore_init(&p->ready);
+    waitqueue_init(&p->done);
+
+    cpu_mask_t mask;
+    memset(&mask, 0, sizeof(mask));
+    cpu_mask_set(&mask, i);
+    for (unsigned j = 0; j < WORKQUEUE_WORKERS; ++j) {
+      worker_t *k = &p->workers[j];
+      k->pool = p;
+      k->wq = NULL;
+      thread_t *t = thread_spawn(&worker, k, /*auto_free=*/1);
+      thread_set_affinity(t, &mask);
+    }
+  }
+
+  system_wq = workqueue_create("system", WORKQUEUE_WORKERS);
+
+  register_debugger_handler("workqueues", "Show work queue statistics",
+                            &inspect_workqueues);
+  return 0;
+}
+
+static prereq_t prereqs[] = { {"kmalloc",NULL}, {"threading",NULL},
+                              {NULL,NULL} };
+static prereq_t load_after[] = { {"debugger",NULL}, {NULL,NULL} };
+
+static module_t x run_on_startup = {
+  .name = "workqueue",
+  .required = prereqs,
+  .load_after = load_after,
+  .init = &workqueue_init,
+  .fini = NULL
+};
@@ -0,0 +1,597 @@
+/* The local and I/O APICs, and the other cores.
+
+   Every core has a local APIC, which takes interrupts for it and sends IPIs
+   to the other cores. External IRQs reach the local APICs through one or
+   more I/O APICs. ACPI's MADT lists them all, along with where each ISA IRQ
+   is connected if not to the I/O APIC input of the same number.
+
+   Once they have been found the APICs replace the 8259 PICs (see
+   interrupts.c). Acknowledging an interrupt is then a single write to the
+   local APIC. Every IRQ is sent to the first core, which is the only one the
+   PIT expects to tick on.
+
+   Without an MADT, or without an I/O APIC, we stay on the PICs with one
+   core, as every other uniprocessor target does.
+
+   The other cores are started with an INIT IPI followed by startup IPIs,
+   which send them to x86/trampoline.s. An IPI's data is left in the target
+   core's mailbox before the interrupt is sent. */
+
+#include "hal.h"
+#include "kmalloc.h"
+#include "percpu.h"
+#include "stdio.h"
+#include "string.h"
+#include "vmspace.h"
+#include "x86/io.h"
+#include "x86/mmap.h"
+#include "x86/smp.h"
+
+#ifdef DEBUG_apic
+# define dbg(args...) kprintf("apic: " args)
+#else
+# define dbg(args...)
+#endif
+
+/* Local APIC registers, as offsets from its base. */
+#define LAPIC_ID      0x20
+#define LAPIC_TPR     0x80
+#define LAPIC_EOI     0xB0
+#define LAPIC_SVR     0xF0
+#define LAPIC_ICR_LO  0x300
+#define LAPIC_ICR_HI  0x310
+#define LAPIC_LINT0   0x350
+
+#define SVR_ENABLE    0x100
+#define LVT_MASKED    0x10000
+
+#define ICR_FIXED     0x000
+#define ICR_INIT      0x500
+#define ICR_STARTUP   0x600
+#define ICR_PENDING   0x1000
+#define ICR_ASSERT    0x4000
+#define ICR_LEVEL     0x8000
+
+/* I/O APIC registers are reached through an index and a data window. */
+#define IOAPIC_REGSEL 0
+#define IOAPIC_WIN    4          /* In 32-bit words. */
+#define IOAPIC_VER    0x01
+#define IOAPIC_REDTBL(n) (0x10 + (n) * 2)
+
+#define REDIR_ACTIVE_LOW (1U<<13)
+#define REDIR_LEVEL      (1U<<15)
+#define REDIR_MASKED     (1U<<16)
+
+/* The MADT entries we care about. */
+#define MADT_LAPIC    0
+#define MADT_IOAPIC   1
+#define MADT_OVERRIDE 2
+
+/* Interrupt source override flags. */
+#define POLARITY_MASK 0x3
+#define POLARITY_LOW  0x3
+#define TRIGGER_MASK  0xC
+#define TRIGGER_LEVEL 0xC
+
+#define LAPIC_ENABLED 1
+
+#define MAX_IOAPICS   8
+#define NUM_ISA_IRQS  16
+
+/* IPIs sent to a core that has yet to take them. The same data sent twice is
+   only delivered once, so this only fills up if many different IPIs are
+   sent to a core with interrupts disabled. */
+#define MAILBOX_SZ 16
+
+/* The stack a core starts on, until it switches to its idle thread. */
+#define AP_STACK_SZ 0x1000
+/* How long a core has to start after its startup IPI. The first gets a
+   millisecond or two before the second is sent. */
+#define AP_TIMEOUT_MS 100
+/* How long to hold a core in INIT. */
+#define INIT_MS 10
+
+/* The first 4MB of physical memory are mapped at the start of kernel space
+   for good (see bringup-1.s). */
+#define LOW_MEM(p) ((void*)(MMAP_KERNEL_START + (p)))
+
+typedef struct rsdp {
+  char sig[8];
+  uint8_t checksum;
+  char oem[6];
+  uint8_t revision;
+  uint32_t rsdt;
+} __attribute__((packed)) rsdp_t;
+
+typedef struct sdt_header {
+  char sig[4];
+  uint32_t length;
+  uint8_t revision, checksum;
+  char oem[6], oem_table[8];
+  uint32_t oem_revision, creator, creator_revision;
+} __attribute__((packed)) sdt_header_t;
+
+typedef struct madt {
+  sdt_header_t h;
+  uint32_t lapic;
+  uint32_t flags;
+} __attribute__((packed)) madt_t;
+
+typedef struct madt_entry {
+  uint8_t type, length;
+} __attribute__((packed)) madt_entry_t;
+
+typedef struct madt_lapic {
+  madt_entry_t e;
+  uint8_t acpi_id, apic_id;
+  uint32_t flags;
+} __attribute__((packed)) madt_lapic_t;
+
+typedef struct madt_ioapic {
+  madt_entry_t e;
+  uint8_t id, reserved;
+  uint32_t addr, gsi_base;
+} __attribute__((packed)) madt_ioapic_t;
+
+typedef struct madt_override {
+  madt_entry_t e;
+  uint8_t bus, irq;
+  uint32_t gsi;
+  uint16_t flags;
+} __attribute__((packed)) madt_override_t;
+
+typedef struct ioapic {
+  uint32_t phys;
+  volatile uint32_t *regs;
+  uint32_t gsi_base;
+  unsigned n;                   /* Number of inputs. */
+} ioapic_t;
+
+/* Left after the trampoline's code for it - see x86/trampoline.s. */
+typedef struct ap_params {
+  uint32_t cr3, cr4, stack, entry;
+} ap_params_t;
+
+typedef struct mailbox {
+  spinlock_t lock;
+  void *data[MAILBOX_SZ];
+  unsigned head;
+  volatile unsigned n;
+} mailbox_t;
+
+extern char ap_trampoline[], ap_trampoline_end[], ap_params[];
+
+static uint32_t lapic_phys;
+static volatile uint32_t *lapic;
+static ioapic_t ioapics[MAX_IOAPICS];
+static unsigned num_ioapics;
+static spinlock_t ioapic_lock = SPINLOCK_RELEASED;
+
+/* Where each ISA IRQ is connected, and the override flags it has if any. */
+static struct {
+  uint32_t gsi;
+  uint16_t flags;
+} isa_irqs[NUM_ISA_IRQS];
+
+static int num_cpus;
+static int cpu_ids[MAX_CORES];
+static uint8_t lapic_ids[MAX_CORES];
+/* The number of cores started so far; they are started in order. */
+static volatile int online;
+static uintptr_t contexts[MAX_CORES];
+static mailbox_t mailboxes[MAX_CORES];
+
+static PERCPU_DEFINE(int, cpu_index) = 0;
+
+int get_processor_id() {
+  return num_cpus ? this_cpu_read(cpu_index) : -1;
+}
+
+int get_num_processors() {
+  return num_cpus ? num_cpus : -1;
+}
+
+int apic_num_online() {
+  return online;
+}
+
+int *get_all_processor_ids() {
+  return num_cpus ? cpu_ids : NULL;
+}
+
+/* The vector exists whether or not there are other cores to send IPIs, so
+   handlers can be registered for it before the APICs are found. */
+int get_ipi_interrupt_num() {
+  return IPI_VECTOR;
+}
+
+void *get_ipi_data(struct regs *r) {
+  return (void*)r->error_code;
+}
+
+/* Maps 'sz' bytes of physical memory at 'p' into kernel space. */
+static void *map_phys(uint32_t p, unsigned sz) {
+  uint32_t base = p & ~get_page_mask();
+  unsigned len = round_to_page_size(p - base + sz);
+  uintptr_t v = vmspace_alloc(&kernel_vmspace, len, 0);
+  map(v, base, len >> get_page_shift(), PAGE_WRITE);
+  return (void*)(v + (p - base));
+}
+
+static void unmap_phys(void *ptr, unsigned sz) {
+  uintptr_t v = (uintptr_t)ptr & ~get_page_mask();
+  unsigned len = round_to_page_size((uintptr_t)ptr - v + sz);
+  unmap(v, len >> get_page_shift());
+  vmspace_free(&kernel_vmspace, len, v, 0);
+}
+
+static uint32_t lapic_read(unsigned reg) {
+  return lapic[reg / 4];
+}
+
+static void lapic_write(unsigned reg, uint32_t value) {
+  lapic[reg / 4] = value;
+}
+
+static uint32_t ioapic_read(ioapic_t *io, unsigned reg) {
+  io->regs[IOAPIC_REGSEL] = reg;
+  return io->regs[IOAPIC_WIN];
+}
+
+static void ioapic_write(ioapic_t *io, unsigned reg, uint32_t value) {
+  io->regs[IOAPIC_REGSEL] = reg;
+  io->regs[IOAPIC_WIN] = value;
+}
+
+/******************************************************************************
+ * Finding the APICs
+ *****************************************************************************/
+
+static bool checksum_ok(const void *p, unsigned len) {
+  uint8_t sum = 0;
+  for (unsigned i = 0; i < len; ++i)
+    sum += ((const uint8_t*)p)[i];
+  return sum == 0;
+}
+
+static rsdp_t *scan_for_rsdp(uintptr_t start, uintptr_t end) {
+  for (uintptr_t p = start; p + sizeof(rsdp_t) <= end; p += 16) {
+    rsdp_t *r = LOW_MEM(p);
+    if (!strncmp(r->sig, "RSD PTR ", 8) && checksum_ok(r, sizeof(rsdp_t)))
+      return r;
+  }
+  return NULL;
+}
+
+/* The RSDP is on a 16-byte boundary in the first KB of the extended BIOS
+   data area, whose segment is kept at 0x40E, or in the BIOS ROM. */
+static rsdp_t *find_rsdp() {
+  uintptr_t ebda = *(uint16_t*)LOW_MEM(0x40E) << 4;
+  rsdp_t *r = NULL;
+  if (ebda)
+    r = scan_for_rsdp(ebda, ebda + 1024);
+  if (!r)
+    r = scan_for_rsdp(0xE0000, 0x100000);
+  return r;
+}
+
+/* Maps the ACPI table at 'p', all of it, if its signature is 'sig'. */
+static sdt_header_t *map_table(uint32_t p, const char *sig) {
+  sdt_header_t *h = map_phys(p, sizeof(sdt_header_t));
+  uint32_t len = h->length;
+  bool match = !strncmp(h->sig, sig, 4);
+  unmap_phys(h, sizeof(sdt_header_t));
+  if (!match)
+    return NULL;
+
+  h = map_phys(p, len);
+  if (!checksum_ok(h, len)) {
+    unmap_phys(h, len);
+    return NULL;
+  }
+  return h;
+}
+
+static void unmap_table(sdt_header_t *h) {
+  unmap_phys(h, h->length);
+}
+
+/* We only use the RSDT. Its 32-bit pointers are all a 32-bit kernel could
+   use anyway. */
+static madt_t *find_madt() {
+  rsdp_t *r = find_rsdp();
+  if (!r)
+    return NULL;
+  sdt_header_t *rsdt = map_table(r->rsdt, "RSDT");
+  if (!rsdt)
+    return NULL;
+
+  madt_t *madt = NULL;
+  uint32_t *tables = (uint32_t*)(rsdt + 1);
+  unsigned n = (rsdt->length - sizeof(sdt_header_t)) / sizeof(uint32_t);
+  for (unsigned i = 0; i < n && !madt; ++i)
+    madt = (madt_t*)map_table(tables[i], "APIC");
+
+  unmap_table(rsdt);
+  return madt;
+}
+
+static void parse_madt(madt_t *madt) {
+  lapic_phys = madt->lapic;
+
+  uint8_t *p = (uint8_t*)(madt + 1);
+  uint8_t *end = (uint8_t*)madt + madt->h.length;
+  while (p + sizeof(madt_entry_t) <= end) {
+    madt_entry_t *e = (madt_entry_t*)p;
+    if (e->length < sizeof(madt_entry_t))
+      break;
+
+    if (e->type == MADT_LAPIC) {
+      madt_lapic_t *l = (madt_lapic_t*)e;
+      if ((l->flags & LAPIC_ENABLED) && num_cpus < MAX_CORES)
+        lapic_ids[num_cpus++] = l->apic_id;
+
+    } else if (e->type == MADT_IOAPIC && num_ioapics < MAX_IOAPICS) {
+      madt_ioapic_t *io = (madt_ioapic_t*)e;
+      ioapics[num_ioapics].phys = io->addr;
+      ioapics[num_ioapics].gsi_base = io->gsi_base;
+      ++num_ioapics;
+
+    } else if (e->type == MADT_OVERRIDE) {
+      madt_override_t *o = (madt_override_t*)e;
+      if (o->bus == 0 && o->irq < NUM_ISA_IRQS) {
+        isa_irqs[o->irq].gsi = o->gsi;
+        isa_irqs[o->irq].flags = o->flags;
+      }
+    }
+
+    p += e->length;
+  }
+}
+
+/******************************************************************************
+ * Interrupts
+ *****************************************************************************/
+
+/* Every interrupt from an APIC is acknowledged the same way. Exceptions are
+   not interrupts, and are not acknowledged. */
+static void lapic_ack_irq(unsigned num) {
+  if (num >= 32)
+    lapic_write(LAPIC_EOI, 0);
+}
+
+/* ISA IRQs are edge triggered and active high, unless overridden. */
+static void ioapic_enable_irq(uint8_t irq, unsigned enable) {
+  if (irq >= NUM_ISA_IRQS)
+    return;
+
+  uint32_t gsi = isa_irqs[irq].gsi;
+  ioapic_t *io = NULL;
+  for (unsigned i = 0; i < num_ioapics; ++i)
+    if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].n)
+      io = &ioapics[i];
+  if (!io) {
+    dbg("IRQ %d (GSI %d) has no I/O APIC!\n", irq, gsi);
+    return;
+  }
+
+  uint32_t lo = IRQ(irq);
+  if ((isa_irqs[irq].flags & POLARITY_MASK) == POLARITY_LOW)
+    lo |= REDIR_ACTIVE_LOW;
+  if ((isa_irqs[irq].flags & TRIGGER_MASK) == TRIGGER_LEVEL)
+    lo |= REDIR_LEVEL;
+  if (!enable)
+    lo |= REDIR_MASKED;
+
+  unsigned pin = gsi - io->gsi_base;
+  spinlock_acquire(&ioapic_lock);
+  ioapic_write(io, IOAPIC_REDTBL(pin) + 1, (uint32_t)lapic_ids[0] << 24);
+  ioapic_write(io, IOAPIC_REDTBL(pin), lo);
+  spinlock_release(&ioapic_lock);
+}
+
+/* Done by every core. The PICs are still wired to LINT0 as an "external
+   interrupt"; they are masked, but even so we want nothing from them. */
+static void lapic_init_cpu() {
+  lapic_write(LAPIC_SVR, SVR_ENABLE | SPURIOUS_VECTOR);
+  lapic_write(LAPIC_TPR, 0);
+  lapic_write(LAPIC_LINT0, LVT_MASKED);
+}
+
+/******************************************************************************
+ * IPIs
+ *****************************************************************************/
+
+/* The interrupt command register is per core, and takes two writes. */
+static void send(uint8_t apic_id, uint32_t cmd) {
+  int state = get_interrupt_state();
+  disable_interrupts();
+  while (lapic_read(LAPIC_ICR_LO) & ICR_PENDING)
+    cpu_relax();
+  lapic_write(LAPIC_ICR_HI, (uint32_t)apic_id << 24);
+  lapic_write(LAPIC_ICR_LO, cmd);
+  set_interrupt_state(state);
+}
+
+static void post(mailbox_t *m, void *data) {
+  spinlock_acquire(&m->lock);
+  bool sent = false;
+  for (unsigned i = 0; i < m->n && !sent; ++i)
+    sent = m->data[(m->head + i) % MAILBOX_SZ] == data;
+  if (!sent) {
+    if (m->n == MAILBOX_SZ)
+      panic("IPI mailbox full!");
+    m->data[(m->head + m->n) % MAILBOX_SZ] = data;
+    ++m->n;
+  }
+  spinlock_release(&m->lock);
+}
+
+void send_ipi(int proc_id, void *data) {
+  int self = get_processor_id();
+  for (int i = 0; i < online; ++i) {
+    if (proc_id == IPI_ALL_BUT_THIS ? i == self :
+        proc_id != IPI_ALL && proc_id != i)
+      continue;
+    post(&mailboxes[i], data);
+    send(lapic_ids[i], ICR_FIXED | ICR_ASSERT | IPI_VECTOR);
+  }
+}
+
+bool apic_take_ipi(void **data) {
+  if (!num_cpus)
+    return false;
+
+  mailbox_t *m = &mailboxes[get_processor_id()];
+  if (m->n == 0)
+    return false;
+
+  spinlock_acquire(&m->lock);
+  bool taken = m->n != 0;
+  if (taken) {
+    *data = m->data[m->head];
+    m->head = (m->head + 1) % MAILBOX_SZ;
+    --m->n;
+  }
+  spinlock_release(&m->lock);
+  return taken;
+}
+
+/******************************************************************************
+ * Starting the other cores
+ *****************************************************************************/
+
+static volatile int timed_out;
+static void time_out(void *unused) {
+  timed_out = 1;
+}
+
+/* Waits up to 'ms' milliseconds (at the PIT's resolution) for core 'id' to
+   come online. The PIT only ticks with interrupts enabled. */
+static bool wait_for_core(int id, unsigned ms) {
+  int state = get_interrupt_state();
+  enable_interrupts();
+
+  timed_out = 0;
+  if (register_callback(ms, 0, &time_out, NULL) == -1)
+    timed_out = 1;
+  while (online == id && !timed_out)
+    cpu_relax();
+  unregister_callback(&time_out);
+
+  set_interrupt_state(state);
+  return online > id;
+}
+
+/* Where a core arrives from x86/trampoline.s, on its own stack and with
+   paging enabled. */
+static void ap_main() {
+  int id = online;
+  load_gdt(id);
+  load_idt();
+  lapic_init_cpu();
+  dbg("CPU %d started\n", id);
+
+  __sync_synchronize();
+  ++online;
+
+  uintptr_t unused;
+  switch_context(&unused, contexts[id]);
+  panic("Switched back to a CPU's startup context!");
+}
+
+int start_processor(int id, uintptr_t context) {
+  if (id <= 0 || id >= num_cpus || id != online)
+    return -1;
+  contexts[id] = context;
+  *per_cpu_ptr(&cpu_index, id) = id;
+
+  /* The trampoline must run from below 1MB. */
+  memcpy(LOW_MEM(AP_TRAMPOLINE), ap_trampoline,
+         ap_trampoline_end - ap_trampoline);
+  ap_params_t *params =
+    LOW_MEM(AP_TRAMPOLINE + (ap_params - ap_trampoline));
+  /* The core's per-CPU copy of the current address space (see vmm.c) was
+     taken from ours when per-CPU data was set up, before any switch. */
+  params->cr3 = read_cr3();
+  params->cr4 = read_cr4();
+  params->stack = (uint32_t)kmalloc(AP_STACK_SZ) + AP_STACK_SZ;
+  params->entry = (uint32_t)&ap_main;
+  __sync_synchronize();
+
+  /* INIT resets the core to wait for a startup IPI, whose vector is the
+     page it starts at. A second startup IPI is sent if the first was
+     missed. */
+  send(lapic_ids[id], ICR_INIT | ICR_ASSERT | ICR_LEVEL);
+  wait_for_core(id, INIT_MS);
+  for (unsigned i = 0; i < 2 && online == id; ++i) {
+    send(lapic_ids[id], ICR_STARTUP | (AP_TRAMPOLINE >> 12));
+    wait_for_core(id, i == 0 ? 2 : AP_TIMEOUT_MS);
+  }
+
+  /* The stack is not freed if the core did not start: it may yet. */
+  return (online > id) ? 0 : -1;
+}
+
+static int apic_init() {
+  for (unsigned i = 0; i < NUM_ISA_IRQS; ++i) {
+    isa_irqs[i].gsi = i;
+    isa_irqs[i].flags = 0;
+  }
+
+  madt_t *madt = find_madt();
+  if (!madt) {
+    dbg("No MADT - staying with the PICs.\n");
+    return 0;
+  }
+  parse_madt(madt);
+  unmap_table(&madt->h);
+
+  if (num_cpus == 0 || num_ioapics == 0) {
+    dbg("No APICs in the MADT - staying with the PICs.\n");
+    num_cpus = 0;
+    return 0;
+  }
+
+  /* MMIO should be uncached. The firmware's MTRRs already cover the APICs,
+     so ordinary mappings do. */
+  lapic = map_phys(lapic_phys, 0x400);
+  for (unsigned i = 0; i < num_ioapics; ++i) {
+    ioapic_t *io = &ioapics[i];
+    io->regs = map_phys(io->phys, 0x20);
+    io->n = ((ioapic_read(io, IOAPIC_VER) >> 16) & 0xFF) + 1;
+    for (unsigned j = 0; j < io->n; ++j)
+      ioapic_write(io, IOAPIC_REDTBL(j), REDIR_MASKED);
+  }
+
+  /* We are the first core. */
+  uint8_t self = lapic_read(LAPIC_ID) >> 24;
+  for (int i = 1; i < num_cpus; ++i) {
+    if (lapic_ids[i] == self) {
+      lapic_ids[i] = lapic_ids[0];
+      lapic_ids[0] = self;
+    }
+  }
+
+  for (int i = 0; i < num_cpus; ++i) {
+    cpu_ids[i] = i;
+    spinlock_init(&mailboxes[i].lock);
+  }
+  online = 1;
+
+  lapic_init_cpu();
+  set_irq_controller(&lapic_ack_irq, &ioapic_enable_irq);
+
+  dbg("%d cores, %d I/O APICs\n", num_cpus, num_ioapics);
+  return 0;
+}
+
+static prereq_t prereqs[] = { {"kmalloc",NULL}, {"interrupts",NULL},
+                              {NULL,NULL} };
+static module_t x run_on_startup = {
+  .name = "x86/apic",
+  .required = prereqs,
+  .load_after = NULL,
+  .init = &apic_init,
+  .fini = NULL
+};
@@ -0,0 +1,23 @@
+;; switch_context(uintptr_t *from, uintptr_t to)
+;;
+;; Only the registers the calling convention says a callee must preserve are
+;; saved, on the stack being switched from; everything else is already dead
+;; at the call. The layout must match init_context() in x86/hal.h.
+global switch_context:function switch_context.end-switch_context
+switch_context:
+        mov     eax, [esp+4]    ; First parameter = where to save our context
+        mov     edx, [esp+8]    ; Second = context to switch to
+
+        push    ebp
+        push    ebx
+        push    esi
+        push    edi
+        mov     [eax], esp
+
+        mov     esp, edx
+        pop     edi
+        pop     esi
+        pop     ebx
+        pop     ebp
+        ret
+.end:
@@ -2,6 +2,30 @@
 #include "x86/hal.h"
 #include "string.h"
 
+/* Replaces the page at 'v' with a copy of it in 'p2'. Kept out of line so
+   that the copy buffer is not on the stack while allocating, which may
+   reclaim. */
+static __attribute__((noinline)) void copy_page(uint32_t v, uint32_t p2,
+                                                unsigned f) {
+  /* We have to copy the page. In order to avoid a costly and
+     non-reentrant map/unmap pair to temporarily have them
+     both mapped into memory, copy first into a buffer on
+     the stack (this means the stack must be >4KB). */
+  uint8_t buffer[4096];
+
+  memcpy(buffer, (uint8_t*)v, 0x1000);
+
+  if (unmap(v, 1) == -1)
+    panic("unmap() failed during copy-on-write!");
+
+  if (map(v, p2, 1, f) == -1)
+    panic("map() failed during copy-on-write!");
+
+  memcpy((uint8_t*)v, buffer, 0x1000);
+
+  /* unmap() has already dropped our reference to the old page. */
+}
+
 bool cow_handle_page_fault(uintptr_t cr2, uintptr_t error_code) {
   unsigned flags;
 
@@ -9,32 +33,26 @@ bool cow_handle_page_fault(uintptr_t cr2, uintptr_t error_code) {
 
   if ((error_code & (X86_PRESENT|X86_WRITE)) &&
       p != ~0UL && (flags & PAGE_COW) ) {
-    /* Page was marked copy-on-write. */
-    uint32_t p2 = (uint32_t)alloc_page(PAGE_REQ_UNDER4GB);
-
-    /* We have to copy the page. In order to avoid a costly and 
-       non-reentrant map/unmap pair to temporarily have them
-       both mapped into memory, copy first into a buffer on
-       the stack (this means the stack must be >4KB). */
-    uint8_t buffer[4096];
-
-    uint32_t v = cr2 & 0xFFFFF000;
-    memcpy(buffer, (uint8_t*)v, 0x1000);
-    
-    if (unmap(v, 1) == -1)
-      panic("unmap() failed during copy-on-write!");
+    /* Page was marked copy-on-write. User pages are never touched with a
+       lock held, so copying one may swap others out to make room, as
+       swapping a page in does. */
+    int req = PAGE_REQ_UNDER4GB;
+    if (flags & X86_USER)
+      req |= PAGE_REQ_RECLAIM;
+    uint32_t p2 = (uint32_t)alloc_page(req);
+    if (p2 == ~0U)
+      panic("Out of memory during copy-on-write!");
+
+    /* If that slept, another thread may have copied the page meanwhile. */
+    if ((uint32_t)get_mapping(cr2, &flags) != p || !(flags & PAGE_COW)) {
+      free_page(p2);
+      return true;
+    }
 
     unsigned f = ((flags & X86_USER) ? PAGE_USER : 0) |
       ((flags & X86_EXECUTE) ? PAGE_EXECUTE : 0) |
       PAGE_WRITE;
-    if (map(v, p2, 1, f) == -1)
-      panic("map() failed during copy-on-write!");
-
-    memcpy((uint8_t*)v, buffer, 0x1000);
-
-    /* Mark the old page as having one less reference. */
-    cow_refcnt_dec(p);
-
+    copy_page(cr2 & 0xFFFFF000, p2, f);
     return true;
   }
   return false;
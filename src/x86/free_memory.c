@@ -54,10 +54,20 @@ static int free_memory() {
   for (i = 0; i < n; ++i)
     ranges_cpy[i] = ranges[i];
 
+  /* Time each phase so regressions in boot time are visible. */
+  uint64_t t0 = get_cycle_count();
   init_physical_memory_early(ranges, n, extent);
+  uint64_t t1 = get_cycle_count();
   init_virtual_memory(ranges, n);
+  uint64_t t2 = get_cycle_count();
   init_physical_memory();
+  uint64_t t3 = get_cycle_count();
   init_cow_refcnts(ranges, n);
+  uint64_t t4 = get_cycle_count();
+
+  kprintf("boot: pmm-early %u, vmm %u, pmm %u, cow %u (kcycles)\n",
+          (uint32_t)((t1 - t0) / 1000), (uint32_t)((t2 - t1) / 1000),
+          (uint32_t)((t3 - t2) / 1000), (uint32_t)((t4 - t3) / 1000));
 
   return 0;
 }
@@ -1,6 +1,7 @@
 #include "hal.h"
 #include "stdio.h"
 #include "string.h"
+#include "x86/smp.h"
 
 /**
 ===
@@ -136,11 +137,14 @@ typedef struct gdt_ptr {
       4. [0x18] A code descriptor for user mode.
       5. [0x20] A data descriptor for user mode.
       6. [0x28] A TSS descriptor, and we'll need one for every core (because each core will require a different kernel stack).
+      7. A data descriptor for every core, following the TSS descriptors, whose base is the offset of the core's per-CPU data (see percpu.h). Each core keeps its own in ``%fs``, so that ``%fs:var`` is its copy of ``var``.
+
+    We don't know how many cores there are until the APIC code finds them, which is long after the first core needs a GDT (see apic.c). So there are TSS and per-CPU descriptors for as many cores as we support; it only costs a few kilobytes.
 
     {*/
 
 static gdt_ptr_t gdt_ptr;
-static gdt_entry_t entries[MAX_CORES+5];
+static gdt_entry_t entries[MAX_CORES*2+5];
 static tss_entry_t tss_entries[MAX_CORES];
 
 unsigned num_gdt_entries, num_tss_entries;
@@ -169,13 +173,21 @@ static void print_tss_entry(unsigned i, tss_entry_t e) {
           i, e.esp0, e.ss0, e.cs, e.ss, e.ds, e.es, e.fs, e.gs);
 }
 
+/* Only the cores that exist are worth printing. */
+static unsigned num_cores() {
+  int n = get_num_processors();
+  return (n < 1) ? 1 : n;
+}
+
 static void print_gdt(const char *cmd, core_debug_state_t *states, int core) {
-  for (unsigned i = 0; i < num_gdt_entries; ++i)
+  for (unsigned i = 0; i < 5 + num_cores(); ++i)
     print_gdt_entry(i, entries[i]);
+  for (unsigned i = 0; i < num_cores(); ++i)
+    print_gdt_entry(i+num_tss_entries+5, entries[i+num_tss_entries+5]);
 }
 
 static void print_tss(const char *cmd, core_debug_state_t *states, int core) {
-  for (unsigned i = 0; i < num_tss_entries; ++i)
+  for (unsigned i = 0; i < num_cores(); ++i)
     print_tss_entry(i, tss_entries[i]);
 }
 
@@ -228,7 +240,29 @@ static void set_tss_entry(tss_entry_t *e) {
 #define TY_ACCESSED 1
 
 
-/** Finally we get to initialise the GDT. We create our 5 code/data descriptors and NumCores TSS descriptors. {*/
+/** The selector of a core's per-CPU data descriptor. {*/
+static uint32_t percpu_selector(int cpu) {
+  return (num_tss_entries + 5 + cpu) * sizeof(gdt_entry_t);
+}
+
+/** Loading the GDT is done once by every core: the first in ``init_gdt``, below, and the others as they start (see apic.c).
+
+    The 'limit' field of the GDT pointer is actually the *last valid addressable byte* of the GDT, so it is the size of the GDT - 1.
+
+    We use the ``lgdt`` instruction to load our GDT, then make sure all segment registers are set correctly; data segments to 0x10 and code to 0x08. Note that we can't set ``%cs`` directly - we have to perform a 'far jump' which performs a jump with change of segment. That's what the ``ljmp`` is for. Finally ``%fs`` is pointed at this core's per-CPU data. {*/
+void load_gdt(int cpu) {
+  __asm volatile("lgdt %0;"
+                 "mov  $0x10, %%ax;"
+                 "mov  %%ax, %%ds;"
+                 "mov  %%ax, %%es;"
+                 "mov  %%ax, %%fs;"
+                 "mov  %%ax, %%gs;"
+                 "ljmp $0x08, $1f;"
+                 "1:" : : "m" (gdt_ptr) : "eax");
+  __asm volatile("mov %0, %%fs" : : "r" (percpu_selector(cpu)));
+}
+
+/** Finally we get to initialise the GDT. We create our 5 code/data descriptors, MAX_CORES TSS descriptors and MAX_CORES per-CPU data descriptors. {*/
 static int init_gdt() {
   register_debugger_handler("print-gdt", "Print the GDT", &print_gdt);
   register_debugger_handler("print-tss", "Print all TSS entries", &print_tss);
@@ -240,39 +274,40 @@ static int init_gdt() {
   set_gdt_entry(&entries[3], 0,   ~0U,  TY_CODE|TY_READABLE, 1, 3,  1, 0, 1, 1);
   set_gdt_entry(&entries[4], 0,   ~0U,  TY_DATA_WRITABLE,    1, 3,  1, 0, 1, 1);
 
-  int num_processors = get_num_processors();
-  if (num_processors == -1)
-    num_processors = 1;
-  for (int i = 0; i < num_processors; ++i) {
+  for (int i = 0; i < MAX_CORES; ++i) {
     set_tss_entry(&tss_entries[i]);
     set_gdt_entry(&entries[i+5], (uint32_t)&tss_entries[i],
                                       /* Type                S  Dpl P  L  D  G*/
                   sizeof(tss_entry_t)-1, TY_CODE|TY_ACCESSED,0, 3,  1, 0, 0, 1);
   }
 
-  num_gdt_entries = num_processors + 5;
-  num_tss_entries = num_processors;
+  /** The per-CPU data descriptors start out flat, which is right for the first core - its per-CPU data is the 'percpu' section itself. The rest are set by set_percpu_offset(), below. {*/
+  for (int i = 0; i < MAX_CORES; ++i)
+    set_gdt_entry(&entries[i+MAX_CORES+5], 0,
+                  ~0U,  TY_DATA_WRITABLE,    1, 0,  1, 0, 1, 1);
 
-  /** Then we set up the GDT pointer struct, and inform the CPU about it.
+  num_gdt_entries = MAX_CORES * 2 + 5;
+  num_tss_entries = MAX_CORES;
 
-      The 'limit' field is actually the *last valid addressable byte* of the GDT, so it is the size of the GDT - 1.
-
-      We use the ``lgdt`` instruction to load our GDT, then make sure all segment registers are set correctly; data segments to 0x10 and code to 0x08. Note that we can't set ``%cs`` directly - we have to perform a 'far jump' which performs a jump with change of segment. That's what the ``ljmp`` is for. {*/
+  /** Then we set up the GDT pointer struct, and inform the CPU about it. {*/
   gdt_ptr.base = (uint32_t)&entries[0];
   gdt_ptr.limit = sizeof(gdt_entry_t) * num_gdt_entries - 1;
 
-  __asm volatile("lgdt %0;"
-                 "mov  $0x10, %%ax;"
-                 "mov  %%ax, %%ds;"
-                 "mov  %%ax, %%es;"
-                 "mov  %%ax, %%fs;"
-                 "mov  %%ax, %%gs;"
-                 "ljmp $0x08, $1f;"
-                 "1:" : : "m" (gdt_ptr) : "eax");
+  load_gdt(0);
 
   return 0;
 }
 
+/** Once the per-CPU data for a core has been copied, its descriptor is pointed at the copy. The CPU caches a descriptor when its selector is loaded, so if it is this core's we reload ``%fs``. {*/
+void set_percpu_offset(int cpu, uintptr_t offset) {
+  set_gdt_entry(&entries[cpu+num_tss_entries+5], offset,
+                ~0U,  TY_DATA_WRITABLE,    1, 0,  1, 0, 1, 1);
+
+  int id = get_processor_id();
+  if (cpu == ((id < 0) ? 0 : id))
+    __asm volatile("mov %0, %%fs" : : "r" (percpu_selector(cpu)));
+}
+
 static prereq_t prereqs[] = { {"console",NULL}, {"debugger",NULL}, {NULL,NULL} };
 static module_t x run_on_startup = {
   .name = "x86/gdt",
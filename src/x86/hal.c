@@ -27,6 +27,16 @@ void set_interrupt_state(int enable) {
     disable_interrupts();
 }
 
+void wait_for_interrupt() {
+  /* STI only takes effect after the next instruction, so an interrupt cannot
+     sneak in between the two and leave us halted. */
+  __asm__ volatile("sti; hlt");
+}
+
+uint64_t get_cycle_count() {
+  return rdtsc();
+}
+
 void trap() {
   __asm__ volatile("int $3");
 }
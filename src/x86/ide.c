@@ -16,6 +16,10 @@
 #define dbg(args...)
 #endif
 
+/* How long to wait for a DMA transfer to complete before assuming its
+   interrupt was lost. */
+#define IDE_TIMEOUT_MS 5000
+
 static void ide_describe(block_device_t *bdev, char *buf, unsigned bufsz) {
   ide_dev_t *dev = (ide_dev_t*)bdev->data;
 
@@ -148,6 +152,29 @@ static void dma_start_write(ide_dev_t *dev, uintptr_t buf,
   dma_setup(dev, buf, size, 1);
 }
 
+/* Waits for the transfer started on 'dev' to complete. If it times out, the
+   transfer is stopped and marked as failed. */
+static void dma_wait(ide_dev_t *dev, semaphore_t *sema) {
+  int timed_out = semaphore_timedwait(sema, IDE_TIMEOUT_MS) != 0;
+
+  /* The IRQ handler may be running on another CPU - it may even have come
+     in just as we gave up. Once we hold its lock it has either finished
+     with 'sema' or will find no operation to complete, so 'sema' can go
+     out of scope. */
+  spinlock_acquire(&dev->irq_lock);
+  if (timed_out && (dev->flags & IDE_FLAG_OP_IN_PROGRESS)) {
+    kprintf("ide: DMA transfer timed out!\n");
+    /* Abort the transfer, and clear any interrupt or error it left. */
+    outb(dev->busmaster+ATA_BUSMASTER_CMD, 0);
+    outb(dev->busmaster+ATA_BUSMASTER_STATUS,
+         ATA_BUSMASTER_IRQ | ATA_BUSMASTER_ERR);
+    dev->flags &= ~IDE_FLAG_OP_IN_PROGRESS;
+    dev->flags |= IDE_FLAG_ERROR;
+  }
+  dev->sema = NULL;
+  spinlock_release(&dev->irq_lock);
+}
+
 static int ide_read(block_device_t *bdev, uint64_t offset, void *buf, uint64_t len) {
   dbg("ide_read(%x, %x, %x)\n", (uint32_t)offset, buf, (uint32_t)len);
 
@@ -170,7 +197,7 @@ static int ide_read(block_device_t *bdev, uint64_t offset, void *buf, uint64_t l
 
   dma_start_read(dev, bufp, len, offset, &sema);
 
-  semaphore_wait(&sema);
+  dma_wait(dev, &sema);
   unsigned error = dev->flags & IDE_FLAG_ERROR;
 
   kprintf("ERROR: %d, buf[0] = %x\n", error, *(unsigned int*)buf);
@@ -202,7 +229,7 @@ static int ide_write(block_device_t *bdev, uint64_t offset, void *buf, uint64_t
 
   dma_start_write(dev, bufp, len, offset, &sema);
 
-  semaphore_wait(&sema);
+  dma_wait(dev, &sema);
   unsigned error = dev->flags & IDE_FLAG_ERROR;
 
   semaphore_signal(dev->lock);
@@ -224,8 +251,11 @@ static int dma_handle_irq(struct regs *r, void *p) {
   outb(dev->busmaster+ATA_BUSMASTER_STATUS, ATA_BUSMASTER_IRQ);
 
   /* Second, check if an operation is actually in progress. */
-  if ((dev->flags & IDE_FLAG_OP_IN_PROGRESS) == 0)
+  spinlock_acquire(&dev->irq_lock);
+  if ((dev->flags & IDE_FLAG_OP_IN_PROGRESS) == 0) {
+    spinlock_release(&dev->irq_lock);
     return 0;
+  }
 
   dbg("dma_handle_irq: was intended for this device.\n");
 
@@ -239,6 +269,7 @@ static int dma_handle_irq(struct regs *r, void *p) {
     dev->flags &= ~IDE_FLAG_OP_IN_PROGRESS;
 
     semaphore_signal(dev->sema);
+    spinlock_release(&dev->irq_lock);
 
     return 0;
   }
@@ -248,6 +279,7 @@ static int dma_handle_irq(struct regs *r, void *p) {
     outb(dev->busmaster+ATA_BUSMASTER_CMD, 0);
     dev->flags &= ~IDE_FLAG_OP_IN_PROGRESS;
     semaphore_signal(dev->sema);
+    spinlock_release(&dev->irq_lock);
 
     return 0;
   }
@@ -260,6 +292,7 @@ static int dma_handle_irq(struct regs *r, void *p) {
                    ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
   dev->next_addr += 4096;
   dev->n--;
+  spinlock_release(&dev->irq_lock);
 
   return 0;
 }
@@ -371,6 +404,7 @@ static block_device_t *probe_dev(uint16_t base, uint16_t control, uint16_t irq,
   dev->chip_select = chip_select;
   dev->busmaster = busmaster;
   dev->lock = bus_lock;
+  spinlock_init(&dev->irq_lock);
   dev->prdt = (ide_prdt_t*)vmspace_alloc(&kernel_vmspace, 0x1000,
                                          /*alloc_phys=*/1);
 
@@ -103,6 +103,7 @@
 #include "string.h"
 #include "x86/io.h"
 #include "x86/regs.h"
+#include "x86/smp.h"
 
 #define NUM_TRAP_STRS 20
 static const char *trap_strs[NUM_TRAP_STRS] = {
@@ -185,9 +186,10 @@ extern ty isr0, isr1, isr2, isr3, isr4, isr5, isr6, isr7, isr8, isr9,
   isr10, isr11, isr12, isr13, isr14, isr15, isr16, isr17, isr18, isr19,
   isr20, isr21, isr22, isr23, isr24, isr25, isr26, isr27, isr28, isr29,
   isr30, isr31, isr32, isr33, isr34, isr35, isr36, isr37, isr38, isr39,
-  isr40, isr41, isr42, isr43, isr44, isr45, isr46, isr47;
+  isr40, isr41, isr42, isr43, isr44, isr45, isr46, isr47, isr48,
+  isr_spurious;
 
-#define NUM_HANDLERS 48
+#define NUM_HANDLERS 49
 #define MAX_HANDLERS_PER_INT 4
 static void **_handlers[NUM_HANDLERS] = {
   &isr0, &isr1, &isr2, &isr3, &isr4, &isr5, &isr6,
@@ -196,7 +198,7 @@ static void **_handlers[NUM_HANDLERS] = {
   &isr21, &isr22, &isr23, &isr24, &isr25, &isr26, &isr27,
   &isr28, &isr29, &isr30, &isr31, &isr32, &isr33, &isr34,
   &isr35, &isr36, &isr37, &isr38, &isr39, &isr40, &isr41,
-  &isr42, &isr43, &isr44, &isr45, &isr46, &isr47};
+  &isr42, &isr43, &isr44, &isr45, &isr46, &isr47, &isr48};
 
 static idt_entry_t entries[256];
 static idt_ptr_t   idt_ptr;
@@ -359,6 +361,25 @@ static void pic_ack_irq(unsigned num) {
 static void (*ack_irq)(unsigned) = 0;
 static void (*enable_irq)(uint8_t, unsigned) = 0;
 
+/** The PICs are only where we start. On a machine with APICs (see apic.c) they take over once they have been found, and the PICs are masked entirely. Any IRQ that already has a handler must be enabled on the new controller. { */
+
+void set_irq_controller(void (*ack)(unsigned),
+                        void (*enable)(uint8_t, unsigned)) {
+  int state = get_interrupt_state();
+  disable_interrupts();
+
+  outb(PIC1_DATA, 0xFF);
+  outb(PIC2_DATA, 0xFF);
+
+  ack_irq = ack;
+  enable_irq = enable;
+  for (unsigned i = 32; i < IPI_VECTOR; ++i)
+    if (num_handlers[i])
+      enable_irq(i-32, 1);
+
+  set_interrupt_state(state);
+}
+
 /** Now we get to initialise interrupt handling. { */
 
 static int init_idt() {
@@ -373,24 +394,27 @@ static int init_idt() {
   memset((uint8_t*)entries, 0, sizeof(idt_entry_t)*256);
   for (unsigned i = 0; i < NUM_HANDLERS; ++i)
     set_idt_entry(&entries[i], (uint32_t)_handlers[i], /*CS=*/0x08, /*DPL=*/0x00);
+  set_idt_entry(&entries[SPURIOUS_VECTOR], (uint32_t)&isr_spurious,
+                /*CS=*/0x08, /*DPL=*/0x00);
 
-  /** Then we inform the processor about the table in the same way we did for the GDT. { */
+  /** Then we inform the processor about the table in the same way we did for the GDT. Every core shares the one table, so the others load it as they start. { */
 
   idt_ptr.limit = sizeof(idt_entry_t) * 256 - 1;
   idt_ptr.base  = (uint32_t)&entries[0];
 
-  __asm volatile("lidt %0" : : "m" (idt_ptr));
+  load_idt();
 
-  /* FIXME: Implement APIC */
-  if (1) {
-    pic_init();
-    ack_irq = &pic_ack_irq;
-    enable_irq = &pic_enable_irq;
-  }
+  pic_init();
+  ack_irq = &pic_ack_irq;
+  enable_irq = &pic_enable_irq;
 
   return 0;
 }
 
+void load_idt() {
+  __asm volatile("lidt %0" : : "m" (idt_ptr));
+}
+
 /** All that is left is some non-machine-specific code that will register and unregister interrupt handlers. If we are registering a handler for an IRQ, this function ensures that it is unmasked and enabled. { */
 
 int register_interrupt_handler(int num, interrupt_handler_t handler, void *p) {
@@ -401,7 +425,7 @@ int register_interrupt_handler(int num, interrupt_handler_t handler, void *p) {
   handlers[num][num_handlers[num]].handler = handler;
   handlers[num][num_handlers[num]++].p = p;
 
-  if (num >= 32 && enable_irq)
+  if (num >= 32 && num < IPI_VECTOR && enable_irq)
     enable_irq(num-32, 1);
 
   return 0;
@@ -424,7 +448,7 @@ int unregister_interrupt_handler(int num, interrupt_handler_t handler, void *p)
   if (found) {
     --num_handlers[num];
 
-    if (num_handlers[num] == 0 && num >= 32 && enable_irq)
+    if (num_handlers[num] == 0 && num >= 32 && num < IPI_VECTOR && enable_irq)
       enable_irq(num-32, 0);
     
     return 0;
@@ -444,11 +468,25 @@ void interrupt_handler(x86_regs_t *regs) {
   /** The first thing we do is ensure any IRQ is ACK'd. { */
   ack_irq(num);
 
-  /** Then we search for registered interrupt handlers and call them all. { */
+  /** An IPI's data waits in the receiving core's mailbox (see apic.c), and several IPIs may be taken as one interrupt. The handlers are called for each in turn, with its data in the otherwise unused error code. { */
+  if (num == IPI_VECTOR) {
+    void *data;
+    while (apic_take_ipi(&data)) {
+      regs->error_code = (uint32_t)data;
+      for (unsigned i = 0, e = num_handlers[num]; i != e; ++i)
+        handlers[num][i].handler(regs, handlers[num][i].p);
+    }
+    interrupt_exit();
+    return;
+  }
+
+  /** Then we search for registered interrupt handlers and call them all. Once they all have, an IRQ is the kernel's chance to switch threads if one of them asked it to (see ``interrupt_exit``). Exceptions can be taken with interrupts disabled, so are not. { */
   if (num_handlers[num]) {
     for (unsigned i = 0, e = num_handlers[num];
          i != e; ++i)
       handlers[num][i].handler(regs, handlers[num][i].p);
+    if (num >= 32)
+      interrupt_exit();
   } else if (num == 3) {
     debugger_trap(regs);
   } else {
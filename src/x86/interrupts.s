@@ -40,9 +40,9 @@ ISR_ERRCODE   12
 ISR_ERRCODE   13
 ISR_ERRCODE   14
 
-        ;; Repeat ISR_NOERRCODE's up to interrupt 48.
+        ;; Repeat ISR_NOERRCODE's up to interrupt 48, the IPI vector.
 %assign i 15
-%rep 48-15
+%rep 49-15
 ISR_NOERRCODE i
 %assign i i+1
 %endrep
@@ -52,7 +52,7 @@ extern interrupt_handler
 ;;; The common interrupt handler does several things.
 ;;; 
 ;;; 1. Saves all of the register state in the machine. This is done using the ``pusha`` instruction.
-;;; 2. Ensures all segment registers are set to kernel data segments.
+;;; 2. Ensures all segment registers are set to kernel data segments - except ``%fs``, which always points at this CPU's per-CPU data (see percpu.h), so is left alone.
 ;;; 3. Pushes ``%esp`` on to the stack. This serves as a pointer to the registers we just pushed (and the processor pushed some state for us too) for the C function ``interrupt_handler``.
 ;;; 4. After the C function returns, it resets the data segments to what they were before, restores all registers it saved and pops the error code and interrupt number from the stack.
 ;;; 5. It then performs an interrupt return ``iret`` to continue execution. {
@@ -67,7 +67,6 @@ isr_common:
         mov ax, 0x10            ; 0x10 is the kernel data selector.
         mov ds, ax
         mov es, ax
-        mov fs, ax
         mov gs, ax
 
         push esp                ; Push pointer to the stack as x86_regs_t* arg.
@@ -77,7 +76,6 @@ isr_common:
         pop eax
         mov ds, ax
         mov es, ax
-        mov fs, ax
         mov gs, ax
 
         popa
@@ -85,3 +83,12 @@ isr_common:
 
         iret
 .end:
+
+;;; The local APIC raises a *spurious* interrupt when an interrupt goes away
+;;; before it can be delivered (see apic.c). There is nothing to do, and it
+;;; must not be acknowledged, so its handler just returns. {
+
+global isr_spurious:function isr_spurious.end-isr_spurious
+isr_spurious:
+        iret
+.end:
@@ -0,0 +1,189 @@
+/* The programmable interval timer (PIT) drives register_callback().
+
+   Channel 0 is set to fire IRQ0 every millisecond. Every tick counts down the
+   registered callbacks and runs any that have expired. Only the boot CPU
+   receives IRQ0.
+
+   When the boot CPU goes idle the periodic tick is replaced by a one-shot
+   count that expires when the next callback is due, and on waking the
+   callbacks are caught up with the time that passed. */
+
+#include "hal.h"
+#include "stdio.h"
+#include "x86/io.h"
+
+#ifdef DEBUG_pit
+# define dbg(args...) kprintf("pit: " args)
+#else
+# define dbg(args...)
+#endif
+
+#define PIT_CHANNEL0 0x40
+#define PIT_CMD      0x43
+/* Channel 0, access lo/hi byte, mode 2 (rate generator), binary. */
+#define PIT_CMD_RATE 0x34
+/* Channel 0, access lo/hi byte, mode 0 (interrupt on terminal count). */
+#define PIT_CMD_ONESHOT 0x30
+/* Channel 0, latch the current count. */
+#define PIT_CMD_LATCH 0x00
+/* The PIT's input clock, in Hz. */
+#define PIT_FREQ     1193182
+#define TICK_HZ      1000
+#define DIVISOR      (PIT_FREQ / TICK_HZ)
+/* The longest a one-shot count can last - the counter is 16 bits. */
+#define MAX_ONESHOT_MS (0xFFFF / DIVISOR)
+
+#define MAX_CALLBACKS 16
+
+typedef struct callback {
+  void (*fn)(void*);
+  void *data;
+  uint32_t period, remaining;
+  int periodic;
+} callback_t;
+
+static callback_t callbacks[MAX_CALLBACKS];
+static spinlock_t lock = SPINLOCK_RELEASED;
+
+/* The count the one-shot timer was started with, or zero if ticking. */
+static uint32_t oneshot_count;
+static volatile int oneshot_fired;
+
+static void start(uint8_t cmd, uint16_t count) {
+  outb(PIT_CMD, cmd);
+  outb(PIT_CHANNEL0, count & 0xFF);
+  outb(PIT_CHANNEL0, count >> 8);
+}
+
+static uint16_t read_count() {
+  outb(PIT_CMD, PIT_CMD_LATCH);
+  uint16_t lo = inb(PIT_CHANNEL0);
+  return lo | (inb(PIT_CHANNEL0) << 8);
+}
+
+int register_callback(uint32_t num_millis, int periodic, void (*cb)(void*),
+                      void *data) {
+  if (num_millis == 0 || cb == NULL)
+    return -1;
+
+  spinlock_acquire(&lock);
+  for (unsigned i = 0; i < MAX_CALLBACKS; ++i) {
+    if (callbacks[i].fn)
+      continue;
+    callbacks[i].fn = cb;
+    callbacks[i].data = data;
+    callbacks[i].period = callbacks[i].remaining = num_millis;
+    callbacks[i].periodic = periodic;
+    spinlock_release(&lock);
+    dbg("register_callback(%d, %d, %x) -> %d\n", num_millis, periodic, cb, i);
+    return i;
+  }
+  spinlock_release(&lock);
+  return -1;
+}
+
+int unregister_callback(void (*cb)(void*)) {
+  int ret = -1;
+  spinlock_acquire(&lock);
+  for (unsigned i = 0; i < MAX_CALLBACKS; ++i) {
+    if (callbacks[i].fn == cb) {
+      callbacks[i].fn = NULL;
+      ret = 0;
+    }
+  }
+  spinlock_release(&lock);
+  return ret;
+}
+
+int timer_idle_enter(void (*ignore)(void*)) {
+  /* Only the boot CPU takes IRQ0. */
+  if (get_processor_id() > 0)
+    return -1;
+
+  uint32_t next = MAX_ONESHOT_MS;
+  spinlock_acquire(&lock);
+  for (unsigned i = 0; i < MAX_CALLBACKS; ++i)
+    if (callbacks[i].fn && callbacks[i].fn != ignore &&
+        callbacks[i].remaining < next)
+      next = callbacks[i].remaining;
+  spinlock_release(&lock);
+
+  /* Due at the next tick anyway. If nothing is due within MAX_ONESHOT_MS,
+     we wake up then and go back to sleep. */
+  if (next <= 1)
+    return -1;
+
+  dbg("idle for up to %dms\n", next);
+  oneshot_fired = 0;
+  oneshot_count = next * DIVISOR;
+  start(PIT_CMD_ONESHOT, oneshot_count);
+  return 0;
+}
+
+void timer_idle_exit() {
+  /* Once it has expired, the counter wraps around and carries on counting
+     down, so it is only meaningful if the IRQ has not fired. */
+  uint32_t count = read_count();
+  uint32_t elapsed = (oneshot_fired || count > oneshot_count) ?
+    oneshot_count : oneshot_count - count;
+  uint32_t ms = elapsed / DIVISOR;
+
+  oneshot_count = 0;
+  start(PIT_CMD_RATE, DIVISOR);
+
+  spinlock_acquire(&lock);
+  for (unsigned i = 0; i < MAX_CALLBACKS; ++i) {
+    callback_t *c = &callbacks[i];
+    if (c->fn)
+      c->remaining = (c->remaining > ms) ? c->remaining - ms : 1;
+  }
+  spinlock_release(&lock);
+}
+
+static int pit_handle_irq(struct regs *r, void *p) {
+  callback_t due[MAX_CALLBACKS];
+  unsigned n = 0;
+
+  /* The end of an idle period - timer_idle_exit() does the accounting. */
+  if (oneshot_count) {
+    oneshot_fired = 1;
+    return 0;
+  }
+
+  spinlock_acquire(&lock);
+  for (unsigned i = 0; i < MAX_CALLBACKS; ++i) {
+    callback_t *c = &callbacks[i];
+    if (!c->fn || --c->remaining != 0)
+      continue;
+    due[n++] = *c;
+    if (c->periodic)
+      c->remaining = c->period;
+    else
+      c->fn = NULL;
+  }
+  spinlock_release(&lock);
+
+  /* Callbacks may register and unregister callbacks, so they are run
+     without the lock held. Any preemption they ask for is taken once they
+     all have run (see interrupt_exit()). */
+  for (unsigned i = 0; i < n; ++i)
+    due[i].fn(due[i].data);
+  return 0;
+}
+
+static int pit_init() {
+  start(PIT_CMD_RATE, DIVISOR);
+
+  register_interrupt_handler(IRQ(0), &pit_handle_irq, NULL);
+  enable_interrupts();
+  return 0;
+}
+
+static prereq_t prereqs[] = { {"interrupts",NULL}, {NULL,NULL} };
+static module_t x run_on_startup = {
+  .name = "x86/pit",
+  .required = prereqs,
+  .load_after = NULL,
+  .init = &pit_init,
+  .fini = NULL
+};
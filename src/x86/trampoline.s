@@ -0,0 +1,75 @@
+;; Where the other cores start.
+;;
+;; A core started by a startup IPI (see apic.c) begins in 16-bit real mode at
+;; the start of a page below 1MB. This code is copied to AP_TRAMPOLINE for
+;; it, followed by the parameters apic.c fills in, and is written to run
+;; there rather than where it is linked - every address is its offset from
+;; ap_trampoline, added to AP_TRAMPOLINE.
+;;
+;; It switches to protected mode with a GDT of its own, which has the same
+;; code and data selectors as the kernel's, then turns on paging with the
+;; kernel's page directory. That still maps the bottom 4MB where they are
+;; (see vmm.c), so we can carry on here until we jump to the entry point
+;; with the stack we were given, at its higher-half address. That loads the
+;; real GDT and IDT.
+
+AP_TRAMPOLINE equ 0x8000
+%define REL(x) (AP_TRAMPOLINE + (x) - ap_trampoline)
+
+bits 16
+global ap_trampoline
+ap_trampoline:
+        cli
+        xor     ax, ax
+        mov     ds, ax
+        o32 lgdt [REL(gdt_ptr)]
+
+        mov     eax, cr0
+        or      eax, 1          ; Protection enable
+        mov     cr0, eax
+        jmp     dword 0x08:REL(.protected)
+
+bits 32
+.protected:
+        mov     ax, 0x10
+        mov     ds, ax
+        mov     es, ax
+        mov     fs, ax
+        mov     gs, ax
+        mov     ss, ax
+
+        mov     eax, [REL(ap_cr4)]
+        mov     cr4, eax
+        mov     eax, [REL(ap_cr3)]
+        mov     cr3, eax
+        mov     eax, cr0
+        or      eax, 0x80010000 ; Paging enable, write protect (as vmm.c)
+        mov     cr0, eax
+
+        mov     esp, [REL(ap_stack)]
+        mov     eax, [REL(ap_entry)]
+        call    eax
+.hang:
+        cli
+        hlt
+        jmp     .hang
+
+align 8
+gdt:
+        dq      0
+        dq      0x00CF9A000000FFFF ; 0x08: Flat 32-bit code, ring 0
+        dq      0x00CF92000000FFFF ; 0x10: Flat 32-bit data, ring 0
+gdt_ptr:
+        dw      gdt_ptr - gdt - 1
+        dd      REL(gdt)
+
+        ;; The parameters, as ap_params_t in apic.c.
+align 4
+global ap_params
+ap_params:
+ap_cr3:   dd 0
+ap_cr4:   dd 0
+ap_stack: dd 0
+ap_entry: dd 0
+global ap_trampoline_end
+ap_trampoline_end:
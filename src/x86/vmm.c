@@ -112,10 +112,14 @@ We define a set of constants for the flags available in a PTE/PDE. We use one of
 
 #include "hal.h"
 #include "mmap.h"
+#include "percpu.h"
 #include "stdio.h"
 #include "string.h"
+#include "swap.h"
+#include "vfs.h"
 #include "x86/io.h"
 #include "x86/regs.h"
+#include "x86/smp.h"
 
 #ifdef DEBUG_vmm
 # define dbg(args...) kprintf("vmm: " args)
@@ -124,9 +128,11 @@ We define a set of constants for the flags available in a PTE/PDE. We use one of
 #endif
 
 /**
-   We defined the struct ``address_space_t`` in our platform-specific HAL header, to just be a pointer to a 32-bit integer (for the page directory) and a spinlock to serialize accesses to the page tables. { */
+   We defined the struct ``address_space_t`` in our platform-specific HAL header, to just be a pointer to a 32-bit integer (for the page directory) and a spinlock to serialize accesses to the page tables.
 
-static address_space_t *current = NULL;
+   Every core has its own ``%cr3``, so which address space is current is a per-CPU variable (see percpu.h). { */
+
+static PERCPU_DEFINE(address_space_t *, current) = NULL;
 
 static spinlock_t global_vmm_lock = SPINLOCK_RELEASED;
 
@@ -151,17 +157,38 @@ static int to_x86_flags(int flags) {
 }
 
 address_space_t *get_current_address_space() {
-  return current;
+  return this_cpu_read(current);
 }
 
 /**
-   Now we can write the code to inform the CPU about a page directory. To do this, we write the (**physical**) address of the directory to the ``%cr3`` register, along with the access flags PRESENT and WRITEable. { */
+   Now we can write the code to inform the CPU about a page directory. To do this, we write the (**physical**) address of the directory to the ``%cr3`` register, along with the access flags PRESENT and WRITEable.
+
+   Writing ``%cr3`` is not free - as well as the write itself, it flushes every non-global entry in the TLB, so every access afterwards pays for a page table walk until the TLB warms up again. If we are asked to switch to the address space we are already in (which is the common case when switching between two kernel threads) there is nothing to do, so we skip the write entirely. { */
 
 int switch_address_space(address_space_t *dest) {
+  if (dest == this_cpu_read(current))
+    return 0;
+
   write_cr3((uintptr_t)dest->directory | X86_PRESENT | X86_WRITE);
+  *this_cpu_ptr(&current) = dest;
   return 0;
 }
 
+/**
+   Kernel space is mapped identically in every address space (``clone_address_space`` shares the kernel page tables rather than copying them), so there is no need for a ``%cr3`` write to throw away its TLB entries. If the CPU supports it, we mark every kernel mapping as *global* (bit 8 of the page table entry), and set the PGE bit in ``%cr4``. Global entries survive a ``%cr3`` write and are only removed by an explicit ``invlpg``, which ``unmap`` already does.
+
+   ``global_flag`` holds the bit we OR into kernel page table entries - it stays zero if the CPU does not support global pages, as setting the bit is then reserved.
+
+   .. note::
+
+     Newer CPUs can also tag TLB entries with a *process-context identifier* (PCID), so that switching between user address spaces need not flush them either. PCIDs can only be enabled (``CR4.PCIDE``) in IA-32e (long) mode, however, so they are not available to this 32-bit kernel even when CPUID advertises them. { */
+
+static unsigned global_flag = 0;
+
+static int is_global_addr(uintptr_t v) {
+  return v >= MMAP_KERNEL_START && v < MMAP_KERNEL_END;
+}
+
 /**
 "The recursive page directory trick"
 ====================================
@@ -253,8 +280,9 @@ static void ensure_page_table_mapped(uintptr_t v) {
 /** The next helper function merely performs a mapping of one page. You can ignore the code referring to "cow" (copy-on-write) - we'll get back to that in a later chapter! { */
 
 static int map_one_page(uintptr_t v, uint64_t p, unsigned flags) {
+  address_space_t *as = this_cpu_read(current);
   dbg("map: getting lock...\n");
-  spinlock_acquire(&current->lock);
+  spinlock_acquire(&as->lock);
   dbg("map: %x -> %x (flags %x)\n", v, (uint32_t)p, flags);
   /* Quick sanity check - a page with CoW must not be writable. */
   if (flags & PAGE_COW) {
@@ -271,9 +299,9 @@ static int map_one_page(uintptr_t v, uint64_t p, unsigned flags) {
   }
 
   *PAGE_TABLE_ENTRY(RPDT_BASE, v) = (p & 0xFFFFF000) |
-    to_x86_flags(flags) | X86_PRESENT;
+    to_x86_flags(flags) | X86_PRESENT | (is_global_addr(v) ? global_flag : 0);
   dbg("map: About to release spinlock\n");
-  spinlock_release(&current->lock);
+  spinlock_release(&as->lock);
   dbg("map: released spinlock\n");
   return 0;
 }
@@ -291,11 +319,70 @@ int map(uintptr_t v, uint64_t p, int num_pages, unsigned flags) {
   return 0;
 }
 
+/** Unmapping, and downgrading a mapping, have a problem that mapping does not: the CPU may have cached the old entry in its TLB (see below), and each core has a TLB of its own. Once more than one core is running, every core that might have cached the entry must drop it before the change can be relied upon. The usual way to do this is a *TLB shootdown*: we interrupt the other cores with an IPI, and wait until each has invalidated the page.
+
+    One shootdown is in flight at a time. ``shootdown_pending`` has an entry for every core that has yet to invalidate ``shootdown_addr``, which it clears once it has. A core waiting to start a shootdown of its own may have interrupts disabled, so cannot take the IPI - it answers the one in flight while it waits instead. The same goes for a core spinning on a lock with interrupts disabled: the initiator may be the one holding that lock, so the lock code answers through ``ipi_poll`` while it spins. { */
+
+static volatile uintptr_t shootdown_addr;
+static volatile uint8_t shootdown_pending[MAX_CORES];
+static volatile int shootdown_busy;
+
+static void invalidate_local(uintptr_t v) {
+  uintptr_t *pv = (uintptr_t*)v;
+  __asm__ volatile("invlpg %0" : : "m" (*pv));
+}
+
+/* Does this core's part of the shootdown in flight, if it has one. */
+static void shootdown_poll() {
+  int cpu = get_processor_id();
+  if (cpu < 0 || !shootdown_pending[cpu])
+    return;
+  invalidate_local(shootdown_addr);
+  __sync_synchronize();
+  shootdown_pending[cpu] = 0;
+}
+
+void ipi_poll() {
+  shootdown_poll();
+}
+
+static int shootdown_ipi(x86_regs_t *regs, void *ptr) {
+  if (get_ipi_data(regs) == (void*)&shootdown_addr)
+    shootdown_poll();
+  return 0;
+}
+
+/* Invalidates 'v' in the TLB of every core. */
+static void invalidate(uintptr_t v) {
+  invalidate_local(v);
+
+  int n = apic_num_online();
+  if (n <= 1)
+    return;
+
+  while (__sync_lock_test_and_set(&shootdown_busy, 1)) {
+    shootdown_poll();
+    cpu_relax();
+  }
+  int self = get_processor_id();
+  shootdown_addr = v;
+  for (int i = 0; i < n; ++i)
+    shootdown_pending[i] = (i != self);
+  __sync_synchronize();
+  send_ipi(IPI_ALL_BUT_THIS, (void*)&shootdown_addr);
+
+  for (int i = 0; i < n; ++i)
+    while (shootdown_pending[i])
+      cpu_relax();
+  __sync_lock_release(&shootdown_busy);
+}
+
 /** Unmapping a page is actually simpler, because we do not have to potentially map
     a page table also. { */
 
 static int unmap_one_page(uintptr_t v) {
-  spinlock_acquire(&current->lock);
+  address_space_t *as = this_cpu_read(current);
+  spinlock_acquire(&as->lock);
 
   /** We do sanity checks to ensure what we're unmapping actually exists, else we'll
       get a page fault somewhere down the line... { */
@@ -304,13 +391,21 @@ static int unmap_one_page(uintptr_t v) {
     panic("Tried to unmap a page that doesn't have its table mapped!");
 
   uint32_t *pte = PAGE_TABLE_ENTRY(RPDT_BASE, v);
-  if ((*pte & X86_PRESENT) == 0)
-    panic("Tried to unmap a page that isn't mapped!");
+  if ((*pte & X86_PRESENT) == 0) {
+    /* A non-present entry may still hold a swap entry, in which case there
+       is no physical page to unmap but the swap slot must be released. */
+    if (*pte == 0)
+      panic("Tried to unmap a page that isn't mapped!");
+    swap_free_entry(*pte >> 1);
+    *pte = 0;
+    spinlock_release(&as->lock);
+    return 0;
+  }
 
   /** Again, ignore this stuff about copy-on-write, we'll cover it later. { */
 
   uint32_t p = *pte & 0xFFFFF000;
-  if (*pte & X86_COW)
+  if (*pte & (X86_COW|X86_SHARED))
     cow_refcnt_dec(p);
 
   /** We can simply set the entry to zero to unmap it. However, this isn't all we need to do.
@@ -322,14 +417,14 @@ static int unmap_one_page(uintptr_t v) {
       The X86 has an instruction for this: ``invlpg`` (invalidate page). It takes a virtual address
       as an argument, although GCC's inline assembly syntax means we need to pass it as a
       dereferenced pointer, which is why we re-cast ``v`` to a pointer type here and dereference
-      it in the inline assembly statement. { */
+      it in the inline assembly statement.
+
+      That only invalidates this core's TLB, though, so ``invalidate()`` (see below) has the other cores do the same. It waits for them, so is called once the lock is released - a core spinning for the lock with interrupts disabled could never answer. { */
   *pte = 0;
+  spinlock_release(&as->lock);
 
   /* Invalidate TLB entry. */
-  uintptr_t *pv = (uintptr_t*)v;
-  __asm__ volatile("invlpg %0" : : "m" (*pv));
-
-  spinlock_release(&current->lock);
+  invalidate(v);
   return 0;
 }
 
@@ -361,10 +456,16 @@ static int page_fault(x86_regs_t *regs, void *ptr) {
   /* Get the faulting address from the %cr2 register. */
   uint32_t cr2 = read_cr2();
 
-  /** Ignore this copy-on-write stuff for now. { */
+  /** Ignore this copy-on-write and swap stuff for now. { */
   if (cow_handle_page_fault(cr2, regs->error_code))
     return 0;
 
+  if ((regs->error_code & X86_PRESENT) == 0 && swap_handle_page_fault(cr2))
+    return 0;
+
+  if ((regs->error_code & X86_PRESENT) == 0 && vfs_mmap_handle_page_fault(cr2))
+    return 0;
+
   /* Just print out a panic message and trap to the debugger if one
      is available. If not, ``debugger_trap()`` will just spin
      infinitely. */
@@ -401,6 +502,51 @@ uint64_t get_mapping(uintptr_t v, unsigned *flags) {
   return *page_table_entry & 0xFFFFF000;
 }
 
+/** Swapped-out pages are represented by a non-present page table entry. The CPU ignores every other bit of a non-present entry, so we are free to store the swap entry in bits 1-31. { */
+
+int set_swap_entry(uintptr_t v, uint32_t entry) {
+  if (!is_mapped(v))
+    return -1;
+
+  address_space_t *as = this_cpu_read(current);
+  spinlock_acquire(&as->lock);
+  uint32_t *pte = PAGE_TABLE_ENTRY(RPDT_BASE, v);
+  *pte = entry << 1;
+  spinlock_release(&as->lock);
+
+  invalidate(v);
+  return 0;
+}
+
+uint32_t get_swap_entry(uintptr_t v) {
+  if ((*PAGE_DIR_ENTRY(RPDT_BASE, v) & X86_PRESENT) == 0)
+    return 0;
+
+  uint32_t pte = *PAGE_TABLE_ENTRY(RPDT_BASE, v);
+  if (pte & X86_PRESENT)
+    return 0;
+  return pte >> 1;
+}
+
+/** The CPU sets the ACCESSED bit in a page table entry whenever it uses it for a translation. To see whether the page is touched again we clear the bit, and must also remove the entry from the TLB - otherwise the CPU will keep using its cached translation and never set the bit again. { */
+
+int test_and_clear_accessed(uintptr_t v) {
+  if (!is_mapped(v))
+    return 0;
+
+  address_space_t *as = this_cpu_read(current);
+  spinlock_acquire(&as->lock);
+  uint32_t *pte = PAGE_TABLE_ENTRY(RPDT_BASE, v);
+  int accessed = (*pte & X86_ACCESSED) ? 1 : 0;
+  if (accessed)
+    *pte &= ~X86_ACCESSED;
+  spinlock_release(&as->lock);
+
+  if (accessed)
+    invalidate(v);
+  return accessed;
+}
+
 int is_mapped(uintptr_t v) {
   unsigned flags;
   return get_mapping(v, &flags) != ~0ULL;
@@ -432,7 +578,7 @@ int init_virtual_memory() {
 
   spinlock_init(&a.lock);
   
-  current = &a;
+  *this_cpu_ptr(&current) = &a;
 
   /* We normally can't write directly to the page directory because it will
      be in physical memory that isn't mapped. However, the initial directory
@@ -441,28 +587,37 @@ int init_virtual_memory() {
   /* Recursive page directory trick - map the page directory onto itself. */
   a.directory[1023] = (uint32_t)a.directory | X86_PRESENT | X86_WRITE;
 
-  /* Ensure that page tables are allocated for the whole of kernel space. */
-  uint32_t *last_table = 0;
-  for (uint64_t addr = MMAP_KERNEL_START; addr < MMAP_KERNEL_END; addr += 0x1000) {
+  /* Ensure that page tables are allocated for the whole of kernel space.
+     Each page directory entry covers PAGE_TABLE_SIZE bytes, so step by
+     that rather than visiting every page. */
+  for (uint64_t addr = MMAP_KERNEL_START; addr < MMAP_KERNEL_END;
+       addr += PAGE_TABLE_SIZE) {
     uint32_t *pde = PAGE_DIR_ENTRY(RPDT_BASE, (uint32_t)addr);
-    if (pde != last_table) {
-      if ((*pde & X86_PRESENT) == 0) {
-        *pde = early_alloc_page() | X86_PRESENT | X86_WRITE;
+    if ((*pde & X86_PRESENT) == 0) {
+      *pde = early_alloc_page() | X86_PRESENT | X86_WRITE;
 
-        memset(PAGE_TABLE_ENTRY(RPDT_BASE, (uint32_t)addr), 0, 0x1000);
-      }
-
-      last_table = pde;
+      memset(PAGE_TABLE_ENTRY(RPDT_BASE, (uint32_t)addr), 0, 0x1000);
     }
   }
 
-  /* Register the page fault handler. */
+  /* Register the page fault handler, and for the other cores' TLB
+     shootdowns. */
   register_interrupt_handler(14, &page_fault, NULL);
+  register_interrupt_handler(get_ipi_interrupt_num(), &shootdown_ipi, NULL);
 
   /* Enable write protection, which allows page faults for read-only addresses
      in kernel mode. We need this for copy-on-write. */
   write_cr0( read_cr0() | CR0_WP );
 
+  /* Enable global pages if the CPU supports them, so that kernel TLB entries
+     survive address space switches. */
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+  if (edx & CPUID_1_EDX_PGE) {
+    write_cr4( read_cr4() | CR4_PGE );
+    global_flag = X86_GLOBAL;
+  }
+
   return 0;
 }
 
@@ -516,12 +671,23 @@ int clone_address_space(address_space_t *dest, int make_cow) {
         uint32_t *d_pte = PAGE_TABLE_ENTRY(RPDT_BASE2, i + j * PAGE_SIZE);
         uint32_t *s_pte = PAGE_TABLE_ENTRY(RPDT_BASE,  i + j * PAGE_SIZE);
 
+        /* Swapped-out pages are now referenced from two address spaces. */
+        if ((*s_pte & X86_PRESENT) == 0) {
+          if (*s_pte != 0)
+            swap_dup_entry(*s_pte >> 1);
+          *d_pte = *s_pte;
+        }
         /* If the page is user-mode and writable, make it copy-on-write. */
-        if (make_cow && is_user && (*s_pte & X86_WRITE)) {
+        else if (make_cow && is_user && (*s_pte & X86_WRITE)) {
           *d_pte = (*s_pte & ~X86_WRITE) | X86_COW;
           cow_refcnt_inc(*s_pte & 0xFFFFF000);
-        } else {
-          *d_pte = *s_pte;
+        }
+        /* Otherwise the page is shared outright. It takes a reference as a
+           copy-on-write page does, so that swap and same-page merging know
+           another address space maps it, and gives it back when unmapped. */
+        else {
+          *d_pte = *s_pte | ((*s_pte & X86_COW) ? 0 : X86_SHARED);
+          cow_refcnt_inc(*s_pte & 0xFFFFF000);
         }
       }
     }
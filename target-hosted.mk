@@ -1,10 +1,15 @@
 TARGET_FLAGS := -DHOSTED=1
-TARGET_LINKFLAGS := 
+TARGET_LINKFLAGS := -lpthread
 CSOURCES := $(shell find src/hosted -type f -name "*.c") $(CSOURCES_TI)
 SSOURCES := $(shell find src/hosted -type f -name "*.s") $(SSOURCES_TI)
 TESTS    := $(shell find test/hosted -type f -name "*.c") $(TESTS_TI)
 EXAMPLES := $(EXAMPLES_TI)
 
+# Run the tests on this many virtual CPUs - see src/hosted/smp.c.
+ifdef SMP
+  TEST_ARGS := -smp $(SMP)
+endif
+
 ifdef COVERAGE
   TARGET_LINKFLAGS := $(TARGET_LINKFLAGS) -fprofile-arcs -ftest-coverage
 endif
@@ -6,6 +6,8 @@ SSOURCES := $(shell find src/x86 -type f -name "*.s") $(SSOURCES_TI)
 TESTS    := $(shell find test/x86 -type f -name "*.c") $(TESTS_TI)
 EXAMPLES := examples/ide.c  $(EXAMPLES_TI)
 RUNNER   := scripts/run.py
+# "make test SMP=4" runs the tests under "qemu -smp 4": the runner takes it
+# from the environment.
 
 ifndef SCANTABLE
     SCANTABLE := src/x86/en_US.scantable
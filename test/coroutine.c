@@ -0,0 +1,188 @@
+#if 0
+exit `$1 $2 | ./test/FileCheck $0`
+#endif
+
+/* Coroutines: they take turns as they yield, one awaiting an event or a
+   semaphore lets the others run until it is signalled - from a timer
+   interrupt or another thread - one waiting for a mutex held by another
+   thread waits with its whole thread, and many can be in flight in one
+   thread.
+   Then the cost of a task run as a coroutine against one run as a thread. */
+
+#include "coroutine.h"
+#include "hal.h"
+#include "stdio.h"
+#include "thread.h"
+#include "timeout.h"
+
+/* Coroutines asleep at once, and tasks run at once in the benchmark. */
+#define FAN_OUT 32
+#define BATCHES 32
+
+static unsigned order[9], norder;
+
+static void take_turns(void *p) {
+  for (unsigned i = 0; i < 3; ++i) {
+    order[norder++] = (unsigned)(uintptr_t)p;
+    co_yield();
+  }
+}
+
+static co_event_t event;
+static volatile unsigned awaited, spins_meanwhile;
+
+static void awaiter(void *unused) {
+  co_await(&event);
+  awaited = 1;
+}
+
+static void spinner(void *unused) {
+  while (!awaited) {
+    ++spins_meanwhile;
+    co_yield();
+  }
+}
+
+static void signal_event(void *unused) {
+  co_signal(&event);
+}
+
+static semaphore_t sema;
+static volatile unsigned sema_woken;
+
+static void sema_waiter(void *unused) {
+  semaphore_wait(&sema);
+  ++sema_woken;
+}
+
+static void signaller(void *unused) {
+  for (unsigned i = 0; i < 4; ++i) {
+    thread_sleep_for(1);
+    semaphore_signal(&sema);
+  }
+}
+
+static mutex_t mutex;
+static volatile unsigned mutex_held, mutex_taken;
+
+static void mutex_holder(void *unused) {
+  mutex_acquire(&mutex);
+  mutex_held = 1;
+  thread_sleep_for(5);
+  mutex_release(&mutex);
+}
+
+static void mutex_taker(void *unused) {
+  mutex_acquire(&mutex);
+  ++mutex_taken;
+  mutex_release(&mutex);
+}
+
+static unsigned fanned_out;
+static void fan_out(void *unused) {
+  co_await(&event);
+  ++fanned_out;
+}
+
+static void nothing(void *unused) {
+}
+
+static int f() {
+  for (unsigned i = 0; i < 3; ++i)
+    co_spawn(&take_turns, (void*)(uintptr_t)i);
+  co_run();
+  // CHECK: order: 0 1 2 0 1 2 0 1 2
+  kprintf("order:");
+  for (unsigned i = 0; i < norder; ++i)
+    kprintf(" %d", order[i]);
+  kprintf("\n");
+
+  co_event_init(&event);
+  timeout_t timeout;
+  timeout_init(&timeout, &signal_event, NULL);
+  co_spawn(&awaiter, NULL);
+  co_spawn(&spinner, NULL);
+  timeout_add(&timeout, 5);
+  co_run();
+  // CHECK: awaited: 1, others ran meanwhile: 1
+  kprintf("awaited: %d, others ran meanwhile: %d\n", awaited,
+          spins_meanwhile > 1);
+
+  semaphore_init(&sema);
+  for (unsigned i = 0; i < 4; ++i)
+    co_spawn(&sema_waiter, NULL);
+  thread_t *t = thread_spawn(&signaller, NULL, 0);
+  co_run();
+  while (t->state != THREAD_DEAD)
+    thread_yield();
+  thread_destroy(t);
+  // CHECK: semaphore waiters woken: 4
+  kprintf("semaphore waiters woken: %d\n", sema_woken);
+
+  mutex_init(&mutex);
+  t = thread_spawn(&mutex_holder, NULL, 0);
+  while (!mutex_held)
+    thread_yield();
+  for (unsigned i = 0; i < 2; ++i)
+    co_spawn(&mutex_taker, NULL);
+  co_run();
+  while (t->state != THREAD_DEAD)
+    thread_yield();
+  thread_destroy(t);
+  // CHECK: contended mutex taken: 2
+  kprintf("contended mutex taken: %d\n", mutex_taken);
+
+  /* Every one is asleep at once, on a stack of its own. */
+  co_event_init(&event);
+  timeout_init(&timeout, &signal_event, NULL);
+  for (unsigned i = 0; i < FAN_OUT; ++i)
+    co_spawn(&fan_out, NULL);
+  timeout_add(&timeout, 5);
+  co_run();
+  // CHECK: fan-out: 32 done
+  kprintf("fan-out: %d done\n", fanned_out);
+
+  /* The stacks are pooled by now, as thread stacks are by their cache. */
+  uint64_t start = get_cycle_count();
+  for (unsigned b = 0; b < BATCHES; ++b) {
+    for (unsigned i = 0; i < FAN_OUT; ++i)
+      co_spawn(&nothing, NULL);
+    co_run();
+  }
+  uint64_t co_cycles = (get_cycle_count() - start) / (BATCHES * FAN_OUT);
+
+  thread_t *ts[FAN_OUT];
+  start = get_cycle_count();
+  for (unsigned b = 0; b < BATCHES; ++b) {
+    for (unsigned i = 0; i < FAN_OUT; ++i)
+      ts[i] = thread_spawn(&nothing, NULL, 0);
+    for (unsigned i = 0; i < FAN_OUT; ++i) {
+      while (ts[i]->state != THREAD_DEAD)
+        thread_yield();
+      thread_destroy(ts[i]);
+    }
+  }
+  uint64_t thread_cycles = (get_cycle_count() - start) / (BATCHES * FAN_OUT);
+
+  // CHECK: co_spawn: {{[0-9]+}} cycles per task
+  kprintf("co_spawn: %d cycles per task\n", (int)co_cycles);
+  // CHECK: thread_spawn: {{[0-9]+}} cycles per task
+  kprintf("thread_spawn: %d cycles per task\n", (int)thread_cycles);
+  // CHECK: coroutines cheaper: 1
+  kprintf("coroutines cheaper: %d\n", co_cycles < thread_cycles);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"x86/serial",NULL},
+                        {"hosted/console",NULL}, {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "coroutine-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
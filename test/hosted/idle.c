@@ -0,0 +1,53 @@
+#if 0
+exit `$1 $2 | ./test/FileCheck $0`
+#endif
+
+/* With every thread asleep the CPU must go idle, not spin, and still wake up
+   for the next timer event. */
+
+#include "hal.h"
+#include "stdio.h"
+#include "thread.h"
+
+#define SLEEP_MS 200
+
+/* Host CPU time used by the process, in microseconds. */
+long clock();
+
+static semaphore_t sem;
+static volatile int fired;
+
+static void wake(void *unused) {
+  fired = 1;
+  semaphore_signal(&sem);
+}
+
+static int f() {
+  semaphore_init(&sem);
+  register_callback(SLEEP_MS, 0, &wake, NULL);
+
+  long start = clock();
+  semaphore_wait(&sem);
+  long used = clock() - start;
+
+  // CHECK: woken by the timer: 1
+  kprintf("woken by the timer: %d\n", fired);
+  // CHECK: used less than a quarter of the CPU: 1
+  kprintf("used less than a quarter of the CPU: %d\n",
+          used < SLEEP_MS * 1000 / 4);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"hosted/console",NULL},
+                        {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "idle-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
@@ -0,0 +1,69 @@
+#if 0
+exit `$1 $2 -smp 4 | ./test/FileCheck $0`
+#endif
+
+/* With every thread asleep and several CPUs, all of them must go idle: the
+   CPU that takes timer interrupts stops its tick until the next timer event,
+   and the others are not sent preemption ticks while they have nothing to
+   run. A periodic tick would interrupt about once a millisecond. */
+
+#include "hal.h"
+#include "stdio.h"
+#include "thread.h"
+
+#define SLEEP_MS 200
+
+static semaphore_t sem;
+static volatile int fired;
+static volatile unsigned timer_irqs, ipis;
+
+static void wake(void *unused) {
+  fired = 1;
+  semaphore_signal(&sem);
+}
+
+static int count_timer(struct regs *r, void *unused) {
+  __sync_fetch_and_add(&timer_irqs, 1);
+  return 0;
+}
+
+static int count_ipi(struct regs *r, void *unused) {
+  __sync_fetch_and_add(&ipis, 1);
+  return 0;
+}
+
+static int f() {
+  semaphore_init(&sem);
+  /* Let the other CPUs settle into their idle loops. */
+  thread_sleep_for(50);
+
+  register_interrupt_handler(HOSTED_IRQ_TIMER, &count_timer, NULL);
+  register_interrupt_handler(get_ipi_interrupt_num(), &count_ipi, NULL);
+  register_callback(SLEEP_MS, 0, &wake, NULL);
+  semaphore_wait(&sem);
+  unsigned t = timer_irqs, i = ipis;
+  unregister_interrupt_handler(HOSTED_IRQ_TIMER, &count_timer, NULL);
+  unregister_interrupt_handler(get_ipi_interrupt_num(), &count_ipi, NULL);
+
+  // CHECK: woken by the timer: 1
+  kprintf("woken by the timer: %d\n", fired);
+  // CHECK: timer stopped: 1
+  kprintf("timer stopped: %d (%d interrupts)\n", t < SLEEP_MS / 10, t);
+  // CHECK: idle CPUs left alone: 1
+  kprintf("idle CPUs left alone: %d (%d IPIs)\n", i < SLEEP_MS / 20, i);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"hosted/console",NULL},
+                        {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "idle-smp-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
@@ -0,0 +1,170 @@
+#if 0
+out=`$1 $2 -smp 2`
+echo "$out" | grep -q "lockstat: not built in" && exit 0
+for p in SPIN MUTEX SEM3 SEM5 WRITER2 WRITER4; do
+  echo "$out" | ./test/FileCheck -check-prefix=$p $0 || exit 1
+done
+exit 0
+#endif
+
+/* Lock contention statistics, which need a build with LOCKSTAT=1 - without
+   one this only checks that it says so. A spinlock, a mutex and a semaphore
+   are each contended from call sites of their own, and the dump at shutdown
+   must record each acquisition against the site it came from: semaphore
+   waits and a rwlock writer's mutex from two sites show up as two entries,
+   not one for the locking code they go through. The dump is in order of
+   time spent waiting, so each entry is checked for on its own. */
+
+#include "hal.h"
+#include "stdio.h"
+#include "thread.h"
+
+#if LOCKSTAT
+
+#define SPIN_ROUNDS 50
+
+static spinlock_t spin;
+static mutex_t mutex;
+static semaphore_t sem;
+static rwlock_t rw;
+
+static volatile int go;
+static volatile unsigned ready, held, taken;
+
+static void pin(unsigned cpu) {
+  cpu_mask_t mask = {{0}};
+  cpu_mask_set(&mask, cpu);
+  thread_set_affinity(thread_current(), &mask);
+  /* Yield at least once, to move there. */
+  do
+    thread_yield();
+  while (!go);
+}
+
+/* Takes the spinlock, and holds it until the contender on the other CPU
+   has queued behind us. Holding it keeps interrupts off here, so not before
+   the contender is running there. */
+static void spin_holder(void *unused) {
+  pin(0);
+  while (!ready)
+    thread_yield();
+  for (unsigned i = 0; i < SPIN_ROUNDS; ++i) {
+    spinlock_acquire(&spin);
+    held = i + 1;
+    while (spin.next == spin.owner + 1)
+      cpu_relax();
+    spinlock_release(&spin);
+    while (taken != i + 1)
+      cpu_relax();
+  }
+}
+
+static void spin_contender(void *unused) {
+  pin(1);
+  ready = 1;
+  for (unsigned i = 0; i < SPIN_ROUNDS; ++i) {
+    while (held != i + 1)
+      cpu_relax();
+    spinlock_acquire(&spin);
+    taken = i + 1;
+    spinlock_release(&spin);
+  }
+}
+
+static void mutex_contender(void *unused) {
+  mutex_acquire(&mutex);
+  mutex_release(&mutex);
+}
+
+static void sem_waiter(void *unused) {
+  for (unsigned i = 0; i < 3; ++i)
+    semaphore_wait(&sem);
+  for (unsigned i = 0; i < 5; ++i)
+    semaphore_wait(&sem);
+}
+
+static void join(thread_t *t) {
+  while (t->state != THREAD_DEAD)
+    thread_yield();
+  thread_destroy(t);
+}
+
+static void wait_asleep(thread_t *t) {
+  while (t->state != THREAD_SLEEP)
+    thread_yield();
+}
+
+static int f() {
+  spinlock_init(&spin);
+  mutex_init(&mutex);
+  semaphore_init(&sem);
+  rwlock_init(&rw);
+
+  // SPIN: spin [[SPIN:[^ ]+]]
+  // MUTEX: mutex [[MUTEX:[^ ]+]]
+  // SEM3: sem [[SEM:[^ ]+]]
+  // SEM5: sem [[SEM:[^ ]+]]
+  // WRITER2: writer [[WRITER:[^ ]+]]
+  // WRITER4: writer [[WRITER:[^ ]+]]
+  kprintf("spin %p mutex %p sem %p writer %p\n", &spin, &mutex, &sem,
+          &rw.writer);
+
+  thread_t *h = thread_spawn(&spin_holder, NULL, 0);
+  thread_t *c = thread_spawn(&spin_contender, NULL, 0);
+  go = 1;
+  join(h);
+  join(c);
+
+  mutex_acquire(&mutex);
+  thread_t *t = thread_spawn(&mutex_contender, NULL, 0);
+  wait_asleep(t);
+  mutex_release(&mutex);
+  join(t);
+
+  t = thread_spawn(&sem_waiter, NULL, 0);
+  for (unsigned i = 0; i < 8; ++i) {
+    wait_asleep(t);
+    semaphore_signal(&sem);
+  }
+  join(t);
+
+  for (unsigned i = 0; i < 2; ++i) {
+    rwlock_write_acquire(&rw);
+    rwlock_write_release(&rw);
+  }
+  for (unsigned i = 0; i < 4; ++i) {
+    rwlock_write_acquire(&rw);
+    rwlock_write_release(&rw);
+  }
+
+  // SPIN: lockstat: 0 dropped acquisitions
+  // SPIN: spinlock [[SPIN]] {{[^:]+}}: 50 acquired, 50 contended
+  // MUTEX: mutex {{ *}}[[MUTEX]] {{[^:]+}}: 1 acquired, 1 contended
+  // SEM3: semaphore [[SEM]] {{[^:]+}}: 3 acquired, 3 contended
+  // SEM5: semaphore [[SEM]] {{[^:]+}}: 5 acquired, 5 contended
+  // WRITER2: mutex {{ *}}[[WRITER]] {{[^:]+}}: 2 acquired, 0 contended
+  // WRITER4: mutex {{ *}}[[WRITER]] {{[^:]+}}: 4 acquired, 0 contended
+  return 0;
+}
+
+#else
+
+static int f() {
+  kprintf("lockstat: not built in\n");
+  return 0;
+}
+
+#endif
+
+static prereq_t p[] = { {"console",NULL}, {"hosted/console",NULL},
+                        {"lockstat",NULL}, {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "lockstat-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
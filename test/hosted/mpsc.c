@@ -0,0 +1,118 @@
+#if 0
+exit `$1 $2 | ./test/FileCheck $0`
+#endif
+
+/* The lock-free MPSC queue under contention from several host CPUs. Each
+   producer is a forked process pushing its own nodes onto a queue in shared
+   memory while we pop them at the same time. Every node must come out
+   exactly once, and each producer's nodes in the order it pushed them. */
+
+#include "adt/mpsc.h"
+#include "hal.h"
+#include "stdio.h"
+#include "thread.h"
+
+#define NUM_PRODUCERS 4
+#define NUM_NODES 20000
+
+/* Host process and shared memory primitives. */
+int fork();
+int waitpid(int pid, int *status, int options);
+void _exit(int status);
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, long off);
+#define PROT_READ_WRITE 3
+#define MAP_SHARED_ANONYMOUS 0x21
+
+typedef struct item {
+  mpsc_node_t node;
+  unsigned producer, seq;
+} item_t;
+
+typedef struct shared {
+  mpsc_queue_t queue;
+  item_t items[NUM_PRODUCERS][NUM_NODES];
+  volatile unsigned ready;
+  volatile int start;
+} shared_t;
+
+static shared_t *shm;
+/* How many times each node was popped. */
+static uint8_t popped[NUM_PRODUCERS][NUM_NODES];
+
+static void produce(unsigned id) {
+  __sync_fetch_and_add(&shm->ready, 1);
+  while (!shm->start)
+    ;
+  for (unsigned i = 0; i < NUM_NODES; ++i)
+    mpsc_push(&shm->queue, &shm->items[id][i].node);
+}
+
+static int f() {
+  shm = mmap(NULL, sizeof(shared_t), PROT_READ_WRITE, MAP_SHARED_ANONYMOUS,
+             -1, 0);
+  mpsc_init(&shm->queue);
+  for (unsigned i = 0; i < NUM_PRODUCERS; ++i)
+    for (unsigned j = 0; j < NUM_NODES; ++j) {
+      shm->items[i][j].producer = i;
+      shm->items[i][j].seq = j;
+    }
+
+  // CHECK: empty: 1, pop: 0
+  kprintf("empty: %d, pop: %d\n", mpsc_empty(&shm->queue),
+          mpsc_pop(&shm->queue) != NULL);
+
+  int pids[NUM_PRODUCERS];
+  for (unsigned i = 0; i < NUM_PRODUCERS; ++i)
+    if ((pids[i] = fork()) == 0) {
+      produce(i);
+      _exit(0);
+    }
+  while (shm->ready != NUM_PRODUCERS)
+    thread_sleep_for(1);
+  shm->start = 1;
+
+  unsigned total = 0, in_order = 1, bogus = 0;
+  unsigned next[NUM_PRODUCERS] = {0};
+  while (total < NUM_PRODUCERS * NUM_NODES) {
+    mpsc_node_t *n = mpsc_pop(&shm->queue);
+    if (!n)
+      continue;
+    item_t *it = (item_t*)n;
+    if (it->producer >= NUM_PRODUCERS || it->seq >= NUM_NODES) {
+      ++bogus;
+      break;
+    }
+    ++popped[it->producer][it->seq];
+    in_order &= it->seq == next[it->producer]++;
+    ++total;
+  }
+  for (unsigned i = 0; i < NUM_PRODUCERS; ++i)
+    waitpid(pids[i], NULL, 0);
+
+  unsigned once = 1;
+  for (unsigned i = 0; i < NUM_PRODUCERS; ++i)
+    for (unsigned j = 0; j < NUM_NODES; ++j)
+      once &= popped[i][j] == 1;
+
+  // CHECK: popped 80000, each once: 1, in order: 1, bogus: 0
+  kprintf("popped %d, each once: %d, in order: %d, bogus: %d\n", total, once,
+          in_order, bogus);
+  // CHECK: empty: 1, pop: 0
+  kprintf("empty: %d, pop: %d\n", mpsc_empty(&shm->queue),
+          mpsc_pop(&shm->queue) != NULL);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"hosted/console",NULL},
+                        {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "mpsc-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
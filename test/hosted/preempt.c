@@ -0,0 +1,78 @@
+#if 0
+exit `$1 $2 | ./test/FileCheck $0`
+#endif
+
+/* A thread that never yields must not stop other threads running, unless
+   preemption is disabled. */
+
+#include "hal.h"
+#include "stdio.h"
+#include "string.h"
+#include "thread.h"
+
+static volatile int done;
+static volatile unsigned spins;
+
+/* With more than one CPU, the spinner would run alongside us. */
+static void pin_to_first_cpu() {
+  cpu_mask_t mask;
+  memset(&mask, 0, sizeof(mask));
+  cpu_mask_set(&mask, 0);
+  thread_set_affinity(thread_current(), &mask);
+  thread_yield();
+}
+
+static void spinner(void *unused) {
+  pin_to_first_cpu();
+  while (!done)
+    ++spins;
+}
+
+static void busy_wait(uint64_t cycles) {
+  uint64_t start = get_cycle_count();
+  while (get_cycle_count() - start < cycles)
+    ;
+}
+
+static int f() {
+  pin_to_first_cpu();
+  thread_t *t = thread_spawn(&spinner, NULL, 0);
+
+  /* Neither thread yields, so the spinner only runs if we are preempted. */
+  uint64_t start = get_cycle_count();
+  while (spins == 0 && get_cycle_count() - start < 20000000000ULL)
+    ;
+  // CHECK: preempted: 1
+  kprintf("preempted: %d\n", spins != 0);
+
+  preempt_disable();
+  unsigned before = spins;
+  busy_wait(200000000ULL);
+  unsigned after = spins;
+  preempt_enable();
+  // CHECK: ran while preemption was disabled: 0
+  kprintf("ran while preemption was disabled: %d\n", after != before);
+
+  done = 1;
+  while (t->state != THREAD_DEAD)
+    ;
+  // CHECK: spinner runtime counted: 1
+  kprintf("spinner runtime counted: %d\n", t->runtime > 0);
+  // CHECK: main runtime counted: 1
+  kprintf("main runtime counted: %d\n", thread_current()->runtime > 0);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"hosted/console",NULL},
+                        {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "preempt-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
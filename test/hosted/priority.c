@@ -0,0 +1,101 @@
+#if 0
+exit `$1 $2 | ./test/FileCheck $0`
+#endif
+
+/* Measures how long a high priority thread takes to run after being woken,
+   while several low priority threads are busy. */
+
+#include "hal.h"
+#include "stdio.h"
+#include "thread.h"
+
+#define NUM_BUSY   8
+#define NUM_WAKES  16
+
+static semaphore_t sem;
+static volatile int done, lowest_ran;
+/* Number of times a busy thread has been run. */
+static volatile unsigned switches;
+static volatile unsigned stamp;
+static volatile uint64_t t0;
+
+static unsigned max_switches;
+static uint64_t total_cycles;
+
+static void busy(void *unused) {
+  while (!done) {
+    ++switches;
+    thread_yield();
+  }
+}
+
+static void waiter(void *unused) {
+  for (unsigned i = 0; i < NUM_WAKES; ++i) {
+    semaphore_wait(&sem);
+    total_cycles += get_cycle_count() - t0;
+    if (switches - stamp > max_switches)
+      max_switches = switches - stamp;
+  }
+}
+
+static void lowest(void *unused) {
+  lowest_ran = 1;
+}
+
+static int f() {
+  semaphore_init(&sem);
+
+  thread_t *t = thread_spawn(&waiter, NULL, 0);
+  thread_set_priority(t, 0);
+
+  for (unsigned i = 0; i < NUM_BUSY; ++i)
+    thread_set_priority(thread_spawn(&busy, NULL, 0), 20);
+  /* Compete with the busy threads on equal terms. */
+  thread_set_priority(thread_current(), 20);
+  thread_yield();
+
+  for (unsigned i = 0; i < NUM_WAKES; ++i) {
+    for (unsigned j = 0; j < 3; ++j)
+      thread_yield();
+
+    stamp = switches;
+    t0 = get_cycle_count();
+    semaphore_signal(&sem);
+    thread_yield();
+  }
+
+  // CHECK: busy threads run before the waiter: 0
+  kprintf("busy threads run before the waiter: %d\n", max_switches);
+  // CHECK: mean wakeup latency: {{[0-9]+}} cycles
+  kprintf("mean wakeup latency: %d cycles\n",
+          (uint32_t)(total_cycles / NUM_WAKES));
+
+  /* Aging must let even the lowest priority thread run while others are
+     always ready. */
+  thread_set_priority(thread_spawn(&lowest, NULL, 0),
+                      THREAD_NUM_PRIORITIES - 1);
+  unsigned n;
+  for (n = 0; n < 10000 && !lowest_ran; ++n)
+    thread_yield();
+  // CHECK: lowest priority thread ran: 1
+  kprintf("lowest priority thread ran: %d\n", lowest_ran);
+
+  done = 1;
+  for (unsigned i = 0; i < NUM_BUSY; ++i)
+    thread_yield();
+
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"hosted/console",NULL},
+                        {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "priority-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
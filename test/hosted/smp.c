@@ -0,0 +1,96 @@
+#if 0
+exit `$1 $2 -smp 4 | ./test/FileCheck $0`
+#endif
+
+/* Hosted SMP: with "-smp", host threads stand in for CPUs. Threads run on
+   all of them, an IPI reaches every CPU it is sent to, and each CPU has its
+   own interrupt flag. */
+
+#include "hal.h"
+#include "stdio.h"
+#include "thread.h"
+
+#define NUM_CPUS 4
+#define IPI_DATA ((void*)0x1234)
+
+static volatile int done;
+static volatile unsigned ran[NUM_CPUS], ipis[NUM_CPUS];
+
+static void worker(void *unused) {
+  while (!done) {
+    ran[get_processor_id()] = 1;
+    thread_yield();
+  }
+}
+
+static int handle_ipi(struct regs *r, void *unused) {
+  if (get_ipi_data(r) == IPI_DATA)
+    __sync_fetch_and_add(&ipis[get_processor_id()], 1);
+  return 0;
+}
+
+static bool all(volatile unsigned *counts, unsigned n) {
+  for (unsigned i = 0; i < NUM_CPUS; ++i)
+    if (counts[i] < n)
+      return false;
+  return true;
+}
+
+static int f() {
+  // CHECK: cpus: 4
+  kprintf("cpus: %d\n", get_num_processors());
+
+  thread_t *ts[NUM_CPUS * 2];
+  for (unsigned i = 0; i < NUM_CPUS * 2; ++i)
+    ts[i] = thread_spawn(&worker, NULL, 0);
+  for (unsigned i = 0; i < 5000 && !all(ran, 1); ++i)
+    thread_sleep_for(1);
+  done = 1;
+  for (unsigned i = 0; i < NUM_CPUS * 2; ++i) {
+    while (ts[i]->state != THREAD_DEAD)
+      thread_yield();
+    thread_destroy(ts[i]);
+  }
+  // CHECK: ran on every CPU: 1
+  kprintf("ran on every CPU: %d\n", all(ran, 1));
+
+  register_interrupt_handler(get_ipi_interrupt_num(), &handle_ipi, NULL);
+  send_ipi(IPI_ALL, IPI_DATA);
+  for (unsigned i = 0; i < 5000 && !all(ipis, 1); ++i)
+    thread_sleep_for(1);
+  // CHECK: IPIs: 1 1 1 1
+  kprintf("IPIs: %d %d %d %d\n", ipis[0], ipis[1], ipis[2], ipis[3]);
+
+  /* With interrupts disabled here we cannot move, and the IPI waits for us
+     while the other CPUs take theirs. */
+  disable_interrupts();
+  int me = get_processor_id();
+  send_ipi(IPI_ALL, IPI_DATA);
+  uint64_t start = get_cycle_count();
+  unsigned others = 0;
+  while (others != NUM_CPUS - 1 && get_cycle_count() - start < 20000000000ULL) {
+    others = 0;
+    for (int i = 0; i < NUM_CPUS; ++i)
+      others += (i != me && ipis[i] == 2);
+  }
+  unsigned held = ipis[me] == 1;
+  enable_interrupts();
+  // CHECK: others took theirs: 3, ours waited: 1, then taken: 1
+  kprintf("others took theirs: %d, ours waited: %d, then taken: %d\n", others,
+          held, ipis[me] == 2);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"hosted/console",NULL},
+                        {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "smp-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
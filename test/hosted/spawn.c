@@ -0,0 +1,82 @@
+#if 0
+exit `$1 $2 | ./test/FileCheck $0`
+#endif
+
+/* Spawn/join throughput, and the shape of the stacks underneath: a guard
+   page, pages mapped only as they are touched, and stacks reused rather than
+   returned to the allocators. */
+
+#include "hal.h"
+#include "stdio.h"
+#include "thread.h"
+
+#define ITERATIONS 10000
+
+static void nothing(void *unused) {
+}
+
+static unsigned recurse(unsigned depth) {
+  volatile uint8_t frame[1024];
+  frame[0] = depth;
+  return depth ? recurse(depth - 1) + frame[0] : 0;
+}
+
+static void deep(void *unused) {
+  recurse(40);
+}
+
+static void join(thread_t *t) {
+  while (t->state != THREAD_DEAD)
+    thread_yield();
+  thread_destroy(t);
+}
+
+static unsigned mapped_pages(uintptr_t stack) {
+  unsigned n = 0;
+  for (unsigned i = 0; i < THREAD_STACK_SZ; i += get_page_size())
+    n += is_mapped(stack + i);
+  return n;
+}
+
+static int f() {
+  thread_t *t = thread_spawn(&nothing, NULL, 0);
+  uintptr_t stack = t->stack;
+  while (t->state != THREAD_DEAD)
+    thread_yield();
+  // CHECK: guard page unmapped: 1
+  kprintf("guard page unmapped: %d\n", !is_mapped(stack + get_page_size()));
+  unsigned shallow = mapped_pages(stack);
+  // CHECK: shallow thread commits a quarter of its stack or less: 1
+  kprintf("shallow thread commits a quarter of its stack or less: %d\n",
+          shallow * get_page_size() <= THREAD_STACK_SZ / 4);
+  thread_destroy(t);
+
+  t = thread_spawn(&deep, NULL, 0);
+  // CHECK: stack reused: 1
+  kprintf("stack reused: %d\n", t->stack == stack);
+  join(t);
+  // CHECK: deep thread commits more: 1
+  kprintf("deep thread commits more: %d\n", mapped_pages(stack) > shallow);
+
+  uint64_t start = get_cycle_count();
+  for (unsigned i = 0; i < ITERATIONS; ++i)
+    join(thread_spawn(&nothing, NULL, 0));
+  uint64_t cycles = (get_cycle_count() - start) / ITERATIONS;
+  // CHECK: spawn+join: {{[0-9]+}} cycles per thread
+  kprintf("spawn+join: %d cycles per thread\n", (int)cycles);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"hosted/console",NULL},
+                        {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "spawn-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
@@ -0,0 +1,141 @@
+#if 0
+exit `$1 $2 | ./test/FileCheck $0`
+#endif
+
+/* Throughput and fairness of spinlocks under contention from several host
+   CPUs. Each contender is a forked process hammering a lock in shared memory
+   for a fixed window: a test-and-set lock (which is what spinlock_t used to
+   be), the ticket lock spinlock_t is now, and an MCS lock. Fairness is the
+   fewest acquisitions any contender managed as a proportion of the most. */
+
+#include "hal.h"
+#include "stdio.h"
+#include "thread.h"
+
+#define NUM_CONTENDERS 4
+#define WINDOW_MS 200
+
+/* Host process and shared memory primitives. */
+int fork();
+int waitpid(int pid, int *status, int options);
+void _exit(int status);
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, long off);
+#define PROT_READ_WRITE 3
+#define MAP_SHARED_ANONYMOUS 0x21
+
+typedef struct shared {
+  volatile unsigned tas;
+  spinlock_t ticket;
+  mcs_lock_t mcs;
+  /* MCS waiters link to each other's nodes, so they must be shared too. */
+  mcs_node_t nodes[NUM_CONTENDERS];
+
+  volatile int start, stop;
+  volatile unsigned counter, inside, overlapped;
+  volatile unsigned ready;
+  volatile unsigned acquisitions[NUM_CONTENDERS];
+} shared_t;
+
+static shared_t *shm;
+
+static void tas_acquire(mcs_node_t *n) {
+  while (!__sync_bool_compare_and_swap(&shm->tas, 0, 1))
+    ;
+}
+static void tas_release(mcs_node_t *n) {
+  while (!__sync_bool_compare_and_swap(&shm->tas, 1, 0))
+    ;
+}
+static void ticket_acquire(mcs_node_t *n) { spinlock_acquire(&shm->ticket); }
+static void ticket_release(mcs_node_t *n) { spinlock_release(&shm->ticket); }
+static void mcs_acquire(mcs_node_t *n) { mcs_lock_acquire(&shm->mcs, n); }
+static void mcs_release(mcs_node_t *n) { mcs_lock_release(&shm->mcs, n); }
+
+static void contend(unsigned id, void (*acquire)(mcs_node_t*),
+                    void (*release)(mcs_node_t*)) {
+  mcs_node_t *node = &shm->nodes[id];
+  __sync_fetch_and_add(&shm->ready, 1);
+  while (!shm->start)
+    ;
+  unsigned n = 0;
+  while (!shm->stop) {
+    acquire(node);
+    if (++shm->inside != 1)
+      shm->overlapped = 1;
+    unsigned c = shm->counter;
+    for (volatile unsigned j = 0; j < 20; ++j)
+      ;
+    shm->counter = c + 1;
+    --shm->inside;
+    release(node);
+    shm->acquisitions[id] = ++n;
+  }
+}
+
+static void run(const char *name, void (*acquire)(mcs_node_t*),
+                void (*release)(mcs_node_t*)) {
+  shm->tas = 0;
+  spinlock_init(&shm->ticket);
+  mcs_lock_init(&shm->mcs);
+  shm->start = shm->stop = 0;
+  shm->counter = shm->inside = shm->overlapped = shm->ready = 0;
+
+  int pids[NUM_CONTENDERS];
+  for (unsigned i = 0; i < NUM_CONTENDERS; ++i) {
+    shm->acquisitions[i] = 0;
+    if ((pids[i] = fork()) == 0) {
+      contend(i, acquire, release);
+      _exit(0);
+    }
+  }
+  while (shm->ready != NUM_CONTENDERS)
+    thread_sleep_for(1);
+
+  uint64_t start = get_cycle_count();
+  shm->start = 1;
+  thread_sleep_for(WINDOW_MS);
+  shm->stop = 1;
+  uint64_t cycles = get_cycle_count() - start;
+  for (unsigned i = 0; i < NUM_CONTENDERS; ++i)
+    waitpid(pids[i], NULL, 0);
+
+  unsigned total = 0, min = ~0U, max = 0;
+  for (unsigned i = 0; i < NUM_CONTENDERS; ++i) {
+    unsigned n = shm->acquisitions[i];
+    total += n;
+    min = (n < min) ? n : min;
+    max = (n > max) ? n : max;
+  }
+
+  kprintf("%s: %d cycles per acquisition, fairness %d/100, correct: %d\n",
+          name, (int)(cycles / (total ? total : 1)),
+          max ? (int)((uint64_t)min * 100 / max) : 0,
+          total != 0 && shm->counter == total && !shm->overlapped);
+}
+
+static int f() {
+  shm = mmap(NULL, sizeof(shared_t), PROT_READ_WRITE, MAP_SHARED_ANONYMOUS,
+             -1, 0);
+
+  // CHECK: test-and-set: {{[0-9]+}} cycles per acquisition, fairness {{[0-9]+}}/100, correct: 1
+  run("test-and-set", &tas_acquire, &tas_release);
+  // CHECK: ticket: {{[0-9]+}} cycles per acquisition, fairness {{[0-9]+}}/100, correct: 1
+  run("ticket", &ticket_acquire, &ticket_release);
+  // CHECK: mcs: {{[0-9]+}} cycles per acquisition, fairness {{[0-9]+}}/100, correct: 1
+  run("mcs", &mcs_acquire, &mcs_release);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"hosted/console",NULL},
+                        {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "spinlock-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
@@ -0,0 +1,92 @@
+#if 0
+IMGNAME=/tmp/$$-swap.img
+dd if=/dev/zero of=$IMGNAME bs=4096 count=1024 2>/dev/null
+OUT=`HDD_IMAGE=$IMGNAME $1 $2 | ./test/FileCheck $0`
+rm $IMGNAME
+exit $OUT
+#endif
+
+/* Overcommits physical memory (the hosted target only has 1MB of it) with
+   anonymous user pages, relying on swap to make room. */
+
+#include "hal.h"
+#include "stdio.h"
+#include "swap.h"
+
+#define BASE      0x70000000
+#define NUM_PAGES 512
+#define SHARED    0x71000000
+
+static int f() {
+  // CHECK: swap_on: 0
+  kprintf("swap_on: %d\n", swap_on(makedev(DEV_MAJ_HDA, 0)));
+
+  /* Pages shared with another address space must never be swapped out, as
+     freeing them would leave the other mapping dangling. */
+  static address_space_t other;
+  for (unsigned i = 0; i < 4; ++i)
+    map(SHARED + i * 0x1000, alloc_page(PAGE_REQ_NONE), 1,
+        PAGE_WRITE|PAGE_USER);
+  clone_address_space(&other, /*make_cow=*/0);
+
+  for (unsigned i = 0; i < NUM_PAGES; ++i) {
+    uintptr_t v = BASE + i * 0x1000;
+    uint64_t p = alloc_page(PAGE_REQ_NONE | PAGE_REQ_RECLAIM);
+    if (p == ~0ULL) {
+      kprintf("alloc_page failed at page %d\n", i);
+      return 1;
+    }
+    map(v, p, 1, PAGE_WRITE|PAGE_USER);
+    for (unsigned j = 0; j < 1024; ++j)
+      ((volatile uint32_t*)v)[j] = i * 1024 + j;
+  }
+
+  // CHECK: allocated 512 pages
+  kprintf("allocated %d pages\n", NUM_PAGES);
+
+  swap_stats_t s;
+  swap_get_stats(&s);
+  // CHECK: swapped out: 1
+  kprintf("swapped out: %d\n", s.pages_out > 0);
+
+  /* Read every page back, which swaps pages in (and others out). */
+  unsigned bad = 0;
+  for (unsigned i = 0; i < NUM_PAGES; ++i) {
+    volatile uint32_t *v = (volatile uint32_t*)(uintptr_t)(BASE + i * 0x1000);
+    for (unsigned j = 0; j < 1024; ++j)
+      if (v[j] != i * 1024 + j)
+        ++bad;
+  }
+  // CHECK: bad words: 0
+  kprintf("bad words: %d\n", bad);
+
+  unsigned kept = 0;
+  for (unsigned i = 0; i < 4; ++i)
+    kept += get_mapping(SHARED + i * 0x1000, NULL) != ~0ULL;
+  // CHECK: shared pages kept: 4
+  kprintf("shared pages kept: %d\n", kept);
+
+  swap_get_stats(&s);
+  // CHECK: swapped in: 1
+  kprintf("swapped in: %d\n", s.pages_in > 0);
+
+  /* Unmapping a swapped-out page must release its slot. */
+  unmap(BASE, NUM_PAGES);
+  swap_get_stats(&s);
+  // CHECK: slots used: 0
+  kprintf("slots used: %d\n", s.slots_used);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"swap",NULL}, {"hosted/hdd",NULL},
+                        {"hosted/free_memory",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "swap-test",
+  .required = p,
+  .load_after = NULL,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
@@ -0,0 +1,82 @@
+#if 0
+IMGNAME=/tmp/$$-swap_cow.img
+dd if=/dev/zero of=$IMGNAME bs=4096 count=1024 2>/dev/null
+OUT=`HDD_IMAGE=$IMGNAME $1 $2 | ./test/FileCheck $0`
+rm $IMGNAME
+exit $OUT
+#endif
+
+/* Overcommits physical memory (the hosted target only has 1MB of it) through
+   ordinary faults: every page starts as a copy-on-write mapping of one
+   template page, and writing to it faults in a private copy. Those faults
+   must swap cold pages out to make room. */
+
+#include "hal.h"
+#include "stdio.h"
+#include "swap.h"
+
+#define TEMPLATE  0x6f000000
+#define BASE      0x70000000
+#define NUM_PAGES 512
+
+static int f() {
+  // CHECK: swap_on: 0
+  kprintf("swap_on: %d\n", swap_on(makedev(DEV_MAJ_HDA, 0)));
+
+  uint64_t t = alloc_page(PAGE_REQ_NONE);
+  map(TEMPLATE, t, 1, PAGE_WRITE);
+  for (unsigned j = 0; j < 1024; ++j)
+    ((volatile uint32_t*)TEMPLATE)[j] = 0xc0c0c0c0;
+  unmap(TEMPLATE, 1);
+  for (unsigned i = 0; i < NUM_PAGES; ++i)
+    map(BASE + i * 0x1000, t, 1, PAGE_WRITE|PAGE_USER|PAGE_COW);
+
+  for (unsigned i = 0; i < NUM_PAGES; ++i) {
+    volatile uint32_t *v = (volatile uint32_t*)(uintptr_t)(BASE + i * 0x1000);
+    for (unsigned j = 0; j < 1024; j += 2)
+      v[j] = i * 1024 + j;
+  }
+
+  // CHECK: written 512 pages
+  kprintf("written %d pages\n", NUM_PAGES);
+
+  swap_stats_t s;
+  swap_get_stats(&s);
+  // CHECK: swapped out: 1
+  kprintf("swapped out: %d\n", s.pages_out > 0);
+
+  /* The words we did not write still come from the template. */
+  unsigned bad = 0;
+  for (unsigned i = 0; i < NUM_PAGES; ++i) {
+    volatile uint32_t *v = (volatile uint32_t*)(uintptr_t)(BASE + i * 0x1000);
+    for (unsigned j = 0; j < 1024; ++j)
+      if (v[j] != ((j & 1) ? 0xc0c0c0c0 : i * 1024 + j))
+        ++bad;
+  }
+  // CHECK: bad words: 0
+  kprintf("bad words: %d\n", bad);
+
+  map(TEMPLATE, t, 1, 0);
+  // CHECK: template intact: 1
+  kprintf("template intact: %d\n",
+          ((volatile uint32_t*)TEMPLATE)[0] == 0xc0c0c0c0);
+
+  unmap(BASE, NUM_PAGES);
+  swap_get_stats(&s);
+  // CHECK: slots used: 0
+  kprintf("slots used: %d\n", s.slots_used);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"swap",NULL}, {"hosted/hdd",NULL},
+                        {"hosted/free_memory",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "swap-cow-test",
+  .required = p,
+  .load_after = NULL,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
@@ -0,0 +1,99 @@
+#if 0
+exit `$1 $2 | ./test/FileCheck $0`
+#endif
+
+/* Mutual exclusion and contention cost of mutex_t, compared with a
+   semaphore used as a mutex (which is what mutex_t used to be). Workers
+   either hold the lock for a short critical section, or yield while holding
+   it so that every other worker has to block. */
+
+#include "hal.h"
+#include "stdio.h"
+#include "thread.h"
+
+#define NUM_WORKERS 4
+#define ITERATIONS 20000
+#define YIELD_ITERATIONS 2000
+
+static semaphore_t sem;
+static mutex_t mutex;
+
+static void sem_acquire(void) { semaphore_wait(&sem); }
+static void sem_release(void) { semaphore_signal(&sem); }
+static void mtx_acquire(void) { mutex_acquire(&mutex); }
+static void mtx_release(void) { mutex_release(&mutex); }
+
+static void (*acquire)(void), (*release)(void);
+static unsigned iterations;
+static int yield_in_section;
+static volatile unsigned counter, inside, overlapped;
+
+static void worker(void *unused) {
+  for (unsigned i = 0; i < iterations; ++i) {
+    acquire();
+    if (++inside != 1)
+      overlapped = 1;
+    unsigned c = counter;
+    if (yield_in_section)
+      thread_yield();
+    for (volatile unsigned j = 0; j < 20; ++j)
+      ;
+    counter = c + 1;
+    --inside;
+    release();
+  }
+}
+
+static void run(const char *name, void (*acq)(void), void (*rel)(void),
+                unsigned n, int yield) {
+  acquire = acq;
+  release = rel;
+  iterations = n;
+  yield_in_section = yield;
+  counter = overlapped = 0;
+
+  thread_t *ts[NUM_WORKERS];
+  uint64_t start = get_cycle_count();
+  for (unsigned i = 0; i < NUM_WORKERS; ++i)
+    ts[i] = thread_spawn(&worker, NULL, 0);
+  for (unsigned i = 0; i < NUM_WORKERS; ++i) {
+    while (ts[i]->state != THREAD_DEAD)
+      thread_yield();
+    thread_destroy(ts[i]);
+  }
+  uint64_t cycles = (get_cycle_count() - start) / (NUM_WORKERS * n);
+
+  kprintf("%s%s: %d cycles per acquire/release, correct: %d\n", name,
+          yield ? " (holder yields)" : "", (int)cycles,
+          counter == NUM_WORKERS * n && !overlapped);
+}
+
+static int f() {
+  semaphore_init(&sem);
+  semaphore_signal(&sem);
+  mutex_init(&mutex);
+
+  // CHECK: semaphore: {{[0-9]+}} cycles per acquire/release, correct: 1
+  run("semaphore", &sem_acquire, &sem_release, ITERATIONS, 0);
+  // CHECK: mutex: {{[0-9]+}} cycles per acquire/release, correct: 1
+  run("mutex", &mtx_acquire, &mtx_release, ITERATIONS, 0);
+  // CHECK: semaphore (holder yields): {{[0-9]+}} cycles per acquire/release, correct: 1
+  run("semaphore", &sem_acquire, &sem_release, YIELD_ITERATIONS, 1);
+  // CHECK: mutex (holder yields): {{[0-9]+}} cycles per acquire/release, correct: 1
+  run("mutex", &mtx_acquire, &mtx_release, YIELD_ITERATIONS, 1);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"x86/serial",NULL},
+                        {"hosted/console",NULL}, {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "mutex-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
@@ -0,0 +1,159 @@
+#if 0
+exit `$1 $2 | ./test/FileCheck $0`
+#endif
+
+/* Priority inheritance through mutexes. A low priority thread holding a
+   mutex that a high priority thread wants must run ahead of busy threads of
+   a priority in between - directly, or through a chain of mutexes - and
+   must drop back to its own priority once it releases the mutex. */
+
+#include "hal.h"
+#include "stdio.h"
+#include "thread.h"
+
+#define LOW    20
+#define MEDIUM 10
+#define HIGH   5
+
+static mutex_t m1, m2;
+static semaphore_t go_low, go_medium;
+static volatile int done;
+static volatile unsigned switches, switches_at_acquire;
+
+/* Holds m1 until told to go. */
+static void low(void *unused) {
+  mutex_acquire(&m1);
+  semaphore_wait(&go_low);
+  mutex_release(&m1);
+}
+
+/* Holds m2, then waits for m1 while holding it. */
+static void medium(void *unused) {
+  mutex_acquire(&m2);
+  semaphore_wait(&go_medium);
+  mutex_acquire(&m1);
+  mutex_release(&m1);
+  mutex_release(&m2);
+}
+
+static void high(void *p) {
+  mutex_t *m = p;
+  mutex_acquire(m);
+  switches_at_acquire = switches;
+  mutex_release(m);
+}
+
+static void timed(void *p) {
+  mutex_t *m = p;
+  if (mutex_timedacquire(m, 20) == 0)
+    mutex_release(m);
+}
+
+static void busy(void *unused) {
+  while (!done) {
+    ++switches;
+    thread_yield();
+  }
+}
+
+static thread_t *spawn(void (*fn)(void*), void *p, unsigned priority) {
+  thread_t *t = thread_spawn(fn, p, 0);
+  thread_set_priority(t, priority);
+  return t;
+}
+
+/* Sleeping lets threads of any priority run meanwhile. */
+static void wait_for(thread_t *t, unsigned state) {
+  while (t->state != state)
+    thread_sleep_for(1);
+}
+
+/* Returns the priority the thread finished at. */
+static unsigned reap(thread_t *t) {
+  wait_for(t, THREAD_DEAD);
+  unsigned priority = t->priority;
+  thread_destroy(t);
+  return priority;
+}
+
+static int f() {
+  mutex_init(&m1);
+  mutex_init(&m2);
+  semaphore_init(&go_low);
+  semaphore_init(&go_medium);
+
+  thread_t *l = spawn(&low, NULL, LOW);
+  wait_for(l, THREAD_SLEEP);
+  thread_t *h = spawn(&high, &m1, HIGH);
+  wait_for(h, THREAD_SLEEP);
+  // CHECK: direct: low runs at 5
+  kprintf("direct: low runs at %d\n", l->priority);
+
+  /* Changing the base priority of a boosted thread keeps the boost. */
+  thread_set_priority(l, LOW + 1);
+  // CHECK: rebased: low runs at 5
+  kprintf("rebased: low runs at %d\n", l->priority);
+
+  /* Busy threads of medium priority must not hold up the high priority one
+     once the low priority one can go. */
+  thread_t *b = spawn(&busy, NULL, MEDIUM);
+  unsigned stamp = switches;
+  semaphore_signal(&go_low);
+  reap(h);
+  // CHECK: busy threads run while inverted: 0
+  kprintf("busy threads run while inverted: %d\n",
+          switches_at_acquire - stamp);
+  done = 1;
+  reap(b);
+  // CHECK: released: low ran at 21
+  kprintf("released: low ran at %d\n", reap(l));
+
+  /* high -> m2 -> medium -> m1 -> low. */
+  l = spawn(&low, NULL, LOW);
+  wait_for(l, THREAD_SLEEP);
+  thread_t *m = spawn(&medium, NULL, MEDIUM);
+  wait_for(m, THREAD_SLEEP);
+  semaphore_signal(&go_medium);
+  while (m1.val != 2)
+    thread_sleep_for(1);
+  wait_for(m, THREAD_SLEEP);
+  // CHECK: one deep: low runs at 10
+  kprintf("one deep: low runs at %d\n", l->priority);
+  h = spawn(&high, &m2, HIGH);
+  wait_for(h, THREAD_SLEEP);
+  // CHECK: two deep: medium runs at 5, low runs at 5
+  kprintf("two deep: medium runs at %d, low runs at %d\n", m->priority,
+          l->priority);
+  semaphore_signal(&go_low);
+  reap(h);
+  unsigned mp = reap(m), lp = reap(l);
+  // CHECK: released: medium ran at 10, low ran at 20
+  kprintf("released: medium ran at %d, low ran at %d\n", mp, lp);
+
+  /* A waiter that gives up takes its priority back. */
+  l = spawn(&low, NULL, LOW);
+  wait_for(l, THREAD_SLEEP);
+  thread_t *t = spawn(&timed, &m1, HIGH);
+  wait_for(t, THREAD_SLEEP);
+  unsigned boosted = l->priority;
+  reap(t);
+  // CHECK: timed out: low ran at 5, runs at 20
+  kprintf("timed out: low ran at %d, runs at %d\n", boosted, l->priority);
+  semaphore_signal(&go_low);
+  reap(l);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"x86/serial",NULL},
+                        {"hosted/console",NULL}, {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "mutex-pi-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
@@ -0,0 +1,84 @@
+#if 0
+exit `$1 $2 | ./test/FileCheck $0`
+#endif
+
+/* Per-CPU variables: every CPU has its own copy, starting with the variable's
+   initialiser, and a counter bumped both by a thread and from the timer
+   interrupt loses no increments. */
+
+#include "hal.h"
+#include "percpu.h"
+#include "stdio.h"
+#include "string.h"
+#include "thread.h"
+
+#define NUM_INCREMENTS 200000
+
+static PERCPU_DEFINE(unsigned, counter) = 42;
+static PERCPU_DEFINE(unsigned, ticks);
+static volatile unsigned total_ticks;
+
+static void timer_callback(void *unused) {
+  this_cpu_inc(counter);
+  this_cpu_inc(ticks);
+  ++total_ticks;
+}
+
+static int f() {
+  int n = get_num_processors();
+  n = (n < 1) ? 1 : n;
+
+  unsigned distinct = 1;
+  for (int i = 0; i < n; ++i)
+    for (int j = 0; j < i; ++j)
+      distinct &= per_cpu_ptr(&counter, i) != per_cpu_ptr(&counter, j);
+  // CHECK: initialised: 42, copies distinct: 1
+  kprintf("initialised: %d, copies distinct: %d\n", this_cpu_read(counter),
+          distinct);
+
+  /* Stay on one CPU so that all the thread's increments land in one copy. */
+  cpu_mask_t mask;
+  memset(&mask, 0, sizeof(mask));
+  cpu_mask_set(&mask, 0);
+  thread_set_affinity(thread_current(), &mask);
+  thread_yield();
+
+  preempt_disable();
+  unsigned *mine = this_cpu_ptr(&counter);
+  *mine = 0;
+  preempt_enable();
+
+  register_callback(1, 1, &timer_callback, NULL);
+  for (unsigned i = 0; i < NUM_INCREMENTS; ++i)
+    this_cpu_inc(counter);
+  while (total_ticks < 5)
+    thread_sleep_for(1);
+  unregister_callback(&timer_callback);
+
+  /* The timer may have fired on any CPU. */
+  unsigned sum = 0, tick_sum = 0;
+  for (int i = 0; i < n; ++i) {
+    sum += *per_cpu_ptr(&counter, i);
+    tick_sum += *per_cpu_ptr(&ticks, i);
+  }
+  sum -= (n - 1) * 42;
+  // CHECK: lost increments: 0
+  kprintf("lost increments: %d\n", NUM_INCREMENTS + tick_sum - sum);
+  // CHECK: ticks counted: 1
+  kprintf("ticks counted: %d\n", tick_sum == total_ticks);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"x86/serial",NULL},
+                        {"hosted/console",NULL}, {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {"percpu",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "percpu-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
@@ -0,0 +1,111 @@
+#if 0
+exit `$1 $2 | ./test/FileCheck $0`
+#endif
+
+/* Readers follow a published pointer under rcu_read_lock() while a writer
+   keeps replacing what it points to, retiring the old version with
+   call_rcu() or synchronize_rcu(). No reader may ever see a retired
+   version, and every callback must run - but only after its grace
+   period. */
+
+#include "hal.h"
+#include "kmalloc.h"
+#include "rcu.h"
+#include "stdio.h"
+#include "thread.h"
+
+#define NUM_READERS 4
+#define UPDATES 2000
+
+#define LIVE 0x11ce
+#define DEAD 0xdead
+
+typedef struct object {
+  rcu_head_t rcu;
+  volatile unsigned magic;
+  unsigned value;
+} object_t;
+
+static object_t *current;
+static volatile int stop;
+static volatile unsigned saw_dead, reads, freed;
+
+static void reader(void *unused) {
+  while (!stop) {
+    rcu_read_lock();
+    object_t *o = rcu_dereference(current);
+    /* Linger, so that the writer gets to run in the middle. */
+    for (volatile unsigned i = 0; i < 100; ++i)
+      if (o->magic != LIVE)
+        saw_dead = 1;
+    rcu_read_unlock();
+    ++reads;
+    thread_yield();
+  }
+}
+
+static void retire(rcu_head_t *head) {
+  object_t *o = (object_t*)head;
+  o->magic = DEAD;
+  kfree(o);
+  ++freed;
+}
+
+static object_t *make(unsigned value) {
+  object_t *o = kmalloc(sizeof(object_t));
+  o->magic = LIVE;
+  o->value = value;
+  return o;
+}
+
+static int f() {
+  current = make(0);
+
+  thread_t *ts[NUM_READERS];
+  for (unsigned i = 0; i < NUM_READERS; ++i)
+    ts[i] = thread_spawn(&reader, NULL, 0);
+
+  for (unsigned i = 1; i <= UPDATES; ++i) {
+    object_t *old = current;
+    rcu_assign_pointer(current, make(i));
+    if (i % 2) {
+      call_rcu(&old->rcu, &retire);
+    } else {
+      synchronize_rcu();
+      retire(&old->rcu);
+    }
+    thread_yield();
+  }
+
+  stop = 1;
+  for (unsigned i = 0; i < NUM_READERS; ++i) {
+    while (ts[i]->state != THREAD_DEAD)
+      thread_yield();
+    thread_destroy(ts[i]);
+  }
+  /* Let the RCU thread catch up. */
+  while (freed != UPDATES)
+    thread_sleep_for(1);
+
+  // CHECK: readers ran: 1
+  kprintf("readers ran: %d\n", reads > 0);
+  // CHECK: readers saw a retired object: 0
+  kprintf("readers saw a retired object: %d\n", saw_dead);
+  // CHECK: retired: 2000
+  kprintf("retired: %d\n", freed);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"x86/serial",NULL},
+                        {"hosted/console",NULL}, {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {"rcu",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "rcu-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
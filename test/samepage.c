@@ -0,0 +1,95 @@
+#if 0
+exit `$1 $2 | ./test/FileCheck $0`
+#endif
+
+#include "hal.h"
+#include "samepage.h"
+#include "stdio.h"
+
+#define BASE      0x70000000
+#define NUM_PAGES 16
+/* Below BASE, so the first user pages a scan comes to. */
+#define STALE     0x60000000
+
+static volatile uint32_t *page(unsigned i) {
+  return (volatile uint32_t*)(uintptr_t)(BASE + i * 0x1000);
+}
+
+int f() {
+  /* Even pages all hold the same contents, odd pages are unique. */
+  for (unsigned i = 0; i < NUM_PAGES; ++i) {
+    map(BASE + i * 0x1000, alloc_page(PAGE_REQ_NONE), 1,
+        PAGE_WRITE|PAGE_USER);
+    for (unsigned j = 0; j < 1024; ++j)
+      page(i)[j] = (i & 1) ? i * 1024 + j : j;
+  }
+
+  // CHECK: merged: 7
+  kprintf("merged: %d\n", samepage_scan(1000));
+
+  samepage_stats_t s;
+  samepage_get_stats(&s);
+  // CHECK: frames 1 pages 8
+  kprintf("frames %d pages %d\n", s.frames_shared, s.pages_sharing);
+
+  unsigned f0, f2;
+  uint64_t p0 = get_mapping(BASE, &f0);
+  uint64_t p2 = get_mapping(BASE + 0x2000, &f2);
+  // CHECK: shared: 1 cow: 1
+  kprintf("shared: %d cow: %d\n", p0 == p2, (f2 & PAGE_COW) ? 1 : 0);
+
+  /* Writing to a merged page must only affect that page. */
+  page(2)[0] = 0xdeadbeef;
+  // CHECK: page2: deadbeef page0: 0 page4: 0
+  kprintf("page2: %x page0: %x page4: %x\n", page(2)[0], page(0)[0],
+          page(4)[0]);
+
+  unsigned bad = 0;
+  for (unsigned i = 1; i < NUM_PAGES; i += 2)
+    for (unsigned j = 0; j < 1024; ++j)
+      if (page(i)[j] != i * 1024 + j)
+        ++bad;
+  // CHECK: bad: 0
+  kprintf("bad: %d\n", bad);
+
+  samepage_get_stats(&s);
+  // CHECK: frames 1 pages 7
+  kprintf("frames %d pages %d\n", s.frames_shared, s.pages_sharing);
+
+  /* A page whose hash is stale by the time a match for it is found must be
+     compared, found different, and left writable. The last scan finished a
+     lap, so the next starts from the bottom. */
+  volatile uint32_t *x = (volatile uint32_t*)STALE;
+  volatile uint32_t *y = (volatile uint32_t*)(STALE + 0x1000);
+  for (unsigned i = 0; i < 2; ++i)
+    map(STALE + i * 0x1000, alloc_page(PAGE_REQ_NONE), 1,
+        PAGE_WRITE|PAGE_USER);
+  for (unsigned j = 0; j < 1024; ++j) {
+    x[j] = 0xc0ffee00 + j;
+    y[j] = 0;
+  }
+  samepage_scan(1);
+  for (unsigned j = 0; j < 1024; ++j) {
+    y[j] = x[j];
+    x[j] = 1;
+  }
+  unsigned merged = samepage_scan(1);
+  unsigned fx;
+  get_mapping(STALE, &fx);
+  // CHECK: stale: merged 0 cow 0
+  kprintf("stale: merged %d cow %d\n", merged, (fx & PAGE_COW) ? 1 : 0);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"samepage",NULL}, {"x86/free_memory",NULL},
+                        {"hosted/free_memory",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "samepage-test",
+  .required = NULL,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
@@ -0,0 +1,72 @@
+#if 0
+exit `$1 $2 | ./test/FileCheck $0`
+#endif
+
+/* Ping-pong context switch latency: two bare contexts passing control back
+   and forth with switch_context(), and two threads doing the same through
+   thread_yield() and the scheduler. */
+
+#include "hal.h"
+#include "stdio.h"
+#include "thread.h"
+
+#define ITERATIONS 100000
+
+static uintptr_t main_context, pong_context;
+static uint8_t pong_stack[0x1000] __attribute__((aligned(16)));
+
+static void pong() {
+  for (;;)
+    switch_context(&pong_context, main_context);
+}
+
+static volatile int done;
+
+static void yielder(void *unused) {
+  while (!done)
+    thread_yield();
+}
+
+static int f() {
+  /* The bare context has no TLS, so must not be preempted. */
+  int interrupts = get_interrupt_state();
+  disable_interrupts();
+  pong_context = init_context((uintptr_t)pong_stack + sizeof pong_stack,
+                              &pong);
+  uint64_t start = get_cycle_count();
+  for (unsigned i = 0; i < ITERATIONS; ++i)
+    switch_context(&main_context, pong_context);
+  uint64_t cycles = (get_cycle_count() - start) / (2 * ITERATIONS);
+  set_interrupt_state(interrupts);
+  // CHECK: switch_context: {{[0-9]+}} cycles per switch
+  kprintf("switch_context: %d cycles per switch\n", (int)cycles);
+
+  thread_t *t = thread_spawn(&yielder, NULL, 0);
+  thread_yield();
+  start = get_cycle_count();
+  for (unsigned i = 0; i < ITERATIONS; ++i)
+    thread_yield();
+  cycles = (get_cycle_count() - start) / (2 * ITERATIONS);
+  // CHECK: thread_yield: {{[0-9]+}} cycles per switch
+  kprintf("thread_yield: %d cycles per switch\n", (int)cycles);
+
+  done = 1;
+  while (t->state != THREAD_DEAD)
+    thread_yield();
+  thread_destroy(t);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"x86/serial",NULL},
+                        {"hosted/console",NULL}, {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "switch-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
@@ -0,0 +1,77 @@
+#if 0
+exit `$1 $2 | ./test/FileCheck $0`
+#endif
+
+#include "hal.h"
+#include "stdio.h"
+#include "thread.h"
+#include "timeout.h"
+
+static volatile unsigned order[4], norder;
+
+static void record(void *p) {
+  order[norder++] = (unsigned)(uintptr_t)p;
+}
+
+static semaphore_t sem;
+
+static void signaller(void *unused) {
+  thread_sleep_for(10);
+  semaphore_signal(&sem);
+}
+
+static int f() {
+  /* 300ms is beyond the root wheel, so has to cascade down. */
+  timeout_t t[4], c;
+  unsigned ms[4] = {300, 5, 70, 1};
+  for (unsigned i = 0; i < 4; ++i) {
+    timeout_init(&t[i], &record, (void*)(uintptr_t)ms[i]);
+    timeout_add(&t[i], ms[i]);
+  }
+  timeout_init(&c, &record, (void*)(uintptr_t)20);
+  timeout_add(&c, 20);
+  // CHECK: cancel: 0 -1
+  int r1 = timeout_cancel(&c);
+  int r2 = timeout_cancel(&c);
+  kprintf("cancel: %d %d\n", r1, r2);
+
+  thread_sleep_for(400);
+  // CHECK: expired: 4: 1 5 70 300
+  kprintf("expired: %d: %d %d %d %d\n", norder, order[0], order[1], order[2],
+          order[3]);
+
+  semaphore_init(&sem);
+  // CHECK: timedwait, no signal: -1
+  kprintf("timedwait, no signal: %d\n", semaphore_timedwait(&sem, 20));
+  // CHECK: left on the queue: 0
+  kprintf("left on the queue: %d\n", !waitqueue_empty(&sem.queue));
+
+  thread_t *th = thread_spawn(&signaller, NULL, 0);
+  // CHECK: timedwait, signalled: 0
+  kprintf("timedwait, signalled: %d\n", semaphore_timedwait(&sem, 1000));
+  while (th->state != THREAD_DEAD)
+    thread_yield();
+  thread_destroy(th);
+
+  mutex_t m;
+  mutex_init(&m);
+  int a1 = mutex_timedacquire(&m, 10);
+  int a2 = mutex_timedacquire(&m, 10);
+  // CHECK: timedacquire: 0 -1
+  kprintf("timedacquire: %d %d\n", a1, a2);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"x86/serial",NULL},
+                        {"hosted/console",NULL}, {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "timeout-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
@@ -301,6 +301,16 @@ int test() {
 
   // Check unmounting.
   // ----------------------------------------------------------------------
+
+  // An open file keeps the filesystem busy.
+  // CHECK: umount = 1
+  // CHECK: errno = 16, EBUSY = 16
+  inode_t *busy = vfs_open("/a/c/a/e", &daccess);
+  kprintf("umount = %d\n",
+          vfs_umount(makedev(DEV_MAJ_NULL, 1), NULL));
+  kprintf("errno = %d, EBUSY = %d\n", get_errno(), EBUSY);
+  vfs_close(busy);
+
   // CHECK: umount = 0
   // CHECK: '' DIR
   // CHECK:   'a' DIR (size 0)
@@ -0,0 +1,130 @@
+#if 0
+exit `$1 $2 | ./test/FileCheck $0`
+#endif
+
+/* Path lookup throughput with 1, 4 and 16 threads resolving the same path
+   concurrently. Every component of the path takes its directory's rwlock
+   for reading, so this is dominated by the rwlock read path. */
+
+#include "hal.h"
+#include "kmalloc.h"
+#include "stdio.h"
+#include "string.h"
+#include "thread.h"
+#include "vfs.h"
+
+#define DEPTH 4
+#define LOOKUPS 8000
+
+static const char *path = "/d/d/d/d";
+
+typedef struct chainfs {
+  /* The only entry in dirs[i] is nodes[i]; dirs[0] is the root. */
+  inode_t *dirs[DEPTH];
+  inode_t nodes[DEPTH];
+} chainfs_t;
+
+static vector_t creaddir(filesystem_t *fs, inode_t *dir) {
+  chainfs_t *cfs = fs->data;
+  vector_t v = vector_new(sizeof(dirent_t), 1);
+  dirent_t de;
+  for (unsigned i = 0; i < DEPTH; ++i) {
+    if (dir == cfs->dirs[i]) {
+      de.name = "d";
+      de.ino = &cfs->nodes[i];
+      vector_add(&v, &de);
+    }
+  }
+  return v;
+}
+
+static int cget_root(filesystem_t *fs, inode_t *inode) {
+  chainfs_t *cfs = fs->data;
+  cfs->dirs[0] = inode;
+  return 0;
+}
+
+static filesystem_t chainfs = {
+  .read = NULL,
+  .write = NULL,
+  .readdir = &creaddir,
+  .mknod = NULL,
+  .get_root = &cget_root,
+  .destroy = NULL
+};
+
+static int cprobe(dev_t dev, filesystem_t *fs) {
+  memcpy(fs, &chainfs, sizeof(filesystem_t));
+
+  chainfs_t *cfs = kmalloc(sizeof(chainfs_t));
+  memset(cfs, 0, sizeof(chainfs_t));
+  for (unsigned i = 0; i < DEPTH; ++i) {
+    cfs->nodes[i].type = (i == DEPTH-1) ? it_file : it_dir;
+    if (i > 0)
+      cfs->dirs[i] = &cfs->nodes[i-1];
+  }
+  fs->data = cfs;
+  return 0;
+}
+
+static bool caccess(int mode) {
+  return true;
+}
+
+static inode_t *target;
+static volatile unsigned wrong;
+
+static void looker(void *unused) {
+  for (unsigned i = 0; i < LOOKUPS; ++i) {
+    inode_t *n = vfs_open(path, &caccess);
+    if (n != target)
+      wrong = 1;
+    if (n)
+      vfs_close(n);
+  }
+}
+
+static void run(unsigned nthreads) {
+  thread_t *ts[16];
+  uint64_t start = get_cycle_count();
+  for (unsigned i = 0; i < nthreads; ++i)
+    ts[i] = thread_spawn(&looker, NULL, 0);
+  for (unsigned i = 0; i < nthreads; ++i) {
+    while (ts[i]->state != THREAD_DEAD)
+      thread_yield();
+    thread_destroy(ts[i]);
+  }
+  uint64_t cycles = (get_cycle_count() - start) / (nthreads * LOOKUPS);
+
+  kprintf("%d threads: %d cycles per lookup, correct: %d\n", nthreads,
+          (int)cycles, !wrong);
+}
+
+static int f() {
+  register_filesystem("chainfs", &cprobe);
+  vfs_mount(makedev(DEV_MAJ_NULL, 0), vfs_get_root(), "chainfs");
+  chainfs_t *cfs = vfs_get_root()->mountpoint->fs.data;
+  target = &cfs->nodes[DEPTH-1];
+
+  // CHECK: 1 threads: {{[0-9]+}} cycles per lookup, correct: 1
+  run(1);
+  // CHECK: 4 threads: {{[0-9]+}} cycles per lookup, correct: 1
+  run(4);
+  // CHECK: 16 threads: {{[0-9]+}} cycles per lookup, correct: 1
+  run(16);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"x86/serial",NULL},
+                        {"hosted/console",NULL}, {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {"vfs",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "vfs-lookup-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
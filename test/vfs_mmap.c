@@ -0,0 +1,193 @@
+#if 0
+exit `$1 $2 | ./test/FileCheck $0`
+#endif
+
+#include "block_cache.h"
+#include "hal.h"
+#include "kmalloc.h"
+#include "stdio.h"
+#include "string.h"
+#include "thread.h"
+#include "vfs.h"
+
+/* A 16KB disk holding a 10KB file at offset 0x1000. Each word on the disk
+   holds its own offset. The first two pages of the file can be mapped from
+   the disk cache; the last, partial, page has to be copied. A second file,
+   'slow', shares the disk but blocks in bmap until told to carry on. */
+
+#define DISK_SZ   0x4000
+#define FILE_BASE 0x1000
+#define FILE_SZ   0x2800
+
+static uint32_t *disk;
+static disk_cache_t *cache;
+static inode_t file, slow;
+static semaphore_t slow_entered, slow_release;
+
+static int bread(block_device_t *obj, uint64_t offset, void *buf, uint64_t len) {
+  memcpy(buf, (uint8_t*)disk + offset, len);
+  return len;
+}
+
+static int bwrite(block_device_t *obj, uint64_t offset, void *buf, uint64_t len) {
+  memcpy((uint8_t*)disk + offset, buf, len);
+  return len;
+}
+
+static void bflush(block_device_t *obj) {
+}
+
+static uint64_t blength(block_device_t *obj) {
+  return DISK_SZ;
+}
+
+static void bdescribe(block_device_t *obj, char *buf, unsigned bufsz) {
+  strcpy(buf, "Mock");
+}
+
+static block_device_t dev = {
+  .read = &bread,
+  .write = &bwrite,
+  .flush = &bflush,
+  .length = &blength,
+  .describe = &bdescribe
+};
+
+static int64_t mread(filesystem_t *fs, inode_t *inode, uint64_t offset,
+                     void *buf, uint64_t sz) {
+  return bread(&dev, FILE_BASE + offset, buf, sz);
+}
+
+static int64_t mwrite(filesystem_t *fs, inode_t *inode, uint64_t offset,
+                      void *buf, uint64_t sz) {
+  return bwrite(&dev, FILE_BASE + offset, buf, sz);
+}
+
+static int64_t fbmap(filesystem_t *fs, inode_t *inode, uint64_t offset,
+                     disk_cache_t **c) {
+  if (inode == &slow) {
+    semaphore_signal(&slow_entered);
+    semaphore_wait(&slow_release);
+  }
+  if (offset + get_page_size() > FILE_SZ)
+    return -1;
+  *c = cache;
+  return FILE_BASE + offset;
+}
+
+static int fget_root(filesystem_t *fs, inode_t *inode) {
+  return 0;
+}
+
+static int fprobe(dev_t dev, filesystem_t *fs) {
+  memset(fs, 0, sizeof(filesystem_t));
+  fs->read = &mread;
+  fs->write = &mwrite;
+  fs->bmap = &fbmap;
+  fs->get_root = &fget_root;
+  return 0;
+}
+
+static void touch_slow(void *p) {
+  *(volatile uint32_t *)p;
+}
+
+static int test() {
+  disk = kmalloc(DISK_SZ);
+  for (unsigned i = 0; i < DISK_SZ / 4; ++i)
+    disk[i] = i * 4;
+  cache = disk_cache_new(disk_cache_group_get_default(), &dev);
+
+  register_filesystem("mmapfs", &fprobe);
+  // CHECK: mount = 0
+  kprintf("mount = %d\n",
+          vfs_mount(makedev(DEV_MAJ_NULL, 0), vfs_get_root(), "mmapfs"));
+
+  memset(&file, 0, sizeof(file));
+  file.mountpoint = vfs_get_root()->mountpoint;
+  file.type = it_file;
+  file.size = FILE_SZ;
+  rwlock_init(&file.rwlock);
+
+  // Read-only mappings fault pages in from the cache, or by copying.
+  // ----------------------------------------------------------------------
+  volatile uint32_t *ro = vfs_mmap(&file, 0, FILE_SZ, 0);
+  // CHECK: ro: 1000 2000 3000 37fc 0
+  kprintf("ro: %x %x %x %x %x\n", ro[0], ro[0x1000/4], ro[0x2000/4],
+          ro[0x27fc/4], ro[0x2800/4]);
+  // CHECK: handles: 1 1 cached: 0
+  kprintf("handles: %d %d cached: %d\n",
+          disk_cache_get_n_handles(cache, 0x1000),
+          disk_cache_get_n_handles(cache, 0x2000),
+          disk_cache_is_cached(cache, 0x3000));
+
+  // Two mappings of the same page share the cached frame.
+  volatile uint32_t *ro2 = vfs_mmap(&file, 0x1000, 0x1000, 0);
+  uint32_t val = ro2[0];
+  // CHECK: ro2: 2000 shared: 1
+  kprintf("ro2: %x shared: %d\n", val,
+          get_mapping((uintptr_t)ro2, NULL) ==
+          get_mapping((uintptr_t)ro + 0x1000, NULL));
+
+  // CHECK: munmap = 0 0 handles: 0
+  kprintf("munmap = %d %d ", vfs_munmap((void*)ro), vfs_munmap((void*)ro2));
+  kprintf("handles: %d\n", disk_cache_get_n_handles(cache, 0x2000));
+
+  // Shared writable mappings are written back by msync.
+  // ----------------------------------------------------------------------
+  volatile uint32_t *sh = vfs_mmap(&file, 0, FILE_SZ,
+                                   PAGE_WRITE|VFS_MAP_SHARED);
+  sh[1] = 0xdeadbeef;
+  sh[0x2004/4] = 0xcafe;
+  // CHECK: msync = 0
+  kprintf("msync = %d\n", vfs_msync((void*)sh));
+  // CHECK: disk: deadbeef cafe
+  kprintf("disk: %x %x\n", disk[0x1004/4], disk[0x3004/4]);
+  // CHECK: munmap = 0
+  kprintf("munmap = %d\n", vfs_munmap((void*)sh));
+
+  // Private writable mappings are copy-on-write.
+  // ----------------------------------------------------------------------
+  volatile uint32_t *pr = vfs_mmap(&file, 0, FILE_SZ, PAGE_WRITE);
+  // CHECK: pr: deadbeef
+  kprintf("pr: %x\n", pr[1]);
+  pr[2] = 0x1234;
+  volatile uint32_t *ro3 = vfs_mmap(&file, 0, 0x1000, 0);
+  // CHECK: pr: 1234 ro3: 1008
+  kprintf("pr: %x ro3: %x\n", pr[2], ro3[2]);
+  // CHECK: munmap = 0 0 disk: 1008
+  kprintf("munmap = %d %d ", vfs_munmap((void*)pr), vfs_munmap((void*)ro3));
+  kprintf("disk: %x\n", disk[0x1008/4]);
+
+  // A fault waiting on the disk does not hold up faults on other mappings.
+  // ----------------------------------------------------------------------
+  memcpy(&slow, &file, sizeof(file));
+  rwlock_init(&slow.rwlock);
+  semaphore_init(&slow_entered);
+  semaphore_init(&slow_release);
+  volatile uint32_t *sl = vfs_mmap(&slow, 0, 0x1000, 0);
+  volatile uint32_t *ro4 = vfs_mmap(&file, 0x1000, 0x1000, 0);
+  thread_t *t = thread_spawn(&touch_slow, (void*)sl, 0);
+  semaphore_wait(&slow_entered);
+  // CHECK: ro4: 2000
+  kprintf("ro4: %x\n", ro4[0]);
+  semaphore_signal(&slow_release);
+  while (t->state != THREAD_DEAD)
+    thread_yield();
+  thread_destroy(t);
+  // CHECK: sl: deadbeef munmap = 0 0
+  kprintf("sl: %x ", sl[1]);
+  kprintf("munmap = %d %d\n", vfs_munmap((void*)sl), vfs_munmap((void*)ro4));
+
+  return 0;
+}
+
+static prereq_t r[] = { {"vfs_mmap",NULL}, {"threading",NULL}, {NULL,NULL} };
+static module_t x run_on_startup = {
+  .name = "vfs-mmap-test",
+  .required = r,
+  .load_after = NULL,
+  .init = &test,
+  .fini = NULL
+};
+module_t *test_module = &x;
@@ -0,0 +1,167 @@
+#if 0
+exit `$1 $2 | ./test/FileCheck $0`
+#endif
+
+/* Wait queue ordering and wakeups: semaphores and mutexes serve sleepers in
+   the order they arrived and hand off to them so they cannot be barged,
+   wake-N wakes non-exclusive waiters along with N exclusive ones, a rwlock
+   writer wakes all the readers it held up together, and a writer sleeps
+   until the last reader leaves. */
+
+#include "hal.h"
+#include "stdio.h"
+#include "thread.h"
+
+#define NUM_WAITERS 6
+
+static semaphore_t sem;
+static mutex_t mutex;
+static waitqueue_t queue;
+static rwlock_t rwlock;
+
+static volatile unsigned order[NUM_WAITERS], norder;
+
+static void sem_waiter(void *p) {
+  semaphore_wait(&sem);
+  order[norder++] = (unsigned)(uintptr_t)p;
+}
+
+static void mutex_waiter(void *p) {
+  mutex_acquire(&mutex);
+  order[norder++] = (unsigned)(uintptr_t)p;
+  mutex_release(&mutex);
+}
+
+/* Even-numbered waiters are exclusive. */
+static void queue_waiter(void *p) {
+  unsigned i = (unsigned)(uintptr_t)p;
+  waiter_t w;
+  spinlock_acquire(&queue.lock);
+  waitqueue_add(&queue, &w, i % 2 == 0);
+  waitqueue_sleep(&queue, &w, WAITQUEUE_FOREVER);
+  order[norder++] = i;
+}
+
+static volatile unsigned written;
+static void writer(void *unused) {
+  rwlock_write_acquire(&rwlock);
+  written = 1;
+  rwlock_write_release(&rwlock);
+}
+
+static void reader(void *p) {
+  rwlock_read_acquire(&rwlock);
+  order[norder++] = (unsigned)(uintptr_t)p;
+  rwlock_read_release(&rwlock);
+}
+
+/* Spawns the waiters one at a time, each going to sleep before the next
+   starts, so that they queue in order. */
+static void spawn(thread_t **ts, void (*fn)(void*)) {
+  norder = 0;
+  for (unsigned i = 0; i < NUM_WAITERS; ++i) {
+    ts[i] = thread_spawn(fn, (void*)(uintptr_t)i, 0);
+    while (ts[i]->state != THREAD_SLEEP)
+      thread_yield();
+  }
+}
+
+static void reap(thread_t **ts) {
+  for (unsigned i = 0; i < NUM_WAITERS; ++i) {
+    while (ts[i]->state != THREAD_DEAD)
+      thread_yield();
+    thread_destroy(ts[i]);
+  }
+}
+
+static void print_order(const char *name) {
+  kprintf("%s:", name);
+  for (unsigned i = 0; i < norder; ++i)
+    kprintf(" %d", order[i]);
+  kprintf("\n");
+}
+
+static int f() {
+  thread_t *ts[NUM_WAITERS];
+
+  semaphore_init(&sem);
+  spawn(ts, &sem_waiter);
+  for (unsigned i = 0; i < NUM_WAITERS; ++i) {
+    semaphore_signal(&sem);
+    /* The unit went to a waiter that has yet to run, not to us. */
+    if (semaphore_timedwait(&sem, 0) == 0)
+      kprintf("semaphore barged\n");
+  }
+  reap(ts);
+  // CHECK: semaphore: 0 1 2 3 4 5
+  print_order("semaphore");
+
+  mutex_init(&mutex);
+  mutex_acquire(&mutex);
+  spawn(ts, &mutex_waiter);
+  mutex_release(&mutex);
+  /* Still held, by the first waiter, though it has yet to run. */
+  // CHECK: mutex handed off: 1
+  kprintf("mutex handed off: %d\n", mutex.owner == ts[0] &&
+          !__sync_bool_compare_and_swap(&mutex.val, 0, 1));
+  reap(ts);
+  // CHECK: mutex: 0 1 2 3 4 5
+  print_order("mutex");
+
+  /* Waking two exclusive waiters also wakes the non-exclusive one between
+     them, then the rest in one go. */
+  waitqueue_init(&queue);
+  spawn(ts, &queue_waiter);
+  unsigned n = waitqueue_wake(&queue, 2);
+  for (unsigned i = 0; i < NUM_WAITERS; ++i)
+    thread_yield();
+  // CHECK: wake 2: 2 exclusive: 0 1 2
+  kprintf("wake 2: %d exclusive:", n);
+  for (unsigned i = 0; i < norder; ++i)
+    kprintf(" %d", order[i]);
+  kprintf("\n");
+  n = waitqueue_wake(&queue, WAITQUEUE_ALL);
+  reap(ts);
+  // CHECK: wake all: 1 exclusive: 0 1 2 3 4 5
+  kprintf("wake all: %d exclusive:", n);
+  for (unsigned i = 0; i < norder; ++i)
+    kprintf(" %d", order[i]);
+  kprintf("\n");
+
+  rwlock_init(&rwlock);
+  rwlock_write_acquire(&rwlock);
+  spawn(ts, &reader);
+  rwlock_write_release(&rwlock);
+  reap(ts);
+  // CHECK: readers: 0 1 2 3 4 5
+  print_order("readers");
+
+  rwlock_read_acquire(&rwlock);
+  thread_t *w = thread_spawn(&writer, NULL, 0);
+  for (unsigned i = 0; i < 100 && w->state != THREAD_SLEEP; ++i)
+    thread_yield();
+  // CHECK: writer asleep: 1 written: 0
+  kprintf("writer asleep: %d written: %d\n", w->state == THREAD_SLEEP,
+          written);
+  rwlock_read_release(&rwlock);
+  while (w->state != THREAD_DEAD)
+    thread_yield();
+  thread_destroy(w);
+  // CHECK: written: 1
+  kprintf("written: %d\n", written);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"x86/serial",NULL},
+                        {"hosted/console",NULL}, {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "waitqueue-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
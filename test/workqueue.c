@@ -0,0 +1,129 @@
+#if 0
+exit `$1 $2 | ./test/FileCheck $0`
+#endif
+
+/* Work queues: items run in order, no more of a queue's items run at once
+   than it allows, flushing waits for everything queued, delayed work waits
+   for its delay and can be cancelled, and work can be queued from a timer
+   interrupt. */
+
+#include "hal.h"
+#include "stdio.h"
+#include "thread.h"
+#include "workqueue.h"
+
+#define NUM_ITEMS 8
+
+typedef struct item {
+  work_t work;
+  unsigned id;
+} item_t;
+
+static item_t items[NUM_ITEMS];
+static volatile unsigned order[NUM_ITEMS], norder;
+static volatile unsigned running, max_running;
+static volatile unsigned sleep_ms;
+
+static void run(work_t *w) {
+  item_t *it = (item_t*)w;
+  if (++running > max_running)
+    max_running = running;
+  if (sleep_ms)
+    thread_sleep_for(sleep_ms);
+  order[norder++] = it->id;
+  --running;
+}
+
+static volatile unsigned delayed_ran;
+static void delayed(work_t *w) {
+  ++delayed_ran;
+}
+
+static work_t irq_work;
+static volatile int irq_ran;
+static void from_irq(work_t *w) {
+  irq_ran = 1;
+}
+static void timer_callback(void *unused) {
+  queue_work(system_wq, &irq_work);
+}
+
+static void queue_items(workqueue_t *wq) {
+  norder = max_running = 0;
+  for (unsigned i = 0; i < NUM_ITEMS; ++i) {
+    work_init(&items[i].work, &run);
+    items[i].id = i;
+    queue_work(wq, &items[i].work);
+  }
+}
+
+static int f() {
+  workqueue_t *serial = workqueue_create("serial", 1);
+  workqueue_t *pair = workqueue_create("pair", 2);
+
+  /* Items that sleep would overlap if the queue allowed it. */
+  sleep_ms = 2;
+  queue_items(serial);
+  // CHECK: pending again: 0
+  kprintf("pending again: %d\n", queue_work(serial, &items[0].work));
+  flush_workqueue(serial);
+  // CHECK: serial: 8 ran, at most 1 at once, in order: 1
+  unsigned in_order = 1;
+  for (unsigned i = 0; i < norder; ++i)
+    in_order &= order[i] == i;
+  kprintf("serial: %d ran, at most %d at once, in order: %d\n", norder,
+          max_running, in_order);
+
+  queue_items(pair);
+  flush_workqueue(pair);
+  // CHECK: pair: 8 ran, at most 2 at once
+  kprintf("pair: %d ran, at most %d at once\n", norder, max_running);
+  sleep_ms = 0;
+
+  delayed_work_t dw;
+  delayed_work_init(&dw, &delayed);
+  queue_delayed_work(serial, &dw, 20);
+  flush_workqueue(serial);
+  unsigned early = delayed_ran;
+  thread_sleep_for(50);
+  // CHECK: delayed: ran early 0, ran 1
+  kprintf("delayed: ran early %d, ran %d\n", early, delayed_ran);
+
+  queue_delayed_work(serial, &dw, 20);
+  int cancelled = cancel_delayed_work(&dw);
+  thread_sleep_for(50);
+  // CHECK: cancelled: 1, ran 1, pending 0
+  kprintf("cancelled: %d, ran %d, pending %d\n", cancelled, delayed_ran,
+          dw.work.pending);
+
+  work_init(&irq_work, &from_irq);
+  register_callback(5, 0, &timer_callback, NULL);
+  while (!irq_ran)
+    thread_sleep_for(1);
+  // CHECK: queued from interrupt: ran 1
+  kprintf("queued from interrupt: ran %d\n", irq_ran);
+
+  workqueue_stats_t s;
+  workqueue_get_stats(serial, &s);
+  // CHECK: serial stats: 9 queued, 9 executed, waited: 1
+  kprintf("serial stats: %d queued, %d executed, waited: %d\n", s.queued,
+          s.executed, s.wait > 0 && s.max_wait > 0);
+
+  workqueue_destroy(serial);
+  workqueue_destroy(pair);
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"x86/serial",NULL},
+                        {"hosted/console",NULL}, {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {"workqueue",NULL},
+                         {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "workqueue-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;
@@ -7,6 +7,7 @@ exit $OUT
 #endif
 
 #include "assert.h"
+#include "coroutine.h"
 #include "hal.h"
 #include "stdio.h"
 #include "stdlib.h"
@@ -51,6 +52,19 @@ void hexdump(uint8_t *buf, unsigned size, uintptr_t address) {
   }
 }
 
+typedef struct read_req {
+  block_device_t *hd;
+  uint64_t offset;
+  uint8_t *buf;
+} read_req_t;
+
+/* Waiting for the disk suspends just this coroutine, so the other's read is
+   issued meanwhile. */
+static void co_read(void *p) {
+  read_req_t *r = (read_req_t*)p;
+  r->hd->read(r->hd, r->offset, r->buf, 0x1000);
+}
+
 int f() {
   assert(get_interrupt_state() != 0);
   /* Get /dev/hda */
@@ -74,6 +88,15 @@ int f() {
   // CHECK: 000009f0: f9 e3 c7 7a 36 51 96 f6 5e 4f 97 96 b1 ba 23 b2
   hexdump((void*)buf + 512 - 0x10, 0x10, 4*512 + 512-0x10);
 
+  uintptr_t buf2 = vmspace_alloc(&kernel_vmspace, 0x1000, 1);
+  read_req_t reqs[2] = { {hd, 0, (uint8_t*)buf}, {hd, 4*512, (uint8_t*)buf2} };
+  co_spawn(&co_read, &reqs[0]);
+  co_spawn(&co_read, &reqs[1]);
+  co_run();
+  // CHECK: coroutine reads: e1 cc
+  kprintf("coroutine reads: %02x %02x\n", ((uint8_t*)buf)[0],
+          ((uint8_t*)buf2)[0]);
+
   /* Now try writing! */
   unsigned char *cbuf = (unsigned char*)buf;
   for (unsigned i = 0; i < 0x1000; ++i)
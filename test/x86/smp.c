@@ -0,0 +1,77 @@
+#if 0
+exit `SMP=4 $1 $2 | ./test/FileCheck $0`
+#endif
+
+/* SMP under "qemu -smp 4": the APICs find every core, threads run on all of
+   them, and an IPI reaches every core it is sent to. */
+
+#include "hal.h"
+#include "stdio.h"
+#include "thread.h"
+
+#define NUM_CPUS 4
+#define IPI_DATA ((void*)0x1234)
+
+static volatile int done;
+static volatile unsigned ran[NUM_CPUS], ipis[NUM_CPUS];
+
+static void worker(void *unused) {
+  while (!done) {
+    ran[get_processor_id()] = 1;
+    thread_yield();
+  }
+}
+
+static int handle_ipi(struct regs *r, void *unused) {
+  if (get_ipi_data(r) == IPI_DATA)
+    __sync_fetch_and_add(&ipis[get_processor_id()], 1);
+  return 0;
+}
+
+static bool all(volatile unsigned *counts) {
+  for (unsigned i = 0; i < NUM_CPUS; ++i)
+    if (counts[i] == 0)
+      return false;
+  return true;
+}
+
+static int f() {
+  // CHECK: cpus: 4
+  kprintf("cpus: %d\n", get_num_processors());
+
+  thread_t *ts[NUM_CPUS * 2];
+  for (unsigned i = 0; i < NUM_CPUS * 2; ++i)
+    ts[i] = thread_spawn(&worker, NULL, 0);
+  for (unsigned i = 0; i < 5000 && !all(ran); ++i)
+    thread_sleep_for(1);
+  done = 1;
+  for (unsigned i = 0; i < NUM_CPUS * 2; ++i) {
+    while (ts[i]->state != THREAD_DEAD)
+      thread_yield();
+    thread_destroy(ts[i]);
+  }
+  // CHECK: ran on every CPU: 1
+  kprintf("ran on every CPU: %d\n", all(ran));
+
+  register_interrupt_handler(get_ipi_interrupt_num(), &handle_ipi, NULL);
+  send_ipi(IPI_ALL, IPI_DATA);
+  for (unsigned i = 0; i < 5000 && !all(ipis); ++i)
+    thread_sleep_for(1);
+  // CHECK: IPIs: 1 1 1 1
+  kprintf("IPIs: %d %d %d %d\n", ipis[0], ipis[1], ipis[2], ipis[3]);
+
+  return 0;
+}
+
+static prereq_t p[] = { {"console",NULL}, {"x86/serial",NULL},
+                        {NULL,NULL} };
+static prereq_t p2[] = { {"threading",NULL}, {NULL,NULL} };
+
+static module_t run_on_startup x = {
+  .name = "smp-test",
+  .required = p2,
+  .load_after = p,
+  .init = &f,
+  .fini = NULL
+};
+module_t *test_module = &x;